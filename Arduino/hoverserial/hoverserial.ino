@@ -28,6 +28,8 @@
 #define HOVER_SERIAL_BAUD   115200      // [-] Baud rate for HoverSerial (used to communicate with the hoverboard)
 #define SERIAL_BAUD         115200      // [-] Baud rate for built-in Serial (used for the Serial Monitor)
 #define START_FRAME         0xABCD     	// [-] Start frme definition for reliable serial communication
+#define CMD_VERSION         1           // [-] Command frame version, must match SERIAL_CMD_VERSION on the hoverboard side
+#define CMD_TLV_STEER_SPEED 1           // [-] Record type for steer and speed
 #define TIME_SEND           100         // [ms] Sending time interval
 #define SPEED_MAX_TEST      300         // [-] Maximum speed for testing
 #define SPEED_STEP          20          // [-] Speed step
@@ -43,8 +45,13 @@ byte *p;                                // Pointer declaration for the new recei
 byte incomingByte;
 byte incomingBytePrev;
 
-typedef struct{
+// Command frame with a single steer/speed record. Other records (per-motor targets, control mode, flags, parameter writes) are listed in util.h
+typedef struct __attribute__((packed)){
    uint16_t start;
+   uint8_t  ver;
+   uint8_t  len;          // Length of the records
+   uint8_t  type;         // Record type
+   uint8_t  recLen;       // Record value length
    int16_t  steer;
    int16_t  speed;
    uint16_t checksum;
@@ -75,14 +82,32 @@ void setup()
   pinMode(LED_BUILTIN, OUTPUT);
 }
 
+// ########################## CRC16 ##########################
+// CRC16 CCITT-FALSE (polynomial 0x1021, initial value 0xFFFF), same as calcCRC16() on the hoverboard side
+uint16_t Crc16(const uint8_t *data, uint16_t len)
+{
+  uint16_t crc = 0xFFFF;
+  while (len--) {
+    crc ^= (uint16_t)(*data++) << 8;
+    for (uint8_t i = 0; i < 8; i++) {
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+    }
+  }
+  return crc;
+}
+
 // ########################## SEND ##########################
 void Send(int16_t uSteer, int16_t uSpeed)
 {
   // Create command
   Command.start    = (uint16_t)START_FRAME;
+  Command.ver      = CMD_VERSION;
+  Command.len      = 6;
+  Command.type     = CMD_TLV_STEER_SPEED;
+  Command.recLen   = 4;
   Command.steer    = (int16_t)uSteer;
   Command.speed    = (int16_t)uSpeed;
-  Command.checksum = (uint16_t)(Command.start ^ Command.steer ^ Command.speed);
+  Command.checksum = Crc16((uint8_t *) &Command, sizeof(Command) - sizeof(Command.checksum));
 
   // Write to Serial
   HoverSerial.write((uint8_t *) &Command, sizeof(Command)); 
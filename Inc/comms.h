@@ -33,11 +33,27 @@ enum types {UINT8_T,UINT16_T,UINT32_T,INT8_T,INT16_T,INT32_T,INT,FLOAT};
     int8_t:     INT8_T, \
     int16_t:    INT16_T, \
     int32_t:    INT32_T, \
-    int:        INT, \
-    float:      FLOAT)
+    float:      FLOAT, \
+    default:    INT)      // int, a distinct type from int32_t (long) on the target only
 
 #define PARAM_SIZE(param) sizeof(param) / sizeof(parameter_entry)
 #define COMMAND_SIZE(command) sizeof(command) / sizeof(command_entry)
+#define COMMAND_HASH_SIZE 32   // command lookup table size, power of 2 and at least twice the number of commands (checked in comms.c)
+#define PARAM_HASH_SIZE   256  // parameter lookup table size, power of 2 and at least twice the number of parameters (checked in comms.c)
+#define DEBUG_LINE_SIZE   64   // [bytes] longest text command line
+#define DEBUG_DUMP_LINE   128  // [bytes] longest HELP/GET output line, a dump continues when this much Tx buffer is free
+
+// Binary frame: | start 0xABCD (2) | version (1) | length (2) | TLV records: type (1), length (1), value | CRC16 (2) |, little endian
+#define DEBUG_BIN_VERSION  1
+#define DEBUG_BIN_HDR_LEN  5
+#define DEBUG_BIN_DATA_MAX 128 // [bytes] longest request payload, e.g. 18 SET records
+#define DEBUG_BIN_NAME_MAX 24  // [bytes] longest parameter name in a schema record
+enum debugBinTlv {
+  DBG_TLV_SCHEMA = 1,      // request: no value. response: one record per parameter with index, type, datatype, flags, EEPROM address, min, max, div, mul, fix, value L/R, name
+  DBG_TLV_VALUES,          // request: no value. response: one record per parameter with index, value L/R
+  DBG_TLV_SET,             // request: index (1), value in external format (4). All SET records of a frame are applied together or not at all
+  DBG_TLV_STATUS           // response to SET: error number (0 = OK), index of the failing record, number of parameters set
+};
 
 #define SIZEP(x) ((char*)(&(x) + 1) - (char*)&(x))
 #define ADD_PARAM(var) typename(var),&var
@@ -46,6 +62,7 @@ enum types {UINT8_T,UINT16_T,UINT32_T,INT8_T,INT16_T,INT32_T,INT,FLOAT};
 int32_t extToInt(uint8_t index,int32_t value);
 int8_t  setParamValInt(uint8_t index, int32_t newValue);
 int8_t  setParamValExt(uint8_t index, int32_t newValue);
+int8_t  writeParamVal(uint8_t index, int32_t value);
 int32_t intToExt(uint8_t index,int32_t value);
 int32_t getParamValInt(uint8_t index);
 int32_t getParamValExt(uint8_t index);
@@ -62,11 +79,17 @@ int8_t printAllParamHelp();
 int8_t printParamVal();
 int8_t printParamDef(uint8_t index);
 int8_t printAllParamDef();
+#ifdef FAULT_BLACKBOX
+int8_t printBlackBox();
+int8_t clearBlackBox();
+#endif
 void printError(uint8_t errornum );
 int8_t watchParamVal(uint8_t index);
 
+void   initLookup(void);
 int8_t findCommand(uint8_t *userCommand, uint32_t len);
 int8_t findParam(uint8_t *userCommand, uint32_t len);
+void debug_rx(const uint8_t *data, uint32_t len);
 void handle_input(uint8_t *userCommand, uint32_t len);
 void process_debug();
 
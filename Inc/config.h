@@ -212,6 +212,30 @@
 
 
 
+// ############################## INPUT PIPELINE ############################
+/* INPUT_PIPE1, INPUT_PIPE2, TARGET_PIPE: DEADBAND, EXPO, RATE, FILTER, MIN, MAX
+ * -----------------------------------------
+ * Conditioning of the input1 and input2 commands in main.c, after calcInputCmd and before the mixer.
+ * TARGET_PIPE conditions the per-motor targets of the serial command (MOTOR_TGT), one row for each motor.
+ * The stages always run in this order, a stage is bypassed by its neutral value. Tunable with the debug protocol: PIPE1_xxx, PIPE2_xxx, PIPET_xxx
+ * DEADBAND:  commands within +/-DEADBAND give 0, the others are moved towards 0 by DEADBAND. 0: off
+ * EXPO:      fixdt(0,16,14) share of the cubic curve u^3/range^2 over the input range, [0, 16384] = [0.0, 1.0]. 0: linear
+ * RATE:      fixdt(1,16,4) max change per main loop, see DEFAULT_RATE. 32767: no limit
+ * FILTER:    fixdt(0,16,16) low-pass coefficient, see DEFAULT_FILTER. 65535: no filter
+ * MIN, MAX:  output clamp, it cuts the EXPO curve and does not rescale it. A clamp at the input range follows it when
+ *            field weakening is switched or FI_WEAK_HI changes (Input_Lim_Init), other values are kept
+ * Default: 0, 0, RATE, FILTER, -1000, 1000 (the input range)
+ * Cost: with EXPO 0 about the former rate limiter and filter chain plus two compares, EXPO adds four multiplies
+ * (Linux/filtbench: 7.7 ns against 6.0 ns on the host, 13.7 ns with EXPO)
+ * -----------------------------------------
+*/
+// #define INPUT_PIPE1   100, 4096, RATE, FILTER, -1000, 1000   // e.g. steering: deadband 100 and 25% expo
+// #define INPUT_PIPE2     0,    0, RATE, FILTER, -1000, 1000
+// #define TARGET_PIPE     0,    0, RATE, FILTER, -1000, 1000
+// ############################## END OF INPUT PIPELINE ############################
+
+
+
 // ############################## CRUISE CONTROL SETTINGS ############################
 /* Cruise Control info:
  * enable CRUISE_CONTROL_SUPPORT and (SUPPORT_BUTTONS_LEFT or SUPPORT_BUTTONS_RIGHT depending on which cable is the button installed)
@@ -251,6 +275,10 @@
 // #define DEBUG_SERIAL_USART2          // left sensor board cable, disable if ADC or PPM is used!
 // #define DEBUG_SERIAL_USART3          // right sensor board cable, disable if I2C (nunchuk or lcd) is used!
 // #define DEBUG_SERIAL_PROTOCOL        // uncomment this to send user commands to the board, change parameters and print specific signals (see comms.c for the user commands)
+// #define LATENCY_MEASURE              // measure the input-to-PWM latency with the DWT cycle counter. Read LAT_P50, LAT_P90, LAT_P99, LAT_MAX [us] via DEBUG_SERIAL_PROTOCOL
+#define LOG_TX_BUFFER_SIZE    1024    // [bytes] debug Tx ring buffer, drained by DMA. Must be a power of 2. Output that does not fit is dropped and counted in LOG_DROP
+#define LOG_HOLD_BUFFER_SIZE  256     // [bytes] text printed while a binary debug frame is being sent, output after the frame
+#define LOG_LEVEL             2       // [-] default log level (LOG_LVL): 0 = errors, 1 = + warnings, 2 = + info (PRINTF), 3 = + debug
 // ########################### END OF DEBUG SERIAL ############################
 
 
@@ -259,13 +287,136 @@
 // #define DEBUG_I2C_LCD                // standard 16x2 or larger text-lcd via i2c-converter on right sensor board cable
 // ########################### END OF DEBUG LCD ############################
 
+
+
+// ############################### LOW POWER IDLE ###############################
+/* When the motors are disabled and stationary for IDLE_ENTRY_TIME, the motor controller steps are skipped,
+ * the ADC (and its DMA interrupt) is triggered every IDLE_ADC_DIV PWM periods instead of every period while the
+ * buzzer is off, the flash interface clock is gated during sleep and the core sleeps with WFI between the interrupts.
+ * With IDLE_ADC_DIV 16 the core wakes every 1 ms, like for SysTick, instead of every 62.5 us.
+ * Idle is left as soon as a hall sensor changes (checked every ADC conversion), the input command exceeds
+ * IDLE_WAKE_THRESHOLD or the motors get enabled (checked every main loop). The PWM is enabled again at the full ADC
+ * rate, up to 2 ms later.
+ * The reduction of the current draw has not been measured.
+*/
+// #define IDLE_LOW_POWER               // enable low-power idle while parked
+#define IDLE_ENTRY_TIME       3000      // [ms] time with motors disabled and stationary before entering idle
+#define IDLE_WAKE_THRESHOLD   50        // [-] input command magnitude that wakes up from idle
+#define IDLE_ADC_DIV          16        // [PWM periods] ADC trigger period in idle, a divisor of PWM_FREQ / 1000 and a power of 2
+// ########################### END OF LOW POWER IDLE ############################
+
+
+
+// ############################### TELEMETRY ###############################
+/* Binary telemetry replaces the fixed feedback frame on FEEDBACK_SERIAL_USART2/3.
+ * Frame: | start (2) | version (1) | length (1) | sequence (2) | timestamp ms (4) | field mask (4) | int16 fields (length - 10) | CRC16 (2) |
+ * The fields are sent in TLM_* bit order (see util.h). Fields and period can be changed at runtime with the
+ * TLM_FIELDS and TLM_DIV debug parameters or with the CMD_TLV_TELEMETRY record of the serial command.
+ * The fields TLM_CTRL_IN..TLM_DC_LINK_R (mask 0x3FE00000) are the raw BLDC controller inputs, for the replay tool in Linux/hoverserial.
+ * TLM_ODOM (mask 0x40000000) sends one word of the ODOMETER_COUNTERS per frame: word (sequence % 8) of distance, charge,
+ * energy and drive time, low word first.
+*/
+// #define FEEDBACK_TELEMETRY           // enable binary telemetry instead of the fixed feedback frame
+#define TLM_VERSION           1         // [-] telemetry frame version
+#define TLM_FIELDS_DEF        0x00FF    // [-] default field mask: commands, speeds, battery, temperature, cmdL/cmdR
+#define TLM_DIV_DEF           2         // [-] default period in main loops (2 = 10 ms). 0 = stop telemetry
+// ########################### END OF TELEMETRY ############################
+
+
+
+// ############################### MULTI-DROP BUS ###############################
+/* Several boards on one host UART: the host Tx goes to the Rx of all boards and the Tx of all boards are wired together.
+ * The Tx pin is switched to open-drain, so the bus needs one pull-up resistor (e.g. 4.7k to 3.3V).
+ * A board only accepts the serial command frames with its node ID or SERIAL_NODE_BCAST in the CMD_TLV_NODE record,
+ * frames without the record are broadcast. Each accepted frame is answered with one telemetry frame (TLM_NODE field set):
+ * - addressed frame: in the next main loop
+ * - broadcast frame: node ID * SERIAL_SLOT_LOOPS main loops later, so the boards answer in turn
+ * The node ID is the NODE_ID debug parameter, saved in the EEPROM. SERIAL_NODE_ID is used until it was saved.
+*/
+// #define SERIAL_MULTIDROP             // enable the addressed multi-drop bus on the CONTROL/FEEDBACK serial
+#define SERIAL_NODE_ID        0         // [-] default node ID, 0..254
+#define SERIAL_NODE_BCAST     0xFF      // [-] broadcast node ID
+#define SERIAL_SLOT_LOOPS     2         // [main loops] feedback slot length. Must cover one main loop of jitter plus the telemetry frame duration
+// ########################### END OF MULTI-DROP BUS ############################
+
+
+
+// ############################### TIME SYNC ###############################
+/* Synchronized setpoints for several boards driving one vehicle.
+ * The host broadcasts its time in us in the CMD_TLV_SYNC record, e.g. every 100 ms. Each board tracks the offset and drift
+ * of its PWM period counter to the host time. A frame with a CMD_TLV_APPLY_AT record holds its CMD_TLV_MOTOR_TGT targets
+ * until the host time in the record, then the motor ISR switches them in the PWM period this time is reached.
+ * The targets still pass the TARGET_PIPE rate limiter and filter: the ISR switches to the first step towards them, so the
+ * ramps start together on all boards, the further steps follow with the main loop of each board (within 5 ms).
+ * The other records of the frame are applied at once. Send the frame at least 2 main loops (10 ms) before the apply time.
+ * The sync error and drift are the SYNC_ERR and SYNC_DRIFT debug variables.
+*/
+// #define SERIAL_SYNC                  // enable time sync and scheduled targets on the CONTROL serial
+#define SYNC_RESET_US         5000      // [us] sync error above which the host time is taken over directly (e.g. host restart)
+#define SYNC_DRIFT_MAX        20000     // [ppm] largest drift corrected, the internal RC oscillator is within +-1%
+#define SYNC_AHEAD_MAX        1000000   // [us] apply times further ahead than this are treated as late and applied at once
+// ########################### END OF TIME SYNC ############################
+
+// ############################### ODOMETER ###############################
+/* Persistent counters for maintenance, integrated in the main loop:
+ * - distance from the average wheel speed and ODOM_WHEEL_CIRC
+ * - charge and energy from dc_curr and batVoltageCalib, consumption only (regeneration is not subtracted)
+ * - drive time while the motors are enabled
+ * The counters are the ODOM_M, ODOM_MAH, ODOM_WH, ODOM_S debug variables and the TLM_ODOM telemetry field.
+ * Each counter is stored as a 32-bit base and a 16-bit delta. A checkpoint writes only the changed deltas, once a delta
+ * exceeds ODOM_DELTA_MAX all bases are rewritten. Checkpoints are written at standstill, also with the motors enabled,
+ * at most every ODOM_SAVE_PERIOD and only when no EEPROM page has to be erased first, and at power off: a battery
+ * disconnect while riding loses what was counted since the last stop.
+*/
+// #define ODOMETER_COUNTERS            // enable the persistent counters (needs the EEPROM configuration of the variants other than HOVERBOARD and TRANSPOTTER)
+#define ODOM_WHEEL_CIRC       530       // [mm] wheel circumference, 6.5" wheel
+#define ODOM_SAVE_PERIOD      60        // [s] minimum time between two checkpoints
+#define ODOM_DELTA_MAX        30000     // [-] delta above which the bases are rewritten
+// ########################### END OF ODOMETER ############################
+
+// ############################### FAULT BLACK BOX ###############################
+/* Records the key signals into a RAM ring of BBOX_SAMPLES samples, one sample every BBOX_DIV main loops:
+ * commands, speeds, DC link current, battery voltage, board temperature, inputs and a state word (errors, timeouts, enable).
+ * A fault (motor error, ADC or serial timeout while the motors are enabled, over-temperature or dead battery power off)
+ * records BBOX_POST_SAMPLES more samples and freezes the ring. The snapshot is written to the BBOX_PAGES flash pages at
+ * the top of the flash once the motors are off and stopped, or at power off: the flash programming stalls the CPU.
+ * The samples are stored as zigzag varint differences, about 1 byte per channel while cruising. The pages are used as a
+ * ring, the oldest page is erased when the newest one is full. The BBOX debug command prints the stored snapshots as CSV,
+ * BBOX_CLR erases them. BBOX_CNT is the number of stored snapshots.
+*/
+// #define FAULT_BLACKBOX               // enable the fault recorder (needs the flash above the EEPROM pages, see BBOX_START_ADDRESS)
+#define BBOX_SAMPLES          128       // [-] samples in the RAM ring, 128 samples of 10 channels = 2.5 KB RAM
+#define BBOX_DIV              4         // [main loops] sample period (4 = 20 ms): 128 samples = 2.56 s
+#define BBOX_POST_SAMPLES     25        // [-] samples recorded after the fault, less than BBOX_SAMPLES
+#define BBOX_PAGES            2         // [-] flash pages for the snapshots, at least 2
+// ########################### END OF FAULT BLACK BOX ############################
+
+// ############################### ADC INPUT GLITCH FILTER ###############################
+/* Filters the ADC inputs (adc_buffer.l_tx2, l_rx2) in the 16 kHz ADC interrupt instead of sampling them once per main loop:
+ * a sliding median of 5 samples removes spikes of up to 2 samples (125 us), then a moving average of 2^ADC_INPUT_AVG_LOG2
+ * samples reduces the noise. The added delay is 2 + 2^ADC_INPUT_AVG_LOG2 / 2 samples, 0.4 ms with the default, where a
+ * softer FILTER costs main loops (5 ms each). The ADC protection then checks the filtered inputs: a single spike no longer
+ * trips it, a disconnected or shorted pedal still does.
+*/
+// #define ADC_INPUT_MEDIAN             // enable the glitch filter of the ADC inputs (CONTROL_ADC)
+#define ADC_INPUT_AVG_LOG2    3         // [-] moving average of 2^ADC_INPUT_AVG_LOG2 samples after the median, [0, 4]. 0: median only
+// ########################### END OF ADC INPUT GLITCH FILTER ############################
+
 #define WAIT_DELAY  (10)
 #define BEEP_DELAY  (100)
+#define BEEP_QUEUE_SIZE     (32)        // buzzer sequencer queue length in notes, must be a power of 2
+#define BEEP_PATTERN_PERIOD (312)       // [ms] base period of the beepCount() error patterns (5000 PWM cycles)
+#define BEEP_COUNT_MAX      (7)         // maximum number of beeps in a beepCount() pattern
+#define LAT_HIST_BINS       (64)        // latency histogram bins
+#define LAT_HIST_RES        (250)       // [us] latency histogram bin width, last bin collects everything above
+#define LAT_HIST_WINDOW     (1000)      // number of commands per latency percentile update
+#define LAT_ADC_STEP        (16)        // [adc counts] pedal change that counts as a new ADC command
 #define CALIBRATE_HOLD_TIME (5 * 1000 / WAIT_DELAY)
 #define KEYLOCK_CHECK_TIME  (1 * 1000 / WAIT_DELAY)
 #define CALIBRARE_MINMAX_CHECK_TIME  (1 * 1000 / WAIT_DELAY)
 #define CALIBRATE_MOD_IMEOUT_TIME (15 * 1000 / WAIT_DELAY) // 10 seconds for entering calibration mode
 #define PWR_BTN_DEBOUNCE (8)
+#define CRUISE_DEBOUNCE_TIME (200)     // [ms] cruise control button debounce, one toggle per press
 
 #define KEYLOCK_POWER_SWITCH
 
@@ -660,6 +811,9 @@
   #define SERIAL_START_FRAME      0xABCD                  // [-] Start frame definition for serial commands
   #define SERIAL_BUFFER_SIZE      64                      // [bytes] Size of Serial Rx buffer. Make sure it is always larger than the structure size
   #define SERIAL_TIMEOUT          160                     // [-] Serial timeout duration for the received data. 160 ~= 0.8 sec. Calculation: 0.8 sec / 0.005 sec
+  #define SERIAL_CMD_VERSION      1                       // [-] Version of the serial command frame. Frames with a different version are rejected
+  #define SERIAL_CMD_DATA_MAX     32                      // [bytes] Maximum length of the TLV records in one serial command frame
+  #define SERIAL_PARAM_QUEUE      8                       // [-] PARAM_SET records kept between two main loops, further records are dropped
 #endif
 #if defined(FEEDBACK_SERIAL_USART2) || defined(CONTROL_SERIAL_USART2) || defined(DEBUG_SERIAL_USART2) || defined(SIDEBOARD_SERIAL_USART2)
   #ifndef USART2_BAUD
@@ -684,6 +838,15 @@
 #ifndef FILTER
   #define FILTER DEFAULT_FILTER
 #endif
+#ifndef INPUT_PIPE1
+  #define INPUT_PIPE1 0, 0, RATE, FILTER, -1000, 1000   // clamp widened by Input_Lim_Init with field weakening
+#endif
+#ifndef INPUT_PIPE2
+  #define INPUT_PIPE2 0, 0, RATE, FILTER, -1000, 1000
+#endif
+#ifndef TARGET_PIPE
+  #define TARGET_PIPE 0, 0, RATE, FILTER, -1000, 1000
+#endif
 #ifndef SPEED_COEFFICIENT
   #define SPEED_COEFFICIENT DEFAULT_SPEED_COEFFICIENT
 #endif
@@ -812,6 +975,30 @@
 #if (defined(CONTROL_PPM_LEFT) || defined(CONTROL_PPM_RIGHT)) && !defined(PPM_NUM_CHANNELS)
   #error Total number of PPM channels needs to be set
 #endif
+#if defined(FEEDBACK_TELEMETRY) && !defined(FEEDBACK_SERIAL_USART2) && !defined(FEEDBACK_SERIAL_USART3)
+  #error FEEDBACK_TELEMETRY needs FEEDBACK_SERIAL_USART2 or FEEDBACK_SERIAL_USART3
+#endif
+
+#if defined(SERIAL_MULTIDROP) && (defined(CONTROL_IBUS) || !defined(FEEDBACK_TELEMETRY) || \
+    !((defined(CONTROL_SERIAL_USART2) && defined(FEEDBACK_SERIAL_USART2)) || (defined(CONTROL_SERIAL_USART3) && defined(FEEDBACK_SERIAL_USART3))))
+  #error SERIAL_MULTIDROP needs CONTROL_SERIAL and FEEDBACK_SERIAL on the same USART, FEEDBACK_TELEMETRY and no CONTROL_IBUS
+#endif
+
+#if defined(SERIAL_SYNC) && (defined(CONTROL_IBUS) || (!defined(CONTROL_SERIAL_USART2) && !defined(CONTROL_SERIAL_USART3)))
+  #error SERIAL_SYNC needs CONTROL_SERIAL_USART2 or CONTROL_SERIAL_USART3 without CONTROL_IBUS
+#endif
+#if defined(ODOMETER_COUNTERS) && (defined(VARIANT_HOVERBOARD) || defined(VARIANT_TRANSPOTTER))
+  #error ODOMETER_COUNTERS needs the EEPROM configuration, not available for VARIANT_HOVERBOARD and VARIANT_TRANSPOTTER
+#endif
+#if defined(FAULT_BLACKBOX) && (BBOX_PAGES < 2 || BBOX_POST_SAMPLES >= BBOX_SAMPLES)
+  #error FAULT_BLACKBOX needs BBOX_PAGES >= 2 and BBOX_POST_SAMPLES < BBOX_SAMPLES
+#endif
+#if defined(IDLE_LOW_POWER) && ((PWM_FREQ / 1000) % IDLE_ADC_DIV != 0 || (IDLE_ADC_DIV & (IDLE_ADC_DIV - 1)) != 0)
+  #error IDLE_ADC_DIV needs to be a power of 2 dividing PWM_FREQ / 1000
+#endif
+#if defined(ADC_INPUT_MEDIAN) && (ADC_INPUT_AVG_LOG2 < 0 || ADC_INPUT_AVG_LOG2 > 4)
+  #error ADC_INPUT_AVG_LOG2 needs to be in [0, 4]
+#endif
 // ############################# END OF VALIDATE SETTINGS ############################
 
 #endif
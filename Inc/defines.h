@@ -235,9 +235,18 @@
     asm(".global _printf_float");     // this is the magic trick for printf to support float. Warning: It will increase code considerably! Better to avoid!
 #endif
 
+// Log severity levels
+#define LOG_ERR   0
+#define LOG_WARN  1
+#define LOG_INFO  2
+#define LOG_DBG   3
+
 #if defined(DEBUG_SERIAL_USART2) || defined(DEBUG_SERIAL_USART3)
-  #define PRINTF(f_, ...) do { printf((f_), ##__VA_ARGS__); } while(0)
+  extern uint8_t logLevel;
+  #define LOG(lvl_, f_, ...) do { if ((lvl_) <= logLevel) { printf((f_), ##__VA_ARGS__); } } while(0)
+  #define PRINTF(f_, ...) LOG(LOG_INFO, (f_), ##__VA_ARGS__)
 #else
+  #define LOG(...)
   #define PRINTF(...)
 #endif
 
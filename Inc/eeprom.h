@@ -180,43 +180,73 @@
 /* EEPROM start address in Flash */
 #define EEPROM_START_ADDRESS  ((uint32_t)ADDR_FLASH_PAGE_64) /* EEPROM emulation start address */
 
-/* Pages 0 and 1 base and end addresses */
+/* Number of pages of the store, consecutive from EEPROM_START_ADDRESS. The
+   records are appended to the pages in turn and the oldest page is compacted,
+   so the erase cycles are spread over all of them */
+#ifndef EE_PAGES
+#define EE_PAGES              8
+#endif
+#if (EE_PAGES < 2) || (EE_PAGES * FLASH_PAGE_SIZE > 0x10000)
+#error "EE_PAGES: 2 pages minimum, the store has to end below PAGE1_BASE_ADDRESS"
+#endif
+
+/* Erased pages kept ready by EE_Process, one of them is only used by the compaction */
+#define EE_FREE_PAGES         2
+
+/* Erase cycles of a page (STM32F103 datasheet), for the projected life */
+#define EE_ENDURANCE          10000
+
+/* Page header, before the records:
+     +0 EE_PAGE_MAGIC once the page is in use
+     +2 sequence number, the page with the highest one takes the new records
+     +4 erase cycles of the page, written back after each erase
+     +6 ERASED, programmed to 0 before the page is erased */
+#define EE_PAGE_MAGIC         ((uint16_t)0xEE01)
+#define EE_HDR_SEQ            2
+#define EE_HDR_ERASES         4
+#define EE_HDR_OBSOLETE       6
+#define EE_HDR_SIZE           8
+
+/* Records per page */
+#define EE_PAGE_RECORDS       ((PAGE_SIZE - EE_HDR_SIZE) / 4)
+
+/* Pages of the former two page format, imported by EE_Init into an empty store */
 #define PAGE0_BASE_ADDRESS    ((uint32_t)(EEPROM_START_ADDRESS + 0x0000))
-#define PAGE0_END_ADDRESS     ((uint32_t)(EEPROM_START_ADDRESS + (PAGE_SIZE - 1)))
-#define PAGE0_ID               ADDR_FLASH_PAGE_64
-
 #define PAGE1_BASE_ADDRESS    ((uint32_t)(EEPROM_START_ADDRESS + 0x10000))
-#define PAGE1_END_ADDRESS     ((uint32_t)(EEPROM_START_ADDRESS + 0x10000 + PAGE_SIZE - 1))
-#define PAGE1_ID               ADDR_FLASH_PAGE_96
-
-/* Used Flash pages for EEPROM emulation */
-#define PAGE0                 ((uint16_t)0x0000)
-#define PAGE1                 ((uint16_t)0x0040)
 
 /* No valid page define */
 #define NO_VALID_PAGE         ((uint16_t)0x00AB)
 
-/* Page status definitions */
+/* Page status definitions of the two page format */
 #define ERASED                ((uint16_t)0xFFFF)     /* Page is empty */
 #define RECEIVE_DATA          ((uint16_t)0xEEEE)     /* Page is marked to receive data */
 #define VALID_PAGE            ((uint16_t)0x0000)     /* Page containing valid data */
 
-/* Valid pages in read and write defines */
-#define READ_FROM_VALID_PAGE  ((uint8_t)0x00)
-#define WRITE_IN_VALID_PAGE   ((uint8_t)0x01)
-
 /* Page full define */
 #define PAGE_FULL             ((uint8_t)0x80)
 
+/* Batch markers: reserved virtual addresses enclosing the records of one
+   EE_WriteVariables call, BEGIN holds the number of records and COMMIT their checksum.
+   ABORT was written by the two page format after an interrupted batch */
+#define EE_BATCH_BEGIN        ((uint16_t)0xFFF0)
+#define EE_BATCH_COMMIT       ((uint16_t)0xFFF1)
+#define EE_BATCH_ABORT        ((uint16_t)0xFFF2)
+
 /* Variables' number */
-#define NB_OF_VAR             ((uint8_t)0x13)       /* 19 Variables */
+#define NB_OF_VAR             ((uint8_t)0x23)       /* 35 Variables */
 
 /* Exported types ------------------------------------------------------------*/
 /* Exported macro ------------------------------------------------------------*/
 /* Exported functions ------------------------------------------------------- */
 uint16_t EE_Init(void);
 uint16_t EE_ReadVariable(uint16_t VirtAddress, uint16_t* Data);
+uint16_t EE_ReadVariables(uint16_t* VirtAddress, uint16_t* Data, uint16_t NbVar);
 uint16_t EE_WriteVariable(uint16_t VirtAddress, uint16_t Data);
+uint16_t EE_WriteVariables(uint16_t* VirtAddress, uint16_t* Data, uint16_t NbVar);
+uint8_t  EE_WriteReady(uint16_t NbVar);
+uint16_t EE_Process(void);
+uint16_t EE_EraseCycles(void);
+uint32_t EE_RemainingLife(void);
 
 #endif /* __EEPROM_H */
 
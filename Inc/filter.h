@@ -0,0 +1,89 @@
+/**
+  * This file is part of the hoverboard-firmware-hack project.
+  *
+  * Copyright (C) 2020-2021 Emanuel FERU <aerdronix@gmail.com>
+  *
+  * This program is free software: you can redistribute it and/or modify
+  * it under the terms of the GNU General Public License as published by
+  * the Free Software Foundation, either version 3 of the License, or
+  * (at your option) any later version.
+  *
+  * This program is distributed in the hope that it will be useful,
+  * but WITHOUT ANY WARRANTY; without even the implied warranty of
+  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  * GNU General Public License for more details.
+  *
+  * You should have received a copy of the GNU General Public License
+  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Define to prevent recursive inclusion
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stdint.h>
+
+/* Fixed-point filters, no HAL dependency: also built on the host by Linux/filtbench
+ * Formats are given as fixdt(signed, word length, fraction length), e.g. fixdt(1,32,16) = int32_t with 16 fractional bits.
+ * The 32-bit products fit in one SMULL/MUL on the Cortex-M3, the saturations in one SSAT/USAT.
+ */
+
+// Coefficient in fixdt(1,16,14) from a floating-point constant, for the biquad coefficients
+#define FILT_Q14(x)       ((int16_t)((x) * 16384.0 + ((x) >= 0 ? 0.5 : -0.5)))
+
+// Moving average: window of 2^log2Len samples
+#define FILT_MAVG_LOG2_MAX  4
+#define FILT_MAVG_LEN_MAX   (1 << FILT_MAVG_LOG2_MAX)
+
+// Biquad, direct form I: y = b0*x + b1*x1 + b2*x2 - a1*y1 - a2*y2
+typedef struct {
+  int16_t   b0, b1, b2; // fixdt(1,16,14) feedforward coefficients
+  int16_t   a1, a2;     // fixdt(1,16,14) feedback coefficients, a0 = 1. |a1| < 2 fits, lowpass and notch filters included
+  int16_t   x1, x2;     // previous inputs
+  int16_t   y1, y2;     // previous outputs
+  int16_t   err;        // truncation remainder of the last output, fed back: no DC offset at low cutoff frequencies
+} Biquad16;
+
+typedef struct {
+  int16_t   buf[FILT_MAVG_LEN_MAX];
+  int32_t   sum;        // sum of the window
+  uint8_t   idx;        // oldest sample
+  uint8_t   log2Len;    // [0, FILT_MAVG_LOG2_MAX]
+} MovAvg16;
+
+typedef struct {
+  int16_t   buf[5];
+  uint8_t   idx;        // oldest sample
+} Median5;
+
+// Input pipeline: deadband, expo, rate limit, low pass, clamp. One row per input channel, see INPUT PIPELINE in config.h
+typedef struct {
+  int16_t   dband;      // [0, 32767] inputs within +/-dband give 0, the others are moved towards 0 by dband
+  uint16_t  expo;       // fixdt(0,16,14) share of the cubic curve u^3/full^2, [0, 16384] = [0.0, 1.0]
+  int16_t   rate;       // fixdt(1,16,4) max change per sample, [0, 32767]
+  uint16_t  filt;       // fixdt(0,16,16) low pass coefficient
+  int16_t   min;        // output clamp
+  int16_t   max;        // output clamp
+  int16_t   full;       // full scale of the expo curve: the input range, set with filtPipeRange
+  int32_t   inv;        // fixdt(0,32,30) 1/full, set with filtPipeRange: no divide per sample
+} PipeCfg;
+
+typedef struct {
+  int16_t   rate;       // fixdt(1,16,4) rate limiter output
+  int32_t   lpf;        // fixdt(1,32,16) low pass output
+} PipeState;
+
+void    filtLowPass32(int32_t u, uint16_t coef, int32_t *y);
+void    rateLimiter16(int16_t u, int16_t rate, int16_t *y);
+void    filtBiquadInit16(Biquad16 *f, int16_t u);
+int16_t filtBiquad16(int16_t u, Biquad16 *f);
+void    filtMovAvgInit16(MovAvg16 *f, uint8_t log2Len, int16_t u);
+int16_t filtMovAvg16(int16_t u, MovAvg16 *f);
+int16_t filtMedian3(int16_t a, int16_t b, int16_t c);
+void    filtMedianInit5(Median5 *f, int16_t u);
+int16_t filtMedian5(int16_t u, Median5 *f);
+void    filtPipeRange(PipeCfg *c, int16_t full);
+int16_t filtPipe(int16_t u, const PipeCfg *c, PipeState *s);
+
+#endif
+
@@ -35,12 +35,57 @@
       uint8_t  checksumh;
     } SerialCommand;
   #else
+    // Serial command frame: | start (2) | version (1) | length (1) | TLV records (length) | CRC16 (2) |
+    // TLV record:           | type (1) | length (1) | value (length) |
     typedef struct{
       uint16_t  start;
+      uint8_t   ver;
+      uint8_t   len;                            // Length of the TLV records
+      uint8_t   data[SERIAL_CMD_DATA_MAX + 2];  // TLV records followed by the CRC16
+    } SerialFrame;
+
+    enum {CMD_TLV_STEER_SPEED = 1,  // int16 steer, int16 speed: mixed command (same as the input1/input2 of the other inputs)
+          CMD_TLV_MOTOR_TGT,        // int16 left, int16 right: per-motor targets, bypass the mixer
+          CMD_TLV_CTRL_MOD,         // uint8 control mode request (z_ctrlModReq) 0:OPEN 1:VLT 2:SPD 3:TRQ
+          CMD_TLV_FLAGS,            // uint8 CMD_FLG_* bits
+          CMD_TLV_PARAM_SET,        // uint8 params[] index, int32 value in external format
+          CMD_TLV_TELEMETRY,        // uint32 telemetry field mask, uint8 period in main loops (FEEDBACK_TELEMETRY)
+          CMD_TLV_NODE,             // uint8 destination node ID (SERIAL_MULTIDROP), SERIAL_NODE_BCAST for all
+          CMD_TLV_SYNC,             // uint32 host time in us (SERIAL_SYNC)
+          CMD_TLV_APPLY_AT};        // uint32 host time in us at which the MOTOR_TGT targets of the frame take effect (SERIAL_SYNC)
+
+    #define CMD_FLG_ENABLE        0x01  // Motors enable allowed. If the FLAGS record is not sent, enable is allowed
+    #define CMD_FLG_BRAKE         0x02  // Zero all targets
+    #define CMD_VLD(type)         (1 << (type))
+
+    typedef struct{
       int16_t   steer;
       int16_t   speed;
-      uint16_t  checksum;
+      int16_t   tgtL;       // Left motor target
+      int16_t   tgtR;       // Right motor target
+      uint8_t   ctrlMod;
+      uint8_t   flags;
+      uint16_t  valid;      // CMD_VLD() bits of the records received in the last frame
+      uint8_t   paramCnt;   // Parameter writes pending, cleared when applied
+      uint8_t   paramIdx[SERIAL_PARAM_QUEUE];
+      int32_t   paramVal[SERIAL_PARAM_QUEUE];
+      uint32_t  tlmFields;
+      uint8_t   tlmDiv;
+      uint8_t   syncReq;    // Sync record pending, cleared when applied
+      uint32_t  syncHost;   // [us] host time of the sync record
+      uint32_t  syncLocal;  // [PWM periods] local time at which the sync record was received
+      uint8_t   applyReq;   // Scheduled targets pending, cleared when applied
+      uint32_t  applyAt;    // [us] host time at which the targets take effect
     } SerialCommand;
+
+    typedef struct{
+      SerialFrame frame;    // Frame being assembled from the Rx stream
+      uint8_t   idx;        // Number of bytes collected in frame
+      uint16_t  cntOk;      // Valid frames received
+      uint16_t  errCrc;     // Frames rejected due to wrong checksum
+      uint16_t  errSync;    // Bytes discarded while searching for the start frame
+      uint16_t  errFmt;     // Frames rejected due to wrong version, length or malformed records
+    } SerialParser;
   #endif
 #endif
 #if defined(SIDEBOARD_SERIAL_USART2) || defined(SIDEBOARD_SERIAL_USART3)
@@ -55,6 +100,17 @@
     } SerialSideboard;
 #endif
 
+// Telemetry fields, bit index in the telemetry field mask
+#ifdef FEEDBACK_TELEMETRY
+enum {TLM_CMD1, TLM_CMD2, TLM_SPEED_R, TLM_SPEED_L, TLM_BATV, TLM_TEMP, TLM_CMD_L, TLM_CMD_R,
+      TLM_IQ_L, TLM_IQ_R, TLM_ID_L, TLM_ID_R, TLM_ANGLE_L, TLM_ANGLE_R, TLM_ERR_L, TLM_ERR_R,
+      TLM_DC_CURR_L, TLM_DC_CURR_R, TLM_ISR_CYC, TLM_ISR_CYC_MAX, TLM_NODE,
+      TLM_CTRL_IN, TLM_TGT_L, TLM_TGT_R, TLM_PHA_AB_L, TLM_PHA_BC_L, TLM_PHA_AB_R, TLM_PHA_BC_R,   // BLDC controller inputs, for the host replay
+      TLM_DC_LINK_L, TLM_DC_LINK_R,
+      TLM_ODOM,                                                                                    // one word of the odometer counters per frame
+      TLM_FIELDS_NUM};
+#endif
+
 // Input Structure
 typedef struct {
   int16_t   raw;    // raw input
@@ -67,6 +123,89 @@ typedef struct {
   int16_t   dband;  // deadband
 } InputStruct;
 
+typedef enum {
+  PWR_RUN = 0,              // normal operation, power button monitored
+  PWR_ON_RELEASE,           // power-on: wait for the power button release
+  PWR_ON_KEYLOCK1,          // power-on: first short press with throttle at maximum
+  PWR_ON_KEYLOCK2,          // power-on: second short press with throttle at maximum
+  PWR_ON_CAL_HOLD,          // power-on: wait for a long press to enter calibration
+  PWR_ON_CAL_THROTTLE,      // power-on: wait for the throttle release
+  PWR_BTN_HOLD,             // power button pressed: measure the press duration
+  PWR_TP_RELEASE1,          // transpotter: wait for the power button release
+  PWR_TP_WAIT,              // transpotter: second press window
+  PWR_TP_RELEASE2,          // transpotter: wait for the second release
+  PWR_CAL_SELECT,           // calibration: a short press selects MIN/MAX calibration
+  PWR_CAL_RELEASE,          // calibration: wait for the power button release
+  PWR_CAL_ADC,              // calibration: sampling input MIN/MID/MAX
+  PWR_CAL_CURSPD,           // calibration: sampling current and speed limits
+  PWR_CAL_CURSPD_RELEASE,   // calibration: wait for the power button release
+  PWR_OFF_KEYLOCK,          // power-off: wait until the key switch is released
+  PWR_OFF_MELODY,           // power-off: play melody, then save config and release the latch
+  PWR_OFF                   // power latch released
+} PowerState;
+
+typedef struct {
+  uint8_t   freq;     // buzzer pitch, 0 for a pause
+  uint16_t  duration; // [ms]
+} BuzzerNote;
+
+// Input-to-PWM latency stages, timestamps relative to the command arrival
+enum {LAT_ARRIVE, LAT_READ, LAT_FILTER, LAT_MIXER, LAT_PWM, LAT_STEP, LAT_STAGES};
+#ifdef LATENCY_MEASURE
+  #define LATENCY_STAGE(stage)   latencyStage(stage)
+  #define LATENCY_ARRIVE()       latencyArrive()
+  #define LATENCY_ARRIVE_IN(idx) latencyArriveIn(idx)
+#else
+  #define LATENCY_STAGE(stage)
+  #define LATENCY_ARRIVE()
+  #define LATENCY_ARRIVE_IN(idx)
+#endif
+
+// Configuration record: VirtAddVarTab slots written as one EEPROM batch, the EEPRM Addr of params[] is the slot of a value
+#define CFG_KEY           0       // FLASH_WRITE_KEY
+#define CFG_VERSION       20      // schema version, unset in the records of the former per-variable format
+#define CFG_CRC_LO        21      // CRC32 of the slots before CFG_CRC_LO
+#define CFG_CRC_HI        22
+#define CFG_SLOTS         23
+#define CFG_SCHEMA        1       // current schema version
+#define CFG_UNSET         0xFFFF  // slot never written
+enum {CFG_NONE, CFG_OK, CFG_MIGRATED, CFG_CORRUPT, CFG_NEWER};   // cfgStatus
+
+// Odometer counters: 32-bit bases (low word first) and 16-bit deltas in the VirtAddVarTab slots after the configuration record
+enum {ODOM_DIST, ODOM_CHARGE, ODOM_ENERGY, ODOM_TIME, ODOM_NUM};   // [m], [mAh], [Wh], [s]
+#define ODOM_BASE         CFG_SLOTS
+#define ODOM_DELTA        (ODOM_BASE + 2 * ODOM_NUM)
+#define ODOM_SLOTS        (3 * ODOM_NUM)
+
+// Fault black box: snapshots in the BBOX_PAGES flash pages at the end of the 256 KB flash, after each other in a page
+// Snapshot: header, then per sample and channel the zigzag varint of the difference to the previous sample (to 0 for the first one)
+#define BBOX_START_ADDRESS  ((uint32_t)0x08040000 - BBOX_PAGES * FLASH_PAGE_SIZE)
+#define BBOX_MAGIC          0xB0C5
+enum {BBOX_FLT_NONE, BBOX_FLT_MOTOR, BBOX_FLT_ADC, BBOX_FLT_SERIAL, BBOX_FLT_TEMP, BBOX_FLT_BATTERY};   // fault codes
+enum {BBOX_CH_CMD_L, BBOX_CH_CMD_R, BBOX_CH_SPEED_L, BBOX_CH_SPEED_R, BBOX_CH_DC_CURR, BBOX_CH_BATV, BBOX_CH_TEMP,
+      BBOX_CH_IN1, BBOX_CH_IN2, BBOX_CH_STATE, BBOX_CH_NUM};
+#define BBOX_STATE_ERR_L    0x0007  // BBOX_CH_STATE bits: left motor z_errCode
+#define BBOX_STATE_ERR_R    0x0038  // right motor z_errCode
+#define BBOX_STATE_ADC      0x0040  // timeoutFlgADC
+#define BBOX_STATE_SERIAL   0x0080  // timeoutFlgSerial
+#define BBOX_STATE_GEN      0x0100  // timeoutFlgGen
+#define BBOX_STATE_ENABLE   0x0200  // motors enabled
+
+typedef struct {
+  uint16_t  magic;      // BBOX_MAGIC, programmed last: a snapshot cut by a power loss has none
+  uint16_t  len;        // [bytes] length of the data, programmed first
+  uint16_t  seq;        // snapshot number
+  uint8_t   fault;      // BBOX_FLT_*
+  uint8_t   channels;   // BBOX_CH_NUM
+  uint16_t  samples;    // samples in the snapshot, the oldest ones are dropped if the data does not fit in a page
+  uint16_t  post;       // samples recorded after the fault
+  uint16_t  period;     // [ms] sample period
+  uint16_t  crc;        // CRC16 of the data
+  uint32_t  time;       // [ms] time since power on at the fault
+  uint32_t  driveTime;  // [s] ODOM_TIME at the fault, 0 without ODOMETER_COUNTERS
+  uint32_t  distance;   // [m] ODOM_DIST at the fault, 0 without ODOMETER_COUNTERS
+} BBoxHeader;
+
 // Initialization Functions
 void BLDC_Init(void);
 void Input_Lim_Init(void);
@@ -80,7 +219,12 @@ void beepLong(uint8_t freq);
 void beepLongMany(uint8_t freq, uint16_t duration, uint8_t count);
 void beepShort(uint8_t freq);
 void beepShortMany(uint8_t cnt, int8_t dir);
+uint8_t beepNote(uint8_t freq, uint16_t duration);
+uint8_t beepBusy(void);
+void beepWait(void);
+void beepSequencer(void);
 void calcAvgSpeed(void);
+void idleCheck(void);
 void adcCalibLim(void);
 void updateCurSpdLim(void);
 void standstillHold(void);
@@ -88,6 +232,16 @@ void electricBrake(uint16_t speedBlend, uint8_t reverseDir);
 void cruiseControl(uint8_t button);
 int  checkInputType(int16_t min, int16_t mid, int16_t max);
 void calibrate(void);
+uint8_t isThrottleMax(void);
+uint8_t isThrottleMin(void);
+
+// Time Sync Functions
+#ifdef SERIAL_SYNC
+enum {SYNC_IDLE, SYNC_PENDING, SYNC_ARMED};
+void syncUpdate(uint32_t hostUs, uint32_t localTick);
+void syncSchedule(int16_t tgtL, int16_t tgtR, uint32_t hostUs);
+uint8_t syncTargets(void);
+#endif
 
 // Input Functions
 void calcInputCmd(InputStruct *in, int16_t out_min, int16_t out_max);
@@ -98,26 +252,76 @@ void usart2_rx_check(void);
 void usart3_rx_check(void);
 #if defined(DEBUG_SERIAL_USART2) || defined(DEBUG_SERIAL_USART3)
 void usart_process_debug(uint8_t *userCommand, uint32_t len);
+uint16_t logFree(void);
+void logWrite(const uint8_t *data, uint16_t len);
+void logFlush(void);
 #endif
 #if defined(CONTROL_SERIAL_USART2) || defined(CONTROL_SERIAL_USART3)
-void usart_process_command(SerialCommand *command_in, SerialCommand *command_out, uint8_t usart_idx);
+  #ifdef CONTROL_IBUS
+uint8_t usart_process_command(SerialCommand *command_in, SerialCommand *command_out, uint8_t usart_idx);
+  #else
+uint8_t usart_process_command(SerialFrame *frame_in, SerialCommand *command_out, uint8_t usart_idx);
+void usart_apply_command(SerialCommand *command);
+void usart_parse_command(SerialParser *parser, const uint8_t *data, uint32_t len, SerialCommand *command_out, uint8_t usart_idx);
+  #endif
 #endif
+uint16_t calcCRC16(const uint8_t *data, uint32_t len);
+uint16_t updateCRC16(uint16_t crc, const uint8_t *data, uint32_t len);
+uint32_t calcCRC32(const uint8_t *data, uint32_t len);
 #if defined(SIDEBOARD_SERIAL_USART2) || defined(SIDEBOARD_SERIAL_USART3)
 void usart_process_sideboard(SerialSideboard *Sideboard_in, SerialSideboard *Sideboard_out, uint8_t usart_idx);
 #endif
 
+// Telemetry functions
+#ifdef FEEDBACK_TELEMETRY
+void telemetryProcess(void);
+#endif
+
 // Sideboard functions
 void sideboardLeds(uint8_t *leds);
 void sideboardSensors(uint8_t sensors);
 
+// Configuration Functions
+uint8_t  configLoad(void);
+uint16_t configSave(void);
+
+// Odometer Functions
+#ifdef ODOMETER_COUNTERS
+void odomLoad(void);
+void odomSave(void);
+void odomProcess(uint32_t now);
+#endif
+
+// Black Box Functions
+#ifdef FAULT_BLACKBOX
+void    bboxInit(void);
+void    bboxProcess(uint32_t now);
+void    bboxSave(void);
+uint8_t bboxClear(void);
+  #if defined(DEBUG_SERIAL_USART2) || defined(DEBUG_SERIAL_USART3)
+void    bboxPrintStart(void);
+uint8_t bboxPrint(void);
+  #endif
+#endif
+
 // Poweroff Functions
 void saveConfig(void);
+uint8_t eepromEraseOk(void);
+void eepromProcess(void);
+void powerOn(void);
 void powerOff(void);
-void powerOffPressCheck(void);
+void powerStep(uint8_t btn, uint32_t now);
+
+// Latency Measurement Functions
+#ifdef LATENCY_MEASURE
+void latencyInit(void);
+void latencyArrive(void);
+void latencyArriveIn(uint8_t idx);
+void latencyStage(uint8_t stage);
+void latencyStep(void);
+#endif
 
-// Filtering Functions
-void filtLowPass32(int32_t u, uint16_t coef, int32_t *y);
-void rateLimiter16(int16_t u, int16_t rate, int16_t *y);
+// Filtering Functions (filter.h: low pass, rate limiter, biquad, moving average, median)
 void mixerFcn(int16_t rtu_speed, int16_t rtu_steer, int16_t *rty_speedR, int16_t *rty_speedL);
 
 // Multiple Tap Function
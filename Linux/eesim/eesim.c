@@ -0,0 +1,729 @@
+// *******************************************************************
+//  eesim: EEPROM emulation (Src/eeprom.c) on a host model of the STM32F1 flash
+//  for   https://github.com/EmanuelFeru/hoverboard-firmware-hack-FOC
+//
+// *******************************************************************
+// Wear run: repeated saves of the configuration, reports the flash operations and busy time per save, the write
+// amplification (flash bytes programmed per byte of saved data), the erase cycles of the pages and the projected
+// number of saves until a page reaches the flash endurance. After each save EE_Process runs like in the main loop
+// at standstill, the busy time of the saves themselves is reported apart.
+// Power loss run: a power loss is injected at a random flash operation of a save or of the following EE_Process
+// and the board restarts (EE_Init), in one of four runs a second power loss hits the restart. Every variable must
+// then read the old or the new value, for a batch save either all old or all new values.
+// Import run: the store starts from pages of the former two page format.
+// Config cases: configLoad/configSave of util.c on the store, the record read back, the migration of a record of the
+// former per-variable format, and the records left alone: empty store, newer schema, CRC error, other FLASH_WRITE_KEY.
+// Black box run: fault snapshots of util.c (bboxProcess) in the BBOX_PAGES pages at the end of the flash. Every
+// snapshot is decoded and checked against the recorded signals: the newest samples up to the fault and the post
+// samples, cut to the page size (no older sample would fit), the seq numbers consecutive while the pages rotate.
+// A power loss hits every other save, after the restart (bboxInit) the snapshots of the page not being written are
+// unchanged and the interrupted one is either complete or not counted.
+//   eesim -n 20000                 wear of 20000 saveConfig batches
+//   eesim -c 5000 --torn           5000 power losses during the operations
+//   eesim -n 0 -c 0 -b 2000 -t     2000 black box snapshots, torn power losses
+// *******************************************************************
+
+#include "eeprom.h"
+#include "defines.h"
+#include "config.h"
+#include "util.h"
+#include "BLDC_controller.h"
+#include "flash_sim.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+extern uint16_t VirtAddVarTab[NB_OF_VAR];   // util.c
+extern uint16_t cfgData[CFG_SLOTS];
+extern uint8_t  cfgStatus;
+extern uint16_t bboxCount;
+extern uint8_t  enable, inIdx, timeoutFlgADC, timeoutFlgSerial, timeoutFlgGen;
+extern int16_t  cmdL, cmdR, dc_curr, batVoltage, batVoltageCalib, board_temp_deg_c, speedAvgAbs;
+extern ExtY     rtY_Left, rtY_Right;
+extern InputStruct input1[], input2[];
+void bboxRestart(void);                     // fwutil.c
+
+static int  single;                         // one EE_WriteVariable per variable instead of EE_WriteVariables
+static int  foreground;                     // no EE_Process: the pages are compacted by the writes
+static int  model[NB_OF_VAR];               // expected values, -1 = not stored
+
+static int save(const uint16_t *addr, const uint16_t *data, int n)
+{
+  if (!single) {
+    return EE_WriteVariables((uint16_t *)addr, (uint16_t *)data, (uint16_t)n) == HAL_OK;
+  }
+  for (int i = 0; i < n; i++) {
+    if (EE_WriteVariable(addr[i], data[i]) != HAL_OK) return 0;
+  }
+  return 1;
+}
+
+// Main loop at standstill: EE_Process until it has nothing left to do
+static void background(void)
+{
+  uint64_t ops;
+  if (foreground) return;
+  do {
+    ops = simStats.ops;
+    EE_Process();
+  } while (simStats.ops != ops);
+}
+
+static void apply(int *m, const uint16_t *addr, const uint16_t *data, int n)
+{
+  for (int i = 0; i < n; i++) {
+    for (int k = 0; k < NB_OF_VAR; k++) {
+      if (VirtAddVarTab[k] == addr[i]) m[k] = data[i];
+    }
+  }
+}
+
+static void readAll(int *v)
+{
+  for (int k = 0; k < NB_OF_VAR; k++) {
+    uint16_t d;
+    v[k] = EE_ReadVariable(VirtAddVarTab[k], &d) == 0 ? d : -1;
+  }
+}
+
+// Random save: all variables like saveConfig, or a few like a changed parameter
+static int randomSave(uint16_t *addr, uint16_t *data, int vars)
+{
+  int n = rand() % 2 ? vars : 1 + rand() % vars;
+  for (int i = 0; i < n; i++) {
+    addr[i] = VirtAddVarTab[n == vars ? i : rand() % NB_OF_VAR];
+    data[i] = (uint16_t)rand();
+  }
+  return n;
+}
+
+static int wearRun(long saves, int vars)
+{
+  uint16_t addr[NB_OF_VAR], data[NB_OF_VAR];
+  SimStats s0;
+  double   saveUs = 0, maxSaveUs = 0;
+  long     ready = 0, readyErased = 0;
+
+  simInit();
+  if (EE_Init() != HAL_OK) {
+    fprintf(stderr, "eesim: EE_Init failed\n");
+    return 1;
+  }
+  s0 = simStats;
+  for (int i = 0; i < vars; i++) addr[i] = VirtAddVarTab[i];
+  for (long n = 0; n < saves; n++) {
+    double   t0 = simStats.timeUs;
+    uint64_t e0 = simStats.erases;
+    int      r  = EE_WriteReady((uint16_t)vars);
+    for (int i = 0; i < vars; i++) data[i] = (uint16_t)(n + i);
+    if (!save(addr, data, vars)) {
+      fprintf(stderr, "eesim: save %ld failed\n", n);
+      return 1;
+    }
+    ready       += r;
+    readyErased += r && !single && simStats.erases != e0;   // EE_WriteReady promised a save without an erase
+    saveUs += simStats.timeUs - t0;
+    if (simStats.timeUs - t0 > maxSaveUs) maxSaveUs = simStats.timeUs - t0;
+    background();
+  }
+
+  double   prog = (double)(simStats.programs - s0.programs) / saves;
+  double   era  = (double)(simStats.erases - s0.erases) / saves;
+  uint32_t maxErases = 0, maxPage = 0;
+  printf("wear: %ld saves of %d variables (%s, %d pages%s)\n", saves, vars, single ? "EE_WriteVariable" : "EE_WriteVariables",
+         EE_PAGES, foreground ? ", no EE_Process" : "");
+  printf("  per save:            %.1f halfword programs, %.4f page erases, %.2f ms flash busy\n",
+         prog, era, (simStats.timeUs - s0.timeUs) / saves / 1000.0);
+  printf("  in the save:         %.2f ms flash busy on average, %.2f ms max\n", saveUs / saves / 1000.0, maxSaveUs / 1000.0);
+  printf("  write amplification: %.2f (%.0f bytes programmed per %d bytes of data)\n", prog / vars, prog * 2, vars * 2);
+  for (uint32_t p = 0; p < simPages(); p++) {
+    uint32_t e = simPageErases(p);
+    if (e) printf("  page 0x%08X:    %u erase cycles\n", SIM_FLASH_BASE + p * FLASH_PAGE_SIZE, e);
+    if (e > maxErases) { maxErases = e; maxPage = p; }
+  }
+  if (maxErases) {
+    printf("  projected:           %.0f saves until page 0x%08X reaches %d cycles\n",
+           (double)saves * SIM_ENDURANCE / maxErases, SIM_FLASH_BASE + maxPage * FLASH_PAGE_SIZE, SIM_ENDURANCE);
+  }
+  printf("  EE_EraseCycles:      %u, EE_RemainingLife: %lu saves\n", EE_EraseCycles(), (unsigned long)EE_RemainingLife());
+  printf("  EE_WriteReady:       %ld saves without an erase announced, %ld of them erased a page\n", ready, readyErased);
+  return readyErased != 0;
+}
+
+static void printVars(const char *name, const int *v)
+{
+  printf("    %-5s", name);
+  for (int k = 0; k < NB_OF_VAR; k++) printf(" %d", v[k]);
+  printf("\n");
+}
+
+static int cutRun(long runs, int vars, int mode)
+{
+  static jmp_buf jb;
+  uint16_t addr[NB_OF_VAR], data[NB_OF_VAR];
+  int      newm[NB_OF_VAR], got[NB_OF_VAR];
+  long     cuts = 0, rolledBack = 0, committed = 0, mixed = 0, failed = 0;
+
+  simInit();
+  for (int k = 0; k < NB_OF_VAR; k++) model[k] = -1;
+  EE_Init();
+
+  for (long r = 0; r < runs; r++) {
+    // Some saves in between, the power losses hit all fill levels of the pages
+    for (int h = rand() % 8; h > 0; h--) {
+      int n = randomSave(addr, data, vars);
+      save(addr, data, n);
+      apply(model, addr, data, n);
+      if (rand() % 2) background();
+    }
+    int n = randomSave(addr, data, vars);
+    memcpy(newm, model, sizeof(newm));
+    apply(newm, addr, data, n);
+
+    simCut(simStats.ops + rand() % (2 * n + 4 * NB_OF_VAR + 24), mode, &jb);
+    if (setjmp(jb) == 0) {
+      save(addr, data, n);
+      background();
+      simCutCancel();
+      memcpy(model, newm, sizeof(model));
+      continue;
+    }
+    cuts++;
+
+    // Restart, one of four restarts is interrupted again
+    if (rand() % 4 == 0) {
+      simCut(simStats.ops + rand() % 64, mode, &jb);
+      if (setjmp(jb) == 0) {
+        EE_Init();
+        simCutCancel();
+      }
+    }
+    uint16_t st = EE_Init();
+    readAll(got);
+
+    int ok = st == HAL_OK, allOld = 1, allNew = 1;
+    for (int k = 0; k < NB_OF_VAR; k++) {
+      int written = 0;
+      for (int i = 0; i < n; i++) {             // single writes: also the earlier value of a variable saved twice
+        written |= addr[i] == VirtAddVarTab[k] && got[k] == data[i];
+      }
+      allOld &= got[k] == model[k];
+      allNew &= got[k] == newm[k];
+      ok     &= got[k] == model[k] || got[k] == newm[k] || (single && written);
+    }
+    if (!single) ok &= allOld || allNew;
+    if (!ok) {
+      if (failed++ < 5) {
+        printf("  run %ld: %s after the power loss (EE_Init %u)\n", r, single ? "lost variables" : "not atomic", st);
+        printVars("read", got);
+        printVars("old", model);
+        printVars("new", newm);
+      }
+      // Start over from what the board reads now
+      EE_Init();
+      readAll(model);
+      continue;
+    }
+    if (allOld)      rolledBack++;
+    else if (allNew) committed++;
+    else             mixed++;
+    memcpy(model, got, sizeof(model));
+
+    // The compaction after the restart keeps the values
+    background();
+    readAll(got);
+    if (memcmp(got, model, sizeof(got)) != 0) {
+      if (failed++ < 5) printf("  run %ld: wrong values after EE_Process\n", r);
+      EE_Init();
+      readAll(model);
+      continue;
+    }
+
+    // It keeps working after the restart
+    n = randomSave(addr, data, vars);
+    if (!save(addr, data, n)) {
+      if (failed++ < 5) printf("  run %ld: save failed after the power loss\n", r);
+      continue;
+    }
+    apply(model, addr, data, n);
+    readAll(got);
+    if (memcmp(got, model, sizeof(got)) != 0 && failed++ < 5) {
+      printf("  run %ld: wrong values after the restart\n", r);
+    }
+  }
+
+  printf("power loss: %ld runs, %ld %s power losses (%s)\n", runs, cuts, mode == SIM_CUT_TORN ? "torn" : "clean",
+         single ? "EE_WriteVariable" : "EE_WriteVariables");
+  printf("  recovered:           %ld old values, %ld new values", rolledBack, committed);
+  if (single) printf(", %ld partly saved", mixed);
+  printf("\n  failed:              %ld\n", failed);
+  return failed != 0;
+}
+
+// One page of the two page format: VALID_PAGE header, plain records, a committed and an interrupted batch
+static void legacyPage(uint32_t base, int *m)
+{
+  uint32_t a = base + 4;
+  uint16_t sum = 0;
+
+  HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, base, VALID_PAGE);
+  for (int k = 0; k < NB_OF_VAR; k++) {                   // plain records, twice: the last one wins
+    for (int r = 0; r < 2; r++, a += 4) {
+      m[k] = (uint16_t)rand();
+      HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, a, (uint16_t)m[k]);
+      HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, a + 2, VirtAddVarTab[k]);
+    }
+  }
+  HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, a, 3);    // committed batch of 3
+  HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, a + 2, EE_BATCH_BEGIN);
+  a += 4;
+  for (int k = 0; k < 3; k++, a += 4) {
+    m[k] = (uint16_t)rand();
+    HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, a, (uint16_t)m[k]);
+    HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, a + 2, VirtAddVarTab[k]);
+    sum = (uint16_t)(((sum << 1) | (sum >> 15)) + (VirtAddVarTab[k] ^ (uint16_t)m[k]) + 1);
+  }
+  HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, a, sum);
+  HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, a + 2, EE_BATCH_COMMIT);
+  a += 4;
+  HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, a, 2);    // interrupted batch: ignored
+  HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, a + 2, EE_BATCH_BEGIN);
+  HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, a + 4, 0x1234);
+  HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, a + 6, VirtAddVarTab[5]);
+}
+
+static int importRun(void)
+{
+  static const uint32_t pages[2] = {PAGE0_BASE_ADDRESS, PAGE1_BASE_ADDRESS};
+  int got[NB_OF_VAR], failed = 0;
+
+  for (int i = 0; i < 2; i++) {
+    simInit();
+    legacyPage(pages[i], model);
+    int ok = EE_Init() == HAL_OK;
+    readAll(got);
+    ok &= memcmp(got, model, sizeof(got)) == 0;
+    ok &= *(volatile uint16_t *)PAGE1_BASE_ADDRESS == ERASED;
+    EE_Init();                                           // imported once
+    readAll(got);
+    ok &= memcmp(got, model, sizeof(got)) == 0;
+    printf("import: two page format page 0x%08X: %s\n", pages[i], ok ? "ok" : "FAILED");
+    failed += !ok;
+  }
+
+  simInit();                                             // other data at the page above the store: left alone
+  HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, PAGE1_BASE_ADDRESS, 0x5A5A);
+  int ok = EE_Init() == HAL_OK;
+  EE_Init();
+  ok &= *(volatile uint16_t *)PAGE1_BASE_ADDRESS == 0x5A5A;
+  ok &= simPageErases((PAGE1_BASE_ADDRESS - SIM_FLASH_BASE) / FLASH_PAGE_SIZE) == 0;
+  printf("import: other data above the store: %s\n", ok ? "ok" : "FAILED");
+  failed += !ok;
+  return failed != 0;
+}
+
+// Configuration record as configSave() stores it: key, schema version and CRC32
+static void cfgRecord(uint16_t *rec, uint16_t key, uint16_t version)
+{
+  uint32_t crc;
+  for (int k = 1; k < CFG_VERSION; k++) rec[k] = (uint16_t)(rand() & 0x7FFF);
+  rec[CFG_KEY]     = key;
+  rec[CFG_VERSION] = version;
+  crc = calcCRC32((const uint8_t *)rec, 2 * CFG_CRC_LO);
+  rec[CFG_CRC_LO]  = (uint16_t)crc;
+  rec[CFG_CRC_HI]  = (uint16_t)(crc >> 16);
+}
+
+// Values read by configLoad(): the record, or all CFG_UNSET if config.h is used
+static int cfgLoaded(const uint16_t *rec)
+{
+  for (int k = 1; k < CFG_VERSION; k++) {
+    if (cfgData[k] != (rec ? rec[k] : CFG_UNSET)) return 0;
+  }
+  return 1;
+}
+
+// The record in the store is left as it is
+static int cfgStored(const uint16_t *rec)
+{
+  uint16_t data[CFG_SLOTS];
+  EE_ReadVariables(VirtAddVarTab, data, CFG_SLOTS);
+  return memcmp(data, rec, sizeof(data)) == 0;
+}
+
+static int cfgCase(const char *name, int ok)
+{
+  printf("config: %-28s %s\n", name, ok ? "ok" : "FAILED");
+  return !ok;
+}
+
+static int configRun(void)
+{
+  uint16_t rec[CFG_SLOTS];
+  int failed = 0, ok;
+
+  simInit();
+  EE_Init();
+  ok = configLoad() == 0 && cfgStatus == CFG_NONE && cfgLoaded(NULL);
+  failed += cfgCase("empty store", ok);
+
+  simInit();
+  EE_Init();
+  cfgRecord(rec, FLASH_WRITE_KEY, CFG_SCHEMA);
+  memcpy(cfgData, rec, sizeof(cfgData));
+  ok = configSave() == HAL_OK && cfgStored(rec);
+  memset(cfgData, 0, sizeof(cfgData));
+  ok &= configLoad() == 1 && cfgStatus == CFG_OK && cfgLoaded(rec);
+  failed += cfgCase("saved record", ok);
+
+  simInit();                                             // key and values only, one EE_WriteVariable each
+  EE_Init();
+  cfgRecord(rec, FLASH_WRITE_KEY, CFG_SCHEMA);
+  for (int k = 0; k < CFG_VERSION; k++) EE_WriteVariable(VirtAddVarTab[k], rec[k]);
+  ok = configLoad() == 1 && cfgStatus == CFG_MIGRATED && cfgLoaded(rec) && cfgStored(rec);
+  ok &= configLoad() == 1 && cfgStatus == CFG_OK && cfgLoaded(rec);   // saved with the version and the CRC
+  failed += cfgCase("per-variable record migrated", ok);
+
+  simInit();                                             // saved by a later firmware: kept for it
+  EE_Init();
+  cfgRecord(rec, FLASH_WRITE_KEY, CFG_SCHEMA + 1);
+  EE_WriteVariables(VirtAddVarTab, rec, CFG_SLOTS);
+  ok = configLoad() == 0 && cfgStatus == CFG_NEWER && cfgLoaded(NULL) && cfgStored(rec);
+  failed += cfgCase("newer schema", ok);
+
+  simInit();                                             // a value changed after the save
+  EE_Init();
+  cfgRecord(rec, FLASH_WRITE_KEY, CFG_SCHEMA);
+  EE_WriteVariables(VirtAddVarTab, rec, CFG_SLOTS);
+  rec[3] ^= 1;
+  EE_WriteVariable(VirtAddVarTab[3], rec[3]);
+  ok = configLoad() == 0 && cfgStatus == CFG_CORRUPT && cfgLoaded(NULL) && cfgStored(rec);
+  failed += cfgCase("CRC error", ok);
+
+  simInit();                                             // saved by a firmware with another FLASH_WRITE_KEY
+  EE_Init();
+  cfgRecord(rec, FLASH_WRITE_KEY ^ 1, CFG_SCHEMA);
+  EE_WriteVariables(VirtAddVarTab, rec, CFG_SLOTS);
+  ok = configLoad() == 0 && cfgStatus == CFG_NONE && cfgLoaded(NULL) && cfgStored(rec);
+  failed += cfgCase("changed key", ok);
+
+  simInit();
+  EE_Init();
+  cfgRecord(rec, FLASH_WRITE_KEY ^ 1, CFG_SCHEMA);
+  for (int k = 0; k < CFG_VERSION; k++) EE_WriteVariable(VirtAddVarTab[k], rec[k]);
+  ok = configLoad() == 0 && cfgStatus == CFG_NONE && cfgLoaded(NULL);
+  failed += cfgCase("changed key, per-variable", ok);
+  return failed != 0;
+}
+
+#define BB_CALLS    (3 * BBOX_SAMPLES * BBOX_DIV)     // main loops of one snapshot at most
+#define BB_MAX      (BBOX_PAGES * FLASH_PAGE_SIZE / sizeof(BBoxHeader))
+#define BB_DATA_MAX (FLASH_PAGE_SIZE - sizeof(BBoxHeader))
+#define BB_SIM_PAGE(p) ((BBOX_START_ADDRESS - SIM_FLASH_BASE) / FLASH_PAGE_SIZE + (p))
+
+typedef struct {
+  uint32_t   addr;
+  BBoxHeader h;
+  uint16_t   crc;                           // of the data as found
+} BBoxEntry;
+
+static int16_t  bbLog[BB_CALLS][BBOX_CH_NUM];   // signals of each main loop since the last save
+static uint8_t  bbImage[BBOX_PAGES * FLASH_PAGE_SIZE];
+
+static int bbVarLen(int32_t d)
+{
+  uint32_t z = ((uint32_t)d << 1) ^ (uint32_t)(d >> 31);
+  return z < 0x80 ? 1 : (z < 0x4000 ? 2 : 3);
+}
+
+// Snapshots with the magic, walked like bboxScan(): a header with its length set and the data within the page
+static int bbList(BBoxEntry *e)
+{
+  int n = 0;
+  for (uint32_t page = 0; page < BBOX_PAGES; page++) {
+    uint32_t addr = BBOX_START_ADDRESS + page * FLASH_PAGE_SIZE, end = addr + FLASH_PAGE_SIZE;
+    while (addr + sizeof(BBoxHeader) <= end) {
+      const BBoxHeader *h = (const BBoxHeader *)addr;
+      if (h->len == 0xFFFF || addr + sizeof(BBoxHeader) + h->len > end) break;
+      if (h->magic == BBOX_MAGIC) {
+        e[n].addr = addr;
+        e[n].h    = *h;
+        e[n].crc  = calcCRC16((const uint8_t *)(addr + sizeof(BBoxHeader)), h->len);
+        n++;
+      }
+      addr += sizeof(BBoxHeader) + ((h->len + 1u) & ~1u);
+    }
+  }
+  return n;
+}
+
+static int bbFind(const BBoxEntry *e, int n, const BBoxEntry *x)
+{
+  for (int i = 0; i < n; i++) {
+    if (e[i].addr == x->addr && !memcmp(&e[i].h, &x->h, sizeof(x->h)) && e[i].crc == x->crc) return 1;
+  }
+  return 0;
+}
+
+static uint32_t bbPage(uint32_t addr)
+{
+  return (addr - BBOX_START_ADDRESS) / FLASH_PAGE_SIZE;
+}
+
+// Signals of main loop n: cmdL counts the main loops, the other channels are small steps or anything (3 byte varints)
+static void bbSignals(int n, int large, int fault)
+{
+  int16_t *s = bbLog[n], *p = n ? bbLog[n - 1] : NULL;
+  for (int c = 0; c < BBOX_CH_NUM; c++) {
+    s[c] = large ? (int16_t)rand() : (int16_t)((p ? p[c] : 0) + rand() % 61 - 30);
+  }
+  s[BBOX_CH_CMD_L] = (int16_t)n;
+  s[BBOX_CH_TEMP]  = (int16_t)(rand() % TEMP_POWEROFF);
+  s[BBOX_CH_STATE] = fault ? 1 + rand() % 7 : 0;
+  cmdL               = s[BBOX_CH_CMD_L];
+  cmdR               = s[BBOX_CH_CMD_R];
+  rtY_Left.n_mot     = s[BBOX_CH_SPEED_L];
+  rtY_Right.n_mot    = s[BBOX_CH_SPEED_R];
+  dc_curr            = s[BBOX_CH_DC_CURR];
+  batVoltageCalib    = s[BBOX_CH_BATV];
+  board_temp_deg_c   = s[BBOX_CH_TEMP];
+  input1[inIdx].cmd  = s[BBOX_CH_IN1];
+  input2[inIdx].cmd  = s[BBOX_CH_IN2];
+  rtY_Left.z_errCode = (uint8_t)s[BBOX_CH_STATE];
+}
+
+// Decode the snapshot saved at main loop save (the samples of main loops 0 to save - 1), fault at main loop fault
+static const char *bbCheck(const BBoxEntry *e, int save, int fault, uint32_t faultTime, int *cut)
+{
+  static int16_t smp[BBOX_SAMPLES][BBOX_CH_NUM];
+  const BBoxHeader *h = &e->h;
+  const uint8_t *d = (const uint8_t *)(e->addr + sizeof(BBoxHeader));
+  uint32_t pos = 0;
+  int16_t  prev[BBOX_CH_NUM] = {0};
+  int      last = save - 1, first, post = 0, recorded, extra = 0;
+
+  if (e->crc != h->crc) return "CRC error";
+  if (h->channels != BBOX_CH_NUM || h->fault != BBOX_FLT_MOTOR || h->post != BBOX_POST_SAMPLES ||
+      h->period != BBOX_DIV * DELAY_IN_MAIN_LOOP || h->time != faultTime) return "wrong header";
+  if (h->samples == 0 || h->samples > BBOX_SAMPLES || h->len > BB_DATA_MAX) return "wrong size";
+  for (int k = 0; k < h->samples; k++) {
+    for (int c = 0; c < BBOX_CH_NUM; c++) {
+      uint32_t z = 0;
+      for (int shift = 0; ; shift += 7) {
+        if (pos >= h->len || shift > 14) return "data overrun";
+        z |= (uint32_t)(d[pos] & 0x7F) << shift;
+        if (!(d[pos++] & 0x80)) break;
+      }
+      smp[k][c] = prev[c] = (int16_t)(prev[c] + (int32_t)((z >> 1) ^ -(z & 1)));
+    }
+  }
+  if (pos != h->len) return "length mismatch";
+
+  // Samples every BBOX_DIV main loops up to the one before the save, BBOX_POST_SAMPLES of them from the fault on
+  first = last - (h->samples - 1) * BBOX_DIV;
+  if (first < 0) return "too many samples";
+  for (int k = 0; k < h->samples; k++) {
+    int n = first + k * BBOX_DIV;
+    if (memcmp(smp[k], bbLog[n], sizeof(smp[k])) != 0) return "wrong samples";
+    post += n >= fault;
+  }
+  if (post != BBOX_POST_SAMPLES) return "wrong post samples";
+
+  // All samples of the ring, or the next older one does not fit
+  recorded = last / BBOX_DIV + 1;
+  if (recorded > BBOX_SAMPLES) recorded = BBOX_SAMPLES;
+  *cut = h->samples < recorded;
+  if (*cut) {
+    for (int c = 0; c < BBOX_CH_NUM; c++) {
+      extra += bbVarLen(bbLog[first - BBOX_DIV][c]) + bbVarLen(bbLog[first][c] - bbLog[first - BBOX_DIV][c]) - bbVarLen(bbLog[first][c]);
+    }
+    if (h->len + extra <= BB_DATA_MAX) return "truncated too much";
+  } else if (h->samples != recorded) {
+    return "samples missing";
+  }
+  return NULL;
+}
+
+static int bboxRun(long snaps, int mode)
+{
+  static jmp_buf      jb;
+  static volatile int n;                    // main loop, of the save after the loop
+  static BBoxEntry    before[BB_MAX], after[BB_MAX];
+  long     cuts = 0, stored = 0, lost = 0, truncated = 0, failed = 0;
+  int      garbage = -1, seqCheck = 1;
+  uint32_t now = 0, garbageErases = 0, seqWait[BBOX_PAGES], faultTime = 0;
+
+  simInit();
+  bboxRestart();
+  enable      = 0;                          // the snapshot is written at standstill with the motors off
+  speedAvgAbs = 0;
+  batVoltage  = BAT_DEAD + 1000;
+
+  for (long r = 0; r < snaps; r++) {
+    int large = rand() % 3 == 0, fault = rand() % (2 * BBOX_SAMPLES * BBOX_DIV), cut = rand() % 2, cutSave = 0;
+    int nb, na, erased = -1, nNew = 0, iNew = -1, trunc = 0;
+    const char *err = NULL;
+    uint64_t writes = simStats.programs + simStats.erases;
+    uint32_t erases[BBOX_PAGES];
+
+    nb = bbList(before);
+    memcpy(bbImage, (const void *)BBOX_START_ADDRESS, sizeof(bbImage));
+    for (int p = 0; p < BBOX_PAGES; p++) erases[p] = simPageErases(BB_SIM_PAGE(p));
+
+    if (cut) {                              // the first operation is the erase of the next page if the snapshot moves there
+      simCut(simStats.ops + (rand() % 8 ? rand() % (BB_DATA_MAX / 2 + 16) : 0), mode, &jb);
+    }
+    if (setjmp(jb) == 0) {
+      for (n = 0; n < BB_CALLS && simStats.programs + simStats.erases == writes; n++) {
+        bbSignals(n, large, n >= fault && n < fault + 3);
+        if (n == fault) faultTime = now;
+        bboxProcess(now);
+        now += DELAY_IN_MAIN_LOOP;
+      }
+      simCutCancel();
+      n--;
+      if (simStats.programs + simStats.erases == writes) {
+        if (failed++ < 5) printf("  snapshot %ld: not saved\n", r);
+        continue;
+      }
+    } else {
+      cuts++;
+      cutSave = 1;
+      bboxRestart();                        // power on again
+    }
+
+    na = bbList(after);
+    if (bboxCount != na) err = "bboxCount differs from the snapshots";
+
+    // Page erased by the save, also partly by a power loss: bits back to 1
+    for (int p = 0; p < BBOX_PAGES; p++) {
+      const uint8_t *f = (const uint8_t *)BBOX_START_ADDRESS + p * FLASH_PAGE_SIZE;
+      for (int i = 0; i < FLASH_PAGE_SIZE && erased != p; i++) {
+        if (f[i] & ~bbImage[p * FLASH_PAGE_SIZE + i]) erased = p;
+      }
+    }
+
+    // A torn erase leaves a page of anything until it is erased again, the seq numbers start over after it
+    if (garbage >= 0 && simPageErases(BB_SIM_PAGE(garbage)) != garbageErases) {
+      for (int p = 0; p < BBOX_PAGES; p++) seqWait[p] = simPageErases(BB_SIM_PAGE(p)) - (p == garbage);
+      garbage = -1;
+    }
+    if (cutSave && erased >= 0 && simPageErases(BB_SIM_PAGE(erased)) == erases[erased]) {
+      garbage       = erased;
+      garbageErases = erases[erased];
+      seqCheck      = 0;
+    }
+
+    // The snapshots of the other pages are unchanged, the new one is the one of this save. Also in a page left by a torn
+    // erase: the header of a snapshot there may still read as one and the next snapshot goes after it
+    for (int i = 0; i < nb && !err; i++) {
+      int p = bbPage(before[i].addr);
+      if (p != erased && !bbFind(after, na, &before[i])) err = "snapshot of another page lost";
+    }
+    for (int i = 0; i < na; i++) {
+      if (!(cutSave && (int)bbPage(after[i].addr) == garbage) && !bbFind(before, nb, &after[i])) {
+        nNew++;
+        iNew = i;
+      }
+    }
+    if (!err && (nNew > 1 || (nNew == 0 && !cutSave))) err = nNew ? "more than one new snapshot" : "snapshot not found";
+    if (!err && iNew >= 0) err = bbCheck(&after[iNew], n, fault, faultTime, &trunc);
+
+    if (!seqCheck && garbage < 0) {
+      seqCheck = 1;
+      for (int p = 0; p < BBOX_PAGES; p++) seqCheck &= simPageErases(BB_SIM_PAGE(p)) > seqWait[p];
+    }
+
+    // The seq numbers are consecutive up to the new snapshot
+    if (!err && seqCheck && iNew >= 0) {
+      for (int i = 0; i < na && !err; i++) {
+        int16_t age = (int16_t)(after[iNew].h.seq - after[i].h.seq);
+        int     found = 0;
+        if (age < 0 || age >= na) err = "seq numbers not consecutive";
+        for (int k = 0; k < na; k++) found += after[k].h.seq == (uint16_t)(after[iNew].h.seq - i);
+        if (found != 1) err = "seq numbers not consecutive";
+      }
+    }
+
+    if (err) {
+      if (failed++ < 5) printf("  snapshot %ld: %s%s\n", r, err, cutSave ? " after the power loss" : "");
+      continue;
+    }
+    truncated += trunc;
+    if (cutSave) {
+      stored += nNew;
+      lost   += !nNew;
+    }
+  }
+
+  printf("black box: %ld snapshots, %ld cut to the page size, %ld %s power losses (%ld saved, %ld not counted)\n", snaps,
+         truncated, cuts, mode == SIM_CUT_TORN ? "torn" : "clean", stored, lost);
+  for (int p = 0; p < BBOX_PAGES; p++) {
+    printf("  page 0x%08X:    %u erase cycles\n", BBOX_START_ADDRESS + p * FLASH_PAGE_SIZE, simPageErases(BB_SIM_PAGE(p)));
+    if (snaps >= 100 && simPageErases(BB_SIM_PAGE(p)) == 0) failed++;
+  }
+  printf("  failed:              %ld\n", failed);
+  return failed != 0;
+}
+
+static void usage(void)
+{
+  fprintf(stderr,
+    "Usage: eesim [options]\n"
+    "  -n, --saves N          saves of the wear run (default 10000, 0 = no wear run)\n"
+    "  -c, --cuts N           runs with a power loss (default 2000, 0 = none)\n"
+    "  -v, --vars N           variables per save (default 19, saveConfig)\n"
+    "  -t, --torn             power losses during the flash operations (partly programmed/erased bits)\n"
+    "      --single           one EE_WriteVariable per variable instead of EE_WriteVariables\n"
+    "      --foreground       no EE_Process, the pages are compacted by the writes\n"
+    "      --import           start from pages of the two page format\n"
+    "  -b, --bbox N           snapshots of the black box run (default 1000, 0 = none)\n"
+    "  -s, --seed N           random seed (default 1)\n");
+}
+
+int main(int argc, char **argv)
+{
+  static const struct option longOpts[] = {
+    {"saves",  required_argument, NULL, 'n'},
+    {"cuts",   required_argument, NULL, 'c'},
+    {"vars",   required_argument, NULL, 'v'},
+    {"torn",   no_argument,       NULL, 't'},
+    {"single", no_argument,       NULL, 'S'},
+    {"foreground", no_argument,   NULL, 'F'},
+    {"import", no_argument,       NULL, 'I'},
+    {"bbox",   required_argument, NULL, 'b'},
+    {"seed",   required_argument, NULL, 's'},
+    {"help",   no_argument,       NULL, 'h'},
+    {NULL,     0,                 NULL, 0}
+  };
+  long saves = 10000, runs = 2000, snaps = 1000;
+  int  vars = 19, mode = SIM_CUT_CLEAN, import = 0, c, rc = 0;
+
+  while ((c = getopt_long(argc, argv, "n:c:v:ts:b:h", longOpts, NULL)) != -1) {
+    switch (c) {
+      case 'n': saves  = atol(optarg); break;
+      case 'c': runs   = atol(optarg); break;
+      case 'v': vars   = atoi(optarg); break;
+      case 't': mode   = SIM_CUT_TORN; break;
+      case 'S': single = 1; break;
+      case 'F': foreground = 1; break;
+      case 'I': import = 1; break;
+      case 'b': snaps  = atol(optarg); break;
+      case 's': srand((unsigned)atoi(optarg)); break;
+      default:  usage(); return c == 'h' ? 0 : 1;
+    }
+  }
+  if (vars < 1 || vars > NB_OF_VAR) {
+    fprintf(stderr, "eesim: 1 to %d variables\n", NB_OF_VAR);
+    return 1;
+  }
+
+  rc |= configRun();
+  if (import)    rc |= importRun();
+  if (saves > 0) rc |= wearRun(saves, vars);
+  if (runs > 0)  rc |= cutRun(runs, vars, mode);
+  if (snaps > 0) rc |= bboxRun(snaps, mode);
+  return rc;
+}
@@ -0,0 +1,142 @@
+/*
+ * Host model of the STM32F1 flash for the EEPROM emulation
+ *  - halfword programming: a programmed halfword can only be overwritten with 0x0000 (PGERR otherwise)
+ *  - page erase to 0xFFFF, FLASH_PAGE_SIZE of the firmware build
+ *  - operation counting for the power loss injection and the busy time of each operation
+ */
+
+#define _GNU_SOURCE
+#include "stm32f1xx_hal.h"
+#include "flash_sim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+SimStats simStats;
+
+static uint16_t *flash;
+static uint32_t  pageErases[SIM_FLASH_SIZE / FLASH_PAGE_SIZE];
+static uint64_t  cutOp = UINT64_MAX;
+static int       cutMode;
+static jmp_buf  *cutJmp;
+
+void simInit(void)
+{
+  if (!flash) {
+    void *m = mmap((void *)(uintptr_t)SIM_FLASH_BASE, SIM_FLASH_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    if (m != (void *)(uintptr_t)SIM_FLASH_BASE) {
+      perror("eesim: flash mapping at 0x08010000");     // needs a non-PIE build, see Makefile
+      exit(1);
+    }
+    flash = m;
+  }
+  memset(flash, 0xFF, SIM_FLASH_SIZE);
+  memset(pageErases, 0, sizeof(pageErases));
+  memset(&simStats, 0, sizeof(simStats));
+  simCutCancel();
+}
+
+void simCut(uint64_t op, int mode, jmp_buf *jb)
+{
+  cutOp   = op;
+  cutMode = mode;
+  cutJmp  = jb;
+}
+
+void simCutCancel(void)
+{
+  cutOp  = UINT64_MAX;
+  cutJmp = NULL;
+}
+
+uint32_t simPages(void)
+{
+  return SIM_FLASH_SIZE / FLASH_PAGE_SIZE;
+}
+
+uint32_t simPageErases(uint32_t page)
+{
+  return page < simPages() ? pageErases[page] : 0;
+}
+
+// Power loss before or during the current operation
+static int powerLoss(void)
+{
+  if (simStats.ops != cutOp) {
+    simStats.ops++;
+    return 0;
+  }
+  return 1;
+}
+
+static void powerOff(void)
+{
+  jmp_buf *jb = cutJmp;
+  simCutCancel();
+  longjmp(*jb, 1);
+}
+
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t TypeProgram, uint32_t Address, uint64_t Data)
+{
+  uint16_t *p;
+
+  if (TypeProgram != FLASH_TYPEPROGRAM_HALFWORD || (Address & 1) ||
+      Address < SIM_FLASH_BASE || Address + 2 > SIM_FLASH_BASE + SIM_FLASH_SIZE) {
+    return HAL_ERROR;
+  }
+  p = &flash[(Address - SIM_FLASH_BASE) / 2];
+  if (powerLoss()) {
+    if (cutMode == SIM_CUT_TORN) {
+      *p &= (uint16_t)Data | (uint16_t)rand();          // some of the 0 bits are programmed
+    }
+    powerOff();
+  }
+  simStats.timeUs += SIM_T_PROG_US;
+  if (*p != 0xFFFF && (uint16_t)Data != 0) {
+    simStats.pgErr++;
+    return HAL_ERROR;
+  }
+  *p &= (uint16_t)Data;
+  simStats.programs++;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef *pEraseInit, uint32_t *PageError)
+{
+  *PageError = 0xFFFFFFFF;
+  for (uint32_t i = 0; i < pEraseInit->NbPages; i++) {
+    uint32_t addr = pEraseInit->PageAddress + i * FLASH_PAGE_SIZE;
+    if (pEraseInit->TypeErase != FLASH_TYPEERASE_PAGES || (addr & (FLASH_PAGE_SIZE - 1)) ||
+        addr < SIM_FLASH_BASE || addr + FLASH_PAGE_SIZE > SIM_FLASH_BASE + SIM_FLASH_SIZE) {
+      *PageError = addr;
+      return HAL_ERROR;
+    }
+    uint16_t *p = &flash[(addr - SIM_FLASH_BASE) / 2];
+    if (powerLoss()) {
+      if (cutMode == SIM_CUT_TORN) {
+        for (uint32_t k = 0; k < FLASH_PAGE_SIZE / 2; k++) {
+          p[k] |= (uint16_t)(rand() & rand());          // partially erased cells
+        }
+      }
+      powerOff();
+    }
+    simStats.timeUs += SIM_T_ERASE_US;
+    memset(p, 0xFF, FLASH_PAGE_SIZE);
+    pageErases[(addr - SIM_FLASH_BASE) / FLASH_PAGE_SIZE]++;
+    simStats.erases++;
+  }
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Unlock(void)
+{
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Lock(void)
+{
+  return HAL_OK;
+}
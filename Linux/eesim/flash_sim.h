@@ -0,0 +1,42 @@
+/*
+ * Host model of the STM32F1 flash for the EEPROM emulation (flash_sim.c)
+ * Src/eeprom.c runs on it unmodified: the flash is mapped at its real address and
+ * HAL_FLASH_Program/HAL_FLASHEx_Erase are replaced by the model.
+ */
+
+#ifndef FLASH_SIM_H
+#define FLASH_SIM_H
+
+#include <setjmp.h>
+#include <stdint.h>
+
+#define SIM_FLASH_BASE    0x08010000u       // EEPROM_START_ADDRESS
+#define SIM_FLASH_SIZE    0x00030000u       // up to the end of the 256 KB flash
+
+// STM32F103xC/D/E datasheet: typical program and erase time, page endurance
+#define SIM_T_PROG_US     52.5
+#define SIM_T_ERASE_US    30000.0
+#define SIM_ENDURANCE     10000
+
+enum {
+  SIM_CUT_CLEAN,                            // power lost between two operations
+  SIM_CUT_TORN                              // power lost during the operation: bits partially programmed/erased
+};
+
+typedef struct {
+  uint64_t ops;                             // program + erase operations
+  uint64_t programs;                        // halfwords
+  uint64_t erases;                          // pages
+  uint64_t pgErr;                           // programming of a non erased halfword
+  double   timeUs;                          // flash busy time
+} SimStats;
+
+extern SimStats simStats;
+
+void     simInit(void);                     // map the flash, all erased
+void     simCut(uint64_t op, int mode, jmp_buf *jb);  // power loss at operation op: longjmp(*jb, 1)
+void     simCutCancel(void);
+uint32_t simPages(void);
+uint32_t simPageErases(uint32_t page);      // erase cycles of a page, 0 = SIM_FLASH_BASE
+
+#endif // FLASH_SIM_H
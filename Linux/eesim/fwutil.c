@@ -0,0 +1,17 @@
+/*
+ * util.c for eesim, with bboxRestart(): the power on after a power loss, the RAM state of the black box is lost
+ * and bboxInit() finds the snapshots in the flash again
+ */
+#include "../../Src/util.c"
+
+void bboxRestart(void) {
+  memset(bboxRing, 0, sizeof(bboxRing));
+  bboxHead   = 0;
+  bboxFill   = 0;
+  bboxDivCnt = 0;
+  bboxActive = 0;
+  bboxFault  = BBOX_FLT_NONE;
+  bboxPost   = 0;
+  bboxSeq    = 0;
+  bboxInit();
+}
@@ -0,0 +1,292 @@
+// *******************************************************************
+//  filtbench: checks and host timing of the fixed-point filters (Src/filter.c)
+//  for   https://github.com/EmanuelFeru/hoverboard-firmware-hack-FOC
+//
+// *******************************************************************
+// Checks, over random and step inputs:
+//  - filtMedian3/filtMedian5 and filtMovAvg16 against sorting and summing the window
+//  - the biquad lowpass example of filter.c settles on the step input without DC offset
+//  - filtPipe with the default stage table gives the same output as the former rateLimiter16 -> filtLowPass32 chain
+//    of main.c, and the deadband, expo and clamp stages follow their definition
+//  - the ADC input glitch filter (ADC_INPUT_MEDIAN) on a noisy pedal with spikes at 16 kHz, sampled every 5 ms main loop:
+//    spikes seen by the main loop and step delay, against the raw input and a softer main loop FILTER
+// Then the time per call of each filter on the host, in ns and TSC ticks (x86). The host numbers only compare the
+// filters with each other: on the Cortex-M3 the 64-bit multiply, shift and clamp cost relatively more.
+//   make && ./filtbench [calls]
+// *******************************************************************
+
+#include "filter.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TICKS() __rdtsc()
+#else
+#define TICKS() 0ULL
+#endif
+
+#define NSAMPLES 4096
+
+static int16_t in[NSAMPLES];
+static volatile int32_t sink;
+
+static int cmp16(const void *a, const void *b)
+{
+  return *(const int16_t *)a - *(const int16_t *)b;
+}
+
+static uint32_t rnd(void)
+{
+  static uint32_t s = 0x12345678;
+  s ^= s << 13; s ^= s >> 17; s ^= s << 5;
+  return s;
+}
+
+static int checkMedian(void)
+{
+  Median5 m;
+  int16_t win[5], s[5];
+  uint64_t bad = 0;
+
+  filtMedianInit5(&m, 0);
+  memset(win, 0, sizeof(win));
+  for (int i = 0; i < 1000000; i++) {
+    int16_t x = (int16_t)rnd();
+    int16_t a = (int16_t)rnd(), b = (int16_t)rnd(), c = (int16_t)rnd();
+    int16_t y = filtMedian5(x, &m);
+    win[i % 5] = x;
+    memcpy(s, win, sizeof(s));
+    qsort(s, 5, sizeof(s[0]), cmp16);
+    bad += (y != s[2]);
+    s[0] = a; s[1] = b; s[2] = c;
+    qsort(s, 3, sizeof(s[0]), cmp16);
+    bad += (filtMedian3(a, b, c) != s[1]);
+  }
+  printf("filtMedian3/5: %llu differences to the sorted window\n", (unsigned long long)bad);
+  return bad != 0;
+}
+
+static int checkMovAvg(void)
+{
+  MovAvg16 f;
+  int16_t win[FILT_MAVG_LEN_MAX];
+  uint64_t bad = 0;
+
+  for (uint8_t l = 0; l <= FILT_MAVG_LOG2_MAX; l++) {
+    int len = 1 << l;
+    filtMovAvgInit16(&f, l, 100);
+    for (int k = 0; k < len; k++) win[k] = 100;
+    for (int i = 0; i < 200000; i++) {
+      int16_t x = (int16_t)rnd();
+      int32_t sum = 0;
+      win[i % len] = x;
+      for (int k = 0; k < len; k++) sum += win[k];
+      bad += (filtMovAvg16(x, &f) != (int16_t)((sum + (len >> 1)) >> l));
+    }
+  }
+  printf("filtMovAvg16: %llu differences to the window sum\n", (unsigned long long)bad);
+  return bad != 0;
+}
+
+static int checkBiquad(void)
+{
+  Biquad16 f = {91, 181, 91, FILT_Q14(-1.778631), FILT_Q14(0.800802)};
+  int16_t y = 0, peak = 0;
+  int settle = -1;
+
+  filtBiquadInit16(&f, 0);
+  for (int i = 0; i < 2000; i++) {
+    y = filtBiquad16(1000, &f);
+    if (y > peak) peak = y;
+    if (y != 1000) settle = -1;
+    else if (settle < 0) settle = i;
+  }
+  printf("filtBiquad16: step 0 -> 1000, overshoot %d, final %d, settled after %d samples\n", peak - 1000, y, settle);
+  return y != 1000;
+}
+
+// Steer/speed chain of main.c before the input pipeline
+static int16_t chainRef(int16_t u, int16_t rate, uint16_t coef, int16_t *yRate, int32_t *yLpf)
+{
+  rateLimiter16(u, rate, yRate);
+  filtLowPass32(*yRate >> 4, coef, yLpf);
+  return (int16_t)(*yLpf >> 16);
+}
+
+static int checkPipeline(void)
+{
+  static const int16_t  rates[] = {16, 480, 4800, 32767};
+  static const uint16_t coefs[] = {3276, 6553, 65535};
+  static const int16_t  lims[]  = {1000, 1500};       // input range without and with field weakening
+  uint64_t n = 0, bad = 0, badStage = 0;
+
+  for (unsigned r = 0; r < sizeof(rates) / sizeof(rates[0]); r++) {
+    for (unsigned c = 0; c < sizeof(coefs) / sizeof(coefs[0]); c++) {
+      for (unsigned l = 0; l < sizeof(lims) / sizeof(lims[0]); l++) {
+        PipeCfg   cfg = {0, 0, rates[r], coefs[c], (int16_t)-lims[l], lims[l]};
+        PipeState st  = {0, 0};
+        int16_t   yRate = 0, u = 0, lo = (int16_t)(lims[l] - 2000);   // rateLimiter16 needs steps < 2048
+        int32_t   yLpf = 0;
+        filtPipeRange(&cfg, lims[l]);
+        for (int i = 0; i < 200000; i++) {
+          if (rnd() % 200 == 0) u = (int16_t)(lo + (int32_t)(rnd() % (uint32_t)(lims[l] - lo + 1)));  // stick/pedal moves
+          if (rnd() % 5000 == 0) st.lpf = yLpf = 0;                                                    // motorsEnable
+          int16_t x = (int16_t)(u + (int16_t)(rnd() % 16) - 8);
+          x = x > lims[l] ? lims[l] : (x < lo ? lo : x);                                               // calcInputCmd range
+          bad += (filtPipe(x, &cfg, &st) != chainRef(x, rates[r], coefs[c], &yRate, &yLpf));
+          n++;
+        }
+      }
+    }
+  }
+
+  // Deadband, expo and clamp alone: rate limiter and filter bypassed and settled on the stage input
+  for (int32_t x = -1000; x <= 1000; x++) {
+    PipeCfg   cfg = {100, 8192, 32767, 65535, -900, 1000};
+    int32_t   d   = x - (x > 100 ? 100 : (x < -100 ? -100 : x));
+    double    e   = d + 0.5 * ((double)d * d * d / 1e6 - d);
+    PipeState st  = {(int16_t)(d << 4), (int32_t)d << 16};
+    int32_t   ref = e < -900 ? -900 : (int32_t)e;
+    int32_t   y;
+    filtPipeRange(&cfg, 1000);
+    y = filtPipe((int16_t)x, &cfg, &st);
+    badStage += (y < ref - 2 || y > ref + 1);                 // truncations of the expo and of the bypassed filter
+  }
+
+  // Clamp below the input range with expo: the curve spans the input range and the clamp cuts it. Full stick from rest,
+  // through the default rate limiter and filter: the output never takes the opposite sign and settles at the clamp
+  static const int16_t  clampMax[] = {400, 500, 800};
+  static const uint16_t expos[]    = {4096, 8192, 16384};
+  for (unsigned m = 0; m < sizeof(clampMax) / sizeof(clampMax[0]); m++) {
+    for (unsigned e = 0; e < sizeof(expos) / sizeof(expos[0]); e++) {
+      for (int sgn = -1; sgn <= 1; sgn += 2) {
+        PipeCfg   cfg = {0, expos[e], 480, 6553, (int16_t)-clampMax[m], clampMax[m]};
+        PipeState st  = {0, 0};
+        int16_t   y   = 0;
+        filtPipeRange(&cfg, 1000);
+        for (int i = 0; i < 400; i++) {
+          y = filtPipe((int16_t)(sgn * 1000), &cfg, &st);
+          badStage += (y * sgn < 0);
+        }
+        badStage += (y != sgn * clampMax[m]);
+      }
+    }
+  }
+  printf("filtPipe: %llu samples, %llu differences to the former chain, %llu stage errors\n",
+         (unsigned long long)n, (unsigned long long)bad, (unsigned long long)badStage);
+  return bad != 0 || badStage != 0;
+}
+
+// Pedal at the 16 kHz ADC rate: ramps between 800 and 3000 in 1 s, noise +/-16, a spike of 1-2 samples every ~800 samples.
+// The main loop reads it every 80 samples (5 ms) and low-pass filters it, as does a reference chain on the clean pedal.
+// Trips: main loop samples outside MIN/MAX -/+ ADC_PROTECT_THRESH (600, 3200), the ADC protection timeout.
+// Glitches: outputs more than 50 (about 23 command counts) off the reference. Delay: main loops until a step 800 -> 3000
+// passes 1900 at the output.
+static void adcGlitchRun(const char *name, int median, uint8_t log2Len, uint16_t coef)
+{
+  Median5  med;
+  MovAvg16 avg;
+  int32_t  lpf = 800 << 16, lpfRef = 800 << 16;
+  int      trips = 0, glitches = 0, delay = -1, spike = 0;
+  int16_t  y;
+
+  filtMedianInit5(&med, 800);
+  filtMovAvgInit16(&avg, log2Len, 800);
+  for (int i = 0; i < 16000 * 60; i++) {                          // 60 s of pedal
+    int      t     = i % 32000;
+    int16_t  clean = (int16_t)(800 + (t < 16000 ? t : 32000 - t) * 2200 / 16000);
+    int16_t  x     = (int16_t)(clean + (int16_t)(rnd() % 33) - 16);
+    if (spike == 0 && rnd() % 800 == 0) spike = 1 + (int)(rnd() % 2);
+    if (spike) {
+      x = (int16_t)(rnd() % 4096);
+      spike--;
+    }
+    y = median ? filtMovAvg16(filtMedian5(x, &med), &avg) : x;
+    if (i % 80 == 0) {
+      filtLowPass32(y, coef, &lpf);
+      filtLowPass32(clean, coef, &lpfRef);
+      trips    += (y < 600 || y > 3200);
+      glitches += ((lpf >> 16) > (lpfRef >> 16) + 50 || (lpf >> 16) < (lpfRef >> 16) - 50);
+    }
+  }
+
+  filtMedianInit5(&med, 800);                                     // step response
+  filtMovAvgInit16(&avg, log2Len, 800);
+  lpf = 800 << 16;
+  for (int i = 0; i < 16000 && delay < 0; i++) {
+    y = median ? filtMovAvg16(filtMedian5(3000, &med), &avg) : 3000;
+    if (i % 80 == 0) {
+      filtLowPass32(y, coef, &lpf);
+      if ((lpf >> 16) >= 1900) delay = i / 80;
+    }
+  }
+  printf("  %-34s %5d trips %5d glitches, step delay %2d main loops\n", name, trips, glitches, delay);
+}
+
+static void checkAdcGlitch(void)
+{
+  printf("ADC pedal input, 60 s = 12000 main loops:\n");
+  adcGlitchRun("raw, FILTER 6553",                  0, 0, 6553);
+  adcGlitchRun("raw, FILTER 1638",                  0, 0, 1638);
+  adcGlitchRun("median 5, FILTER 6553",             1, 0, 6553);
+  adcGlitchRun("median 5 + average 8, FILTER 6553", 1, 3, 6553);
+  adcGlitchRun("median 5 + average 8, no FILTER",   1, 3, 65535);
+}
+
+static double nowNs(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+#define BENCH(name, init, call)                                                   \
+  do {                                                                            \
+    init;                                                                         \
+    double t0 = nowNs();                                                          \
+    unsigned long long c0 = TICKS();                                              \
+    for (long i = 0; i < calls; i++) { int16_t x = in[i & (NSAMPLES - 1)]; call; } \
+    unsigned long long c1 = TICKS();                                              \
+    double t1 = nowNs();                                                          \
+    printf("  %-26s %6.2f ns %7.1f ticks\n", name, (t1 - t0) / calls, (double)(c1 - c0) / calls); \
+  } while (0)
+
+int main(int argc, char **argv)
+{
+  long calls = argc > 1 ? atol(argv[1]) : 20000000;
+  int fail = 0;
+
+  fail |= checkMedian();
+  fail |= checkMovAvg();
+  fail |= checkBiquad();
+  fail |= checkPipeline();
+  checkAdcGlitch();
+
+  for (int i = 0; i < NSAMPLES; i++) in[i] = (int16_t)(1000 + rnd() % 64);     // settled input with ADC noise
+  printf("time per call, %ld calls:\n", calls);
+  BENCH("filtLowPass32",              int32_t y = 1000 << 16,   { filtLowPass32(x, 6553, &y); sink = y; });
+  BENCH("rateLimiter16",              int16_t y = 0,            { rateLimiter16(x, 480, &y); sink = y; });
+  Biquad16 bq = {91, 181, 91, FILT_Q14(-1.778631), FILT_Q14(0.800802)};
+  BENCH("filtBiquad16",               filtBiquadInit16(&bq, 1000), { sink = filtBiquad16(x, &bq); });
+  MovAvg16 ma;
+  BENCH("filtMovAvg16 (16 samples)",  filtMovAvgInit16(&ma, 4, 1000), { sink = filtMovAvg16(x, &ma); });
+  Median5 md;
+  BENCH("filtMedian5",                filtMedianInit5(&md, 1000), { sink = filtMedian5(x, &md); });
+  PipeCfg pc = {0, 0, 480, 6553, -1000, 1000};
+  PipeState ps = {1000 << 4, 1000 << 16};
+  filtPipeRange(&pc, 1000);
+  BENCH("filtPipe",                   (void)0,                  { sink = filtPipe(x, &pc, &ps); });
+  pc.dband = 50;
+  pc.expo  = 4096;
+  BENCH("filtPipe (deadband, expo)",  (void)0,                  { sink = filtPipe(x, &pc, &ps); });
+  int16_t cr = 1000 << 4;
+  int32_t cl = 1000 << 16;
+  BENCH("former chain",               (void)0,                  { sink = chainRef(x, 480, 6553, &cr, &cl); });
+  BENCH("filtMedian3",                (void)0,                  { sink = filtMedian3(x, in[(i + 1) & (NSAMPLES - 1)], in[(i + 2) & (NSAMPLES - 1)]); });
+
+  printf(fail ? "FAILED\n" : "OK\n");
+  return fail;
+}
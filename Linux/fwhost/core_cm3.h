@@ -0,0 +1,7 @@
+/*
+ * Host build: the Cortex-M3 core header with the inline assembly compiled out.
+ * Found before Drivers/CMSIS/Include, the intrinsics (__disable_irq, __DSB, ...) become no-ops.
+ */
+#define __asm if (0) __asm__
+#include_next <core_cm3.h>
+#undef __asm
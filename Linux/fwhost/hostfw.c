@@ -0,0 +1,207 @@
+/*
+ * HAL and main.c replacements for the host build of the firmware serial code, see hostfw.h
+ */
+
+#define _GNU_SOURCE
+#include "stm32f1xx_hal.h"
+#include "defines.h"
+#include "config.h"
+#include "util.h"
+#include "filter.h"
+#include "BLDC_controller.h"
+#include "hostfw.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#if defined(DEBUG_SERIAL_USART2) || defined(DEBUG_SERIAL_USART3)
+int _write(int file, char *data, int len);
+#endif
+
+// Globals of main.c and bldc.c used by util.c and comms.c
+uint8_t  enable;
+uint8_t  buzzerFreq;
+uint8_t  timeoutFlgGen;
+int16_t  batVoltageCalib, board_temp_deg_c, left_dc_curr, right_dc_curr, dc_curr, cmdL, cmdR;
+int16_t  batVoltage;
+uint8_t  backwardDrive;
+volatile uint32_t main_loop_counter, buzzerTimer;
+volatile uint16_t isrCycles, isrCyclesMax;
+#ifndef VARIANT_TRANSPOTTER
+PipeCfg  inPipe[4] = { {INPUT_PIPE1}, {INPUT_PIPE2}, {TARGET_PIPE}, {TARGET_PIPE} };
+#endif
+
+UART_HandleTypeDef huart2, huart3;
+static DMA_HandleTypeDef hdma2rx, hdma2tx, hdma3rx, hdma3tx;
+
+typedef struct {
+  uint8_t  *rxBuf;
+  uint16_t  rxLen;
+  uint16_t  rxPos;                                                // DMA write position
+  uint8_t  *volatile txData;                                      // volatile like the DMA registers: the Tx complete
+  volatile uint16_t txLen;                                        // interrupt (a signal) must not see them reordered
+} HostPort;
+static HostPort ports[2];
+
+static UART_HandleTypeDef *portUart(uint8_t port) { return port == 2 ? &huart2 : &huart3; }
+static HostPort *portOf(UART_HandleTypeDef *huart) { return huart == &huart2 ? &ports[0] : &ports[1]; }
+
+static void mapRegion(uintptr_t base, size_t size) {
+  if (mmap((void *)base, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0) != (void *)base) {
+    perror("hostfw: register mapping");                           // needs a non-PIE build, see Makefile
+    exit(2);
+  }
+}
+
+void UART2_Init(void) {
+  huart2.Instance         = USART2;
+  hdma2rx.Instance        = DMA1_Channel6;
+  hdma2tx.Instance        = DMA1_Channel7;
+  huart2.hdmarx           = &hdma2rx;
+  huart2.hdmatx           = &hdma2tx;
+}
+
+void UART3_Init(void) {
+  huart3.Instance         = USART3;
+  hdma3rx.Instance        = DMA1_Channel3;
+  hdma3tx.Instance        = DMA1_Channel2;
+  huart3.hdmarx           = &hdma3rx;
+  huart3.hdmatx           = &hdma3tx;
+}
+
+HAL_StatusTypeDef HAL_UART_Receive_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size) {
+  HostPort *p = portOf(huart);
+  p->rxBuf = pData;
+  p->rxLen = Size;
+  p->rxPos = 0;
+  huart->hdmarx->Instance->CNDTR = Size;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size) {
+  HostPort *p = portOf(huart);
+  if (p->txLen) {
+    return HAL_BUSY;
+  }
+  p->txData = pData;
+  p->txLen  = Size;
+  huart->hdmatx->Instance->CNDTR = Size;
+  return HAL_OK;
+}
+
+void HAL_GPIO_WritePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState) {
+  if (PinState == GPIO_PIN_RESET) {                               // the output level is kept in ODR, e.g. the power latch
+    GPIOx->ODR &= ~(uint32_t)GPIO_Pin;
+  } else {
+    GPIOx->ODR |= GPIO_Pin;
+  }
+}
+__attribute__((weak)) HAL_StatusTypeDef HAL_FLASH_Unlock(void) { return HAL_OK; }   // weak: the flash model of ../eesim
+__attribute__((weak)) HAL_StatusTypeDef HAL_FLASH_Lock(void) { return HAL_OK; }
+uint32_t HAL_GetTick(void) { return 0; }
+void HAL_Delay(uint32_t Delay) { }
+
+// EEPROM emulation: nothing stored, the defaults of config.h are used. Weak: ../eesim links Src/eeprom.c instead
+__attribute__((weak)) uint16_t EE_Init(void) { return HAL_OK; }
+__attribute__((weak)) uint16_t EE_ReadVariables(uint16_t *VirtAddress, uint16_t *Data, uint16_t NbVar) { return 1; }
+__attribute__((weak)) uint16_t EE_WriteVariables(uint16_t *VirtAddress, uint16_t *Data, uint16_t NbVar) { return HAL_OK; }
+__attribute__((weak)) uint8_t  EE_WriteReady(uint16_t NbVar) { return 1; }
+__attribute__((weak)) uint16_t EE_Process(void) { return HAL_OK; }
+__attribute__((weak)) uint16_t EE_EraseCycles(void) { return 0; }
+__attribute__((weak)) uint32_t EE_RemainingLife(void) { return 0; }
+
+void BLDC_controller_initialize(RT_MODEL *const rtM) { }
+
+__attribute__((weak)) void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart) { }   // defined by util.c with a debug USART
+
+#if defined(DEBUG_SERIAL_USART2) || defined(DEBUG_SERIAL_USART3)
+// printf() of the firmware goes through _write() of util.c into the debug Tx ring, as with newlib on the target
+static ssize_t stdoutWrite(void *cookie, const char *data, size_t len) {
+  return _write(1, (char *)data, (int)len);
+}
+#endif
+
+void hostInit(void) {
+  mapRegion(PERIPH_BASE, 0x30000);                                // APB1, APB2 and AHB up to the flash interface
+  #if defined(DEBUG_SERIAL_USART2) || defined(DEBUG_SERIAL_USART3)
+  stdout = fopencookie(NULL, "w", (cookie_io_functions_t){.write = stdoutWrite});
+  setvbuf(stdout, NULL, _IONBF, 0);
+  #endif
+  Input_Init();
+}
+
+void hostLoop(void) {
+  readCommand();
+  #ifdef FEEDBACK_TELEMETRY
+  telemetryProcess();
+  #endif
+  main_loop_counter++;
+}
+
+void hostRx(uint8_t port, const uint8_t *data, uint32_t len) {
+  UART_HandleTypeDef *huart = portUart(port);
+  HostPort *p = portOf(huart);
+  uint32_t n;
+
+  if (!p->rxBuf) {
+    return;
+  }
+  while (len) {
+    n = MIN(len, (uint32_t)p->rxLen - 1);                         // what one IDLE event can pass without overrunning the parser
+    len -= n;
+    while (n--) {
+      p->rxBuf[p->rxPos] = *data++;
+      p->rxPos = (p->rxPos + 1) % p->rxLen;
+    }
+    huart->hdmarx->Instance->CNDTR = p->rxLen - p->rxPos;
+    if (port == 2) {
+      usart2_rx_check();
+    } else {
+      usart3_rx_check();
+    }
+  }
+}
+
+uint32_t hostTx(uint8_t port, uint8_t *out, uint32_t max) {
+  UART_HandleTypeDef *huart = portUart(port);
+  HostPort *p = portOf(huart);
+  uint32_t len = p->txLen;
+
+  if (!len) {
+    return 0;
+  }
+  if (out) {
+    memcpy(out, p->txData, MIN(len, max));
+  }
+  p->txLen = 0;
+  huart->hdmatx->Instance->CNDTR = 0;
+  HAL_UART_TxCpltCallback(huart);
+  return len;
+}
+
+uint8_t hostTxBusy(uint8_t port) {
+  return portOf(portUart(port))->txLen != 0;
+}
+
+void hostRxStats(uint8_t port, HostRxStats *stats) {
+  memset(stats, 0, sizeof(*stats));
+  #if (defined(CONTROL_SERIAL_USART2) || defined(CONTROL_SERIAL_USART3)) && !defined(CONTROL_IBUS)
+  SerialParser *parser = NULL;
+  #ifdef CONTROL_SERIAL_USART2
+  extern SerialParser parserL;
+  if (port == 2) parser = &parserL;
+  #endif
+  #ifdef CONTROL_SERIAL_USART3
+  extern SerialParser parserR;
+  if (port == 3) parser = &parserR;
+  #endif
+  if (parser) {
+    stats->ok      = parser->cntOk;
+    stats->errCrc  = parser->errCrc;
+    stats->errSync = parser->errSync;
+    stats->errFmt  = parser->errFmt;
+  }
+  #endif
+}
@@ -0,0 +1,30 @@
+/*
+ * Host build of the firmware serial code (Src/util.c, Src/comms.c)
+ * The HAL is replaced by hostfw.c: the USART Rx DMA ring buffers are filled by hostRx(), the Tx DMA transfers are
+ * completed by hostTx(). The peripheral and core registers are plain memory mapped at their real addresses.
+ */
+#ifndef HOSTFW_H
+#define HOSTFW_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+  uint32_t ok, errCrc, errSync, errFmt;                           // SerialParser counters of a CONTROL_SERIAL USART
+} HostRxStats;
+
+void     hostInit(void);                                          // map the registers and run Input_Init(), as main() does
+void     hostLoop(void);                                          // one main loop pass: readCommand() and the telemetry
+void     hostRx(uint8_t port, const uint8_t *data, uint32_t len); // bytes received on USART2/3, followed by the IDLE interrupt
+uint32_t hostTx(uint8_t port, uint8_t *out, uint32_t max);        // complete the Tx DMA transfer in flight, returns its length
+uint8_t  hostTxBusy(uint8_t port);
+void     hostRxStats(uint8_t port, HostRxStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
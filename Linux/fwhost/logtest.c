@@ -0,0 +1,284 @@
+// *******************************************************************
+//  logtest: debug Tx ring buffer of util.c (DEBUG_SERIAL_USART3) under a concurrent producer and consumer
+//  for   https://github.com/EmanuelFeru/hoverboard-firmware-hack-FOC
+//
+// *******************************************************************
+// The producer is the main loop: text through _write(), binary frames written with logWrite() while logHold is set,
+// as sendBinResponse() does, and logFlush() as in process_debug(). The consumer is the Tx complete interrupt: a
+// timer signal completes the DMA transfer in flight at random points of the producer, so every producer statement
+// can be interrupted. The received stream is checked against the producer:
+//  - every binary frame arrives whole and contiguous, in order
+//  - the text arrives in order, bytes are only missing where LOG_DROP counted them
+//  - text printed while a frame was sent arrives after the frame
+// Then a HELP and a GET dump are printed through process_debug(): every line arrives, nothing is dropped.
+// Last, SET of TLM_FIELDS takes the int32 values of its range (the telemetry bits above 15), not more.
+//   make && ./logtest [steps] [seed]
+// *******************************************************************
+
+#define _GNU_SOURCE
+#include "stm32f1xx_hal.h"
+#include "defines.h"
+#include "config.h"
+#include "util.h"
+#include "comms.h"
+#include "hostfw.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define OUT_MAX     (16 << 20)
+#define FRAME_MARK  0xFF                                          // text is ASCII, frame bytes have bit 7 set
+
+extern uint16_t logDrop;
+extern uint16_t logPeak;
+extern uint8_t  logHold;
+int  _write(int file, char *data, int len);
+void process_debug(void);
+
+static uint8_t           out[OUT_MAX];                            // received stream
+static volatile uint32_t outLen;
+static volatile uint32_t irqCount;
+static uint8_t           textRef[OUT_MAX];                        // text accepted by the ring or the hold buffer
+static uint32_t          textRefLen;
+
+// Random numbers of the interrupt, rand() takes a lock the interrupted producer may hold
+static uint32_t irqRand(void) {
+  static uint32_t x = 2463534242U;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return x;
+}
+
+// Tx complete interrupt: the DMA transfer in flight ends at a random point of the producer
+static void txIrq(int sig) {
+  uint8_t  buf[LOG_TX_BUFFER_SIZE];
+  uint32_t len;
+
+  irqCount++;
+  if (irqRand() % 4 == 0) {
+    return;                                                       // the UART is still sending
+  }
+  len = hostTx(3, buf, sizeof(buf));
+  if (outLen + len <= OUT_MAX) {
+    memcpy(&out[outLen], buf, len);
+    outLen += len;
+  }
+}
+
+static void drain(void) {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGALRM);
+  sigprocmask(SIG_BLOCK, &set, NULL);                             // the producer waits with the interrupt masked
+  while (hostTxBusy(3)) {
+    txIrq(0);
+  }
+  sigprocmask(SIG_UNBLOCK, &set, NULL);
+}
+
+static void text(uint32_t *seq) {
+  char     line[96];
+  uint16_t drop = logDrop;
+  int      len  = snprintf(line, sizeof(line), "L%08u %.*s\r\n", *seq, rand() % 60,
+                           "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789abcdefghijklmnop");
+  (*seq)++;
+  _write(1, line, len);
+  len -= (uint16_t)(logDrop - drop);                              // the tail that did not fit is dropped
+  memcpy(&textRef[textRefLen], line, len);
+  textRefLen += len;
+}
+
+static int checkStream(uint32_t frames, uint32_t frameBytes) {
+  uint32_t i = 0, t = 0, f = 0, fseq = 0, len;
+
+  while (i < outLen) {
+    if (out[i] == FRAME_MARK) {
+      if (i + 1 >= outLen) {
+        dprintf(STDOUT_FILENO, "FAIL: frame header cut at %u\n", i);
+        return 0;
+      }
+      len = out[i + 1] & 0x7F;
+      if (i + 2 + len > outLen) {
+        dprintf(STDOUT_FILENO, "FAIL: frame %u cut at %u\n", f, i);
+        return 0;
+      }
+      for (uint32_t k = 0; k < len; k++, fseq++) {
+        if (out[i + 2 + k] != (0x80 | (fseq & 0x7F)) || out[i + 2 + k] == FRAME_MARK) {
+          if (out[i + 2 + k] == FRAME_MARK && (fseq & 0x7F) == 0x7F) continue;
+          dprintf(STDOUT_FILENO, "FAIL: frame %u byte %u is 0x%02x, text inside a frame?\n", f, k, out[i + 2 + k]);
+          return 0;
+        }
+      }
+      i += 2 + len;
+      f++;
+    } else {
+      if (t >= textRefLen || out[i] != textRef[t]) {
+        dprintf(STDOUT_FILENO, "FAIL: text byte %u (stream %u) is 0x%02x, expected 0x%02x\n", t, i, out[i], t < textRefLen ? textRef[t] : 0);
+        return 0;
+      }
+      i++;
+      t++;
+    }
+  }
+  if (f != frames || t != textRefLen) {
+    dprintf(STDOUT_FILENO, "FAIL: received %u of %u frames, %u of %u text bytes\n", f, frames, t, textRefLen);
+    return 0;
+  }
+  dprintf(STDOUT_FILENO, "ring: %u frames (%u bytes) and %u text bytes received intact, %u interrupts, drop %u, peak %u\n",
+         frames, frameBytes, t, irqCount, logDrop, logPeak);
+  return 1;
+}
+
+static int ringTest(uint32_t steps) {
+  uint8_t  frame[2 + 100];
+  uint32_t seq = 0, frames = 0, frameBytes = 0, fseq = 0;
+  uint16_t frameLen = 0, framePos = 0;
+
+  for (uint32_t s = 0; s < steps && textRefLen < OUT_MAX / 2; s++) {
+    switch (rand() % 8) {
+      case 0: case 1: case 2:                                     // printf
+        text(&seq);
+        break;
+      case 3:                                                     // binary response: hold the text, write the frame in pieces
+        if (!logHold && rand() % 4 == 0) {
+          frameLen = 1 + rand() % 100;
+          frame[0] = FRAME_MARK;
+          frame[1] = 0x80 | frameLen;
+          for (uint16_t k = 0; k < frameLen; k++, fseq++) {
+            frame[2 + k] = 0x80 | (fseq & 0x7F);
+          }
+          frameLen += 2;
+          framePos  = 0;
+          logHold   = 1;
+        }
+        break;
+      case 4: case 5:                                             // sendBinResponse(): only what fits, the rest on the next pass
+        if (logHold) {
+          uint16_t n = logFree();
+          n = MIN(n, frameLen - framePos);
+          if (framePos == 0 && n < 2) break;                      // the header is never split from the first record
+          logWrite(&frame[framePos], n);
+          framePos += n;
+          if (framePos == frameLen) {
+            frames++;
+            frameBytes += frameLen;
+            logHold = 0;
+          }
+        }
+        break;
+      case 6:                                                     // process_debug()
+        logFlush();
+        break;
+      default:                                                    // rest of the main loop
+        for (volatile int k = rand() % 2000; k > 0; k--) { }
+        break;
+    }
+  }
+  while (logHold) {                                               // finish the frame in progress
+    uint16_t n = logFree();
+    n = MIN(n, frameLen - framePos);
+    logWrite(&frame[framePos], n);
+    framePos += n;
+    if (framePos == frameLen) {
+      frames++;
+      frameBytes += frameLen;
+      logHold = 0;
+    }
+    drain();
+  }
+  for (int k = 0; k < LOG_HOLD_BUFFER_SIZE; k++) {                // the held text follows
+    logFlush();
+    drain();
+  }
+  return checkStream(frames, frameBytes);
+}
+
+static int countLines(const uint8_t *data, uint32_t len, const char *prefix) {
+  int n = 0;
+  size_t pl = strlen(prefix);
+  for (uint32_t i = 0; i + pl <= len; i++) {
+    if ((i == 0 || data[i - 1] == '\n') && !memcmp(&data[i], prefix, pl)) n++;
+  }
+  return n;
+}
+
+// Runs a text command through process_debug() for many main loop passes, returns the number of lines starting with prefix
+static int dumpTest(const char *name, const char *prefix, int *sections) {
+  char     cmd[16];
+  uint16_t drop  = logDrop;
+  uint32_t start = outLen;
+  int      lines, ok;
+
+  snprintf(cmd, sizeof(cmd), "%s\r\n", name);
+  usart_process_debug((uint8_t *)cmd, strlen(cmd));
+  for (int loop = 0; loop < 1000; loop++) {                       // main loop passes, the Tx interrupt keeps draining
+    process_debug();
+    for (volatile int k = 0; k < 20000; k++) { }
+  }
+  drain();
+  lines     = countLines(&out[start], outLen - start, prefix);
+  if (sections) {
+    *sections = countLines(&out[start], outLen - start, "?\r\n");
+  }
+  ok        = logDrop == drop && countLines(&out[start], outLen - start, "OK\r\n") == 1;
+  dprintf(STDOUT_FILENO, "%-4s: %3d lines, %5u bytes, drop %u  %s\n", name, lines, outLen - start, (uint16_t)(logDrop - drop), ok ? "ok" : "FAIL");
+  return ok ? lines : -1;
+}
+
+// Runs a SET command, checks the parameter value afterwards
+static int setTest(const char *param, const char *value, int32_t expect) {
+  char    cmd[64];
+  int8_t  index = findParam((uint8_t *)param, strlen(param));
+  int32_t got;
+  int     ok;
+
+  snprintf(cmd, sizeof(cmd), "SET %s %s\r\n", param, value);
+  usart_process_debug((uint8_t *)cmd, strlen(cmd));
+  for (int loop = 0; loop < 10; loop++) {
+    process_debug();
+  }
+  drain();
+  got = index < 0 ? -1 : getParamValExt(index);
+  ok  = index >= 0 && got == expect;
+  dprintf(STDOUT_FILENO, "SET : %s %s -> %ld  %s\n", param, value, (long)got, ok ? "ok" : "FAIL");
+  return ok;
+}
+
+int main(int argc, char **argv) {
+  uint32_t steps = argc > 1 ? strtoul(argv[1], NULL, 0) : 2000000;
+  struct itimerval it = {{0, 20}, {0, 20}};                       // [us] Tx complete interrupt period
+  uint32_t start;
+  int ok, help, get, cmds, sections;
+
+  srand(argc > 2 ? strtoul(argv[2], NULL, 0) : 1);
+  hostInit();
+  drain();                                                        // the input setup messages are not part of the test
+  outLen = 0;
+  signal(SIGALRM, txIrq);
+  setitimer(ITIMER_REAL, &it, NULL);
+
+  ok    = ringTest(steps);
+  start = outLen;
+  help  = dumpTest("HELP", "? ", &sections);                      // 3 headings, the commands, the parameters and variables
+  get   = dumpTest("GET",  "# name:", NULL);
+  cmds  = -1;                                                     // lines between "? Commands" and the first "?"
+  for (char *c = memmem(&out[start], outLen - start, "? Commands\r\n", 12); c && strncmp(c, "?\r\n", 3); cmds++) {
+    c = memmem(c, (char *)&out[outLen] - c, "\r\n", 2) + 2;
+  }
+  if (help < 0 || get < 0 || sections != 3 || help != 3 + cmds + get) {
+    dprintf(STDOUT_FILENO, "dump: HELP has %d lines, %d sections, %d commands, GET has %d parameters  FAIL\n", help, sections, cmds, get);
+    ok = 0;
+  }
+
+  ok &= setTest("TLM_FIELDS", "1610612991", 0x600000FF);         // TLM_ODOM and the bit 29 field
+  ok &= setTest("TLM_FIELDS", "2147483648", 0x600000FF);         // out of range: unchanged
+
+  it.it_value.tv_usec = 0;
+  setitimer(ITIMER_REAL, &it, NULL);
+  return ok ? 0 : 1;
+}
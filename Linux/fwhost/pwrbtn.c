@@ -0,0 +1,7 @@
+/*
+ * util.c with the push button power switch for pwrtest_btn: config.h defines KEYLOCK_POWER_SWITCH unconditionally,
+ * so it is undefined after config.h is included once, its include guard keeps it undefined in util.c
+ */
+#include "config.h"
+#undef KEYLOCK_POWER_SWITCH
+#include "../../Src/util.c"
@@ -0,0 +1,177 @@
+// *******************************************************************
+//  pwrtest: power state machine of util.c (powerOn, powerStep, powerOff) with scripted power button and inputs
+//  for   https://github.com/EmanuelFeru/hoverboard-firmware-hack-FOC
+//
+// *******************************************************************
+// Runs the main loop as main.c does: a command frame with the scripted inputs is received on USART2 (VARIANT_USART),
+// readCommand(), then powerStep() with the scripted power button level. The buzzer sequencer runs every 1 ms as in the
+// DMA interrupt. Each sequence checks the power states entered, the motor enable and the power latch (OFF pin):
+//  - push button (pwrtest_btn): a bounce is ignored, a short press powers off, a long press enters calibration
+//  - key switch (pwrtest, KEYLOCK_POWER_SWITCH of config.h): switching off powers off, the key toggles with the
+//    throttle at maximum enter calibration
+// Every power off plays the melody first, then releases the latch.
+//   make test
+// *******************************************************************
+
+#include "stm32f1xx_hal.h"
+#include "defines.h"
+#include "config.h"
+#ifdef PWRTEST_BUTTON
+  #undef KEYLOCK_POWER_SWITCH                                     // util.c built the same way, see pwrbtn.c
+#endif
+#include "util.h"
+#include "BLDC_controller.h"
+#include "hostfw.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+extern uint8_t    enable;
+extern PowerState powerState;
+extern P          rtP_Left;
+
+static const char *stateName[] = {
+  "RUN", "ON_RELEASE", "ON_KEYLOCK1", "ON_KEYLOCK2", "ON_CAL_HOLD", "ON_CAL_THROTTLE", "BTN_HOLD", "TP_RELEASE1",
+  "TP_WAIT", "TP_RELEASE2", "CAL_SELECT", "CAL_RELEASE", "CAL_ADC", "CAL_CURSPD", "CAL_CURSPD_RELEASE", "OFF_KEYLOCK",
+  "OFF_MELODY", "OFF"
+};
+
+static PowerState trace[32];                                      // states entered since the sequence started
+static int        traceLen;
+static uint32_t   now;                                            // [ms]
+static int16_t    inSteer, inSpeed;                               // scripted inputs
+
+static void sendInput(void) {
+  uint8_t  frame[4 + 6 + 2] = {(uint8_t)SERIAL_START_FRAME, (uint8_t)(SERIAL_START_FRAME >> 8), SERIAL_CMD_VERSION, 6,
+                               CMD_TLV_STEER_SPEED, 4, (uint8_t)inSteer, (uint8_t)(inSteer >> 8), (uint8_t)inSpeed, (uint8_t)(inSpeed >> 8)};
+  uint16_t crc = calcCRC16(frame, 4 + 6);
+
+  frame[10] = (uint8_t)crc;
+  frame[11] = (uint8_t)(crc >> 8);
+  hostRx(2, frame, sizeof(frame));
+}
+
+static void record(void) {
+  if ((traceLen == 0 || trace[traceLen - 1] != powerState) && traceLen < (int)ARRAY_LEN(trace)) {
+    trace[traceLen++] = powerState;
+  }
+}
+
+// Main loop passes for ms with the power button at btn
+static void loops(uint8_t btn, uint32_t ms) {
+  for (uint32_t t = 0; t < ms; t += DELAY_IN_MAIN_LOOP) {
+    sendInput();
+    hostLoop();
+    powerStep(btn, now);
+    record();
+    for (int i = 0; i < DELAY_IN_MAIN_LOOP; i++) {
+      beepSequencer();
+    }
+    while (hostTx(2, NULL, 0) || hostTx(3, NULL, 0)) { }          // the debug output and telemetry are not checked
+    now += DELAY_IN_MAIN_LOOP;
+  }
+}
+
+static void start(int16_t steer, int16_t speed) {
+  inSteer  = steer;
+  inSpeed  = speed;
+  HAL_GPIO_WritePin(OFF_PORT, OFF_PIN, GPIO_PIN_SET);             // power latch, as main() at start-up
+  loops(0, 50);                                                   // the inputs arrive before powerOn() reads them
+  traceLen = 0;
+  powerOn();
+  record();
+}
+
+static int check(const char *name, const PowerState *exp, int expLen, uint8_t expEnable, uint8_t expOff) {
+  uint8_t off = !(OFF_PORT->ODR & OFF_PIN);
+  int     ok  = traceLen == expLen && !memcmp(trace, exp, expLen * sizeof(*exp)) && enable == expEnable && off == expOff;
+  char    line[512];
+  int     len = snprintf(line, sizeof(line), "%-14s:", name);
+
+  for (int i = 0; i < traceLen; i++) {
+    len += snprintf(&line[len], sizeof(line) - len, " %s", stateName[trace[i]]);
+  }
+  dprintf(STDOUT_FILENO, "%s | enable %u, latch %s  %s\n", line, enable, off ? "released" : "held", ok ? "ok" : "FAIL");
+  return ok;
+}
+
+static int checkLimit(const char *name, int16_t iMax) {
+  if (rtP_Left.i_max == iMax) {
+    dprintf(STDOUT_FILENO, "%-14s: current limit not updated  FAIL\n", name);
+    return 0;
+  }
+  return 1;
+}
+
+#define CHECK(name, en, off, ...) check(name, (const PowerState[]){__VA_ARGS__}, ARRAY_LEN(((const PowerState[]){__VA_ARGS__})), en, off)
+
+int main(void) {
+  int     ok = 1;
+  int16_t iMax;
+
+  hostInit();
+  loops(0, 500);                                                  // input setup and the serial timeout recovery
+
+#ifndef KEYLOCK_POWER_SWITCH
+  start(0, 0);                                                    // the button is still pressed from switching on
+  loops(1, 300);
+  loops(0, 100);
+  enable = 1;
+  loops(1, 5);                                                    // bounce: back to RUN, the motors are disabled
+  loops(0, 100);
+  ok &= CHECK("bounce", 0, 0, PWR_ON_RELEASE, PWR_RUN, PWR_BTN_HOLD, PWR_RUN);
+
+  start(0, 0);
+  loops(1, 300);
+  loops(0, 100);
+  enable = 1;
+  loops(1, 200);                                                  // short press: power off after the melody
+  loops(0, 100);
+  ok &= CHECK("short press", 0, 0, PWR_ON_RELEASE, PWR_RUN, PWR_BTN_HOLD, PWR_OFF_MELODY);
+  loops(0, 2000);                                                 // the power-on melody is still queued before it
+  ok &= CHECK("power off", 0, 1, PWR_ON_RELEASE, PWR_RUN, PWR_BTN_HOLD, PWR_OFF_MELODY, PWR_OFF);
+
+  start(500, 500);
+  loops(1, 300);
+  loops(0, 100);
+  enable = 1;
+  iMax   = rtP_Left.i_max;
+  loops(1, CALIBRATE_HOLD_TIME * WAIT_DELAY + 500);               // long press: calibration, current and speed limits at half
+  loops(0, CALIBRARE_MINMAX_CHECK_TIME * WAIT_DELAY + 200);
+  loops(1, 100);                                                  // confirm
+  loops(0, 2000);
+  ok &= CHECK("long press", 0, 1, PWR_ON_RELEASE, PWR_RUN, PWR_BTN_HOLD, PWR_CAL_SELECT, PWR_CAL_RELEASE, PWR_CAL_CURSPD,
+              PWR_CAL_CURSPD_RELEASE, PWR_OFF_MELODY, PWR_OFF);
+  ok &= checkLimit("long press", iMax);
+#else
+  start(0, 0);                                                    // the key is switched on
+  loops(1, 300);
+  enable = 1;
+  loops(0, 50);                                                   // bounce
+  loops(1, 300);
+  ok &= CHECK("key bounce", 1, 0, PWR_RUN);
+  loops(0, 200);                                                  // switched off: power off after the melody
+  ok &= CHECK("key off", 0, 0, PWR_RUN, PWR_OFF_KEYLOCK, PWR_OFF_MELODY);
+  loops(0, 2000);
+  ok &= CHECK("power off", 0, 1, PWR_RUN, PWR_OFF_KEYLOCK, PWR_OFF_MELODY, PWR_OFF);
+
+  start(0, 1000);                                                 // throttle at maximum while switching on
+  iMax = rtP_Left.i_max;
+  loops(1, 300);
+  loops(0, 100);                                                  // key toggles within KEYLOCK_CHECK_TIME
+  loops(1, CALIBRATE_HOLD_TIME * WAIT_DELAY + 500);               // then held for CALIBRATE_HOLD_TIME
+  loops(0, 100);
+  inSpeed = -1000;                                                // throttle released: calibration
+  loops(0, CALIBRARE_MINMAX_CHECK_TIME * WAIT_DELAY + 200);
+  loops(1, 100);                                                  // confirm, the limits are taken when the key is released
+  ok &= CHECK("keylock cal", 0, 0, PWR_ON_KEYLOCK1, PWR_ON_KEYLOCK2, PWR_ON_CAL_HOLD, PWR_ON_CAL_THROTTLE, PWR_CAL_SELECT,
+              PWR_CAL_RELEASE, PWR_CAL_CURSPD, PWR_CAL_CURSPD_RELEASE);
+  loops(0, 2000);
+  ok &= CHECK("power off", 0, 1, PWR_ON_KEYLOCK1, PWR_ON_KEYLOCK2, PWR_ON_CAL_HOLD, PWR_ON_CAL_THROTTLE, PWR_CAL_SELECT,
+              PWR_CAL_RELEASE, PWR_CAL_CURSPD, PWR_CAL_CURSPD_RELEASE, PWR_OFF_KEYLOCK, PWR_OFF_MELODY, PWR_OFF);
+  ok &= checkLimit("keylock cal", iMax);
+#endif
+
+  return ok ? 0 : 1;
+}
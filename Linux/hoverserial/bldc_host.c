@@ -0,0 +1,14 @@
+/*
+ * The generated BLDC controller for 64-bit hosts.
+ * The code does not use long, so the long size check of the 32-bit target is relaxed for LP64.
+ */
+
+#include <limits.h>
+#if ULONG_MAX != 0xFFFFFFFFU
+  #undef  ULONG_MAX
+  #undef  LONG_MAX
+  #define ULONG_MAX   0xFFFFFFFFU
+  #define LONG_MAX    0x7FFFFFFF
+#endif
+
+#include "BLDC_controller.c"
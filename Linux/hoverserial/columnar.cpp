@@ -0,0 +1,224 @@
+// *******************************************************************
+//  Columnar telemetry recording
+//  for   https://github.com/EmanuelFeru/hoverboard-firmware-hack-FOC
+//
+// *******************************************************************
+
+#include "columnar.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+namespace hover {
+
+void ColumnLayout::init(uint32_t mask, uint32_t blockRows)
+{
+  uint32_t off = 8;                                     // rows, reserved
+  hostUs  = off;  off += 8 * blockRows;
+  timeMs  = off;  off += 4 * blockRows;
+  seq     = off;  off += 2 * blockRows;
+  rowMask = off;  off += 4 * blockRows;
+  for (int i = 0; i < TLM_FIELDS_NUM; i++) {
+    field[i] = 0;
+    if (mask & (1UL << i)) {
+      field[i] = off;
+      off += 2 * blockRows;
+    }
+  }
+  blockSize = (off + 7) & ~7u;                          // keep the hostUs column of the next block aligned
+}
+
+
+// ########################## WRITER ##########################
+
+bool ColumnWriter::open(const std::string &path, uint32_t mask, uint32_t blockRows, unsigned flushMs)
+{
+  struct timeval tv;
+
+  close();
+  if (!blockRows || blockRows % 4) {
+    return false;
+  }
+  file_ = std::fopen(path.c_str(), "wb");
+  if (!file_) {
+    return false;
+  }
+  mask &= (1UL << TLM_FIELDS_NUM) - 1;
+  layout_.init(mask, blockRows);
+  gettimeofday(&tv, nullptr);
+
+  std::memset(&hdr_, 0, sizeof(hdr_));
+  std::memcpy(hdr_.magic, COL_MAGIC, sizeof(hdr_.magic));
+  hdr_.version   = COL_VERSION;
+  hdr_.fieldsNum = TLM_FIELDS_NUM;
+  hdr_.mask      = mask;
+  hdr_.blockRows = blockRows;
+  hdr_.blockSize = layout_.blockSize;
+  hdr_.created   = (uint64_t)tv.tv_sec * 1000000u + (uint64_t)tv.tv_usec;
+  block_.assign(layout_.blockSize, 0);
+  blockFill_ = 0;
+  blockIdx_  = 0;
+  rows_      = 0;
+  flushUs_   = (uint64_t)flushMs * 1000u;
+  lastFlush_ = 0;
+
+  if (std::fwrite(&hdr_, sizeof(hdr_), 1, file_) != 1) {
+    close();
+    return false;
+  }
+  return true;
+}
+
+bool ColumnWriter::append(uint64_t hostUs, const Telemetry &t)
+{
+  if (!file_) {
+    return false;
+  }
+  uint8_t *b = block_.data();
+  uint32_t r = blockFill_;
+  uint16_t seq = t.seq;
+  uint32_t rowMask = t.mask & hdr_.mask;
+
+  std::memcpy(b + layout_.hostUs  + 8 * r, &hostUs,  8);
+  std::memcpy(b + layout_.timeMs  + 4 * r, &t.timeMs, 4);
+  std::memcpy(b + layout_.seq     + 2 * r, &seq,     2);
+  std::memcpy(b + layout_.rowMask + 4 * r, &rowMask, 4);
+  for (int i = 0; i < TLM_FIELDS_NUM; i++) {
+    if (layout_.field[i]) {
+      int16_t v = (rowMask & (1UL << i)) ? t.field[i] : 0;
+      std::memcpy(b + layout_.field[i] + 2 * r, &v, 2);
+    }
+  }
+  blockFill_++;
+  rows_++;
+
+  if (blockFill_ == hdr_.blockRows) {
+    bool ok = writeBlock();
+    blockIdx_++;
+    blockFill_ = 0;
+    std::memset(b, 0, block_.size());
+    lastFlush_ = hostUs;
+    return ok;
+  }
+  if (flushUs_ && hostUs - lastFlush_ >= flushUs_) {    // Partial block, rewritten until it is full
+    lastFlush_ = hostUs;
+    return writeBlock();
+  }
+  return true;
+}
+
+bool ColumnWriter::writeBlock()
+{
+  std::memcpy(block_.data(), &blockFill_, 4);
+  if (fseeko(file_, (off_t)(sizeof(ColumnHeader) + blockIdx_ * hdr_.blockSize), SEEK_SET) != 0 ||
+      std::fwrite(block_.data(), block_.size(), 1, file_) != 1) {
+    return false;
+  }
+  return std::fflush(file_) == 0;
+}
+
+bool ColumnWriter::close()
+{
+  bool ok = true;
+  if (file_) {
+    if (blockFill_) {
+      ok = writeBlock();
+    }
+    ok &= std::fclose(file_) == 0;
+    file_ = nullptr;
+  }
+  blockFill_ = 0;
+  return ok;
+}
+
+
+// ########################## READER ##########################
+
+bool ColumnReader::open(const std::string &path)
+{
+  struct stat st;
+
+  close();
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    err_ = std::strerror(errno);
+    return false;
+  }
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ColumnHeader)) {
+    err_ = "not a column file";
+    ::close(fd);
+    return false;
+  }
+  size_ = (size_t)st.st_size;
+  void *m = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (m == MAP_FAILED) {
+    err_ = std::strerror(errno);
+    size_ = 0;
+    return false;
+  }
+  map_ = (const uint8_t *)m;
+  madvise(m, size_, MADV_SEQUENTIAL);
+
+  hdr_ = (const ColumnHeader *)map_;
+  if (std::memcmp(hdr_->magic, COL_MAGIC, sizeof(COL_MAGIC)) != 0 || hdr_->version != COL_VERSION ||
+      hdr_->fieldsNum > TLM_FIELDS_NUM || !hdr_->blockRows || hdr_->blockRows % 4) {
+    err_ = "not a column file or unsupported version";
+    close();
+    return false;
+  }
+  layout_.init(hdr_->mask & ((1UL << hdr_->fieldsNum) - 1), hdr_->blockRows);
+  if (layout_.blockSize != hdr_->blockSize) {
+    err_ = "block size mismatch";
+    close();
+    return false;
+  }
+  blocks_ = (size_ - sizeof(ColumnHeader)) / hdr_->blockSize;
+  return true;
+}
+
+void ColumnReader::close()
+{
+  if (map_) {
+    munmap((void *)map_, size_);
+  }
+  map_   = nullptr;
+  hdr_   = nullptr;
+  size_  = 0;
+  blocks_ = 0;
+}
+
+ColumnReader::Block ColumnReader::block(size_t i) const
+{
+  const uint8_t *b = map_ + sizeof(ColumnHeader) + i * hdr_->blockSize;
+  Block blk;
+
+  std::memcpy(&blk.rows, b, 4);
+  if (blk.rows > hdr_->blockRows) {
+    blk.rows = 0;                                       // damaged block
+  }
+  blk.hostUs  = (const uint64_t *)(b + layout_.hostUs);
+  blk.timeMs  = (const uint32_t *)(b + layout_.timeMs);
+  blk.seq     = (const uint16_t *)(b + layout_.seq);
+  blk.rowMask = (const uint32_t *)(b + layout_.rowMask);
+  for (int f = 0; f < TLM_FIELDS_NUM; f++) {
+    blk.field[f] = layout_.field[f] ? (const int16_t *)(b + layout_.field[f]) : nullptr;
+  }
+  return blk;
+}
+
+uint64_t ColumnReader::rows() const
+{
+  uint64_t n = 0;
+  for (size_t i = 0; i < blocks_; i++) {
+    n += block(i).rows;
+  }
+  return n;
+}
+
+} // namespace hover
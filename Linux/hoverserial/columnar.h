@@ -0,0 +1,101 @@
+// *******************************************************************
+//  Columnar telemetry recording
+//  for   https://github.com/EmanuelFeru/hoverboard-firmware-hack-FOC
+//
+// *******************************************************************
+// INFO:
+// • The file is a header followed by fixed size blocks, appended as they fill up. Each block holds up to blockRows
+//   rows as one array per column, so a reader can mmap the file and use the columns in place:
+//     | rows (4) | reserved (4) | hostUs uint64[blockRows] | timeMs uint32[blockRows] | seq uint16[blockRows] |
+//     | rowMask uint32[blockRows] | one int16[blockRows] array for each field in the file mask, in TLM_* order |
+// • rowMask holds the fields received in each row, a field outside of it reads as 0
+// • The last block is rewritten in place until it is full, at most flushMs of rows are lost if the host stops
+// • All values are little endian (host byte order of the x86/ARM Linux hosts)
+// *******************************************************************
+
+#ifndef COLUMNAR_H
+#define COLUMNAR_H
+
+#include "hoverserial.h"
+
+#include <cstdio>
+
+namespace hover {
+
+constexpr char     COL_MAGIC[8]    = {'H', 'V', 'R', 'C', 'O', 'L', '1', '\0'};
+constexpr uint16_t COL_VERSION     = 1;
+constexpr uint32_t COL_BLOCK_ROWS  = 4096;
+
+struct ColumnHeader {
+  char     magic[8];
+  uint16_t version;
+  uint16_t fieldsNum;     // TLM_FIELDS_NUM of the writer
+  uint32_t mask;          // stored fields
+  uint32_t blockRows;
+  uint32_t blockSize;     // bytes per block, multiple of 8
+  uint64_t created;       // host time of the first row, us since the epoch
+  uint8_t  reserved[32];
+};
+static_assert(sizeof(ColumnHeader) == 64, "column file header must be 64 bytes");
+
+// Column offsets inside one block
+struct ColumnLayout {
+  void init(uint32_t mask, uint32_t blockRows);
+  uint32_t hostUs = 0, timeMs = 0, seq = 0, rowMask = 0;
+  uint32_t field[TLM_FIELDS_NUM] = {};   // 0 if the field is not stored
+  uint32_t blockSize = 0;
+};
+
+class ColumnWriter {
+public:
+  ~ColumnWriter() { close(); }
+  // mask = stored fields, blockRows must be a multiple of 4
+  bool open(const std::string &path, uint32_t mask, uint32_t blockRows = COL_BLOCK_ROWS, unsigned flushMs = 1000);
+  bool append(uint64_t hostUs, const Telemetry &t);
+  bool close();
+  uint64_t rows() const { return rows_; }
+
+private:
+  bool writeBlock();
+  FILE        *file_ = nullptr;
+  ColumnHeader hdr_;
+  ColumnLayout layout_;
+  std::vector<uint8_t> block_;
+  uint32_t     blockFill_ = 0;
+  uint64_t     blockIdx_  = 0;
+  uint64_t     rows_      = 0;
+  uint64_t     flushUs_   = 0, lastFlush_ = 0;
+};
+
+class ColumnReader {
+public:
+  ~ColumnReader() { close(); }
+  bool open(const std::string &path);
+  void close();
+  const ColumnHeader &header() const { return *hdr_; }
+  const std::string  &error() const { return err_; }
+
+  // Views into the mapped file, valid until close()
+  struct Block {
+    uint32_t        rows;
+    const uint64_t *hostUs;
+    const uint32_t *timeMs;
+    const uint16_t *seq;
+    const uint32_t *rowMask;
+    const int16_t  *field[TLM_FIELDS_NUM];   // nullptr if the field is not stored
+  };
+  size_t blocks() const { return blocks_; }
+  Block  block(size_t i) const;
+  uint64_t rows() const;
+
+private:
+  const uint8_t      *map_ = nullptr;
+  size_t              size_ = 0, blocks_ = 0;
+  const ColumnHeader *hdr_ = nullptr;
+  ColumnLayout        layout_;
+  std::string         err_;
+};
+
+} // namespace hover
+
+#endif // COLUMNAR_H
@@ -0,0 +1,62 @@
+/*
+ * Host build of the BLDC controllers for the replay tool.
+ * The parameters come from config.h like in BLDC_Init() (util.c), so build with the VARIANT of the recorded firmware.
+ */
+
+#include "config.h"
+#include "BLDC_controller.h"
+#include "ctrl_host.h"
+
+RT_MODEL rtM_Left_;                     /* Real-time model */
+RT_MODEL rtM_Right_;                    /* Real-time model */
+RT_MODEL *const rtM_Left  = &rtM_Left_;
+RT_MODEL *const rtM_Right = &rtM_Right_;
+
+extern P rtP_Left;                      /* Block parameters (auto storage) */
+DW       rtDW_Left;                     /* Observable states */
+ExtU     rtU_Left;                      /* External inputs */
+ExtY     rtY_Left;                      /* External outputs */
+
+P        rtP_Right;                     /* Block parameters (auto storage) */
+DW       rtDW_Right;                    /* Observable states */
+ExtU     rtU_Right;                     /* External inputs */
+ExtY     rtY_Right;                     /* External outputs */
+
+const int ctrlPwmFreq = PWM_FREQ;
+const int ctrlA2Bit   = A2BIT_CONV;
+
+void ctrlInit(void) {
+  /* Same as BLDC_Init() */
+  rtP_Left.b_angleMeasEna       = 0;
+  rtP_Left.z_selPhaCurMeasABC   = 0;
+  rtP_Left.z_ctrlTypSel         = CTRL_TYP_SEL;
+  rtP_Left.b_diagEna            = DIAG_ENA;
+  rtP_Left.i_max                = (I_MOT_MAX * A2BIT_CONV) << 4;
+  rtP_Left.n_max                = N_MOT_MAX << 4;
+  rtP_Left.b_fieldWeakEna       = FIELD_WEAK_ENA;
+  rtP_Left.id_fieldWeakMax      = (FIELD_WEAK_MAX * A2BIT_CONV) << 4;
+  rtP_Left.a_phaAdvMax          = PHASE_ADV_MAX << 4;
+  rtP_Left.r_fieldWeakHi        = FIELD_WEAK_HI << 4;
+  rtP_Left.r_fieldWeakLo        = FIELD_WEAK_LO << 4;
+
+  rtP_Right                     = rtP_Left;
+  rtP_Right.z_selPhaCurMeasABC  = 1;
+
+  rtM_Left->defaultParam        = &rtP_Left;
+  rtM_Left->dwork               = &rtDW_Left;
+  rtM_Left->inputs              = &rtU_Left;
+  rtM_Left->outputs             = &rtY_Left;
+
+  rtM_Right->defaultParam       = &rtP_Right;
+  rtM_Right->dwork              = &rtDW_Right;
+  rtM_Right->inputs             = &rtU_Right;
+  rtM_Right->outputs            = &rtY_Right;
+
+  BLDC_controller_initialize(rtM_Left);
+  BLDC_controller_initialize(rtM_Right);
+}
+
+void ctrlStep(void) {
+  BLDC_controller_step(rtM_Left);
+  BLDC_controller_step(rtM_Right);
+}
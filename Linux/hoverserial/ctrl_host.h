@@ -0,0 +1,30 @@
+/*
+ * Host build of the BLDC controllers for the replay tool (ctrl_host.c)
+ */
+
+#ifndef CTRL_HOST_H
+#define CTRL_HOST_H
+
+#include "BLDC_controller.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern RT_MODEL *const rtM_Left;
+extern RT_MODEL *const rtM_Right;
+extern P    rtP_Left, rtP_Right;
+extern ExtU rtU_Left, rtU_Right;
+extern ExtY rtY_Left, rtY_Right;
+
+extern const int ctrlPwmFreq;           // [Hz] controller step rate, PWM_FREQ
+extern const int ctrlA2Bit;             // A2BIT_CONV
+
+void ctrlInit(void);                    // BLDC_Init() with the config.h parameters
+void ctrlStep(void);                    // one PWM period of both controllers
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CTRL_HOST_H
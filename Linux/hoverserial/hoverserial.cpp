@@ -0,0 +1,423 @@
+// *******************************************************************
+//  Linux host library for the hoverboard serial protocol
+//  for   https://github.com/EmanuelFeru/hoverboard-firmware-hack-FOC
+//
+// *******************************************************************
+
+#include "hoverserial.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace hover {
+
+const char *const tlmFieldNames[TLM_FIELDS_NUM] = {
+  "cmd1", "cmd2", "speedR", "speedL", "batV", "temp", "cmdL", "cmdR",
+  "iqL", "iqR", "idL", "idR", "angleL", "angleR", "errL", "errR",
+  "dcCurrL", "dcCurrR", "isrCyc", "isrCycMax", "node",
+  "ctrlIn", "tgtL", "tgtR", "phaAbL", "phaBcL", "phaAbR", "phaBcR", "dcLinkL", "dcLinkR",
+  "odom"
+};
+
+static inline uint16_t rd16(const uint8_t *p) { return (uint16_t)(p[0] | (p[1] << 8)); }
+static inline uint32_t rd32(const uint8_t *p) { return (uint32_t)(p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24)); }
+static inline void wr16(uint8_t *p, uint16_t v) { p[0] = (uint8_t)v; p[1] = (uint8_t)(v >> 8); }
+static inline void wr32(uint8_t *p, uint32_t v) { wr16(p, (uint16_t)v); wr16(p + 2, (uint16_t)(v >> 16)); }
+
+uint16_t crc16(const uint8_t *data, size_t len, uint16_t crc)
+{
+  while (len--) {
+    crc ^= (uint16_t)(*data++) << 8;
+    for (int i = 0; i < 8; i++) {
+      crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+    }
+  }
+  return crc;
+}
+
+uint64_t monotonicUs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+
+// ########################## COMMANDS ##########################
+
+CommandBuilder &CommandBuilder::record(uint8_t type, const uint8_t *value, uint8_t len)
+{
+  data_.push_back(type);
+  data_.push_back(len);
+  data_.insert(data_.end(), value, value + len);
+  return *this;
+}
+
+CommandBuilder &CommandBuilder::steerSpeed(int16_t steer, int16_t speed)
+{
+  uint8_t v[4];
+  wr16(v, (uint16_t)steer);
+  wr16(v + 2, (uint16_t)speed);
+  return record(CMD_TLV_STEER_SPEED, v, sizeof(v));
+}
+
+CommandBuilder &CommandBuilder::motorTargets(int16_t left, int16_t right)
+{
+  uint8_t v[4];
+  wr16(v, (uint16_t)left);
+  wr16(v + 2, (uint16_t)right);
+  return record(CMD_TLV_MOTOR_TGT, v, sizeof(v));
+}
+
+CommandBuilder &CommandBuilder::ctrlMode(uint8_t mode) { return record(CMD_TLV_CTRL_MOD, &mode, 1); }
+CommandBuilder &CommandBuilder::flags(uint8_t flags)   { return record(CMD_TLV_FLAGS, &flags, 1); }
+CommandBuilder &CommandBuilder::node(uint8_t id)       { return record(CMD_TLV_NODE, &id, 1); }
+
+CommandBuilder &CommandBuilder::paramSet(uint8_t index, int32_t value)
+{
+  uint8_t v[5];
+  v[0] = index;
+  wr32(v + 1, (uint32_t)value);
+  return record(CMD_TLV_PARAM_SET, v, sizeof(v));
+}
+
+CommandBuilder &CommandBuilder::telemetry(uint32_t fields, uint8_t period)
+{
+  uint8_t v[5];
+  wr32(v, fields);
+  v[4] = period;
+  return record(CMD_TLV_TELEMETRY, v, sizeof(v));
+}
+
+CommandBuilder &CommandBuilder::sync(uint32_t hostUs)
+{
+  uint8_t v[4];
+  wr32(v, hostUs);
+  return record(CMD_TLV_SYNC, v, sizeof(v));
+}
+
+CommandBuilder &CommandBuilder::applyAt(uint32_t hostUs)
+{
+  uint8_t v[4];
+  wr32(v, hostUs);
+  return record(CMD_TLV_APPLY_AT, v, sizeof(v));
+}
+
+bool CommandBuilder::build(std::vector<uint8_t> &frame) const
+{
+  if (data_.size() > CMD_DATA_MAX) {
+    return false;
+  }
+  frame.resize(4 + data_.size() + 2);
+  wr16(&frame[0], START_FRAME);
+  frame[2] = CMD_VERSION;
+  frame[3] = (uint8_t)data_.size();
+  std::memcpy(&frame[4], data_.data(), data_.size());
+  wr16(&frame[4 + data_.size()], crc16(frame.data(), 4 + data_.size()));
+  return true;
+}
+
+
+// ########################## FEEDBACK ##########################
+
+void StreamParser::feed(const uint8_t *data, size_t len)
+{
+  size_t used = 0, n;
+
+  if (buf_.empty()) {                                   // Decode in place, keep only the incomplete tail
+    while (used < len && (n = parse(data + used, len - used)) > 0) {
+      used += n;
+    }
+    buf_.assign(data + used, data + len);
+    return;
+  }
+  buf_.insert(buf_.end(), data, data + len);            // Complete the frame started in a previous chunk
+  while (used < buf_.size() && (n = parse(buf_.data() + used, buf_.size() - used)) > 0) {
+    used += n;
+  }
+  buf_.erase(buf_.begin(), buf_.begin() + used);
+}
+
+size_t StreamParser::parse(const uint8_t *p, size_t len)
+{
+  if (p[0] != (uint8_t)START_FRAME) {
+    stats_.errSync++;
+    return 1;
+  }
+  if (len < 2) {
+    return 0;
+  }
+  if (p[1] != (uint8_t)(START_FRAME >> 8)) {
+    stats_.errSync++;
+    return 1;
+  }
+
+  if (mode_ == LEGACY) {
+    if (len < 18) {
+      return 0;
+    }
+    uint16_t chk = 0;
+    for (int i = 0; i < 16; i += 2) {
+      chk ^= rd16(p + i);
+    }
+    if (chk != rd16(p + 16)) {
+      stats_.errCrc++;
+      return 1;
+    }
+    Feedback fb;
+    fb.cmd1       = (int16_t)rd16(p + 2);
+    fb.cmd2       = (int16_t)rd16(p + 4);
+    fb.speedR     = (int16_t)rd16(p + 6);
+    fb.speedL     = (int16_t)rd16(p + 8);
+    fb.batVoltage = (int16_t)rd16(p + 10);
+    fb.boardTemp  = (int16_t)rd16(p + 12);
+    fb.cmdLed     = rd16(p + 14);
+    stats_.frames++;
+    if (onFeedback) onFeedback(fb);
+    return 18;
+  }
+
+  if (len < 4) {
+    return 0;
+  }
+  uint8_t flen = p[3];
+  if (p[2] != TLM_VERSION || flen < 10 || (flen - 10) % 2 || (flen - 10) / 2 > TLM_FIELDS_NUM) {
+    stats_.errFmt++;
+    return 1;
+  }
+  size_t total = 4u + flen + 2u;
+  if (len < total) {
+    return 0;
+  }
+  if (crc16(p, 4u + flen) != rd16(p + 4 + flen)) {
+    stats_.errCrc++;
+    return 1;
+  }
+
+  Telemetry t;
+  t.seq    = rd16(p + 4);
+  t.timeMs = rd32(p + 6);
+  t.mask   = rd32(p + 10);
+  const uint8_t *f = p + 14;
+  int count = 0;
+  for (int i = 0; i < TLM_FIELDS_NUM; i++) {
+    if (t.mask & (1UL << i)) {
+      if (++count > (flen - 10) / 2) break;
+      t.field[i] = (int16_t)rd16(f);
+      f += 2;
+    } else {
+      t.field[i] = 0;
+    }
+  }
+  if (count != (flen - 10) / 2) {                       // Field mask does not match the length
+    stats_.errFmt++;
+    return 1;
+  }
+  stats_.frames++;
+  if (onTelemetry) onTelemetry(t);
+  return total;
+}
+
+
+void Odometer::add(const Telemetry &t)
+{
+  if (!t.has(TLM_ODOM)) return;
+  unsigned  w     = t.seq & 7;
+  unsigned  shift = 16 * (w & 1);
+  uint32_t &v     = value[w >> 1];
+  v = (v & ~(0xFFFFu << shift)) | ((uint32_t)(uint16_t)t.field[TLM_ODOM] << shift);
+  words |= (uint8_t)(1u << w);
+}
+
+
+// ########################## SERIAL PORT ##########################
+
+static speed_t baudFlag(int baud)
+{
+  switch (baud) {
+    case 9600:    return B9600;
+    case 19200:   return B19200;
+    case 38400:   return B38400;
+    case 57600:   return B57600;
+    case 115200:  return B115200;
+    case 230400:  return B230400;
+    case 460800:  return B460800;
+    case 921600:  return B921600;
+    default:      return 0;
+  }
+}
+
+bool SerialPort::open(const std::string &path, int baud)
+{
+  struct termios tio;
+  speed_t speed = baudFlag(baud);
+
+  close();
+  if (!speed) {
+    err_ = "unsupported baud rate";
+    return false;
+  }
+  fd_ = ::open(path.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+  if (fd_ < 0) {
+    err_ = std::strerror(errno);
+    return false;
+  }
+  if (tcgetattr(fd_, &tio) == 0) {                      // Not a tty (e.g. a pipe): use as is
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cflag &= ~(CSTOPB | CRTSCTS);
+    tio.c_cc[VMIN]  = 0;
+    tio.c_cc[VTIME] = 0;
+    cfsetispeed(&tio, speed);
+    cfsetospeed(&tio, speed);
+    if (tcsetattr(fd_, TCSANOW, &tio) != 0) {
+      err_ = std::strerror(errno);
+      close();
+      return false;
+    }
+    tcflush(fd_, TCIOFLUSH);
+  }
+  txq_.clear();
+  return true;
+}
+
+void SerialPort::close()
+{
+  if (fd_ >= 0) {
+    ::close(fd_);
+    fd_ = -1;
+  }
+  txq_.clear();
+}
+
+ssize_t SerialPort::read(uint8_t *data, size_t len)
+{
+  ssize_t n = ::read(fd_, data, len);
+  if (n >= 0) {                                         // 0: no data (VMIN = 0), a hangup is reported by poll()
+    return n;
+  }
+  if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+    return 0;
+  }
+  err_ = std::strerror(errno);
+  return -1;
+}
+
+bool SerialPort::write(const uint8_t *data, size_t len)
+{
+  txq_.insert(txq_.end(), data, data + len);
+  return flush();
+}
+
+bool SerialPort::flush()
+{
+  while (!txq_.empty()) {
+    ssize_t n = ::write(fd_, txq_.data(), txq_.size());
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        return true;                                    // Rest is sent when the port is writable again
+      }
+      err_ = std::strerror(errno);
+      return false;
+    }
+    txq_.erase(txq_.begin(), txq_.begin() + n);
+  }
+  return true;
+}
+
+
+// ########################## CLIENT ##########################
+
+bool Client::connect()
+{
+  if (!port_.open(path_, baud_)) {
+    return false;
+  }
+  parser_.reset();
+  if (onLog) onLog("connected to " + path_);
+  return true;
+}
+
+int Client::run(unsigned periodMs, unsigned durationMs)
+{
+  const uint64_t start   = monotonicUs();
+  const uint64_t period  = (uint64_t)periodMs * 1000u;
+  uint64_t nextSend      = start;
+  uint64_t nextConnect   = start;
+  bool     reported      = false;
+  uint8_t  rx[4096];
+  std::vector<uint8_t> frame;
+
+  stop_ = false;
+  while (!stop_) {
+    uint64_t now = monotonicUs();
+    if (durationMs && now - start >= (uint64_t)durationMs * 1000u) {
+      break;
+    }
+
+    if (!port_.isOpen()) {                              // (Re)connect every 500 ms
+      if (now >= nextConnect) {
+        if (!connect()) {
+          if (!reported && onLog) onLog("cannot open " + path_ + ": " + port_.error() + ", retrying");
+          reported    = true;
+          nextConnect = now + 500000u;
+        } else {
+          reported = false;
+        }
+      }
+      if (!port_.isOpen()) {
+        usleep(10000);
+        continue;
+      }
+    }
+
+    int timeout = 100;
+    if (period) {
+      timeout = nextSend > now ? (int)((nextSend - now + 999) / 1000) : 0;
+    }
+    struct pollfd pfd = { port_.fd(), (short)(POLLIN | (port_.pendingTx() ? POLLOUT : 0)), 0 };
+    int ret = poll(&pfd, 1, timeout);
+    bool lost = ret < 0 && errno != EINTR;
+
+    if (ret > 0 && (pfd.revents & POLLIN)) {
+      ssize_t n;
+      while ((n = port_.read(rx, sizeof(rx))) > 0) {
+        parser_.feed(rx, (size_t)n);
+      }
+      lost |= n < 0;
+    }
+    if (ret > 0 && (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))) {
+      port_.setError("hang up");
+      lost = true;
+    }
+    if (!lost && ret > 0 && (pfd.revents & POLLOUT)) {
+      lost = !port_.flush();
+    }
+
+    now = monotonicUs();
+    if (!lost && period && now >= nextSend) {
+      if (onSend && onSend(frame)) {
+        lost = !port_.write(frame.data(), frame.size());
+      }
+      nextSend += period;
+      if (nextSend < now) {                             // Late: do not send a burst to catch up
+        nextSend = now + period;
+      }
+    }
+
+    if (lost) {
+      if (onLog) onLog("lost " + path_ + ": " + port_.error());
+      port_.close();
+      nextConnect = monotonicUs() + 500000u;
+    }
+  }
+  port_.close();
+  return 0;
+}
+
+} // namespace hover
@@ -0,0 +1,192 @@
+// *******************************************************************
+//  Linux host library for the hoverboard serial protocol
+//  for   https://github.com/EmanuelFeru/hoverboard-firmware-hack-FOC
+//
+// *******************************************************************
+// INFO:
+// • Command frames:  | start 0xABCD (2) | version (1) | length (1) | TLV records | CRC16 (2) |   (util.h, CMD_TLV_*)
+// • Telemetry:       | start 0xABCD (2) | version (1) | length (1) | sequence (2) | time ms (4) | field mask (4) | int16 fields | CRC16 (2) |
+// • Legacy feedback: the fixed SerialFeedback structure with XOR checksum, when FEEDBACK_TELEMETRY is not used
+// • All values are little endian, the CRC16 is CCITT-FALSE (polynomial 0x1021, initial value 0xFFFF) over header and data
+// • The stream parser decodes the frames in place from the receive chunks, only an incomplete frame tail is copied
+// *******************************************************************
+
+#ifndef HOVERSERIAL_H
+#define HOVERSERIAL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+namespace hover {
+
+// ########################## PROTOCOL ##########################
+constexpr uint16_t START_FRAME   = 0xABCD;   // SERIAL_START_FRAME
+constexpr uint8_t  CMD_VERSION   = 1;        // SERIAL_CMD_VERSION
+constexpr uint8_t  CMD_DATA_MAX  = 32;       // SERIAL_CMD_DATA_MAX
+constexpr uint8_t  TLM_VERSION   = 1;        // TLM_VERSION
+constexpr uint8_t  NODE_BCAST    = 0xFF;     // SERIAL_NODE_BCAST
+
+enum CmdTlv : uint8_t {
+  CMD_TLV_STEER_SPEED = 1,  // int16 steer, int16 speed
+  CMD_TLV_MOTOR_TGT,        // int16 left, int16 right
+  CMD_TLV_CTRL_MOD,         // uint8 control mode 0:OPEN 1:VLT 2:SPD 3:TRQ
+  CMD_TLV_FLAGS,            // uint8 CMD_FLG_* bits
+  CMD_TLV_PARAM_SET,        // uint8 params[] index, int32 value
+  CMD_TLV_TELEMETRY,        // uint32 field mask, uint8 period in main loops
+  CMD_TLV_NODE,             // uint8 destination node ID
+  CMD_TLV_SYNC,             // uint32 host time us
+  CMD_TLV_APPLY_AT          // uint32 host time us for the MOTOR_TGT targets
+};
+
+constexpr uint8_t CMD_FLG_ENABLE = 0x01;
+constexpr uint8_t CMD_FLG_BRAKE  = 0x02;
+
+// Telemetry fields in field mask bit order (util.h TLM_*)
+enum TlmField {
+  TLM_CMD1, TLM_CMD2, TLM_SPEED_R, TLM_SPEED_L, TLM_BATV, TLM_TEMP, TLM_CMD_L, TLM_CMD_R,
+  TLM_IQ_L, TLM_IQ_R, TLM_ID_L, TLM_ID_R, TLM_ANGLE_L, TLM_ANGLE_R, TLM_ERR_L, TLM_ERR_R,
+  TLM_DC_CURR_L, TLM_DC_CURR_R, TLM_ISR_CYC, TLM_ISR_CYC_MAX, TLM_NODE,
+  TLM_CTRL_IN, TLM_TGT_L, TLM_TGT_R, TLM_PHA_AB_L, TLM_PHA_BC_L, TLM_PHA_AB_R, TLM_PHA_BC_R,
+  TLM_DC_LINK_L, TLM_DC_LINK_R, TLM_ODOM, TLM_FIELDS_NUM
+};
+constexpr uint32_t TLM_REPLAY_MASK = 0x3FE00000;   // TLM_CTRL_IN..TLM_DC_LINK_R, the BLDC controller inputs
+
+// TLM_CTRL_IN bits
+constexpr uint16_t CTRL_IN_HALL_L = 0x0007;        // left hall A, B, C
+constexpr uint16_t CTRL_IN_HALL_R = 0x0038;        // right hall A, B, C
+constexpr uint16_t CTRL_IN_ENA    = 0x0040;        // motor enable
+constexpr int      CTRL_IN_MOD_SHIFT = 8;          // control mode request, 2 bits
+extern const char *const tlmFieldNames[TLM_FIELDS_NUM];
+
+uint16_t crc16(const uint8_t *data, size_t len, uint16_t crc = 0xFFFF);
+
+// ########################## COMMANDS ##########################
+// Builds one command frame from TLV records
+class CommandBuilder {
+public:
+  CommandBuilder &steerSpeed(int16_t steer, int16_t speed);
+  CommandBuilder &motorTargets(int16_t left, int16_t right);
+  CommandBuilder &ctrlMode(uint8_t mode);
+  CommandBuilder &flags(uint8_t flags);
+  CommandBuilder &paramSet(uint8_t index, int32_t value);
+  CommandBuilder &telemetry(uint32_t fields, uint8_t period);
+  CommandBuilder &node(uint8_t id);
+  CommandBuilder &sync(uint32_t hostUs);
+  CommandBuilder &applyAt(uint32_t hostUs);
+
+  // Returns false if the records exceed CMD_DATA_MAX
+  bool build(std::vector<uint8_t> &frame) const;
+  void clear() { data_.clear(); }
+
+private:
+  CommandBuilder &record(uint8_t type, const uint8_t *value, uint8_t len);
+  std::vector<uint8_t> data_;
+};
+
+// ########################## FEEDBACK ##########################
+struct Telemetry {
+  uint16_t seq;
+  uint32_t timeMs;
+  uint32_t mask;
+  int16_t  field[TLM_FIELDS_NUM];             // only the fields in mask are valid
+  bool has(TlmField f) const { return mask & (1UL << f); }
+};
+
+// Odometer counters of the board, TLM_ODOM carries word (seq % 8) of them, low word first
+struct Odometer {
+  enum { DIST, CHARGE, ENERGY, TIME, NUM };    // [m], [mAh], [Wh], [s]
+  uint32_t value[NUM] = {};
+  uint8_t  words = 0;                          // bit per received word
+  void add(const Telemetry &t);
+  bool complete() const { return words == 0xFF; }
+};
+
+struct Feedback {
+  int16_t  cmd1, cmd2, speedR, speedL, batVoltage, boardTemp;
+  uint16_t cmdLed;
+};
+
+struct ParserStats {
+  uint64_t frames  = 0;   // valid frames
+  uint64_t errCrc  = 0;   // frames with wrong CRC or checksum
+  uint64_t errSync = 0;   // bytes dropped while searching for the start frame
+  uint64_t errFmt  = 0;   // frames with unknown version or length
+};
+
+// Stream parser for the board output: feed any chunks, complete frames are decoded and reported
+class StreamParser {
+public:
+  enum Mode { TELEMETRY, LEGACY };
+  explicit StreamParser(Mode mode = TELEMETRY) : mode_(mode) {}
+
+  std::function<void(const Telemetry &)> onTelemetry;
+  std::function<void(const Feedback &)>  onFeedback;
+
+  void feed(const uint8_t *data, size_t len);
+  void reset() { buf_.clear(); }
+  const ParserStats &stats() const { return stats_; }
+
+private:
+  size_t parse(const uint8_t *p, size_t len);     // returns the bytes consumed, 0 if more data is needed
+  Mode mode_;
+  std::vector<uint8_t> buf_;                      // unparsed tail of the previous chunks
+  ParserStats stats_;
+};
+
+// ########################## SERIAL PORT ##########################
+// Non-blocking serial port, 8N1 raw
+class SerialPort {
+public:
+  ~SerialPort() { close(); }
+  bool open(const std::string &path, int baud);
+  void close();
+  bool isOpen() const { return fd_ >= 0; }
+  int  fd() const { return fd_; }
+  // Returns the bytes read, 0 if none are available, -1 if the port was lost
+  ssize_t read(uint8_t *data, size_t len);
+  // Queues and writes as much as possible, the rest is sent by flush(). Returns false if the port was lost
+  bool write(const uint8_t *data, size_t len);
+  bool flush();
+  bool pendingTx() const { return !txq_.empty(); }
+  const std::string &error() const { return err_; }
+  void setError(const std::string &err) { err_ = err; }
+
+private:
+  int fd_ = -1;
+  std::vector<uint8_t> txq_;
+  std::string err_;
+};
+
+// ########################## CLIENT ##########################
+// Event loop: reads and parses the feedback, sends the periodic command, reconnects if the port is lost
+class Client {
+public:
+  Client(const std::string &path, int baud, StreamParser::Mode mode) : path_(path), baud_(baud), parser_(mode) {}
+
+  StreamParser &parser() { return parser_; }
+  // Called every period to build the next command frame. Return false to send nothing
+  std::function<bool(std::vector<uint8_t> &frame)> onSend;
+  std::function<void(const std::string &msg)> onLog;
+
+  // Runs until stop() or the duration is over (0 = forever). periodMs = 0 disables the periodic command
+  int  run(unsigned periodMs, unsigned durationMs);
+  void stop() { stop_ = true; }
+
+private:
+  bool connect();
+  std::string  path_;
+  int          baud_;
+  SerialPort   port_;
+  StreamParser parser_;
+  volatile bool stop_ = false;
+};
+
+uint64_t monotonicUs();
+
+} // namespace hover
+
+#endif // HOVERSERIAL_H
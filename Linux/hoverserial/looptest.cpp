@@ -0,0 +1,159 @@
+// *******************************************************************
+//  looptest: pseudo-terminal loopback of the host library against the firmware serial code
+//  for   https://github.com/EmanuelFeru/hoverboard-firmware-hack-FOC
+//
+// *******************************************************************
+// The Client of the library runs on the slave side of a pty. The master side is the board: the firmware util.c and
+// comms.c built for the host by ../fwhost (VARIANT_USART, FEEDBACK_TELEMETRY), with the command bytes passed to the
+// USART2 Rx DMA ring and the telemetry taken from the USART2 Tx DMA. A thread runs the main loop every 5 ms.
+//  - the client sends steer/speed commands with the telemetry request, every CMD_BAD-th frame with a wrong CRC
+//  - the board corrupts one byte of every TLM_BAD-th telemetry frame
+// Checked at the end:
+//  - the firmware parser accepted every good command and counted every bad one as a CRC error
+//  - the library decoded every good telemetry frame and counted every bad one as a CRC error
+//  - the commanded values came back in TLM_CMD1/TLM_CMD2
+//   make test   or   ./looptest [duration_ms]
+// *******************************************************************
+
+#include "hoverserial.h"
+#include "hostfw.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <thread>
+#include <unistd.h>
+
+using namespace hover;
+
+constexpr unsigned LOOP_US  = 5000;      // main loop period, DELAY_IN_MAIN_LOOP
+constexpr unsigned CMD_MS   = 5;         // command period
+constexpr unsigned CMD_BAD  = 7;         // every CMD_BAD-th command frame has a wrong CRC
+constexpr unsigned TLM_BAD  = 11;        // every TLM_BAD-th telemetry frame is corrupted
+constexpr unsigned TAIL_MS  = 300;       // the telemetry is stopped this long before the end, so that all of it is read
+constexpr uint32_t TLM_MASK = (1UL << TLM_CMD1) | (1UL << TLM_CMD2) | (1UL << TLM_BATV);
+
+static std::atomic<bool>     boardStop{false};
+static std::atomic<unsigned> tlmSent{0}, tlmBad{0};
+
+static bool writeAll(int fd, const uint8_t *data, size_t len)
+{
+  while (len) {
+    ssize_t n = write(fd, data, len);
+    if (n < 0) {
+      return false;
+    }
+    data += n;
+    len  -= (size_t)n;
+  }
+  return true;
+}
+
+// The board: Rx bytes into the firmware parser, a main loop pass every LOOP_US, the telemetry back to the client
+static void board(int master)
+{
+  uint8_t  buf[512];
+  uint64_t nextLoop = monotonicUs();
+
+  while (!boardStop) {
+    struct pollfd pfd = { master, POLLIN, 0 };
+    if (poll(&pfd, 1, 1) > 0 && (pfd.revents & POLLIN)) {
+      ssize_t n = read(master, buf, sizeof(buf));
+      if (n > 0) {
+        hostRx(2, buf, (uint32_t)n);
+      }
+    }
+    if (monotonicUs() < nextLoop) {
+      continue;
+    }
+    nextLoop += LOOP_US;
+    hostLoop();
+    if (hostTxBusy(2)) {
+      uint32_t len = hostTx(2, buf, sizeof(buf));
+      if (++tlmSent % TLM_BAD == 0) {
+        buf[14] ^= 0x40;                                // first field
+        tlmBad++;
+      }
+      writeAll(master, buf, len);
+    }
+    while (hostTxBusy(3)) {                             // debug output of the firmware, not used
+      hostTx(3, nullptr, 0);
+    }
+  }
+}
+
+int main(int argc, char **argv)
+{
+  unsigned durationMs = argc > 1 ? (unsigned)std::strtoul(argv[1], nullptr, 0) : 2000;
+  unsigned sent = 0, bad = 0, tlmRecv = 0, tlmWrong = 0;
+  bool     stopSent = false;
+  struct termios tio;
+
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+    std::perror("looptest: pty");
+    return 2;
+  }
+  const char *slavePath = ptsname(master);
+  int slave = open(slavePath, O_RDWR | O_NOCTTY);      // kept open, so the master is not hung up between connections
+  if (slave < 0 || tcgetattr(slave, &tio) != 0) {
+    std::perror(slavePath);
+    return 2;
+  }
+  cfmakeraw(&tio);
+  tcsetattr(slave, TCSANOW, &tio);
+
+  hostInit();
+  std::thread boardThread(board, master);
+
+  Client cl(slavePath, 115200, StreamParser::TELEMETRY);
+  const uint64_t start = monotonicUs();
+  cl.onSend = [&](std::vector<uint8_t> &frame) {
+    CommandBuilder cmd;
+    if (monotonicUs() - start >= (uint64_t)(durationMs - TAIL_MS) * 1000u) {
+      if (stopSent) {
+        return false;
+      }
+      stopSent = true;
+      cmd.telemetry(TLM_MASK, 0);                       // period 0: telemetry off
+    } else {
+      int16_t steer = (int16_t)((sent * 37) % 1000) - 500;
+      cmd.steerSpeed(steer, (int16_t)-steer).telemetry(TLM_MASK, 1);
+    }
+    cmd.build(frame);
+    if (++sent % CMD_BAD == 0) {
+      frame.back() ^= 0x01;                             // CRC high byte
+      bad++;
+    }
+    return true;
+  };
+  cl.parser().onTelemetry = [&](const Telemetry &t) {
+    tlmRecv++;
+    if (!t.has(TLM_CMD1) || !t.has(TLM_CMD2) || t.field[TLM_CMD2] != -t.field[TLM_CMD1] || t.field[TLM_CMD1] < -500 || t.field[TLM_CMD1] > 499) {
+      tlmWrong++;
+    }
+  };
+  cl.onLog = [](const std::string &msg) { std::fprintf(stderr, "looptest: %s\n", msg.c_str()); };
+  cl.run(CMD_MS, durationMs);
+
+  boardStop = true;
+  boardThread.join();
+
+  HostRxStats fw;                                       // stdout is the firmware debug output since hostInit()
+  hostRxStats(2, &fw);
+  const ParserStats &host = cl.parser().stats();
+  bool cmdOk = fw.ok == sent - bad && fw.errCrc == bad;
+  bool tlmOk = host.frames == tlmSent - tlmBad && host.errCrc == tlmBad && tlmWrong == 0 && tlmRecv > 0;
+
+  dprintf(STDOUT_FILENO, "commands:  sent %u, bad %u | firmware ok %u, crc %u, sync %u, fmt %u  %s\n",
+          sent, bad, fw.ok, fw.errCrc, fw.errSync, fw.errFmt, cmdOk ? "ok" : "FAIL");
+  dprintf(STDOUT_FILENO, "telemetry: sent %u, bad %u | library frames %llu, crc %llu, sync %llu, fmt %llu, wrong values %u  %s\n",
+          tlmSent.load(), tlmBad.load(), (unsigned long long)host.frames, (unsigned long long)host.errCrc,
+          (unsigned long long)host.errSync, (unsigned long long)host.errFmt, tlmWrong, tlmOk ? "ok" : "FAIL");
+  close(slave);
+  close(master);
+  return cmdOk && tlmOk ? 0 : 1;
+}
@@ -0,0 +1,227 @@
+// *******************************************************************
+//  hoverserial: command line client for the hoverboard serial protocol
+//  for   https://github.com/EmanuelFeru/hoverboard-firmware-hack-FOC
+//
+// *******************************************************************
+// Sends the periodic command and records the feedback/telemetry as CSV, e.g.:
+//   hoverserial -p /dev/ttyUSB0 --tgt 100,100 --mode 2 --enable 1 --tlm 0xFF,1 -o log.csv
+//   hoverserial -p /dev/ttyUSB0 --legacy --speed 300 -t 10
+//   hoverserial -p /dev/ttyUSB0 --tlm 0x3FE0FF0F,1 --columnar run.hvc      (replay with hoverreplay run.hvc)
+//   hoverserial -p /dev/ttyUSB0 --tlm 0x40000000,20 -t 5                   (odometer counters, ODOMETER_COUNTERS)
+// *******************************************************************
+
+#include "columnar.h"
+
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+
+using namespace hover;
+
+static Client *client;
+
+static void onSignal(int)
+{
+  if (client) client->stop();
+}
+
+static void usage()
+{
+  std::fprintf(stderr,
+    "Usage: hoverserial [options]\n"
+    "  -p, --port PATH        serial port (default /dev/ttyUSB0)\n"
+    "  -b, --baud N           baud rate (default 115200)\n"
+    "  -r, --rate HZ          command rate, 0 = listen only (default 20)\n"
+    "  -t, --time S           stop after S seconds (default: until Ctrl+C)\n"
+    "  -o, --record FILE      record the feedback as CSV, '-' for stdout\n"
+    "  -c, --columnar FILE    record the telemetry into a memory-mappable columnar file (fields of --tlm, or all)\n"
+    "      --legacy           legacy SerialCommand/SerialFeedback structures instead of the TLV protocol\n"
+    "      --steer N          steer command\n"
+    "      --speed N          speed command\n"
+    "      --tgt L,R          direct motor targets\n"
+    "      --mode M           control mode 0:OPEN 1:VLT 2:SPD 3:TRQ\n"
+    "      --enable 0|1       motor enable flag\n"
+    "      --brake            brake flag\n"
+    "      --tlm MASK[,DIV]   telemetry field mask and period in main loops\n"
+    "      --param IDX=VAL    set a params[] entry\n"
+    "      --node ID          destination node on a multi-drop bus (255 = broadcast)\n"
+    "      --sync             send the host time for the board clock synchronization\n"
+    "  -q, --quiet            no status messages\n");
+}
+
+int main(int argc, char **argv)
+{
+  enum { OPT_LEGACY = 256, OPT_STEER, OPT_SPEED, OPT_TGT, OPT_MODE, OPT_ENABLE, OPT_BRAKE, OPT_TLM, OPT_PARAM, OPT_NODE, OPT_SYNC };
+  static const struct option longOpts[] = {
+    {"port",     required_argument, nullptr, 'p'},
+    {"baud",     required_argument, nullptr, 'b'},
+    {"rate",     required_argument, nullptr, 'r'},
+    {"time",     required_argument, nullptr, 't'},
+    {"record",   required_argument, nullptr, 'o'},
+    {"columnar", required_argument, nullptr, 'c'},
+    {"quiet",    no_argument,       nullptr, 'q'},
+    {"help",     no_argument,       nullptr, 'h'},
+    {"legacy",   no_argument,       nullptr, OPT_LEGACY},
+    {"steer",    required_argument, nullptr, OPT_STEER},
+    {"speed",    required_argument, nullptr, OPT_SPEED},
+    {"tgt",      required_argument, nullptr, OPT_TGT},
+    {"mode",     required_argument, nullptr, OPT_MODE},
+    {"enable",   required_argument, nullptr, OPT_ENABLE},
+    {"brake",    no_argument,       nullptr, OPT_BRAKE},
+    {"tlm",      required_argument, nullptr, OPT_TLM},
+    {"param",    required_argument, nullptr, OPT_PARAM},
+    {"node",     required_argument, nullptr, OPT_NODE},
+    {"sync",     no_argument,       nullptr, OPT_SYNC},
+    {nullptr,    0,                 nullptr, 0}
+  };
+
+  std::string port = "/dev/ttyUSB0", record, columnar;
+  int  baud = 115200, steer = 0, speed = 0, tgtL = 0, tgtR = 0, mode = -1, enable = -1, node = -1;
+  int  paramIdx = -1, paramVal = 0;
+  long tlmMask = -1, tlmDiv = 1;
+  double rate = 20, seconds = 0;
+  bool legacy = false, haveSteer = false, haveTgt = false, brake = false, sync = false, quiet = false;
+  int  c;
+
+  while ((c = getopt_long(argc, argv, "p:b:r:t:o:c:qh", longOpts, nullptr)) != -1) {
+    switch (c) {
+      case 'p':        port    = optarg; break;
+      case 'b':        baud    = std::atoi(optarg); break;
+      case 'r':        rate    = std::atof(optarg); break;
+      case 't':        seconds = std::atof(optarg); break;
+      case 'o':        record  = optarg; break;
+      case 'c':        columnar = optarg; break;
+      case 'q':        quiet   = true; break;
+      case OPT_LEGACY: legacy  = true; break;
+      case OPT_STEER:  steer   = std::atoi(optarg); haveSteer = true; break;
+      case OPT_SPEED:  speed   = std::atoi(optarg); haveSteer = true; break;
+      case OPT_TGT:
+        if (std::sscanf(optarg, "%d,%d", &tgtL, &tgtR) != 2) { usage(); return 1; }
+        haveTgt = true;
+        break;
+      case OPT_MODE:   mode    = std::atoi(optarg); break;
+      case OPT_ENABLE: enable  = std::atoi(optarg) ? 1 : 0; break;
+      case OPT_BRAKE:  brake   = true; break;
+      case OPT_TLM:
+        if (std::sscanf(optarg, "%li,%li", &tlmMask, &tlmDiv) < 1) { usage(); return 1; }
+        break;
+      case OPT_PARAM:
+        if (std::sscanf(optarg, "%d=%d", &paramIdx, &paramVal) != 2) { usage(); return 1; }
+        break;
+      case OPT_NODE:   node    = std::atoi(optarg); break;
+      case OPT_SYNC:   sync    = true; break;
+      default:         usage(); return c == 'h' ? 0 : 1;
+    }
+  }
+  if (legacy && (haveTgt || !columnar.empty() || mode >= 0 || enable >= 0 || brake || tlmMask >= 0 || paramIdx >= 0 || node >= 0 || sync)) {
+    std::fprintf(stderr, "hoverserial: --legacy only supports --steer/--speed\n");
+    return 1;
+  }
+
+  // Static records, the frame is rebuilt only for the time dependent ones
+  CommandBuilder cmd;
+  if (node >= 0)      cmd.node((uint8_t)node);
+  if (haveSteer)      cmd.steerSpeed((int16_t)steer, (int16_t)speed);
+  if (haveTgt)        cmd.motorTargets((int16_t)tgtL, (int16_t)tgtR);
+  if (mode >= 0)      cmd.ctrlMode((uint8_t)mode);
+  if (enable >= 0 || brake) cmd.flags((uint8_t)((enable != 0 ? CMD_FLG_ENABLE : 0) | (brake ? CMD_FLG_BRAKE : 0)));
+  if (tlmMask >= 0)   cmd.telemetry((uint32_t)tlmMask, (uint8_t)tlmDiv);
+  if (paramIdx >= 0)  cmd.paramSet((uint8_t)paramIdx, paramVal);
+  std::vector<uint8_t> staticFrame;
+  if (!legacy && !cmd.build(staticFrame)) {
+    std::fprintf(stderr, "hoverserial: too many records for one command frame\n");
+    return 1;
+  }
+
+  FILE *out = nullptr;
+  static char outBuf[1 << 20];
+  if (!record.empty()) {
+    out = record == "-" ? stdout : std::fopen(record.c_str(), "w");
+    if (!out) {
+      std::perror(record.c_str());
+      return 1;
+    }
+    std::setvbuf(out, outBuf, _IOFBF, sizeof(outBuf));  // Full rate logging: buffer, do not flush per line
+  }
+
+  ColumnWriter col;
+  if (!columnar.empty() && !col.open(columnar, tlmMask >= 0 ? (uint32_t)tlmMask : 0xFFFFFFFF)) {
+    std::perror(columnar.c_str());
+    return 1;
+  }
+
+  Odometer odo;
+  Client cl(port, baud, legacy ? StreamParser::LEGACY : StreamParser::TELEMETRY);
+  client = &cl;
+  std::signal(SIGINT,  onSignal);
+  std::signal(SIGTERM, onSignal);
+
+  cl.onLog = [quiet](const std::string &msg) {
+    if (!quiet) std::fprintf(stderr, "hoverserial: %s\n", msg.c_str());
+  };
+
+  cl.onSend = [&](std::vector<uint8_t> &frame) {
+    if (legacy) {                                       // SerialCommand {start, steer, speed, checksum}
+      uint16_t w[4] = { START_FRAME, (uint16_t)steer, (uint16_t)speed, 0 };
+      w[3] = w[0] ^ w[1] ^ w[2];
+      frame.resize(sizeof(w));
+      for (int i = 0; i < 4; i++) {
+        frame[2*i]     = (uint8_t)w[i];
+        frame[2*i + 1] = (uint8_t)(w[i] >> 8);
+      }
+      return true;
+    }
+    if (!sync) {
+      frame = staticFrame;
+      return true;
+    }
+    CommandBuilder sc = cmd;
+    sc.sync((uint32_t)monotonicUs());
+    return sc.build(frame);
+  };
+
+  if (out && legacy) {
+    std::fprintf(out, "host_us,cmd1,cmd2,speedR,speedL,batV,temp,cmdLed\n");
+    cl.parser().onFeedback = [out](const Feedback &fb) {
+      std::fprintf(out, "%llu,%d,%d,%d,%d,%d,%d,%u\n", (unsigned long long)monotonicUs(),
+                   fb.cmd1, fb.cmd2, fb.speedR, fb.speedL, fb.batVoltage, fb.boardTemp, fb.cmdLed);
+    };
+  } else if (!legacy) {
+    if (out) {
+      std::fprintf(out, "host_us,seq,time_ms,mask");
+      for (int i = 0; i < TLM_FIELDS_NUM; i++) std::fprintf(out, ",%s", tlmFieldNames[i]);
+      std::fputc('\n', out);
+    }
+    cl.parser().onTelemetry = [out, &col, &columnar, &odo](const Telemetry &t) {
+      uint64_t now = monotonicUs();
+      odo.add(t);
+      if (!columnar.empty()) col.append(now, t);
+      if (!out) return;
+      std::fprintf(out, "%llu,%u,%u,0x%X", (unsigned long long)now, t.seq, t.timeMs, t.mask);
+      for (int i = 0; i < TLM_FIELDS_NUM; i++) {
+        if (t.has((TlmField)i)) std::fprintf(out, ",%d", t.field[i]);
+        else                    std::fputs(",", out);
+      }
+      std::fputc('\n', out);
+    };
+  }
+
+  cl.run(rate > 0 ? (unsigned)(1000.0 / rate) : 0, (unsigned)(seconds * 1000.0));
+
+  if (!columnar.empty() && !col.close()) std::perror(columnar.c_str());
+  if (out && out != stdout) std::fclose(out);
+  else if (out)             std::fflush(out);
+  const ParserStats &st = cl.parser().stats();
+  if (!quiet) {
+    std::fprintf(stderr, "hoverserial: frames %llu, CRC errors %llu, format errors %llu, dropped bytes %llu\n",
+                 (unsigned long long)st.frames, (unsigned long long)st.errCrc,
+                 (unsigned long long)st.errFmt, (unsigned long long)st.errSync);
+    if (odo.complete()) {
+      std::fprintf(stderr, "hoverserial: odometer %u m, %u mAh, %u Wh, %u s\n", odo.value[Odometer::DIST],
+                   odo.value[Odometer::CHARGE], odo.value[Odometer::ENERGY], odo.value[Odometer::TIME]);
+    }
+  }
+  return 0;
+}
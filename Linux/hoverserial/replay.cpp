@@ -0,0 +1,204 @@
+// *******************************************************************
+//  hoverreplay: replays a columnar telemetry recording through the host build of the BLDC controllers
+//  for   https://github.com/EmanuelFeru/hoverboard-firmware-hack-FOC
+//
+// *******************************************************************
+// Record with the controller input fields, e.g.:
+//   hoverserial --tlm 0x3FE0FF0F,1 --columnar run.hvc
+//   hoverreplay run.hvc -o replay.csv
+// Between two rows the inputs of the previous row are held for the elapsed PWM periods, the last period gets the
+// inputs of the row. The controller outputs are then compared with the recorded ones (speed, iq, id, angle, error).
+// The inputs are sampled at the telemetry rate, so the hall edges are only as accurate as TLM_DIV: record with
+// TLM_DIV 1 and compare at low speeds for a close match, higher speeds show the commutation timing of the sampling.
+// *******************************************************************
+
+#include "columnar.h"
+#include "ctrl_host.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+
+using namespace hover;
+
+// Compared outputs
+enum { CMP_SPEED, CMP_IQ, CMP_ID, CMP_ANGLE, CMP_NUM };
+static const char *const cmpNames[CMP_NUM] = {"speed", "iq", "id", "angle"};
+static const int cmpField[2][CMP_NUM] = {
+  {TLM_SPEED_L, TLM_IQ_L, TLM_ID_L, TLM_ANGLE_L},
+  {TLM_SPEED_R, TLM_IQ_R, TLM_ID_R, TLM_ANGLE_R}
+};
+
+struct CmpStat {
+  uint64_t n = 0;
+  double   sumSq = 0, maxAbs = 0;
+  void add(double d) { n++; sumSq += d * d; if (std::fabs(d) > maxAbs) maxAbs = std::fabs(d); }
+};
+
+static void setInputs(const ColumnReader::Block &b, uint32_t r)
+{
+  uint16_t in = (uint16_t)b.field[TLM_CTRL_IN][r];
+
+  rtU_Left.b_hallA       = (in >> 0) & 1;
+  rtU_Left.b_hallB       = (in >> 1) & 1;
+  rtU_Left.b_hallC       = (in >> 2) & 1;
+  rtU_Right.b_hallA      = (in >> 3) & 1;
+  rtU_Right.b_hallB      = (in >> 4) & 1;
+  rtU_Right.b_hallC      = (in >> 5) & 1;
+  rtU_Left.b_motEna      = rtU_Right.b_motEna     = (in & CTRL_IN_ENA) != 0;
+  rtU_Left.z_ctrlModReq  = rtU_Right.z_ctrlModReq = (uint8_t)((in >> CTRL_IN_MOD_SHIFT) & 3);
+  rtU_Left.r_inpTgt      = b.field[TLM_TGT_L][r];
+  rtU_Right.r_inpTgt     = b.field[TLM_TGT_R][r];
+  rtU_Left.i_phaAB       = b.field[TLM_PHA_AB_L][r];
+  rtU_Left.i_phaBC       = b.field[TLM_PHA_BC_L][r];
+  rtU_Right.i_phaAB      = b.field[TLM_PHA_AB_R][r];
+  rtU_Right.i_phaBC      = b.field[TLM_PHA_BC_R][r];
+  rtU_Left.i_DCLink      = b.field[TLM_DC_LINK_L][r];
+  rtU_Right.i_DCLink     = b.field[TLM_DC_LINK_R][r];
+}
+
+static int16_t output(const ExtY &y, int c)
+{
+  switch (c) {
+    case CMP_SPEED: return y.n_mot;
+    case CMP_IQ:    return y.iq;
+    case CMP_ID:    return y.id;
+    default:        return y.a_elecAngle;
+  }
+}
+
+static void usage()
+{
+  std::fprintf(stderr,
+    "Usage: hoverreplay FILE [options]\n"
+    "  -o, --output FILE      write the replayed and recorded outputs as CSV\n"
+    "  -m, --max-gap MS       restart the controllers after a gap in the recording (default 100)\n");
+}
+
+int main(int argc, char **argv)
+{
+  static const struct option longOpts[] = {
+    {"output",  required_argument, nullptr, 'o'},
+    {"max-gap", required_argument, nullptr, 'm'},
+    {"help",    no_argument,       nullptr, 'h'},
+    {nullptr,   0,                 nullptr, 0}
+  };
+  std::string outPath;
+  unsigned maxGap = 100;
+  int c;
+
+  while ((c = getopt_long(argc, argv, "o:m:h", longOpts, nullptr)) != -1) {
+    switch (c) {
+      case 'o': outPath = optarg; break;
+      case 'm': maxGap  = (unsigned)std::atoi(optarg); break;
+      default:  usage(); return c == 'h' ? 0 : 1;
+    }
+  }
+  if (optind != argc - 1) {
+    usage();
+    return 1;
+  }
+
+  ColumnReader rd;
+  if (!rd.open(argv[optind])) {
+    std::fprintf(stderr, "hoverreplay: %s: %s\n", argv[optind], rd.error().c_str());
+    return 1;
+  }
+  if ((rd.header().mask & TLM_REPLAY_MASK) != TLM_REPLAY_MASK) {
+    std::fprintf(stderr, "hoverreplay: the recording has no controller inputs, record with the field mask 0x%X\n", TLM_REPLAY_MASK);
+    return 1;
+  }
+
+  FILE *out = nullptr;
+  static char outBuf[1 << 20];
+  if (!outPath.empty()) {
+    out = outPath == "-" ? stdout : std::fopen(outPath.c_str(), "w");
+    if (!out) {
+      std::perror(outPath.c_str());
+      return 1;
+    }
+    std::setvbuf(out, outBuf, _IOFBF, sizeof(outBuf));
+    std::fprintf(out, "time_ms,side");
+    for (int k = 0; k < CMP_NUM; k++) std::fprintf(out, ",%s,%s_rec", cmpNames[k], cmpNames[k]);
+    std::fprintf(out, ",err,err_rec\n");
+  }
+
+  CmpStat  stat[2][CMP_NUM];
+  uint64_t rows = 0, steps = 0, restarts = 0, errMismatch = 0, firstErrMs = 0;
+  bool     started = false;
+  uint32_t prevMs = 0;
+  const uint64_t t0 = monotonicUs();
+
+  for (size_t bi = 0; bi < rd.blocks(); bi++) {
+    ColumnReader::Block b = rd.block(bi);
+    for (uint32_t r = 0; r < b.rows; r++) {
+      if ((b.rowMask[r] & TLM_REPLAY_MASK) != TLM_REPLAY_MASK) {
+        continue;
+      }
+      uint32_t dt = b.timeMs[r] - prevMs;
+      if (!started || dt > maxGap) {                    // First row or lost data: start over from this row
+        ctrlInit();
+        setInputs(b, r);
+        ctrlStep();
+        started = true;
+        prevMs  = b.timeMs[r];
+        restarts++;
+        continue;
+      }
+      uint32_t n = (uint32_t)((uint64_t)dt * ctrlPwmFreq / 1000u);
+      for (uint32_t k = 1; k < n; k++) {                // Hold the previous inputs
+        ctrlStep();
+      }
+      setInputs(b, r);
+      ctrlStep();
+      steps += n ? n : 1;
+      prevMs = b.timeMs[r];
+      rows++;
+
+      for (int side = 0; side < 2; side++) {
+        const ExtY &y = side ? rtY_Right : rtY_Left;
+        int16_t rec[CMP_NUM];
+        for (int k = 0; k < CMP_NUM; k++) {
+          const int16_t *col = b.field[cmpField[side][k]];
+          bool have = col && (b.rowMask[r] & (1UL << cmpField[side][k]));
+          rec[k] = have ? col[r] : 0;
+          if (!have) continue;
+          double d = (double)output(y, k) - rec[k];
+          if (k == CMP_ANGLE) {                         // a_elecAngle wraps at 360 deg, fixdt(1,16,6)
+            d = std::remainder(d, 360.0 * 64.0);
+          }
+          stat[side][k].add(d);
+        }
+        const int16_t *errCol = b.field[side ? TLM_ERR_R : TLM_ERR_L];
+        int16_t errRec = errCol ? errCol[r] : 0;
+        if (errCol && errRec != y.z_errCode) {
+          if (!errMismatch++) firstErrMs = b.timeMs[r];
+        }
+        if (out) {
+          std::fprintf(out, "%u,%c", b.timeMs[r], side ? 'R' : 'L');
+          for (int k = 0; k < CMP_NUM; k++) std::fprintf(out, ",%d,%d", output(y, k), rec[k]);
+          std::fprintf(out, ",%d,%d\n", y.z_errCode, errRec);
+        }
+      }
+    }
+  }
+  if (out && out != stdout) std::fclose(out);
+  else if (out)             std::fflush(out);
+
+  double secs = (monotonicUs() - t0) / 1e6;
+  std::fprintf(stderr, "hoverreplay: %llu rows, %llu controller steps, %llu restarts, %.2f s (%.0f rows/s)\n",
+               (unsigned long long)rows, (unsigned long long)steps, (unsigned long long)restarts, secs, secs > 0 ? rows / secs : 0.0);
+  for (int side = 0; side < 2; side++) {
+    for (int k = 0; k < CMP_NUM; k++) {
+      const CmpStat &s = stat[side][k];
+      if (!s.n) continue;
+      std::fprintf(stderr, "  %c %-6s rms %8.1f  max %8.0f\n", side ? 'R' : 'L', cmpNames[k], std::sqrt(s.sumSq / s.n), s.maxAbs);
+    }
+  }
+  if (errMismatch) {
+    std::fprintf(stderr, "  error code differs in %llu rows, first at %u ms\n", (unsigned long long)errMismatch, (unsigned)firstErrMs);
+  }
+  return 0;
+}
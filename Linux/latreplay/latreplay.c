@@ -0,0 +1,245 @@
+// *******************************************************************
+//  latreplay: replays command arrival times through the input-to-PWM latency measurement (Src/latency.c)
+//  for   https://github.com/EmanuelFeru/hoverboard-firmware-hack-FOC
+//
+// *******************************************************************
+// The firmware latency.c is built for the host with LATENCY_MEASURE. The DWT and CoreDebug registers are mapped at
+// their real address, and the simulated time in CPU cycles is written to DWT->CYCCNT before every call, so the
+// firmware code runs unchanged on a simulated timeline:
+//  - the 16 kHz DMA interrupt calls latencyStep()
+//  - the main loop starts every LOOP_TICKS interrupts and calls latencyStage() for READ, FILTER, MIXER and PWM
+//    at the given offsets from the loop start
+//  - the command arrivals, read from a file (one time in us per line) or generated with a period and a jitter,
+//    call latencyArrive()
+// The same timeline is evaluated exactly by the harness. At every LAT_HIST_WINDOW commands the firmware
+// percentiles are compared with the exact ones: the firmware reports the upper edge of the LAT_HIST_RES bin,
+// so each must lie in [exact, exact + LAT_HIST_RES]. The exit code is 1 when a window fails.
+//   make && ./latreplay [-f arrivals.txt] [-p period_us] [-j jitter_us] [-n count] [-s read,filter,mixer,pwm] [-l loop_ticks]
+// *******************************************************************
+
+#define _GNU_SOURCE
+#include "stm32f1xx_hal.h"
+#include "defines.h"
+#include "config.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define CPU_HZ        64000000U
+#define ISR_CYCLES    (CPU_HZ / 16000U)                     // DMA interrupt period, 16 kHz
+#define SCS_REGION    0xE0000000UL                          // DWT, CoreDebug and the rest of the private peripheral bus
+#define SCS_SIZE      0x00010000UL
+
+uint32_t SystemCoreClock = CPU_HZ;
+uint8_t  inIdx;
+
+extern uint16_t latP50, latP90, latP99, latMax;
+extern uint16_t latStageUs[];
+
+static uint64_t *arrivals;                                  // [cycles]
+static uint32_t  nArrivals;
+static uint32_t *exact;                                     // [us] exact arrival-to-step latency of each command
+static uint32_t  nExact;
+
+static void now(uint64_t t)
+{
+  DWT->CYCCNT = (uint32_t)t;                                // wraps like the hardware counter
+}
+
+static int cmpU32(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Same rank as latencyPercentile(): the ceil(n * pct / 100)-th smallest value
+static uint32_t percentile(const uint32_t *sorted, uint32_t n, uint32_t pct)
+{
+  uint32_t rank = (n * pct + 99) / 100;
+  return sorted[rank ? rank - 1 : 0];
+}
+
+static int checkWindow(uint32_t w, const uint32_t *lat, uint32_t n)
+{
+  static const uint32_t pcts[3] = {50, 90, 99};
+  uint16_t fw[4] = {latP50, latP90, latP99, latMax};
+  uint32_t ex[4];
+  uint32_t *s = malloc(n * sizeof(*s));
+  int ok = 1;
+
+  memcpy(s, lat, n * sizeof(*s));
+  qsort(s, n, sizeof(*s), cmpU32);
+  for (int i = 0; i < 3; i++) {
+    ex[i] = percentile(s, n, pcts[i]);
+  }
+  ex[3] = s[n - 1];
+  free(s);
+
+  for (int i = 0; i < 4; i++) {
+    if (fw[i] < ex[i] || fw[i] > ex[i] + LAT_HIST_RES) {
+      ok = 0;
+    }
+  }
+  printf("window %3u  fw P50 %5u P90 %5u P99 %5u max %5u  exact P50 %5u P90 %5u P99 %5u max %5u  %s\n",
+         w, fw[0], fw[1], fw[2], fw[3], ex[0], ex[1], ex[2], ex[3], ok ? "ok" : "FAIL");
+  return ok;
+}
+
+static void loadFile(const char *name)
+{
+  FILE *f = fopen(name, "r");
+  double us;
+  uint32_t cap = 1024;
+
+  if (!f) {
+    perror(name);
+    exit(2);
+  }
+  arrivals = malloc(cap * sizeof(*arrivals));
+  while (fscanf(f, "%lf", &us) == 1) {
+    if (nArrivals == cap) {
+      cap *= 2;
+      arrivals = realloc(arrivals, cap * sizeof(*arrivals));
+    }
+    arrivals[nArrivals++] = (uint64_t)(us * (CPU_HZ / 1000000U));
+  }
+  fclose(f);
+}
+
+static void generate(uint32_t n, uint32_t periodUs, uint32_t jitterUs)
+{
+  arrivals = malloc(n * sizeof(*arrivals));
+  nArrivals = n;
+  srand(1);
+  for (uint32_t i = 0; i < n; i++) {
+    uint64_t us = (uint64_t)(i + 1) * periodUs + (jitterUs ? (uint32_t)rand() % jitterUs : 0);
+    arrivals[i] = us * (CPU_HZ / 1000000U);
+  }
+  for (uint32_t i = 1; i < n; i++) {                        // jitter larger than the period can reorder them
+    for (uint32_t j = i; j > 0 && arrivals[j] < arrivals[j - 1]; j--) {
+      uint64_t t = arrivals[j]; arrivals[j] = arrivals[j - 1]; arrivals[j - 1] = t;
+    }
+  }
+}
+
+int main(int argc, char **argv)
+{
+  const char *file = NULL;
+  uint32_t periodUs = 20000, jitterUs = 0, count = 20000, loopTicks = 16 * DELAY_IN_MAIN_LOOP + 1;
+  uint32_t stageUs[LAT_STAGES] = {[LAT_READ] = 20, [LAT_FILTER] = 150, [LAT_MIXER] = 180, [LAT_PWM] = 200};  // [us] from the loop start
+  int opt;
+
+  while ((opt = getopt(argc, argv, "f:p:j:n:s:l:")) != -1) {
+    switch (opt) {
+      case 'f': file      = optarg; break;
+      case 'p': periodUs  = strtoul(optarg, NULL, 0); break;
+      case 'j': jitterUs  = strtoul(optarg, NULL, 0); break;
+      case 'n': count     = strtoul(optarg, NULL, 0); break;
+      case 'l': loopTicks = strtoul(optarg, NULL, 0); break;
+      case 's':
+        if (sscanf(optarg, "%u,%u,%u,%u", &stageUs[LAT_READ], &stageUs[LAT_FILTER], &stageUs[LAT_MIXER], &stageUs[LAT_PWM]) != 4) {
+          fprintf(stderr, "latreplay: -s needs read,filter,mixer,pwm in us\n");
+          return 2;
+        }
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-f arrivals.txt] [-p period_us] [-j jitter_us] [-n count] [-s read,filter,mixer,pwm] [-l loop_ticks]\n", argv[0]);
+        return 2;
+    }
+  }
+  for (int i = LAT_FILTER; i <= LAT_PWM; i++) {
+    if (stageUs[i] < stageUs[i - 1]) {
+      fprintf(stderr, "latreplay: stage offsets must not decrease\n");
+      return 2;
+    }
+  }
+  if (stageUs[LAT_PWM] * (CPU_HZ / 1000000U) >= (uint64_t)loopTicks * ISR_CYCLES) {
+    fprintf(stderr, "latreplay: the main loop must end before the next one starts\n");
+    return 2;
+  }
+
+  if (mmap((void *)SCS_REGION, SCS_SIZE, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0) != (void *)SCS_REGION) {
+    perror("latreplay: DWT mapping at 0xE0000000");         // needs a non-PIE build, see Makefile
+    return 2;
+  }
+  if (file) {
+    loadFile(file);
+  } else {
+    generate(count, periodUs, jitterUs);
+  }
+  if (!nArrivals) {
+    fprintf(stderr, "latreplay: no arrivals\n");
+    return 2;
+  }
+  exact = malloc(nArrivals * sizeof(*exact));
+
+  latencyInit();
+
+  // Exact model of the measurement: latest arrival before READ, consumed by the first interrupt after PWM
+  uint64_t lastArrival = 0, cmdArrival = 0;
+  int arrivalNew = 0, cmdValid = 0, cmdPending = 0;
+  uint32_t a = 0, stage = LAT_STAGES, windows = 0, fails = 0;
+  uint64_t tick = 0, loopStart = 0;
+  uint64_t end = arrivals[nArrivals - 1] + 2ULL * loopTicks * ISR_CYCLES;
+
+  while (tick * ISR_CYCLES <= end) {
+    uint64_t tIsr   = tick * ISR_CYCLES;
+    uint64_t tStage = stage < LAT_STAGES ? loopStart + (uint64_t)stageUs[stage] * (CPU_HZ / 1000000U) : UINT64_MAX;
+    uint64_t tArr   = a < nArrivals ? arrivals[a] : UINT64_MAX;
+
+    if (tArr <= tStage && tArr < tIsr) {                    // command arrival
+      now(tArr);
+      latencyArrive();
+      lastArrival = tArr;
+      arrivalNew  = 1;
+      a++;
+    } else if (tStage < tIsr) {                             // main loop stage
+      now(tStage);
+      latencyStage((uint8_t)stage);
+      if (stage == LAT_READ) {
+        cmdPending  = 0;
+        cmdValid    = arrivalNew;
+        arrivalNew  = 0;
+        cmdArrival  = lastArrival;
+      } else if (stage == LAT_PWM) {
+        cmdPending  = cmdValid;
+      }
+      stage = stage == LAT_PWM ? LAT_STAGES : stage + 1;
+    } else {                                                // DMA interrupt
+      now(tIsr);
+      latencyStep();
+      if (cmdPending) {
+        cmdPending = 0;
+        exact[nExact++] = (uint32_t)MIN((tIsr - cmdArrival) / (CPU_HZ / 1000000U), UINT16_MAX);
+      }
+      if (tick % loopTicks == 0) {
+        loopStart = tIsr;
+        stage     = LAT_READ;
+      }
+      tick++;
+    }
+
+    // The firmware records a command at the READ after its step, the window percentiles are then updated
+    if (stage == LAT_FILTER && nExact >= (windows + 1) * LAT_HIST_WINDOW) {
+      if (!checkWindow(windows, &exact[windows * LAT_HIST_WINDOW], LAT_HIST_WINDOW)) {
+        fails++;
+      }
+      windows++;
+    }
+  }
+
+  qsort(exact, nExact, sizeof(*exact), cmpU32);
+  printf("arrivals %u  commands %u  windows %u  failed %u\n", nArrivals, nExact, windows, fails);
+  if (nExact) {
+    printf("all commands  P50 %u  P90 %u  P99 %u  max %u us\n",
+           percentile(exact, nExact, 50), percentile(exact, nExact, 90), percentile(exact, nExact, 99), exact[nExact - 1]);
+    printf("last command  read %u  filter %u  mixer %u  pwm %u  step %u us\n",
+           latStageUs[LAT_READ], latStageUs[LAT_FILTER], latStageUs[LAT_MIXER], latStageUs[LAT_PWM], latStageUs[LAT_STEP]);
+  }
+  return fails ? 1 : 0;
+}
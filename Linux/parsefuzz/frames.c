@@ -0,0 +1,73 @@
+/*
+ * Valid input frames of the firmware serial parsers, see frames.h
+ */
+
+#include "frames.h"
+
+#include <string.h>
+
+// CRC16 CCITT-FALSE, written again here so that a wrong calcCRC16() of the firmware is not hidden
+static uint16_t crc16(const uint8_t *data, size_t len) {
+  uint16_t crc = 0xFFFF;
+  while (len--) {
+    crc ^= (uint16_t)*data++ << 8;
+    for (int i = 0; i < 8; i++) {
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+size_t tlvFrame(uint8_t *frame, const uint8_t *records, uint8_t len) {
+  uint16_t crc;
+  frame[0] = 0xCD;
+  frame[1] = 0xAB;
+  frame[2] = 1;                                                   // SERIAL_CMD_VERSION
+  frame[3] = len;
+  memcpy(&frame[4], records, len);
+  crc = crc16(frame, 4 + len);
+  frame[4 + len] = (uint8_t)crc;
+  frame[5 + len] = (uint8_t)(crc >> 8);
+  return 6 + len;
+}
+
+size_t dbgBinFrame(uint8_t *frame, const uint8_t *data, uint8_t len) {
+  uint16_t crc;
+  frame[0] = 0xCD;
+  frame[1] = 0xAB;
+  frame[2] = 1;                                                   // DEBUG_BIN_VERSION
+  frame[3] = len;
+  frame[4] = 0;
+  memcpy(&frame[5], data, len);
+  crc = crc16(frame, 5 + len);
+  frame[5 + len] = (uint8_t)crc;
+  frame[6 + len] = (uint8_t)(crc >> 8);
+  return 7 + len;
+}
+
+size_t ibusFrame(uint8_t *frame, uint16_t ch1, uint16_t ch2) {
+  uint16_t sum = 0xFFFF;
+  frame[0] = 0x20;                                                // IBUS_LENGTH
+  frame[1] = 0x40;                                                // IBUS_COMMAND
+  for (int i = 0; i < 14; i++) {
+    uint16_t ch = i == 0 ? ch1 : i == 1 ? ch2 : 1500;
+    frame[2 + 2 * i] = (uint8_t)ch;
+    frame[3 + 2 * i] = (uint8_t)(ch >> 8);
+  }
+  for (int i = 0; i < 30; i++) {
+    sum -= frame[i];
+  }
+  frame[30] = (uint8_t)sum;
+  frame[31] = (uint8_t)(sum >> 8);
+  return 32;
+}
+
+size_t sideboardFrame(uint8_t *frame, int16_t cmd1, int16_t cmd2, uint16_t sensors) {
+  uint16_t w[7] = {0xABCD, 0, 0, (uint16_t)cmd1, (uint16_t)cmd2, sensors, 0};
+  w[6] = w[0] ^ w[1] ^ w[2] ^ w[3] ^ w[4] ^ w[5];
+  for (int i = 0; i < 7; i++) {
+    frame[2 * i]     = (uint8_t)w[i];
+    frame[2 * i + 1] = (uint8_t)(w[i] >> 8);
+  }
+  return 14;
+}
@@ -0,0 +1,15 @@
+/*
+ * Valid input frames of the firmware serial parsers, the seeds of parsefuzz and the streams of parsebench
+ */
+#ifndef FRAMES_H
+#define FRAMES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+size_t tlvFrame(uint8_t *frame, const uint8_t *records, uint8_t len);        // TLV command frame (usart_parse_command)
+size_t dbgBinFrame(uint8_t *frame, const uint8_t *data, uint8_t len);         // binary debug request (comms.c)
+size_t ibusFrame(uint8_t *frame, uint16_t ch1, uint16_t ch2);                 // 14 channel iBUS frame, the others at 1500
+size_t sideboardFrame(uint8_t *frame, int16_t cmd1, int16_t cmd2, uint16_t sensors);
+
+#endif
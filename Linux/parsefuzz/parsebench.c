@@ -0,0 +1,124 @@
+// *******************************************************************
+//  parsebench: throughput of the firmware serial and debug protocol parsers in bytes per second
+//  for   https://github.com/EmanuelFeru/hoverboard-firmware-hack-FOC
+//
+// *******************************************************************
+// Built per configuration like parsefuzz. Each stream of the configuration is passed through the same path as on the
+// board: the bytes are written into the USART Rx DMA ring and usartX_rx_check() runs for every IDLE event, one per
+// frame or text line. The debug output is sent between the lines, a main loop pass follows every 8 frames.
+//   ./parsebench_<config> [MB per stream]
+// *******************************************************************
+
+#define _GNU_SOURCE
+#include "stm32f1xx_hal.h"
+#include "defines.h"
+#include "config.h"
+#include "util.h"
+#include "hostfw.h"
+#include "frames.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static int failed;
+
+// Passes the frame repeatedly until total bytes went through, prints the throughput. With check, every frame must be
+// accepted by the TLV command parser (its counters are 16 bit, compared modulo 65536)
+static void run(const char *name, uint8_t port, const uint8_t *frame, size_t len, size_t total, int check) {
+  HostRxStats s0, s1;
+  size_t done = 0;
+  uint32_t frames = 0;
+  double t0, dt;
+
+  hostRxStats(port, &s0);
+  t0 = now();
+  while (done < total) {
+    hostRx(port, frame, len);
+    hostTx(2, NULL, 0);
+    hostTx(3, NULL, 0);
+    if (++frames % 8 == 0) {
+      hostLoop();
+    }
+    done += len;
+  }
+  dt = now() - t0;
+  hostRxStats(port, &s1);
+  fprintf(stderr, "%-24s %3zu bytes/frame %8.2f MB/s %9.0f frames/s", name, len, done / dt / 1e6, frames / dt);
+  if (check && ((uint16_t)(s1.ok - s0.ok) != (uint16_t)frames || s1.errCrc != s0.errCrc || s1.errFmt != s0.errFmt)) {
+    fprintf(stderr, "  FAIL: frames rejected by the parser");
+    failed = 1;
+  }
+  fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv) {
+  size_t  total = (argc > 1 ? strtoul(argv[1], NULL, 0) : 16) << 20;
+  uint8_t f[160], junk[32];
+  size_t  n;
+
+  hostInit();
+  memset(junk, 0x55, sizeof(junk));
+  fprintf(stderr, "parsebench " PARSEFUZZ_CONFIG ": %zu MB per stream\n", total >> 20);
+
+  #if (defined(CONTROL_SERIAL_USART2) || defined(CONTROL_SERIAL_USART3)) && !defined(CONTROL_IBUS)
+  {
+    #ifdef CONTROL_SERIAL_USART2
+    const uint8_t port = 2;
+    #else
+    const uint8_t port = 3;
+    #endif
+    static const uint8_t steer[]  = {1, 4, 10, 0, 20, 0};
+    static const uint8_t full[]   = {1, 4, 10, 0, 20, 0,  2, 4, 1, 0, 2, 0,  3, 1, 2,  4, 1, 1,  6, 5, 0xFF, 0, 0, 0, 1};
+    n = tlvFrame(f, steer, sizeof(steer));  run("TLV steer/speed", port, f, n, total, 1);
+    n = tlvFrame(f, full, sizeof(full));    run("TLV 5 records", port, f, n, total, 1);
+    #ifdef SERIAL_MULTIDROP
+    static const uint8_t other[]  = {7, 1, 9,  1, 4, 10, 0, 20, 0};
+    n = tlvFrame(f, other, sizeof(other));  run("TLV for another node", port, f, n, total, 0);
+    #endif
+    run("garbage", port, junk, sizeof(junk), total, 0);
+  }
+  #endif
+
+  #ifdef CONTROL_IBUS
+  n = ibusFrame(f, 1200, 1800);
+  #ifdef CONTROL_SERIAL_USART2
+  run("iBUS", 2, f, n, total, 0);
+  #else
+  run("iBUS", 3, f, n, total, 0);
+  #endif
+  #endif
+
+  #if defined(SIDEBOARD_SERIAL_USART2) || defined(SIDEBOARD_SERIAL_USART3)
+  n = sideboardFrame(f, 100, -200, SWA_SET);
+  #ifdef SIDEBOARD_SERIAL_USART2
+  run("sideboard USART2", 2, f, n, total, 0);
+  #endif
+  #ifdef SIDEBOARD_SERIAL_USART3
+  run("sideboard USART3", 3, f, n, total, 0);
+  #endif
+  #endif
+
+  #if defined(DEBUG_SERIAL_PROTOCOL) && (defined(DEBUG_SERIAL_USART2) || defined(DEBUG_SERIAL_USART3))
+  {
+    #ifdef DEBUG_SERIAL_USART2
+    const uint8_t port = 2;
+    #else
+    const uint8_t port = 3;
+    #endif
+    static const uint8_t get[] = {2, 1, 5};                      // values request of one parameter
+    const char *line = "GET SPEED_COEF\r\n";
+    run("debug text GET", port, (const uint8_t *)line, strlen(line), total, 0);
+    n = dbgBinFrame(f, get, sizeof(get));
+    run("debug binary GET", port, f, n, total, 0);
+  }
+  #endif
+  return failed;
+}
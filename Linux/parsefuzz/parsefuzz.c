@@ -0,0 +1,245 @@
+// *******************************************************************
+//  parsefuzz: fuzz harness of the firmware serial and debug protocol parsers
+//  for   https://github.com/EmanuelFeru/hoverboard-firmware-hack-FOC
+//
+// *******************************************************************
+// The firmware util.c and comms.c are built for the host with the HAL of ../fwhost, once per configuration (Makefile),
+// so each build covers other parsers:
+//  - usart:     TLV commands on USART2 (usart_parse_command, usart_process_command), debug text and binary on USART3
+//               (usart_process_debug, handle_input, process_debug)
+//  - multidrop: TLV commands with node IDs and time sync on USART2 and USART3 (SERIAL_MULTIDROP, SERIAL_SYNC)
+//  - ibus:      iBUS frames and their checksum on USART3 (CONTROL_IBUS)
+//  - sideboard: sideboard frames on USART2 and USART3 (usart_process_sideboard)
+// The input is a list of records | op (2 bits) len (6 bits) | len bytes |, ops:
+//  0: bytes received on USART2, 1: bytes received on USART3 (Rx DMA ring and IDLE interrupt: usartX_rx_check)
+//  2: a debug text line passed to handle_input(), 3: one main loop pass (readCommand, telemetry, process_debug)
+// Builds:
+//  - make:                          standalone mutation driver with ASan and UBSan, replays files given as arguments
+//  - make FUZZER=libfuzzer CC=clang: libFuzzer, LLVMFuzzerTestOneInput() only
+//  - AFL:   make CC=afl-clang-fast, then afl-fuzz -i corpus -o out -- ./parsefuzz_usart @@ (corpus: ./parsefuzz_usart -c corpus)
+//   ./parsefuzz_<config> [-n iterations] [-s seed] [-c corpus_dir] [file...]
+// A failing input of the standalone driver is written to crash-<config>.bin.
+// *******************************************************************
+
+#define _GNU_SOURCE
+#include "stm32f1xx_hal.h"
+#include "defines.h"
+#include "config.h"
+#include "util.h"
+#include "hostfw.h"
+#include "frames.h"
+#ifdef DEBUG_SERIAL_PROTOCOL
+#include "comms.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define INPUT_MAX_LEN 4096
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  static uint8_t init;
+  uint8_t line[64];
+  size_t  i = 0, n;
+
+  if (!init) {
+    hostInit();
+    init = 1;
+  }
+  while (i < size) {
+    uint8_t op = data[i] >> 6;
+    n = data[i++] & 0x3F;
+    if (n > size - i) {
+      n = size - i;
+    }
+    switch (op) {
+      case 0:
+        hostRx(2, &data[i], n);
+        break;
+      case 1:
+        hostRx(3, &data[i], n);
+        break;
+      case 2:
+        #ifdef DEBUG_SERIAL_PROTOCOL
+        memcpy(line, &data[i], n);                                // handle_input() may write into the line
+        handle_input(line, n);
+        #endif
+        break;
+      default:
+        hostLoop();
+        #ifdef DEBUG_SERIAL_PROTOCOL
+        process_debug();
+        #endif
+        break;
+    }
+    i += n;
+    hostTx(2, NULL, 0);                                           // the UARTs keep sending
+    hostTx(3, NULL, 0);
+  }
+  return 0;
+}
+
+#ifndef PARSEFUZZ_LIBFUZZER
+static uint8_t seeds[64][256];
+static size_t  seedLen[64];
+static int     seedNum;
+static uint8_t input[INPUT_MAX_LEN];
+static size_t  inputLen;
+
+// Seed: data on a port in records of up to 63 bytes, followed by a main loop pass
+static void addSeed(uint8_t op, const void *data, size_t len) {
+  const uint8_t *d = data;
+  uint8_t *s = seeds[seedNum];
+  size_t   o = 0, k;
+
+  while (len) {
+    k = len > 63 ? 63 : len;
+    s[o++] = (uint8_t)(op << 6 | k);
+    memcpy(&s[o], d, k);
+    o   += k;
+    d   += k;
+    len -= k;
+  }
+  s[o++] = 3 << 6;
+  seedLen[seedNum++] = o;
+}
+
+static void addSeeds(void) {
+  static const uint8_t cmd1[] = {1, 4, 10, 0, 20, 0,  2, 4, 1, 0, 2, 0,  3, 1, 2,  4, 1, 1};
+  static const uint8_t cmd2[] = {5, 5, 3, 1, 0, 0, 0,  6, 5, 0xFF, 0, 0, 0, 1,  7, 1, 0,  8, 4, 1, 2, 3, 4,  9, 4, 5, 6, 7, 8};
+  static const uint8_t cmd3[] = {7, 1, 0xFF,  2, 4, 0x10, 0, 0x20, 0,  8, 4, 0, 0, 1, 0};
+  static const uint8_t bin1[] = {0, 1, 0};                       // schema request
+  static const uint8_t bin2[] = {3, 6, 2, 5, 0, 0, 0, 0};        // set request
+  static const char *const text[] = {"GET\r\n", "SET I_MOT_MAX 12\n", "GET SPEED_COEF\n", "SAVE\n", "HELP\n",
+                                     "SET TLM_FIELDS 1\n", "WATCH I_MOT_MAX\n"};
+  uint8_t f[128];
+  size_t  n;
+
+  n = tlvFrame(f, cmd1, sizeof(cmd1));  addSeed(0, f, n);  addSeed(1, f, n);
+  n = tlvFrame(f, cmd2, sizeof(cmd2));  addSeed(0, f, n);  addSeed(1, f, n);
+  n = tlvFrame(f, cmd3, sizeof(cmd3));  addSeed(0, f, n);  addSeed(1, f, n);
+  for (size_t i = 0; i < sizeof(text) / sizeof(text[0]); i++) {
+    addSeed(1, text[i], strlen(text[i]));
+    addSeed(2, text[i], strlen(text[i]));
+  }
+  n = dbgBinFrame(f, bin1, sizeof(bin1));  addSeed(1, f, n);
+  n = dbgBinFrame(f, bin2, sizeof(bin2));  addSeed(1, f, n);
+  n = ibusFrame(f, 1200, 1800);            addSeed(0, f, n);  addSeed(1, f, n);
+  n = sideboardFrame(f, 100, -200, SWA_SET); addSeed(0, f, n); addSeed(1, f, n);
+}
+
+static void writeFile(const char *name, const uint8_t *data, size_t len) {
+  FILE *f = fopen(name, "wb");
+  if (f) {
+    fwrite(data, 1, len, f);
+    fclose(f);
+  }
+}
+
+// Sanitizer reports end the process, the input is saved first
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/common_interface_defs.h>
+
+static const char *crashFile = "crash-" PARSEFUZZ_CONFIG ".bin";
+
+static void onCrash(void) {
+  writeFile(crashFile, input, inputLen);
+  fprintf(stderr, "parsefuzz: input written to %s\n", crashFile);
+}
+#endif
+
+// A few seeds joined, then up to 8 mutations
+static void mutate(void) {
+  static const uint8_t special[] = {0xCD, 0xAB, 0x20, 0x40, 0xFF, 0x00, 0x01, '\n', '$', 3 << 6};
+  int parts = 1 + rand() % 6, muts = rand() % 8, k;
+  size_t pos;
+
+  inputLen = 0;
+  for (int p = 0; p < parts; p++) {
+    k = rand() % seedNum;
+    if (inputLen + seedLen[k] <= sizeof(input)) {
+      memcpy(&input[inputLen], seeds[k], seedLen[k]);
+      inputLen += seedLen[k];
+    }
+  }
+  for (int m = 0; m < muts && inputLen; m++) {
+    pos = rand() % inputLen;
+    switch (rand() % 5) {
+      case 0:  input[pos] ^= 1 << (rand() % 8);  break;
+      case 1:  input[pos]  = rand();             break;
+      case 2:
+        if (inputLen < sizeof(input)) {
+          memmove(&input[pos + 1], &input[pos], inputLen - pos);
+          input[pos] = rand();
+          inputLen++;
+        }
+        break;
+      case 3:
+        memmove(&input[pos], &input[pos + 1], inputLen - pos - 1);
+        inputLen--;
+        break;
+      default: input[pos] = special[rand() % sizeof(special)];  break;
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  long     iterations = 1000000;
+  unsigned seed = (unsigned)time(NULL);
+  const char *corpus = NULL;
+  int      opt;
+
+  while ((opt = getopt(argc, argv, "n:s:c:")) != -1) {
+    switch (opt) {
+      case 'n': iterations = strtol(optarg, NULL, 0);            break;
+      case 's': seed       = (unsigned)strtoul(optarg, NULL, 0); break;
+      case 'c': corpus     = optarg;                             break;
+      default:
+        fprintf(stderr, "usage: %s [-n iterations] [-s seed] [-c corpus_dir] [file...]\n", argv[0]);
+        return 2;
+    }
+  }
+  #ifdef __SANITIZE_ADDRESS__
+  __sanitizer_set_death_callback(onCrash);
+  #endif
+  addSeeds();
+
+  if (corpus) {                                                   // seed corpus for AFL or libFuzzer
+    char name[256];
+    mkdir(corpus, 0755);
+    for (int k = 0; k < seedNum; k++) {
+      snprintf(name, sizeof(name), "%s/seed%02d", corpus, k);
+      writeFile(name, seeds[k], seedLen[k]);
+    }
+    fprintf(stderr, "%d seeds written to %s\n", seedNum, corpus);   // stdout is the firmware debug output
+    return 0;
+  }
+
+  if (optind < argc) {                                            // replay
+    for (int a = optind; a < argc; a++) {
+      FILE *f = fopen(argv[a], "rb");
+      if (!f) {
+        perror(argv[a]);
+        return 2;
+      }
+      inputLen = fread(input, 1, sizeof(input), f);
+      fclose(f);
+      LLVMFuzzerTestOneInput(input, inputLen);
+    }
+    return 0;
+  }
+
+  fprintf(stderr, "parsefuzz " PARSEFUZZ_CONFIG ": %ld iterations, seed %u\n", iterations, seed);
+  srand(seed);
+  for (long it = 0; it < iterations; it++) {
+    mutate();
+    LLVMFuzzerTestOneInput(input, inputLen);
+  }
+  fprintf(stderr, "parsefuzz " PARSEFUZZ_CONFIG ": done\n");
+  return 0;
+}
+#endif
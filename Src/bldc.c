@@ -27,6 +27,7 @@
 #include "setup.h"
 #include "config.h"
 #include "util.h"
+#include "filter.h"
 
 // Matlab includes and defines - from auto-code generation
 // ###############################################################################
@@ -57,13 +58,32 @@ volatile int pwml = 0;
 volatile int pwmr = 0;
 
 extern volatile adc_buf_t adc_buffer;
+#if defined(LATENCY_MEASURE) && defined(CONTROL_ADC)
+extern uint8_t inIdx;
+static int16_t latTx2Ref, latRx2Ref;    // ADC pedal values of the last stamped command
+#endif
+#ifdef IDLE_LOW_POWER
+extern volatile uint8_t idleMode;
+extern volatile uint8_t idleWake;
+static uint8_t idleHalls = 0xFF;
+static uint8_t idleStep     = 1;        // [PWM periods] since the last ADC conversion, IDLE_ADC_DIV while idle
+static uint8_t idleStepNext = 1;        // [PWM periods] from the next conversion on: the repetition counter is preloaded
+#endif
+#ifdef SERIAL_SYNC
+extern volatile uint8_t  syncSched;
+extern volatile uint32_t syncSchedTick;
+extern volatile int syncPwmL;
+extern volatile int syncPwmR;
+#endif
 
 uint8_t buzzerFreq          = 0;
-uint8_t buzzerPattern       = 0;
-uint8_t buzzerCount         = 0;
 volatile uint32_t buzzerTimer = 0;
 static uint8_t  buzzerPrev  = 0;
-static uint8_t  buzzerIdx   = 0;
+
+#ifdef FEEDBACK_TELEMETRY
+volatile uint16_t isrCycles;            // [cycles] duration of the last motor control step
+volatile uint16_t isrCyclesMax;         // [cycles] longest motor control step since the last telemetry frame
+#endif
 
 uint8_t        enable       = 0;        // initially motors are disabled for SAFETY
 static uint8_t enableFin    = 0;
@@ -81,6 +101,14 @@ static int16_t offsetdcr    = 2000;
 int16_t        batVoltage       = (400 * BAT_CELLS * BAT_CALIB_ADC) / BAT_CALIB_REAL_VOLTAGE;
 static int32_t batVoltageFixdt  = (400 * BAT_CELLS * BAT_CALIB_ADC) / BAT_CALIB_REAL_VOLTAGE << 16;  // Fixed-point filter output initialized at 400 V*100/cell = 4 V/cell converted to fixed-point
 
+#if defined(ADC_INPUT_MEDIAN) && defined(CONTROL_ADC)
+volatile int16_t adcTx2Filt;            // adc_buffer.l_tx2 after the glitch filter
+volatile int16_t adcRx2Filt;            // adc_buffer.l_rx2 after the glitch filter
+static Median5   adcTx2Med, adcRx2Med;
+static MovAvg16  adcTx2Avg = {.log2Len = ADC_INPUT_AVG_LOG2};
+static MovAvg16  adcRx2Avg = {.log2Len = ADC_INPUT_AVG_LOG2};
+#endif
+
 // =================================
 // DMA interrupt frequency =~ 16 kHz
 // =================================
@@ -90,6 +118,12 @@ void DMA1_Channel1_IRQHandler(void) {
   // HAL_GPIO_WritePin(LED_PORT, LED_PIN, 1);
   // HAL_GPIO_TogglePin(LED_PORT, LED_PIN);
 
+  #if defined(ADC_INPUT_MEDIAN) && defined(CONTROL_ADC)
+  // Glitch filter of the ADC inputs at the ADC rate, running from the first sample: median of 5, then moving average
+  adcTx2Filt = filtMovAvg16(filtMedian5(adc_buffer.l_tx2, &adcTx2Med), &adcTx2Avg);
+  adcRx2Filt = filtMovAvg16(filtMedian5(adc_buffer.l_rx2, &adcRx2Med), &adcRx2Avg);
+  #endif
+
   if(offsetcount < 2000) {  // calibrate ADC offsets
     offsetcount++;
     offsetrlA = (adc_buffer.rlA + offsetrlA) / 2;
@@ -101,6 +135,21 @@ void DMA1_Channel1_IRQHandler(void) {
     return;
   }
 
+  #if defined(LATENCY_MEASURE) && defined(CONTROL_ADC)
+  if (inIdx == CONTROL_ADC) {     // a pedal move of at least LAT_ADC_STEP counts is a new command
+    #ifdef ADC_INPUT_MEDIAN
+    int16_t latTx2 = adcTx2Filt, latRx2 = adcRx2Filt;
+    #else
+    int16_t latTx2 = adc_buffer.l_tx2, latRx2 = adc_buffer.l_rx2;
+    #endif
+    if (ABS(latTx2 - latTx2Ref) >= LAT_ADC_STEP || ABS(latRx2 - latRx2Ref) >= LAT_ADC_STEP) {
+      latTx2Ref = latTx2;
+      latRx2Ref = latRx2;
+      latencyArrive();
+    }
+  }
+  #endif
+
   if (buzzerTimer % 1000 == 0) {  // Filter battery voltage at a slower sampling rate
     filtLowPass32(adc_buffer.batt1, BAT_FILT_COEF, &batVoltageFixdt);
     batVoltage = (int16_t)(batVoltageFixdt >> 16);  // convert fixed-point to integer
@@ -116,30 +165,54 @@ void DMA1_Channel1_IRQHandler(void) {
   curR_phaC = (int16_t)(offsetrrC - adc_buffer.rrC);
   curR_DC   = (int16_t)(offsetdcr - adc_buffer.dcr);
 
+  uint8_t pwmOff = enable == 0;
+  #ifdef IDLE_LOW_POWER
+  if (enable && idleMode) {       // leave the idle mode before MOE is restored, so the controller runs from the first enabled period
+    idleMode  = 0;
+    idleWake  = 1;
+  }
+  uint8_t idleSlow = idleStep != 1;   // still at the idle ADC rate: no PWM and no controller step until the full rate is back
+  pwmOff |= idleSlow;
+  #endif
+
   // Disable PWM when current limit is reached (current chopping)
   // This is the Level 2 of current protection. The Level 1 should kick in first given by I_MOT_MAX
-  if(ABS(curL_DC) > curDC_max || enable == 0) {
+  if(ABS(curL_DC) > curDC_max || pwmOff) {
     LEFT_TIM->BDTR &= ~TIM_BDTR_MOE;
   } else {
     LEFT_TIM->BDTR |= TIM_BDTR_MOE;
   }
 
-  if(ABS(curR_DC)  > curDC_max || enable == 0) {
+  if(ABS(curR_DC)  > curDC_max || pwmOff) {
     RIGHT_TIM->BDTR &= ~TIM_BDTR_MOE;
   } else {
     RIGHT_TIM->BDTR |= TIM_BDTR_MOE;
   }
 
   // Create square wave for buzzer
-  buzzerTimer++;
-  if (buzzerFreq != 0 && (buzzerTimer / 5000) % (buzzerPattern + 1) == 0) {
-    if (buzzerPrev == 0) {
-      buzzerPrev = 1;
-      if (++buzzerIdx > (buzzerCount + 2)) {    // pause 2 periods
-        buzzerIdx = 1;
-      }
+  #ifdef IDLE_LOW_POWER
+  // Idle with the buzzer off: the ADC is triggered every IDLE_ADC_DIV PWM periods (LEFT_TIM repetition counter), buzzerTimer
+  // still counts PWM periods. A new repetition count is loaded at the next trigger, the step changes one conversion later
+  buzzerTimer += idleStep;
+  idleStep     = idleStepNext;
+  if (idleMode && buzzerFreq == 0) {
+    if (idleStepNext == 1 && (buzzerTimer + idleStep) % IDLE_ADC_DIV == 0) {   // keeps buzzerTimer % (PWM_FREQ / 1000) hitting 0
+      LEFT_TIM->RCR = 2 * IDLE_ADC_DIV - 1;
+      idleStepNext  = IDLE_ADC_DIV;
     }
-    if (buzzerTimer % buzzerFreq == 0 && (buzzerIdx <= buzzerCount || buzzerCount == 0)) {
+  } else if (idleStepNext != 1) {
+    LEFT_TIM->RCR = 1;
+    idleStepNext  = 1;
+  }
+  #else
+  buzzerTimer++;
+  #endif
+  if (buzzerTimer % (PWM_FREQ / 1000) == 0) {   // advance the buzzer sequencer every 1 ms
+    beepSequencer();
+  }
+  if (buzzerFreq != 0) {
+    buzzerPrev = 1;
+    if (buzzerTimer % buzzerFreq == 0) {
       HAL_GPIO_TogglePin(BUZZER_PORT, BUZZER_PIN);
     }
   } else if (buzzerPrev) {
@@ -160,12 +233,43 @@ void DMA1_Channel1_IRQHandler(void) {
   int ur, vr, wr;
   static boolean_T OverrunFlag = false;
 
+  #ifdef IDLE_LOW_POWER
+  if (idleMode || idleSlow) {     // motors disabled and stationary: skip the controller steps, wake up on any hall change
+    uint8_t halls = (uint8_t)(((LEFT_HALL_U_PORT->IDR  & LEFT_HALL_U_PIN)  ? 0x01 : 0) | ((LEFT_HALL_V_PORT->IDR  & LEFT_HALL_V_PIN)  ? 0x02 : 0) |
+                              ((LEFT_HALL_W_PORT->IDR  & LEFT_HALL_W_PIN)  ? 0x04 : 0) | ((RIGHT_HALL_U_PORT->IDR & RIGHT_HALL_U_PIN) ? 0x08 : 0) |
+                              ((RIGHT_HALL_V_PORT->IDR & RIGHT_HALL_V_PIN) ? 0x10 : 0) | ((RIGHT_HALL_W_PORT->IDR & RIGHT_HALL_W_PIN) ? 0x20 : 0));
+    if (idleHalls == 0xFF) {
+      idleHalls = halls;
+    } else if (halls != idleHalls) {
+      idleMode  = 0;
+      idleWake  = 1;
+    }
+    return;
+  }
+  idleHalls = 0xFF;
+  #endif
+
   /* Check for overrun */
   if (OverrunFlag) {
     return;
   }
   OverrunFlag = true;
 
+  #ifdef SERIAL_SYNC
+  if (syncSched == SYNC_ARMED && (int32_t)(buzzerTimer - syncSchedTick) >= 0) {
+    pwml = syncPwmL;              // scheduled targets take effect in this PWM period, on all synchronized boards
+    pwmr = syncPwmR;
+  }
+  #endif
+
+  #ifdef FEEDBACK_TELEMETRY
+  uint32_t isrStart = SysTick->VAL;   // SysTick counts down from LOAD at the core clock
+  #endif
+
+  #ifdef LATENCY_MEASURE
+  latencyStep();                  // latest pwml/pwmr consumed by this step
+  #endif
+
   /* Make sure to stop BOTH motors in case of an error */
   enableFin = enable && !rtY_Left.z_errCode && !rtY_Right.z_errCode;
  
@@ -244,6 +348,14 @@ void DMA1_Channel1_IRQHandler(void) {
     RIGHT_TIM->RIGHT_TIM_W  = (uint16_t)CLAMP(wr + pwm_res / 2, pwm_margin, pwm_res-pwm_margin);
   // =================================================================
 
+  #ifdef FEEDBACK_TELEMETRY
+  uint32_t isrEnd = SysTick->VAL;
+  isrCycles = (uint16_t)(isrStart >= isrEnd ? isrStart - isrEnd : isrStart + SysTick->LOAD + 1 - isrEnd);
+  if (isrCycles > isrCyclesMax) {
+    isrCyclesMax = isrCycles;
+  }
+  #endif
+
   /* Indicate task complete */
   OverrunFlag = false;
  
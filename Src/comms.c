@@ -27,6 +27,7 @@
 #include "eeprom.h"
 #include "BLDC_controller.h"
 #include "util.h"
+#include "filter.h"
 #include "comms.h"
 
 #if defined(DEBUG_SERIAL_PROTOCOL)
@@ -54,8 +55,18 @@ extern P    rtP_Right;
 
 extern InputStruct input1[];            // input structure
 extern InputStruct input2[];            // input structure
+#ifndef VARIANT_TRANSPOTTER
+extern PipeCfg inPipe[];                // input pipeline stage table
+#endif
 
-extern uint16_t VirtAddVarTab[NB_OF_VAR];
+extern uint16_t cfgData[CFG_SLOTS];
+extern uint8_t  cfgStatus;
+#ifdef ODOMETER_COUNTERS
+extern uint32_t odom[ODOM_NUM];
+#endif
+#ifdef FAULT_BLACKBOX
+extern uint16_t bboxCount;
+#endif
 extern int16_t speedAvg;                      // average measured speed
 extern int16_t speedAvgAbs;                   // average measured speed in absolute
 extern uint8_t ctrlModReqRaw;
@@ -66,6 +77,34 @@ extern int16_t right_dc_curr;
 extern int16_t dc_curr;
 extern int16_t cmdL; 
 extern int16_t cmdR; 
+extern uint16_t logDrop;
+extern uint16_t logPeak;
+extern uint8_t  logHold;
+extern uint16_t eeErases;
+extern uint32_t eeLife;
+#if defined(CONTROL_SERIAL_USART2) && !defined(CONTROL_IBUS)
+extern SerialParser parserL;
+#endif
+#if defined(CONTROL_SERIAL_USART3) && !defined(CONTROL_IBUS)
+extern SerialParser parserR;
+#endif
+#ifdef SERIAL_MULTIDROP
+extern uint8_t nodeId;
+#endif
+#ifdef SERIAL_SYNC
+extern int32_t  syncErr;
+extern int16_t  syncDrift;
+extern uint16_t syncLate;
+#endif
+#ifdef FEEDBACK_TELEMETRY
+extern uint32_t tlmFields;
+extern uint8_t  tlmDiv;
+extern uint16_t tlmDrop;
+#endif
+#ifdef LATENCY_MEASURE
+extern uint16_t latP50, latP90, latP99, latMax;
+extern uint16_t latStageUs[];
+#endif
 
 
 
@@ -81,6 +120,10 @@ const command_entry commands[] = {
     {WRITE  ,"SET"     ,NULL              ,NULL            ,setParamValExt ,"Set Parameter"},
     {WRITE  ,"INIT"    ,NULL              ,initParamVal    ,NULL           ,"Init Parameter from EEPROM or CONFIG.H"},
     {WRITE  ,"SAVE"    ,saveAllParamVal   ,NULL            ,NULL           ,"Save Parameters to EEPROM"},
+#ifdef FAULT_BLACKBOX
+    {READ   ,"BBOX"    ,printBlackBox     ,NULL            ,NULL           ,"Print fault snapshots"},
+    {WRITE  ,"BBOX_CLR",clearBlackBox     ,NULL            ,NULL           ,"Erase fault snapshots"},
+#endif
 };
 
 enum paramTypes {PARAMETER,VARIABLE};
@@ -91,7 +134,7 @@ const parameter_entry params[] = {
     {PARAMETER  ,"CTRL_TYP"           ,ADD_PARAM(rtP_Left.z_ctrlTypSel)      ,&rtP_Right.z_ctrlTypSel   ,0          ,CTRL_TYP_SEL      ,0      ,0      ,2      ,0               ,0    ,0     ,NULL               ,"Ctrl type 0:COM 1:SIN 2:FOC"},
     {PARAMETER  ,"I_MOT_MAX"          ,ADD_PARAM(rtP_Left.i_max)             ,&rtP_Right.i_max          ,1          ,I_MOT_MAX         ,1      ,1      ,40     ,A2BIT_CONV      ,0    ,4     ,NULL               ,"Max phase current A"},
     {PARAMETER  ,"N_MOT_MAX"          ,ADD_PARAM(rtP_Left.n_max)             ,&rtP_Right.n_max          ,2          ,N_MOT_MAX         ,1      ,10     ,2000   ,0               ,0    ,4     ,NULL               ,"Max motor RPM"},
-    {PARAMETER  ,"FI_WEAK_ENA"        ,ADD_PARAM(rtP_Left.b_fieldWeakEna)    ,&rtP_Right.b_fieldWeakEna ,0          ,FIELD_WEAK_ENA    ,0      ,0      ,1      ,0               ,0    ,0     ,NULL               ,"Enable field weak"},
+    {PARAMETER  ,"FI_WEAK_ENA"        ,ADD_PARAM(rtP_Left.b_fieldWeakEna)    ,&rtP_Right.b_fieldWeakEna ,0          ,FIELD_WEAK_ENA    ,0      ,0      ,1      ,0               ,0    ,0     ,Input_Lim_Init     ,"Enable field weak"},
   	{PARAMETER  ,"FI_WEAK_HI"         ,ADD_PARAM(rtP_Left.r_fieldWeakHi)     ,&rtP_Right.r_fieldWeakHi  ,0          ,FIELD_WEAK_HI     ,1      ,0      ,1500   ,0               ,0    ,4     ,Input_Lim_Init     ,"Field weak high RPM"},
 	  {PARAMETER  ,"FI_WEAK_LO"         ,ADD_PARAM(rtP_Left.r_fieldWeakLo)     ,&rtP_Right.r_fieldWeakLo  ,0          ,FIELD_WEAK_LO     ,1      ,0      ,1000   ,0               ,0    ,4     ,Input_Lim_Init     ,"Field weak low RPM"},
     {PARAMETER  ,"FI_WEAK_MAX"        ,ADD_PARAM(rtP_Left.id_fieldWeakMax)   ,&rtP_Right.id_fieldWeakMax,0          ,FIELD_WEAK_MAX    ,1      ,0      ,20     ,A2BIT_CONV      ,0    ,4     ,NULL               ,"Field weak max current A(FOC)"},
@@ -127,6 +170,25 @@ const parameter_entry params[] = {
     {PARAMETER  ,"AUX_IN2_MAX"        ,ADD_PARAM(input2[1].max)              ,NULL                      ,18         ,RAW_MAX           ,0      ,RAW_MIN,RAW_MAX,0               ,0    ,0     ,0                  ,"Aux. input2 max"},
     {VARIABLE   ,"AUX_IN2_CMD"        ,ADD_PARAM(input2[1].cmd)              ,NULL                      ,0          ,0                 ,0      ,0      ,0      ,0               ,0    ,0     ,0                  ,"Aux. input2 cmd"},
 #endif  
+#ifndef VARIANT_TRANSPOTTER
+  // INPUT PIPELINE
+  // Type       ,Name                 ,Datatype, ValueL ptr                  ,ValueR                    ,EEPRM Addr ,Init              Int/Ext ,Min    ,Max    ,Div             ,Mul  ,Fix   ,Callback Function  ,Help text
+    {PARAMETER  ,"PIPE1_DBAND"        ,ADD_PARAM(inPipe[0].dband)            ,NULL                      ,0          ,0                 ,0      ,0      ,1500   ,0               ,0    ,0     ,NULL               ,"Input1 pipeline deadband"},
+    {PARAMETER  ,"PIPE1_EXPO"         ,ADD_PARAM(inPipe[0].expo)             ,NULL                      ,0          ,0                 ,0      ,0      ,100    ,0               ,100  ,14    ,NULL               ,"Input1 pipeline expo %"},
+    {PARAMETER  ,"PIPE1_RATE"         ,ADD_PARAM(inPipe[0].rate)             ,NULL                      ,0          ,RATE              ,0      ,0      ,20479  ,0               ,10   ,4     ,NULL               ,"Input1 pipeline rate per loop *10"},
+    {PARAMETER  ,"PIPE1_FILT"         ,ADD_PARAM(inPipe[0].filt)             ,NULL                      ,0          ,FILTER            ,0      ,0      ,65535  ,0               ,0    ,0     ,NULL               ,"Input1 pipeline filter fixdt(0,16,16)"},
+    {PARAMETER  ,"PIPE1_MIN"          ,ADD_PARAM(inPipe[0].min)              ,NULL                      ,0          ,-1000             ,0      ,-1500  ,0      ,0               ,0    ,0     ,NULL               ,"Input1 pipeline clamp min"},
+    {PARAMETER  ,"PIPE1_MAX"          ,ADD_PARAM(inPipe[0].max)              ,NULL                      ,0          ,1000              ,0      ,0      ,1500   ,0               ,0    ,0     ,NULL               ,"Input1 pipeline clamp max"},
+
+    {PARAMETER  ,"PIPE2_DBAND"        ,ADD_PARAM(inPipe[1].dband)            ,NULL                      ,0          ,0                 ,0      ,0      ,1500   ,0               ,0    ,0     ,NULL               ,"Input2 pipeline deadband"},
+    {PARAMETER  ,"PIPE2_EXPO"         ,ADD_PARAM(inPipe[1].expo)             ,NULL                      ,0          ,0                 ,0      ,0      ,100    ,0               ,100  ,14    ,NULL               ,"Input2 pipeline expo %"},
+    {PARAMETER  ,"PIPE2_RATE"         ,ADD_PARAM(inPipe[1].rate)             ,NULL                      ,0          ,RATE              ,0      ,0      ,20479  ,0               ,10   ,4     ,NULL               ,"Input2 pipeline rate per loop *10"},
+    {PARAMETER  ,"PIPE2_FILT"         ,ADD_PARAM(inPipe[1].filt)             ,NULL                      ,0          ,FILTER            ,0      ,0      ,65535  ,0               ,0    ,0     ,NULL               ,"Input2 pipeline filter fixdt(0,16,16)"},
+    {PARAMETER  ,"PIPE2_MIN"          ,ADD_PARAM(inPipe[1].min)              ,NULL                      ,0          ,-1000             ,0      ,-1500  ,0      ,0               ,0    ,0     ,NULL               ,"Input2 pipeline clamp min"},
+    {PARAMETER  ,"PIPE2_MAX"          ,ADD_PARAM(inPipe[1].max)              ,NULL                      ,0          ,1000              ,0      ,0      ,1500   ,0               ,0    ,0     ,NULL               ,"Input2 pipeline clamp max"},
+    {PARAMETER  ,"PIPET_RATE"         ,ADD_PARAM(inPipe[2].rate)             ,&inPipe[3].rate           ,0          ,RATE              ,0      ,0      ,20479  ,0               ,10   ,4     ,NULL               ,"Motor target pipeline rate per loop *10"},
+    {PARAMETER  ,"PIPET_FILT"         ,ADD_PARAM(inPipe[2].filt)             ,&inPipe[3].filt           ,0          ,FILTER            ,0      ,0      ,65535  ,0               ,0    ,0     ,NULL               ,"Motor target pipeline filter fixdt(0,16,16)"},
+#endif
   // FEEDBACK
   // Type       ,Name                 ,Datatype, ValueL ptr                  ,ValueR                    ,EEPRM Addr ,Init              Int/Ext ,Min    ,Max    ,Div             ,Mul  ,Fix   ,Callback Function  ,Help text
     {VARIABLE   ,"DC_CURR"            ,ADD_PARAM(dc_curr)                    ,NULL                      ,0          ,0                 ,0      ,0      ,0      ,0               ,0    ,0     ,NULL               ,"Total DC Link current A *100"},
@@ -142,6 +204,74 @@ const parameter_entry params[] = {
     {VARIABLE   ,"STR_COEF"           ,0       , NULL                        ,NULL                      ,0          ,STEER_COEFFICIENT ,0      ,0      ,0      ,0               ,10   ,14    ,NULL               ,"Steer Coefficient *10"},
     {VARIABLE   ,"BATV"               ,ADD_PARAM(batVoltageCalib)            ,NULL                      ,0          ,0                 ,0      ,0      ,0      ,0               ,0    ,0     ,NULL               ,"Calibrated Battery voltage *100"},       
     {VARIABLE   ,"TEMP"               ,ADD_PARAM(board_temp_deg_c)           ,NULL                      ,0          ,0                 ,0      ,0      ,0      ,0               ,0    ,0     ,NULL               ,"Calibrated Temperature °C *10"},       
+  // LOG
+  // Type       ,Name                 ,Datatype, ValueL ptr                  ,ValueR                    ,EEPRM Addr ,Init              Int/Ext ,Min    ,Max    ,Div             ,Mul  ,Fix   ,Callback Function  ,Help text
+    {PARAMETER  ,"LOG_LVL"            ,ADD_PARAM(logLevel)                   ,NULL                      ,0          ,LOG_LEVEL         ,0      ,0      ,3      ,0               ,0    ,0     ,NULL               ,"Log level 0:ERR 1:WARN 2:INFO 3:DBG"},
+    {VARIABLE   ,"LOG_DROP"           ,ADD_PARAM(logDrop)                    ,NULL                      ,0          ,0                 ,0      ,0      ,0      ,0               ,0    ,0     ,NULL               ,"Log bytes dropped"},
+    {VARIABLE   ,"LOG_PEAK"           ,ADD_PARAM(logPeak)                    ,NULL                      ,0          ,0                 ,0      ,0      ,0      ,0               ,0    ,0     ,NULL               ,"Log buffer peak fill bytes"},
+  // EEPROM
+  // Type       ,Name                 ,Datatype, ValueL ptr                  ,ValueR                    ,EEPRM Addr ,Init              Int/Ext ,Min    ,Max    ,Div             ,Mul  ,Fix   ,Callback Function  ,Help text
+    {VARIABLE   ,"EE_ERASES"          ,ADD_PARAM(eeErases)                   ,NULL                      ,0          ,0                 ,0      ,0      ,0      ,0               ,0    ,0     ,NULL               ,"EEPROM most worn page erase cycles"},
+    {VARIABLE   ,"EE_LIFE"            ,ADD_PARAM(eeLife)                     ,NULL                      ,0          ,0                 ,0      ,0      ,0      ,0               ,0    ,0     ,NULL               ,"EEPROM projected saves left"},
+    {VARIABLE   ,"CFG_STAT"           ,ADD_PARAM(cfgStatus)                  ,NULL                      ,0          ,0                 ,0      ,0      ,0      ,0               ,0    ,0     ,NULL               ,"Config 0:NONE 1:OK 2:MIGRATED 3:CRC ERR 4:NEWER"},
+#ifdef ODOMETER_COUNTERS
+  // ODOMETER
+  // Type       ,Name                 ,Datatype, ValueL ptr                  ,ValueR                    ,EEPRM Addr ,Init              Int/Ext ,Min    ,Max    ,Div             ,Mul  ,Fix   ,Callback Function  ,Help text
+    {VARIABLE   ,"ODOM_M"             ,ADD_PARAM(odom[ODOM_DIST])            ,NULL                      ,0          ,0                 ,0      ,0      ,0      ,0               ,0    ,0     ,NULL               ,"Odometer distance m"},
+    {VARIABLE   ,"ODOM_MAH"           ,ADD_PARAM(odom[ODOM_CHARGE])          ,NULL                      ,0          ,0                 ,0      ,0      ,0      ,0               ,0    ,0     ,NULL               ,"Odometer charge mAh"},
+    {VARIABLE   ,"ODOM_WH"            ,ADD_PARAM(odom[ODOM_ENERGY])          ,NULL                      ,0          ,0                 ,0      ,0      ,0      ,0               ,0    ,0     ,NULL               ,"Odometer energy Wh"},
+    {VARIABLE   ,"ODOM_S"             ,ADD_PARAM(odom[ODOM_TIME])            ,NULL                      ,0          ,0                 ,0      ,0      ,0      ,0               ,0    ,0     ,NULL               ,"Odometer drive time s"},
+#endif
+#ifdef FAULT_BLACKBOX
+  // FAULT BLACK BOX
+  // Type       ,Name                 ,Datatype, ValueL ptr                  ,ValueR                    ,EEPRM Addr ,Init              Int/Ext ,Min    ,Max    ,Div             ,Mul  ,Fix   ,Callback Function  ,Help text
+    {VARIABLE   ,"BBOX_CNT"           ,ADD_PARAM(bboxCount)                  ,NULL                      ,0          ,0                 ,0      ,0      ,0      ,0               ,0    ,0     ,NULL               ,"Stored fault snapshots"},
+#endif
+#if defined(CONTROL_SERIAL_USART2) && !defined(CONTROL_IBUS)
+  // SERIAL COMMAND USART2
+  // Type       ,Name                 ,Datatype, ValueL ptr                  ,ValueR                    ,EEPRM Addr ,Init              Int/Ext ,Min    ,Max    ,Div             ,Mul  ,Fix   ,Callback Function  ,Help text
+    {VARIABLE   ,"RX_OK2"             ,ADD_PARAM(parserL.cntOk)             ,NULL                      ,0          ,0                 ,0      ,0      ,0      ,0               ,0    ,0     ,NULL               ,"USART2 Valid command frames"},
+    {VARIABLE   ,"RX_ERR_CRC2"        ,ADD_PARAM(parserL.errCrc)            ,NULL                      ,0          ,0                 ,0      ,0      ,0      ,0               ,0    ,0     ,NULL               ,"USART2 Frames with wrong CRC"},
+    {VARIABLE   ,"RX_ERR_SYNC2"       ,ADD_PARAM(parserL.errSync)           ,NULL                      ,0          ,0                 ,0      ,0      ,0      ,0               ,0    ,0     ,NULL               ,"USART2 Bytes dropped on resync"},
+    {VARIABLE   ,"RX_ERR_FMT2"        ,ADD_PARAM(parserL.errFmt)            ,NULL                      ,0          ,0                 ,0      ,0      ,0      ,0               ,0    ,0     ,NULL               ,"USART2 Frames with wrong format"},
+#endif
+#if defined(CONTROL_SERIAL_USART3) && !defined(CONTROL_IBUS)
+  // SERIAL COMMAND USART3
+  // Type       ,Name                 ,Datatype, ValueL ptr                  ,ValueR                    ,EEPRM Addr ,Init              Int/Ext ,Min    ,Max    ,Div             ,Mul  ,Fix   ,Callback Function  ,Help text
+    {VARIABLE   ,"RX_OK3"             ,ADD_PARAM(parserR.cntOk)             ,NULL                      ,0          ,0                 ,0      ,0      ,0      ,0               ,0    ,0     ,NULL               ,"USART3 Valid command frames"},
+    {VARIABLE   ,"RX_ERR_CRC3"        ,ADD_PARAM(parserR.errCrc)            ,NULL                      ,0          ,0                 ,0      ,0      ,0      ,0               ,0    ,0     ,NULL               ,"USART3 Frames with wrong CRC"},
+    {VARIABLE   ,"RX_ERR_SYNC3"       ,ADD_PARAM(parserR.errSync)           ,NULL                      ,0          ,0                 ,0      ,0      ,0      ,0               ,0    ,0     ,NULL               ,"USART3 Bytes dropped on resync"},
+    {VARIABLE   ,"RX_ERR_FMT3"        ,ADD_PARAM(parserR.errFmt)            ,NULL                      ,0          ,0                 ,0      ,0      ,0      ,0               ,0    ,0     ,NULL               ,"USART3 Frames with wrong format"},
+#endif
+#ifdef SERIAL_MULTIDROP
+  // MULTI-DROP BUS
+  // Type       ,Name                 ,Datatype, ValueL ptr                  ,ValueR                    ,EEPRM Addr ,Init              Int/Ext ,Min    ,Max    ,Div             ,Mul  ,Fix   ,Callback Function  ,Help text
+    {PARAMETER  ,"NODE_ID"            ,ADD_PARAM(nodeId)                     ,NULL                      ,19         ,SERIAL_NODE_ID    ,0      ,0      ,254    ,0               ,0    ,0     ,NULL               ,"Node ID on the multi-drop bus"},
+#endif
+#ifdef SERIAL_SYNC
+  // TIME SYNC
+  // Type       ,Name                 ,Datatype, ValueL ptr                  ,ValueR                    ,EEPRM Addr ,Init              Int/Ext ,Min    ,Max    ,Div             ,Mul  ,Fix   ,Callback Function  ,Help text
+    {VARIABLE   ,"SYNC_ERR"           ,ADD_PARAM(syncErr)                    ,NULL                      ,0          ,0                 ,0      ,0      ,0      ,0               ,0    ,0     ,NULL               ,"Host time sync error us"},
+    {VARIABLE   ,"SYNC_DRIFT"         ,ADD_PARAM(syncDrift)                  ,NULL                      ,0          ,0                 ,0      ,0      ,0      ,0               ,0    ,0     ,NULL               ,"Host vs local clock rate ppm"},
+    {VARIABLE   ,"SYNC_LATE"          ,ADD_PARAM(syncLate)                   ,NULL                      ,0          ,0                 ,0      ,0      ,0      ,0               ,0    ,0     ,NULL               ,"Scheduled targets applied late"},
+#endif
+#ifdef FEEDBACK_TELEMETRY
+  // TELEMETRY
+  // Type       ,Name                 ,Datatype, ValueL ptr                  ,ValueR                    ,EEPRM Addr ,Init              Int/Ext ,Min    ,Max    ,Div             ,Mul  ,Fix   ,Callback Function  ,Help text
+    {PARAMETER  ,"TLM_FIELDS"         ,ADD_PARAM(tlmFields)                  ,NULL                      ,0          ,TLM_FIELDS_DEF    ,0      ,0      ,0x7FFFFFFF,0            ,0    ,0     ,NULL               ,"Telemetry field mask"},
+    {PARAMETER  ,"TLM_DIV"            ,ADD_PARAM(tlmDiv)                     ,NULL                      ,0          ,TLM_DIV_DEF       ,0      ,0      ,255    ,0               ,0    ,0     ,NULL               ,"Telemetry period loops 0:off"},
+    {VARIABLE   ,"TLM_DROP"           ,ADD_PARAM(tlmDrop)                    ,NULL                      ,0          ,0                 ,0      ,0      ,0      ,0               ,0    ,0     ,NULL               ,"Telemetry frames dropped"},
+#endif
+#ifdef LATENCY_MEASURE
+  // LATENCY
+  // Type       ,Name                 ,Datatype, ValueL ptr                  ,ValueR                    ,EEPRM Addr ,Init              Int/Ext ,Min    ,Max    ,Div             ,Mul  ,Fix   ,Callback Function  ,Help text
+    {VARIABLE   ,"LAT_P50"            ,ADD_PARAM(latP50)                     ,NULL                      ,0          ,0                 ,0      ,0      ,0      ,0               ,0    ,0     ,NULL               ,"Input-to-PWM latency 50% us"},
+    {VARIABLE   ,"LAT_P90"            ,ADD_PARAM(latP90)                     ,NULL                      ,0          ,0                 ,0      ,0      ,0      ,0               ,0    ,0     ,NULL               ,"Input-to-PWM latency 90% us"},
+    {VARIABLE   ,"LAT_P99"            ,ADD_PARAM(latP99)                     ,NULL                      ,0          ,0                 ,0      ,0      ,0      ,0               ,0    ,0     ,NULL               ,"Input-to-PWM latency 99% us"},
+    {VARIABLE   ,"LAT_MAX"            ,ADD_PARAM(latMax)                     ,NULL                      ,0          ,0                 ,0      ,0      ,0      ,0               ,0    ,0     ,NULL               ,"Input-to-PWM latency max us"},
+    {VARIABLE   ,"LAT_READ"           ,ADD_PARAM(latStageUs[LAT_READ])       ,NULL                      ,0          ,0                 ,0      ,0      ,0      ,0               ,0    ,0     ,NULL               ,"Arrival to readCommand us"},
+    {VARIABLE   ,"LAT_PWM"            ,ADD_PARAM(latStageUs[LAT_PWM])        ,NULL                      ,0          ,0                 ,0      ,0      ,0      ,0               ,0    ,0     ,NULL               ,"Arrival to pwml/pwmr us"},
+#endif
 
 };
 
@@ -162,6 +292,10 @@ const char *errors[9] = {
 debug_command command;
 int8_t watchParamList[MAX_PARAM_WATCH] = {-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1}; 
 
+enum dumpPhases {DUMP_NONE,DUMP_HELP_CMD,DUMP_HELP_PAR,DUMP_HELP_VAR,DUMP_DEF,DUMP_END};
+static uint8_t dumpPhase;                                         // HELP/GET dump in progress, printed by printAllStep()
+static uint8_t dumpIndex;                                         // next line of the dump phase
+
 // Set Param with Value from external format
 int8_t setParamValExt(uint8_t index, int32_t value) {   
   int8_t ret = 0;
@@ -175,41 +309,50 @@ int8_t setParamValExt(uint8_t index, int32_t value) {
   return ret;
 }
 
-// Set Param with value from internal format
-int8_t setParamValInt(uint8_t index, int32_t newValue) {
-  int32_t oldValue = getParamValInt(index);
-  if (oldValue != newValue){ 
-    // if value is different, beep, cast and assign new value
-    switch (params[index].datatype){
-      case UINT8_T:
-        if (params[index].valueL != NULL) *(uint8_t*)params[index].valueL = newValue;
-        if (params[index].valueR != NULL) *(uint8_t*)params[index].valueR = newValue;
-        break;
-      case UINT16_T:
-        if (params[index].valueL != NULL) *(uint16_t*)params[index].valueL = newValue; 
-        if (params[index].valueR != NULL) *(uint16_t*)params[index].valueR = newValue;
-        break;
-      case UINT32_T:
-        if (params[index].valueL != NULL) *(uint32_t*)params[index].valueL = newValue; 
-        if (params[index].valueR != NULL) *(uint32_t*)params[index].valueR = newValue;
-        break;
-      case INT8_T:
-        if (params[index].valueL != NULL) *(int8_t*)params[index].valueL = newValue; 
-        if (params[index].valueR != NULL) *(int8_t*)params[index].valueR = newValue;
-        break;
-      case INT16_T:
-        if (params[index].valueL != NULL) *(int16_t*)params[index].valueL = newValue; 
-        if (params[index].valueR != NULL) *(int16_t*)params[index].valueR = newValue;
-        break;
-      case INT32_T:
-        if (params[index].valueL != NULL) *(int32_t*)params[index].valueL = newValue; 
-        if (params[index].valueR != NULL) *(int32_t*)params[index].valueR = newValue;
-        break;
-    }
+// Set Param with Value from external format, without printing (used by the binary serial command)
+int8_t writeParamVal(uint8_t index, int32_t value) {
+  if (index >= PARAM_SIZE(params) || params[index].type != PARAMETER || !IN_RANGE(value,params[index].min,params[index].max)){
+    return 0;
+  }
+  return setParamValInt(index,extToInt(index,value));
+}
 
-    // Beep if value was modified
-    beepShort(5);
+// Cast and assign a value in internal format to the parameter variables, returns 1 if the value changed
+static int8_t storeParamValInt(uint8_t index, int32_t newValue) {
+  if (getParamValInt(index) == newValue) return 0;
+  switch (params[index].datatype){
+    case UINT8_T:
+      if (params[index].valueL != NULL) *(uint8_t*)params[index].valueL = newValue;
+      if (params[index].valueR != NULL) *(uint8_t*)params[index].valueR = newValue;
+      break;
+    case UINT16_T:
+      if (params[index].valueL != NULL) *(uint16_t*)params[index].valueL = newValue; 
+      if (params[index].valueR != NULL) *(uint16_t*)params[index].valueR = newValue;
+      break;
+    case UINT32_T:
+      if (params[index].valueL != NULL) *(uint32_t*)params[index].valueL = newValue; 
+      if (params[index].valueR != NULL) *(uint32_t*)params[index].valueR = newValue;
+      break;
+    case INT8_T:
+      if (params[index].valueL != NULL) *(int8_t*)params[index].valueL = newValue; 
+      if (params[index].valueR != NULL) *(int8_t*)params[index].valueR = newValue;
+      break;
+    case INT16_T:
+      if (params[index].valueL != NULL) *(int16_t*)params[index].valueL = newValue; 
+      if (params[index].valueR != NULL) *(int16_t*)params[index].valueR = newValue;
+      break;
+    case INT32_T:
+      if (params[index].valueL != NULL) *(int32_t*)params[index].valueL = newValue; 
+      if (params[index].valueR != NULL) *(int32_t*)params[index].valueR = newValue;
+      break;
   }
+  return 1;
+}
+
+// Set Param with value from internal format
+int8_t setParamValInt(uint8_t index, int32_t newValue) {
+  // Beep if value was modified
+  if (storeParamValInt(index,newValue)) beepShort(5);
 
   // Run callback function if assigned
   if (params[index].callback_function) (*params[index].callback_function)();
@@ -221,6 +364,19 @@ int32_t getParamValExt(uint8_t index) {
   return intToExt(index,getParamValInt(index));
 }
 
+// Read one parameter variable, cast from the parameter datatype
+static int32_t readParamInt(uint8_t datatype, const void *value) {
+  switch (datatype){
+    case UINT8_T:  return *(const uint8_t*)value;
+    case UINT16_T: return *(const uint16_t*)value;
+    case UINT32_T: return *(const uint32_t*)value;
+    case INT8_T:   return *(const int8_t*)value;
+    case INT16_T:  return *(const int16_t*)value;
+    case INT32_T:  return *(const int32_t*)value;
+    default:       return 0;
+  }
+}
+
 // Get Parameter Internal Value
 int32_t getParamValInt(uint8_t index) {
   int32_t value = 0;
@@ -233,34 +389,8 @@ int32_t getParamValInt(uint8_t index) {
     // Read Left and Right values and calculate average 
     // If left and right have to be summed up, DIV field could be adapted to multiply by 2
     // Cast to parameter datatype
-    switch (params[index].datatype){
-      case UINT8_T:
-        if (params[index].valueL != NULL) value += *(uint8_t*)params[index].valueL;
-        if (params[index].valueR != NULL) value += *(uint8_t*)params[index].valueR;
-        break;
-      case UINT16_T:
-        if (params[index].valueL != NULL) value += *(uint16_t*)params[index].valueL;
-        if (params[index].valueR != NULL) value += *(uint16_t*)params[index].valueR;
-        break;
-      case UINT32_T:
-        if (params[index].valueL != NULL) value += *(uint32_t*)params[index].valueL;
-        if (params[index].valueR != NULL) value += *(uint32_t*)params[index].valueR;
-        break;
-      case INT8_T:
-        if (params[index].valueL != NULL) value += *(int8_t*)params[index].valueL;
-        if (params[index].valueR != NULL) value += *(int8_t*)params[index].valueR;
-        break;
-      case INT16_T:
-        if (params[index].valueL != NULL) value += *(int16_t*)params[index].valueL;
-        if (params[index].valueR != NULL) value += *(int16_t*)params[index].valueR;
-        break;
-      case INT32_T:
-        if (params[index].valueL != NULL) value += *(int32_t*)params[index].valueL;
-        if (params[index].valueR != NULL) value += *(int32_t*)params[index].valueR;
-        break;
-      default:
-        value = 0;
-    }
+    if (params[index].valueL != NULL) value += readParamInt(params[index].datatype,params[index].valueL);
+    if (params[index].valueR != NULL) value += readParamInt(params[index].datatype,params[index].valueR);
 
     // Divide by number of values provided for the parameter
     value /= countVar;
@@ -314,26 +444,11 @@ int8_t printParamHelp(uint8_t index){
   return 1;
 }
 
-// Print help for all parameters
+// Print help for all commands, parameters and variables, the output is paced by process_debug()
 int8_t printAllParamHelp(){
-  printf("? Commands\r\n");
-  for(int i=0;i<COMMAND_SIZE(commands);i++)
-    printCommandHelp(i);
-  printf("?\r\n");
-
-  printf("? Parameters\r\n");
-  for(int i=0;i<PARAM_SIZE(params);i++){
-    if (params[i].type == PARAMETER) printParamHelp(i);
-  }
-  printf("?\r\n");
-
-  printf("? Variables\r\n");
-  for(int i=0;i<PARAM_SIZE(params);i++){
-    if (params[i].type == VARIABLE) printParamHelp(i);
-  }
-  printf("?\r\n");
-
-  return 1;
+  dumpPhase = DUMP_HELP_CMD;
+  dumpIndex = 0;
+  return 0;
 }
 
 // Print definition(name,value,initial value, min, max) for parameter
@@ -347,14 +462,76 @@ int8_t printParamDef(uint8_t index){
   return 1;
 }
 
-// Print definition(name,value,initial value, min, max) for all parameters
+// Print definition(name,value,initial value, min, max) for all parameters, the output is paced by process_debug()
 int8_t printAllParamDef(){
-  for(int i=0;i<PARAM_SIZE(params);i++) printParamDef(i);
+  dumpPhase = DUMP_DEF;
+  dumpIndex = 0;
+  return 0;
+}
+
+// Print the HELP/GET dump in progress, one line at a time while the Tx buffer has room: called by process_debug() until it returns 0
+static uint8_t printAllStep(){
+  while (dumpPhase != DUMP_NONE){
+    if (logFree() < DEBUG_DUMP_LINE) return 1;
+    switch (dumpPhase){
+      case DUMP_HELP_CMD:
+        if (dumpIndex == 0)                               printf("? Commands\r\n");
+        else if (dumpIndex <= COMMAND_SIZE(commands))     printCommandHelp(dumpIndex - 1);
+        else {
+          printf("?\r\n");
+          dumpPhase = DUMP_HELP_PAR;
+          dumpIndex = 0;
+          continue;
+        }
+        break;
+      case DUMP_HELP_PAR:
+      case DUMP_HELP_VAR:
+        if (dumpIndex == 0)                               printf(dumpPhase == DUMP_HELP_PAR ? "? Parameters\r\n" : "? Variables\r\n");
+        else if (dumpIndex <= PARAM_SIZE(params)){
+          if (params[dumpIndex - 1].type == (dumpPhase == DUMP_HELP_PAR ? PARAMETER : VARIABLE)) printParamHelp(dumpIndex - 1);
+        } else {
+          printf("?\r\n");
+          dumpPhase = (dumpPhase == DUMP_HELP_PAR) ? DUMP_HELP_VAR : DUMP_END;
+          dumpIndex = 0;
+          continue;
+        }
+        break;
+      case DUMP_DEF:
+        if (dumpIndex < PARAM_SIZE(params))               printParamDef(dumpIndex);
+        else {
+          dumpPhase = DUMP_END;
+          continue;
+        }
+        break;
+      default:                                            // DUMP_END
+        printf("OK\r\n");
+        dumpPhase = DUMP_NONE;
+        continue;
+    }
+    dumpIndex++;
+  }
+  return 0;
+}
+
+#ifdef FAULT_BLACKBOX
+// Print the stored fault snapshots, the output is paced by process_debug()
+int8_t printBlackBox(){
+  bboxPrintStart();
+  return 0;
+}
+
+// Erase the stored fault snapshots
+int8_t clearBlackBox(){
+  if (!bboxClear()){
+    LOG(LOG_ERR, "! Stop the motors first\r\n");
+    return 0;
+  }
   return 1;
 }
+#endif
 
 void printError(uint8_t errornum ){
-  printf("! Err%i:\"%s\"\r\n",errornum,errors[errornum-1]);
+  LOG(LOG_ERR, "! Err%i:\"%s\"\r\n",errornum,errors[errornum-1]);
 }
 
 // Function to increment a value
@@ -374,16 +551,16 @@ int8_t incrParamVal(uint8_t index) {
 
 // Get internal Parameter value and save it to EEprom for all paraemeter with an address assigned 
 int8_t saveAllParamVal() {
-  HAL_FLASH_Unlock();
-  EE_WriteVariable(VirtAddVarTab[0] , (uint16_t)FLASH_WRITE_KEY);
-  for(int i=0;i<PARAM_SIZE(params);i++){ 
+  for(int i=0;i<PARAM_SIZE(params);i++){
     // Only Parameters with eeprom address can be saved
     if (params[i].addr){
-      EE_WriteVariable(VirtAddVarTab[params[i].addr] , (uint16_t)getParamValInt(i));    
+      cfgData[params[i].addr] = (uint16_t)getParamValInt(i);
     }
   }
-  HAL_FLASH_Lock();
-  return 1;
+  // One record: the slots of this build replace theirs, the other slots are kept
+  // A save that would first compact a page has to wait for the standstill, see eepromEraseOk()
+  if (!eepromEraseOk() && !EE_WriteReady(CFG_SLOTS)) return 0;
+  return configSave() == HAL_OK;
 }
 
 // Translate from Internal to External format
@@ -416,17 +593,9 @@ int32_t getParamInitExt(uint8_t index) {
 // Get Parameter value with EEprom data if address is avalaible, init/config.h value otherwise
 int16_t getParamInitInt(uint8_t index){
   if (params[index].addr){
-    // if EEPROM address is specified, init from EEPROM address
-    uint16_t writeCheck, readVal;
-    
-    HAL_FLASH_Unlock();
-    EE_ReadVariable(VirtAddVarTab[0], &writeCheck);
-    EE_ReadVariable(VirtAddVarTab[params[index].addr] , &readVal);
-    HAL_FLASH_Lock();
-    
-    // EEPROM was written, use stored value
-    if (writeCheck == FLASH_WRITE_KEY){
-      return readVal;
+    // if EEPROM address is specified, init from the configuration record loaded at boot
+    if ((cfgStatus == CFG_OK || cfgStatus == CFG_MIGRATED) && cfgData[params[index].addr] != CFG_UNSET){
+      return cfgData[params[index].addr];
     }else{
       // Use init value from array
       if (params[index].initFormat){
@@ -455,32 +624,288 @@ int8_t initParamVal(uint8_t index) {
   return ret;
 }
 
+// Lookup tables: open addressing hash of the names, each slot holds the commands[]/params[] index or -1
+static int8_t commandHash[COMMAND_HASH_SIZE];
+static int8_t paramHash[PARAM_HASH_SIZE];
+
+// Compile time checks of the table sizes (an array of size -1 does not compile): the linear probing needs free slots to
+// end, power of 2 sizes at least twice the number of entries, and the slots hold int8_t indices, so at most 127 entries
+typedef char commandHashCheck[((COMMAND_SIZE(commands)) * 2 <= COMMAND_HASH_SIZE && (COMMAND_SIZE(commands)) <= 127 &&
+                               (COMMAND_HASH_SIZE & (COMMAND_HASH_SIZE - 1)) == 0) ? 1 : -1];
+typedef char paramHashCheck[((PARAM_SIZE(params)) * 2 <= PARAM_HASH_SIZE && (PARAM_SIZE(params)) <= 127 &&
+                             (PARAM_HASH_SIZE & (PARAM_HASH_SIZE - 1)) == 0) ? 1 : -1];
+
+// FNV-1a hash of a name
+static uint32_t hashName(const uint8_t *name, uint32_t len){
+  uint32_t hash = 2166136261UL;
+  while (len--){
+    hash ^= *name++;
+    hash *= 16777619UL;
+  }
+  return hash;
+}
+
+// Length of the token at the start of userCommand, up to a space or end of line
+static uint32_t tokenLen(const uint8_t *userCommand, uint32_t len){
+  uint32_t i;
+  for (i = 0; i < len && userCommand[i] != ' ' && userCommand[i] != '\r' && userCommand[i] != '\n'; i++);
+  return i;
+}
+
+// Build the command and parameter lookup tables, called once at startup
+void initLookup(void){
+  uint32_t slot;
+  memset(commandHash, -1, sizeof(commandHash));
+  memset(paramHash, -1, sizeof(paramHash));
+  for(int index=0;index<COMMAND_SIZE(commands);index++){
+    slot = hashName((const uint8_t *)commands[index].name, strlen(commands[index].name)) & (COMMAND_HASH_SIZE - 1);
+    while (commandHash[slot] != -1) slot = (slot + 1) & (COMMAND_HASH_SIZE - 1);
+    commandHash[slot] = index;
+  }
+  for(int index=0;index<PARAM_SIZE(params);index++){
+    slot = hashName((const uint8_t *)params[index].name, strlen(params[index].name)) & (PARAM_HASH_SIZE - 1);
+    while (paramHash[slot] != -1) slot = (slot + 1) & (PARAM_HASH_SIZE - 1);
+    paramHash[slot] = index;
+  }
+}
+
 // Find command in commands array and return index
 int8_t findCommand(uint8_t *userCommand, uint32_t len){
-  for(int index=0;index<COMMAND_SIZE(commands);index++){
-    uint8_t command_len = strlen(commands[index].name);
-    if (command_len < len){
-      if (memcmp(userCommand,commands[index].name,command_len)==0){
-        return index;
-      }
+  uint32_t tlen = tokenLen(userCommand, len);
+  uint32_t slot = hashName(userCommand, tlen) & (COMMAND_HASH_SIZE - 1);
+  int8_t   index;
+  while ((index = commandHash[slot]) != -1){
+    if (strlen(commands[index].name) == tlen && memcmp(userCommand,commands[index].name,tlen)==0){
+      return index;
     }
+    slot = (slot + 1) & (COMMAND_HASH_SIZE - 1);
   }
   return -1; // Not found
 }
 
 // Find parameter in params array and return index
 int8_t findParam(uint8_t *userCommand, uint32_t len){
-  for(int index=0;index<PARAM_SIZE(params);index++){
-    uint8_t param_len = strlen(params[index].name);
-    if (param_len < len){
-      if (memcmp(userCommand,params[index].name,param_len)==0){
-        return index;
-      }
+  uint32_t tlen = tokenLen(userCommand, len);
+  uint32_t slot = hashName(userCommand, tlen) & (PARAM_HASH_SIZE - 1);
+  int8_t   index;
+  while ((index = paramHash[slot]) != -1){
+    if (strlen(params[index].name) == tlen && memcmp(userCommand,params[index].name,tlen)==0){
+      return index;
     }
+    slot = (slot + 1) & (PARAM_HASH_SIZE - 1);
   }
   return -1; // Not found
 }
 
+// Text line and binary frame assembly, filled in the USART interrupt
+static uint8_t  lineBuf[DEBUG_LINE_SIZE];
+static uint8_t  lineLen;
+static uint8_t  binRx[DEBUG_BIN_HDR_LEN + DEBUG_BIN_DATA_MAX + 2];
+static uint16_t binRxLen;
+static uint8_t  binReq[DEBUG_BIN_DATA_MAX];                      // payload of the last valid binary frame, executed in process_debug()
+static uint16_t binReqLen;
+static volatile uint8_t binReqPending;
+
+// Binary response streamed by process_debug()
+static uint8_t  binTxType;                                       // record type of the response in progress, 0 = none
+static uint8_t  binTxHdr;                                        // header still to be sent
+static uint8_t  binTxIndex;                                      // next parameter to send
+static uint16_t binTxLen;                                        // length of the records
+static uint16_t binTxCrc;
+
+static void putLE32(uint8_t *buf, int32_t value){
+  buf[0] = value;
+  buf[1] = value >> 8;
+  buf[2] = value >> 16;
+  buf[3] = value >> 24;
+}
+
+static void putBinHeader(uint8_t *buf, uint16_t len){
+  buf[0] = (uint8_t)SERIAL_START_FRAME;
+  buf[1] = (uint8_t)(SERIAL_START_FRAME >> 8);
+  buf[2] = DEBUG_BIN_VERSION;
+  buf[3] = len;
+  buf[4] = len >> 8;
+}
+
+// Parameter Left/Right value in external format, 0 if not assigned
+static int32_t getParamSideExt(uint8_t index, const void *value){
+  return (value != NULL) ? intToExt(index,readParamInt(params[index].datatype,value)) : 0;
+}
+
+// Build the response record for a parameter, returns the record length
+static uint8_t buildBinRecord(uint8_t type, uint8_t index, uint8_t *rec){
+  uint8_t nameLen;
+
+  rec[0] = type;
+  rec[2] = index;
+  if (type == DBG_TLV_VALUES){
+    putLE32(&rec[3], getParamSideExt(index,params[index].valueL));
+    putLE32(&rec[7], getParamSideExt(index,params[index].valueR));
+    rec[1] = 9;
+  }else{
+    nameLen = strlen(params[index].name);
+    if (nameLen > DEBUG_BIN_NAME_MAX) nameLen = DEBUG_BIN_NAME_MAX;
+    rec[3] = params[index].type;
+    rec[4] = params[index].datatype;
+    rec[5] = (params[index].valueL != NULL) | (params[index].valueR != NULL) << 1;
+    rec[6] = params[index].addr;
+    rec[7] = params[index].addr >> 8;
+    putLE32(&rec[8], params[index].min);
+    putLE32(&rec[12], params[index].max);
+    rec[16] = params[index].div;
+    rec[17] = params[index].mul;
+    rec[18] = params[index].fix;
+    putLE32(&rec[19], getParamSideExt(index,params[index].valueL));
+    putLE32(&rec[23], getParamSideExt(index,params[index].valueR));
+    memcpy(&rec[27], params[index].name, nameLen);
+    rec[1] = 25 + nameLen;
+  }
+  return rec[1] + 2;
+}
+
+// Start a schema or values response, text output is held back until it is sent
+static void startBinResponse(uint8_t type){
+  uint8_t rec[27 + DEBUG_BIN_NAME_MAX];
+  binTxLen = 0;
+  for(int i=0;i<PARAM_SIZE(params);i++) binTxLen += buildBinRecord(type,i,rec);
+  binTxType  = type;
+  binTxHdr   = 1;
+  binTxIndex = 0;
+  logHold    = 1;
+}
+
+// Send as much of the response in progress as fits in the Tx buffer, the rest follows on the next call
+static void sendBinResponse(void){
+  uint8_t rec[27 + DEBUG_BIN_NAME_MAX];
+  uint8_t len;
+
+  if (binTxHdr){
+    if (logFree() < DEBUG_BIN_HDR_LEN) return;
+    putBinHeader(rec,binTxLen);
+    binTxCrc = calcCRC16(rec,DEBUG_BIN_HDR_LEN);
+    logWrite(rec,DEBUG_BIN_HDR_LEN);
+    binTxHdr = 0;
+  }
+  while (binTxIndex < PARAM_SIZE(params)){
+    // The values are read when the record is sent, each record is consistent but the snapshot spans several calls
+    len = buildBinRecord(binTxType,binTxIndex,rec);
+    if (logFree() < len + 2) return;
+    binTxCrc = updateCRC16(binTxCrc,rec,len);
+    logWrite(rec,len);
+    binTxIndex++;
+  }
+  rec[0] = binTxCrc;
+  rec[1] = binTxCrc >> 8;
+  logWrite(rec,2);
+  binTxType = 0;
+  logHold   = 0;
+}
+
+// Send the result of the SET records
+static void sendBinStatus(uint8_t error, uint8_t recIndex, uint8_t count){
+  uint8_t  frame[DEBUG_BIN_HDR_LEN + 5 + 2];
+  uint16_t crc;
+  putBinHeader(frame,5);
+  frame[5] = DBG_TLV_STATUS;
+  frame[6] = 3;
+  frame[7] = error;
+  frame[8] = recIndex;
+  frame[9] = count;
+  crc = calcCRC16(frame,sizeof(frame) - 2);
+  frame[10] = crc;
+  frame[11] = crc >> 8;
+  logWrite(frame,sizeof(frame));
+}
+
+// Execute a binary request. All SET records are checked first and then applied together,
+// so the motor control never runs with only part of a new parameter set
+static void execBinRequest(void){
+  uint8_t  *rec = binReq;
+  uint16_t pos;
+  uint8_t  recIndex = 0, count = 0, error = 0, changed = 0, response = 0;
+  int32_t  value;
+
+  for (pos = 0; pos < binReqLen; pos += 2 + rec[1], recIndex++){
+    rec = &binReq[pos];
+    if (pos + 2 > binReqLen || pos + 2 + rec[1] > binReqLen){
+      error = 9;                                                  // record exceeds the frame
+    }else if (rec[0] == DBG_TLV_SET){
+      count++;
+      if (rec[1] != 5){
+        error = 9;                                                // wrong record length
+      }else if (rec[2] >= PARAM_SIZE(params)){
+        error = 2;                                                // Parameter not found
+      }else if (params[rec[2]].type != PARAMETER){
+        error = 3;                                                // Variables cannot be set
+      }else{
+        value = (int32_t)(rec[3] | (rec[4] << 8) | (rec[5] << 16) | ((uint32_t)rec[6] << 24));
+        if (!IN_RANGE(value,params[rec[2]].min,params[rec[2]].max)) error = 4;
+      }
+    }else if (rec[0] == DBG_TLV_SCHEMA || rec[0] == DBG_TLV_VALUES){
+      response = rec[0];
+    }
+    if (error) break;                                             // unknown records are skipped
+  }
+
+  if (count && !error){
+    __disable_irq();
+    for (pos = 0; pos < binReqLen; pos += 2 + rec[1]){
+      rec = &binReq[pos];
+      if (rec[0] == DBG_TLV_SET){
+        value = (int32_t)(rec[3] | (rec[4] << 8) | (rec[5] << 16) | ((uint32_t)rec[6] << 24));
+        changed |= storeParamValInt(rec[2],extToInt(rec[2],value));
+      }
+    }
+    __enable_irq();
+    for (pos = 0; pos < binReqLen; pos += 2 + rec[1]){
+      rec = &binReq[pos];
+      if (rec[0] == DBG_TLV_SET && params[rec[2]].callback_function) (*params[rec[2]].callback_function)();
+    }
+    if (changed) beepShort(5);
+  }
+
+  if (count || error) sendBinStatus(error,error ? recIndex : 0,error ? 0 : count);
+  if (response && !error) startBinResponse(response);
+}
+
+// Assemble text lines and binary frames from the received data, called in the USART interrupt
+// A binary frame starts with the low byte of SERIAL_START_FRAME, which is not a valid start of a text line
+void debug_rx(const uint8_t *data, uint32_t len){
+  uint32_t frameLen;
+  uint8_t  c;
+
+  while (len--){
+    c = *data++;
+    if (binRxLen || (lineLen == 0 && c == (uint8_t)SERIAL_START_FRAME)){
+      binRx[binRxLen++] = c;
+      frameLen = DEBUG_BIN_HDR_LEN + (binRx[3] | (binRx[4] << 8)) + 2;
+      if (binRxLen == 2 && c != (uint8_t)(SERIAL_START_FRAME >> 8)){
+        binRxLen = 0;                                             // Not a frame start
+      }else if (binRxLen == DEBUG_BIN_HDR_LEN && (binRx[2] != DEBUG_BIN_VERSION || frameLen > DEBUG_BIN_HDR_LEN + DEBUG_BIN_DATA_MAX + 2)){
+        binRxLen = 0;                                             // Unknown version or too long
+      }else if (binRxLen > DEBUG_BIN_HDR_LEN && binRxLen == frameLen){
+        // Complete frame: keep it if the CRC is correct and the previous request was executed
+        if (!binReqPending && calcCRC16(binRx,frameLen - 2) == (binRx[frameLen - 2] | (binRx[frameLen - 1] << 8))){
+          binReqLen = frameLen - DEBUG_BIN_HDR_LEN - 2;
+          memcpy(binReq,&binRx[DEBUG_BIN_HDR_LEN],binReqLen);
+          binReqPending = 1;
+        }
+        binRxLen = 0;
+      }
+    }else if (c == '\n' || c == '\r'){
+      // End of line: parse the command, empty lines are ignored
+      if (lineLen){
+        lineBuf[lineLen++] = c;
+        handle_input(lineBuf,lineLen);
+        lineLen = 0;
+      }
+    }else if (lineLen < DEBUG_LINE_SIZE - 1){
+      lineBuf[lineLen++] = c;
+    }
+  }
+}
+
 // Parse and save the command to be executed
 void handle_input(uint8_t *userCommand, uint32_t len)
 {
@@ -489,12 +914,10 @@ void handle_input(uint8_t *userCommand, uint32_t len)
   if (command.semaphore == 1) return;
 
   // Check end of line
-  userCommand+=len-1; // Go to last char
-  if (*userCommand != '\n' && *userCommand != '\r'){
+  if (len == 0 || (userCommand[len-1] != '\n' && userCommand[len-1] != '\r')){
     command.error = 7; // Error - End of line expected
     return;
   }
-  userCommand-=len-1; // Come back
 
   int8_t  cindex = -1;
   int8_t  pindex = -1;
@@ -561,6 +984,7 @@ void handle_input(uint8_t *userCommand, uint32_t len)
   }
   
   int32_t value = 0;
+  int32_t limit = params[pindex].max > MAX_int16_T ? MAX_int32_T : MAX_int16_T;   // int32 values for the wider parameters, e.g. TLM_FIELDS
   int8_t  sign  = 1;
   int8_t  count = 0;
 
@@ -568,10 +992,10 @@ void handle_input(uint8_t *userCommand, uint32_t len)
   if (*userCommand == '-'){len-=1;userCommand+=1;sign =-1;} 
   // Read value
   for (value=0; (unsigned)*userCommand-'0'<10; userCommand++){
+    // Error - Value out of range
+    if (value>(limit-(*userCommand-'0'))/10){command.error = 4;return;}
     value = 10*value+(*userCommand-'0');
     count++;
-    // Error - Value out of range
-    if (value>MAX_int16_T){command.error = 4;return;}
   }
 
   if (count == 0){
@@ -603,6 +1027,30 @@ void handle_input(uint8_t *userCommand, uint32_t len)
 
 void process_debug()
 {
+
+  // Text printed while a binary response was sent goes out first
+  logFlush();
+
+  // Finish the binary response in progress first, nothing else is printed meanwhile
+  if (binTxType){
+    sendBinResponse();
+    return;
+  }
+
+  // Execute the binary request
+  if (binReqPending){
+    execBinRequest();
+    binReqPending = 0;
+    if (binTxType) return;
+  }
+
+  #ifdef FAULT_BLACKBOX
+  // Finish printing the fault snapshots first
+  if (bboxPrint()) return;
+  #endif
+
+  // Finish the HELP/GET dump first
+  if (printAllStep()) return;
   
   // Print parameters from watch list
   printParamVal();
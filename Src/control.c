@@ -5,6 +5,7 @@
 #include "defines.h"
 #include "setup.h"
 #include "config.h"
+#include "util.h"
 
 TIM_HandleTypeDef TimHandle;
 TIM_HandleTypeDef TimHandle2;
@@ -27,6 +28,12 @@ uint32_t ppm_timeout = 0;
 
 bool ppm_valid = true;
 
+#if defined(CONTROL_PPM_LEFT)
+  #define PPM_IN_IDX  CONTROL_PPM_LEFT
+#else
+  #define PPM_IN_IDX  CONTROL_PPM_RIGHT
+#endif
+
 void PPM_ISR_Callback(void) {
   // Dummy loop with 16 bit count wrap around
   uint16_t rc_delay = TIM2->CNT;
@@ -38,6 +45,7 @@ void PPM_ISR_Callback(void) {
       timeoutCntGen = 0;
       timeoutFlgGen = 0;
       memcpy(ppm_captured_value, ppm_captured_value_buffer, sizeof(ppm_captured_value));
+      LATENCY_ARRIVE_IN(PPM_IN_IDX);
     }
     ppm_valid = true;
     ppm_count = 0;
@@ -112,6 +120,12 @@ uint16_t pwm_CNT_prev_ch2 = 0;
 uint32_t pwm_timeout_ch1 = 0;
 uint32_t pwm_timeout_ch2 = 0;
 
+#if defined(CONTROL_PWM_LEFT)
+  #define PWM_IN_IDX  CONTROL_PWM_LEFT
+#else
+  #define PWM_IN_IDX  CONTROL_PWM_RIGHT
+#endif
+
 void PWM_ISR_CH1_Callback(void) {
   // Dummy loop with 16 bit count wrap around
   if(HAL_GPIO_ReadPin(PWM_PORT_CH1, PWM_PIN_CH1)) {   // Rising  Edge interrupt -> save timer value OR reset timer
@@ -128,6 +142,7 @@ void PWM_ISR_CH1_Callback(void) {
       timeoutFlgGen = 0;
       pwm_timeout_ch1 = 0;
       pwm_captured_ch1_value = CLAMP(rc_signal, 1000, 2000) - 1000;
+      LATENCY_ARRIVE_IN(PWM_IN_IDX);
     }
   }
 }
@@ -148,6 +163,7 @@ void PWM_ISR_CH2_Callback(void) {
       timeoutFlgGen = 0;
       pwm_timeout_ch2 = 0;
       pwm_captured_ch2_value = CLAMP(rc_signal, 1000, 2000) - 1000;
+      LATENCY_ARRIVE_IN(PWM_IN_IDX);
     }
   }
 }
@@ -243,6 +259,9 @@ void Nunchuk_Read(void) {
   if (HAL_I2C_Master_Receive(&hi2c2,0xA4,(uint8_t*)nunchuk_data, 6, 10) == HAL_OK) {
     timeoutCntGen = 0;
     timeoutFlgGen = 0;
+    #ifdef CONTROL_NUNCHUK
+    LATENCY_ARRIVE_IN(CONTROL_NUNCHUK);
+    #endif
   }
 
   #ifndef TRANSPOTTER
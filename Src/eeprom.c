@@ -44,296 +44,262 @@
 
 /* Private typedef -----------------------------------------------------------*/
 /* Private define ------------------------------------------------------------*/
+/* Page states kept in RAM */
+#define EE_PAGE_FREE          ((uint8_t)0x00)       /* Erased, only the erase cycles are written */
+#define EE_PAGE_USED          ((uint8_t)0x01)       /* Holds records */
+#define EE_PAGE_DIRTY         ((uint8_t)0x02)       /* Compacted page or interrupted open/erase: to erase */
+
 /* Private macro -------------------------------------------------------------*/
-/* Private variables ---------------------------------------------------------*/
+#define EE_PAGE_ADDRESS(Page) ((uint32_t)(EEPROM_START_ADDRESS + (uint32_t)(Page) * PAGE_SIZE))
 
-/* Global variable used to store variable value in read sequence */
-uint16_t DataVar = 0;
+/* Private variables ---------------------------------------------------------*/
 
 /* Virtual address defined by the user: 0xFFFF value is prohibited */
 extern uint16_t VirtAddVarTab[NB_OF_VAR];
 
+/* Pages read by EE_Init: state, sequence number and erase cycles */
+static uint8_t  EE_PageState[EE_PAGES];
+static uint16_t EE_PageSeq[EE_PAGES];
+static uint16_t EE_PageErases[EE_PAGES];
+
+/* Page taking the new records and offset of its first free record */
+static uint16_t EE_Head = NO_VALID_PAGE;
+static uint16_t EE_HeadOffset = 0;
+
+/* RAM index: page and offset of the last committed record of each
+   VirtAddVarTab variable, NO_VALID_PAGE if the variable is not stored */
+static uint8_t  EE_IndexPage[NB_OF_VAR];
+static uint16_t EE_IndexOffset[NB_OF_VAR];
+
+/* Records appended and batches saved since EE_Init, for the projected life */
+static uint32_t EE_Records = 0;
+static uint32_t EE_Batches = 0;
+
 /* Private function prototypes -----------------------------------------------*/
 /* Private functions ---------------------------------------------------------*/
-static HAL_StatusTypeDef EE_Format(void);
-static uint16_t EE_FindValidPage(uint8_t Operation);
-static uint16_t EE_VerifyPageFullWriteVariable(uint16_t VirtAddress, uint16_t Data);
-static uint16_t EE_PageTransfer(uint16_t VirtAddress, uint16_t Data);
 static uint16_t EE_VerifyPageFullyErased(uint32_t Address);
+static HAL_StatusTypeDef EE_PageOpen(uint16_t Page);
+static HAL_StatusTypeDef EE_PageErase(uint16_t Page);
+static uint16_t EE_FreePage(void);
+static uint16_t EE_FreePages(void);
+static uint16_t EE_OldestPage(void);
+static uint16_t EE_Append(uint16_t* VirtAddress, uint16_t* Data, uint16_t NbVar, uint16_t Reserve);
+static uint16_t EE_Compact(void);
+static uint16_t EE_LegacyRead(uint32_t PageStartAddress, uint16_t* VirtAddress, uint16_t* Data);
+static int16_t  EE_IndexFind(uint16_t VirtAddress);
+static void     EE_IndexBuild(uint16_t Page);
+static HAL_StatusTypeDef EE_ProgramRecord(uint32_t Address, uint16_t VirtAddress, uint16_t Data);
+static uint16_t EE_BatchSum(uint16_t Sum, uint16_t VirtAddress, uint16_t Data);
+static uint8_t  EE_BatchEnd(uint32_t PageStartAddress, uint32_t* Offset);
 
 /**
-  * @brief  Restore the pages to a known good state in case of page's status
-  *   corruption after a power loss.
+  * @brief  Read the pages, erase the ones left by a power loss and build the
+  *   RAM index. An empty store takes the variables of the two page format.
   * @param  None.
   * @retval - Flash error code: on write Flash error
   *         - FLASH_COMPLETE: on success
   */
 uint16_t EE_Init(void)
 {
-  uint16_t pagestatus0 = 6, pagestatus1 = 6;
-  uint16_t varidx = 0;
-  uint16_t eepromstatus = 0, readstatus = 0;
-  int16_t x = -1;
-  HAL_StatusTypeDef  flashstatus;
+  uint16_t page = 0, older = 0, magic = 0, seq = 0, erases = 0, obsolete = 0, maxerases = 0;
+  uint16_t legacyaddr[NB_OF_VAR], legacydata[NB_OF_VAR], legacyvars = 0;
+  uint16_t eepromstatus = 0;
+  uint32_t pagestartaddress = EEPROM_START_ADDRESS, legacypage = 0, offset = 0;
+  uint32_t age = 0, prevage = 0;
+  int16_t  varidx = 0;
+  HAL_StatusTypeDef flashstatus;
   uint32_t page_error = 0;
   FLASH_EraseInitTypeDef s_eraseinit;
 
+  EE_Head = NO_VALID_PAGE;
+  for (varidx = 0; varidx < NB_OF_VAR; varidx++)
+  {
+    EE_IndexPage[varidx] = NO_VALID_PAGE;
+  }
 
-  /* Get Page0 status */
-  pagestatus0 = (*(__IO uint16_t*)PAGE0_BASE_ADDRESS);
-  /* Get Page1 status */
-  pagestatus1 = (*(__IO uint16_t*)PAGE1_BASE_ADDRESS);
-
-  /* Fill EraseInit structure*/
-  s_eraseinit.TypeErase   = FLASH_TYPEERASE_PAGES;
-  s_eraseinit.PageAddress = PAGE0_ID;
-  s_eraseinit.NbPages     = 1;
-
-  /* Check for invalid header states and repair if necessary */
-  switch (pagestatus0)
+  /* Read the page headers */
+  for (page = 0; page < EE_PAGES; page++)
   {
-    case ERASED:
-      if (pagestatus1 == VALID_PAGE) /* Page0 erased, Page1 valid */
-      {
-          /* Erase Page0 */
-        if(!EE_VerifyPageFullyErased(PAGE0_BASE_ADDRESS))
-        {
-          flashstatus = HAL_FLASHEx_Erase(&s_eraseinit, &page_error);
-          /* If erase operation was failed, a Flash error code is returned */
-          if (flashstatus != HAL_OK)
-          {
-            return flashstatus;
-          }
-        }
-      }
-      else if (pagestatus1 == RECEIVE_DATA) /* Page0 erased, Page1 receive */
-      {
-        /* Erase Page0 */
-        if(!EE_VerifyPageFullyErased(PAGE0_BASE_ADDRESS))
-        {
-          flashstatus = HAL_FLASHEx_Erase(&s_eraseinit, &page_error);
-          /* If erase operation was failed, a Flash error code is returned */
-          if (flashstatus != HAL_OK)
-          {
-            return flashstatus;
-          }
-        }
-        /* Mark Page1 as valid */
-        flashstatus = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, PAGE1_BASE_ADDRESS, VALID_PAGE);
-        /* If program operation was failed, a Flash error code is returned */
-        if (flashstatus != HAL_OK)
-        {
-          return flashstatus;
-        }
-      }
-      else /* First EEPROM access (Page0&1 are erased) or invalid state -> format EEPROM */
+    pagestartaddress = EE_PAGE_ADDRESS(page);
+    magic    = (*(__IO uint16_t*)pagestartaddress);
+    seq      = (*(__IO uint16_t*)(pagestartaddress + EE_HDR_SEQ));
+    erases   = (*(__IO uint16_t*)(pagestartaddress + EE_HDR_ERASES));
+    obsolete = (*(__IO uint16_t*)(pagestartaddress + EE_HDR_OBSOLETE));
+
+    EE_PageSeq[page]    = seq;
+    EE_PageErases[page] = erases;
+    if (magic == EE_PAGE_MAGIC && obsolete == ERASED)
+    {
+      EE_PageState[page] = EE_PAGE_USED;
+      if (EE_Head == NO_VALID_PAGE || (int16_t)(seq - EE_PageSeq[EE_Head]) > 0)
       {
-        /* Erase both Page0 and Page1 and set Page0 as valid page */
-        flashstatus = EE_Format();
-        /* If erase/program operation was failed, a Flash error code is returned */
-        if (flashstatus != HAL_OK)
-        {
-          return flashstatus;
-        }
+        EE_Head = page;
       }
-      break;
+    }
+    else if (magic == ERASED && seq == ERASED && obsolete == ERASED &&
+             EE_VerifyPageFullyErased(pagestartaddress + EE_HDR_SIZE))
+    {
+      EE_PageState[page] = EE_PAGE_FREE;
+    }
+    else
+    {
+      EE_PageState[page] = EE_PAGE_DIRTY;
+    }
+    if (erases != ERASED && erases > maxerases)
+    {
+      maxerases = erases;
+    }
+  }
+  /* Erase cycles not written back after a power loss: assume the most worn page */
+  for (page = 0; page < EE_PAGES; page++)
+  {
+    if (EE_PageErases[page] == ERASED)
+    {
+      EE_PageErases[page] = maxerases;
+    }
+  }
 
-    case RECEIVE_DATA:
-      if (pagestatus1 == VALID_PAGE) /* Page0 receive, Page1 valid */
-      {
-        /* Transfer data from Page1 to Page0 */
-        for (varidx = 0; varidx < NB_OF_VAR; varidx++)
-        {
-          if (( *(__IO uint16_t*)(PAGE0_BASE_ADDRESS + 6)) == VirtAddVarTab[varidx])
-          {
-            x = varidx;
-          }
-          if (varidx != x)
-          {
-            /* Read the last variables' updates */
-            readstatus = EE_ReadVariable(VirtAddVarTab[varidx], &DataVar);
-            /* In case variable corresponding to the virtual address was found */
-            if (readstatus != 0x1)
-            {
-              /* Transfer the variable to the Page0 */
-              eepromstatus = EE_VerifyPageFullWriteVariable(VirtAddVarTab[varidx], DataVar);
-              /* If program operation was failed, a Flash error code is returned */
-              if (eepromstatus != HAL_OK)
-              {
-                return eepromstatus;
-              }
-            }
-          }
-        }
-        /* Mark Page0 as valid */
-        flashstatus = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, PAGE0_BASE_ADDRESS, VALID_PAGE);
-        /* If program operation was failed, a Flash error code is returned */
-        if (flashstatus != HAL_OK)
-        {
-          return flashstatus;
-        }
-        s_eraseinit.TypeErase   = FLASH_TYPEERASE_PAGES;
-        s_eraseinit.PageAddress = PAGE1_ID;
-        s_eraseinit.NbPages     = 1;
-        /* Erase Page1 */
-        if(!EE_VerifyPageFullyErased(PAGE1_BASE_ADDRESS))
-        {
-          flashstatus = HAL_FLASHEx_Erase(&s_eraseinit, &page_error);
-          /* If erase operation was failed, a Flash error code is returned */
-          if (flashstatus != HAL_OK)
-          {
-            return flashstatus;
-          }
-        }
-      }
-      else if (pagestatus1 == ERASED) /* Page0 receive, Page1 erased */
-      {
-        s_eraseinit.TypeErase   = FLASH_TYPEERASE_PAGES;
-        s_eraseinit.PageAddress = PAGE1_ID;
-        s_eraseinit.NbPages     = 1;
-        /* Erase Page1 */
-        if(!EE_VerifyPageFullyErased(PAGE1_BASE_ADDRESS))
-        {
-          flashstatus = HAL_FLASHEx_Erase(&s_eraseinit, &page_error);
-          /* If erase operation was failed, a Flash error code is returned */
-          if (flashstatus != HAL_OK)
-          {
-            return flashstatus;
-          }
-        }
-        /* Mark Page0 as valid */
-        flashstatus = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, PAGE0_BASE_ADDRESS, VALID_PAGE);
-        /* If program operation was failed, a Flash error code is returned */
-        if (flashstatus != HAL_OK)
-        {
-          return flashstatus;
-        }
-      }
-      else /* Invalid state -> format eeprom */
-      {
-        /* Erase both Page0 and Page1 and set Page0 as valid page */
-        flashstatus = EE_Format();
-        /* If erase/program operation was failed, a Flash error code is returned */
-        if (flashstatus != HAL_OK)
-        {
-          return flashstatus;
-        }
-      }
-      break;
+  /* Empty store: read the variables of the two page format */
+  if (EE_Head == NO_VALID_PAGE)
+  {
+    if ((*(__IO uint16_t*)PAGE0_BASE_ADDRESS) == VALID_PAGE)
+    {
+      legacypage = PAGE0_BASE_ADDRESS;
+    }
+    else if ((*(__IO uint16_t*)PAGE1_BASE_ADDRESS) == VALID_PAGE)
+    {
+      legacypage = PAGE1_BASE_ADDRESS;
+    }
+    else if ((*(__IO uint16_t*)PAGE0_BASE_ADDRESS) == RECEIVE_DATA)
+    {
+      legacypage = PAGE0_BASE_ADDRESS;
+    }
+    else if ((*(__IO uint16_t*)PAGE1_BASE_ADDRESS) == RECEIVE_DATA)
+    {
+      legacypage = PAGE1_BASE_ADDRESS;
+    }
+    if (legacypage != 0)
+    {
+      legacyvars = EE_LegacyRead(legacypage, legacyaddr, legacydata);
+    }
+  }
 
-    case VALID_PAGE:
-      if (pagestatus1 == VALID_PAGE) /* Invalid state -> format eeprom */
+  /* Erase the pages left by a power loss, a page of the two page format once imported */
+  for (page = 0; page < EE_PAGES; page++)
+  {
+    if (EE_PageState[page] == EE_PAGE_DIRTY && EE_PAGE_ADDRESS(page) != legacypage)
+    {
+      flashstatus = EE_PageErase(page);
+      /* If erase operation was failed, a Flash error code is returned */
+      if (flashstatus != HAL_OK)
       {
-        /* Erase both Page0 and Page1 and set Page0 as valid page */
-        flashstatus = EE_Format();
-        /* If erase/program operation was failed, a Flash error code is returned */
-        if (flashstatus != HAL_OK)
-        {
-          return flashstatus;
-        }
+        return flashstatus;
       }
-      else if (pagestatus1 == ERASED) /* Page0 valid, Page1 erased */
+    }
+  }
+
+  if (EE_Head == NO_VALID_PAGE)
+  {
+    /* First EEPROM access: open the first page, one batch with the imported variables */
+    flashstatus = EE_PageOpen(EE_FreePage());
+    /* If program operation was failed, a Flash error code is returned */
+    if (flashstatus != HAL_OK)
+    {
+      return flashstatus;
+    }
+    if (legacyvars != 0)
+    {
+      eepromstatus = EE_Append(legacyaddr, legacydata, legacyvars, 0);
+      if (eepromstatus != HAL_OK)
       {
-        s_eraseinit.TypeErase   = FLASH_TYPEERASE_PAGES;
-        s_eraseinit.PageAddress = PAGE1_ID;
-        s_eraseinit.NbPages     = 1;
-        /* Erase Page1 */
-        if(!EE_VerifyPageFullyErased(PAGE1_BASE_ADDRESS))
-        {
-          flashstatus = HAL_FLASHEx_Erase(&s_eraseinit, &page_error);
-          /* If erase operation was failed, a Flash error code is returned */
-          if (flashstatus != HAL_OK)
-          {
-            return flashstatus;
-          }
-        }
+        return eepromstatus;
       }
-      else /* Page0 valid, Page1 receive */
+    }
+    if (legacypage == PAGE0_BASE_ADDRESS)
+    {
+      flashstatus = EE_PageErase(0);
+      if (flashstatus != HAL_OK)
       {
-        /* Transfer data from Page0 to Page1 */
-        for (varidx = 0; varidx < NB_OF_VAR; varidx++)
-        {
-          if ((*(__IO uint16_t*)(PAGE1_BASE_ADDRESS + 6)) == VirtAddVarTab[varidx])
-          {
-            x = varidx;
-          }
-          if (varidx != x)
-          {
-            /* Read the last variables' updates */
-            readstatus = EE_ReadVariable(VirtAddVarTab[varidx], &DataVar);
-            /* In case variable corresponding to the virtual address was found */
-            if (readstatus != 0x1)
-            {
-              /* Transfer the variable to the Page1 */
-              eepromstatus = EE_VerifyPageFullWriteVariable(VirtAddVarTab[varidx], DataVar);
-              /* If program operation was failed, a Flash error code is returned */
-              if (eepromstatus != HAL_OK)
-              {
-                return eepromstatus;
-              }
-            }
-          }
-        }
-        /* Mark Page1 as valid */
-        flashstatus = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, PAGE1_BASE_ADDRESS, VALID_PAGE);
-        /* If program operation was failed, a Flash error code is returned */
-        if (flashstatus != HAL_OK)
-        {
-          return flashstatus;
-        }
-        s_eraseinit.TypeErase   = FLASH_TYPEERASE_PAGES;
-        s_eraseinit.PageAddress = PAGE0_ID;
-        s_eraseinit.NbPages     = 1;
-        /* Erase Page0 */
-        if(!EE_VerifyPageFullyErased(PAGE0_BASE_ADDRESS))
-        {
-          flashstatus = HAL_FLASHEx_Erase(&s_eraseinit, &page_error);
-          /* If erase operation was failed, a Flash error code is returned */
-          if (flashstatus != HAL_OK)
-          {
-            return flashstatus;
-          }
-        }
+        return flashstatus;
       }
-      break;
+    }
+  }
 
-    default:  /* Any other state -> format eeprom */
-      /* Erase both Page0 and Page1 and set Page0 as valid page */
-      flashstatus = EE_Format();
-      /* If erase/program operation was failed, a Flash error code is returned */
-      if (flashstatus != HAL_OK)
+  /* The page of the two page format above the store is not used any more: erased
+     once if it still holds its data, any other content is left alone */
+  if ((*(__IO uint16_t*)PAGE1_BASE_ADDRESS) == VALID_PAGE ||
+      (*(__IO uint16_t*)PAGE1_BASE_ADDRESS) == RECEIVE_DATA)
+  {
+    s_eraseinit.TypeErase   = FLASH_TYPEERASE_PAGES;
+    s_eraseinit.PageAddress = PAGE1_BASE_ADDRESS;
+    s_eraseinit.NbPages     = 1;
+    flashstatus = HAL_FLASHEx_Erase(&s_eraseinit, &page_error);
+    /* If erase operation was failed, a Flash error code is returned */
+    if (flashstatus != HAL_OK)
+    {
+      return flashstatus;
+    }
+  }
+
+  /* Index the pages from the oldest one: the last committed record of a variable wins */
+  prevage = 0x10000;
+  do
+  {
+    older = NO_VALID_PAGE;
+    for (page = 0; page < EE_PAGES; page++)
+    {
+      age = (uint16_t)(EE_PageSeq[EE_Head] - EE_PageSeq[page]);
+      if (EE_PageState[page] == EE_PAGE_USED && age < prevage &&
+          (older == NO_VALID_PAGE || age > (uint16_t)(EE_PageSeq[EE_Head] - EE_PageSeq[older])))
       {
-        return flashstatus;
+        older = page;
       }
+    }
+    if (older != NO_VALID_PAGE)
+    {
+      EE_IndexBuild(older);
+      prevage = (uint16_t)(EE_PageSeq[EE_Head] - EE_PageSeq[older]);
+    }
+  } while (older != NO_VALID_PAGE && prevage != 0);
+
+  /* The new records follow the last programmed one of the head page */
+  pagestartaddress = EE_PAGE_ADDRESS(EE_Head);
+  for (offset = PAGE_SIZE; offset > EE_HDR_SIZE; offset -= 4)
+  {
+    if ((*(__IO uint32_t*)(pagestartaddress + offset - 4)) != 0xFFFFFFFF)
+    {
       break;
+    }
   }
+  EE_HeadOffset = (uint16_t)offset;
+
+  EE_Records = 0;
+  EE_Batches = 0;
 
   return HAL_OK;
 }
 
 /**
-  * @brief  Verify if specified page is fully erased.
-  * @param  Address: page address
-  *   This parameter can be one of the following values:
-  *     @arg PAGE0_BASE_ADDRESS: Page0 base address
-  *     @arg PAGE1_BASE_ADDRESS: Page1 base address
+  * @brief  Verify if a page is erased from the specified address to its end.
+  * @param  Address: first address to check
   * @retval page fully erased status:
   *           - 0: if Page not erased
   *           - 1: if Page erased
   */
-uint16_t EE_VerifyPageFullyErased(uint32_t Address)
+static uint16_t EE_VerifyPageFullyErased(uint32_t Address)
 {
   uint32_t readstatus = 1;
-  uint16_t addressvalue = 0x5555;
+  uint32_t addressvalue = 0x55555555;
+  uint32_t endaddress = (Address & ~(PAGE_SIZE - 1)) + PAGE_SIZE - 1;
 
-  /* Check each active page address starting from end */
-  while (Address <= PAGE0_END_ADDRESS)
+  /* Check each address up to the end of the page */
+  while (Address <= endaddress)
   {
-    /* Get the current location content to be compared with virtual address */
-    addressvalue = (*(__IO uint16_t*)Address);
+    /* Get the current location content, data and virtual address */
+    addressvalue = (*(__IO uint32_t*)Address);
 
     /* Compare the read address with the virtual address */
-    if (addressvalue != ERASED)
+    if (addressvalue != 0xFFFFFFFF)
     {
 
       /* In case variable value is read, reset readstatus flag */
@@ -361,50 +327,54 @@ uint16_t EE_VerifyPageFullyErased(uint32_t Address)
   */
 uint16_t EE_ReadVariable(uint16_t VirtAddress, uint16_t* Data)
 {
-  uint16_t validpage = PAGE0;
-  uint16_t addressvalue = 0x5555, readstatus = 1;
-  uint32_t address = EEPROM_START_ADDRESS, PageStartAddress = EEPROM_START_ADDRESS;
-
-  /* Get active Page for read operation */
-  validpage = EE_FindValidPage(READ_FROM_VALID_PAGE);
+  int16_t varidx = -1;
 
   /* Check if there is no valid page */
-  if (validpage == NO_VALID_PAGE)
+  if (EE_Head == NO_VALID_PAGE)
   {
-    return  NO_VALID_PAGE;
+    return NO_VALID_PAGE;
   }
 
-  /* Get the valid Page start Address */
-  PageStartAddress = (uint32_t)(EEPROM_START_ADDRESS + (uint32_t)(validpage * PAGE_SIZE));
-
-  /* Get the valid Page end Address */
-  address = (uint32_t)((EEPROM_START_ADDRESS - 2) + (uint32_t)((1 + validpage) * PAGE_SIZE));
-
-  /* Check each active page address starting from end */
-  while (address > (PageStartAddress + 2))
+  /* The variables are read through the RAM index */
+  varidx = EE_IndexFind(VirtAddress);
+  if (varidx < 0 || EE_IndexPage[varidx] == NO_VALID_PAGE)
   {
-    /* Get the current location content to be compared with virtual address */
-    addressvalue = (*(__IO uint16_t*)address);
+    return 1;
+  }
+  *Data = (*(__IO uint16_t*)(EE_PAGE_ADDRESS(EE_IndexPage[varidx]) + EE_IndexOffset[varidx]));
 
-    /* Compare the read address with the virtual address */
-    if (addressvalue == VirtAddress)
-    {
-      /* Get content of Address-2 which is variable value */
-      *Data = (*(__IO uint16_t*)(address - 2));
+  return 0;
+}
 
-      /* In case variable value is read, reset readstatus flag */
-      readstatus = 0;
+/**
+  * @brief  Returns the last stored values of several variables, e.g. a record
+  *   written by one EE_WriteVariables call. Variables not stored keep their Data.
+  * @param  VirtAddress: virtual addresses of the variables, from VirtAddVarTab
+  * @param  Data: read values of the variables
+  * @param  NbVar: number of variables
+  * @retval Success or error status:
+  *           - 0: if all the variables were found
+  *           - 1: if at least one variable was not found
+  *           - NO_VALID_PAGE: if no valid page was found.
+  */
+uint16_t EE_ReadVariables(uint16_t* VirtAddress, uint16_t* Data, uint16_t NbVar)
+{
+  uint16_t varidx = 0, readstatus = 0;
 
-      break;
-    }
-    else
+  for (varidx = 0; varidx < NbVar; varidx++)
+  {
+    switch (EE_ReadVariable(VirtAddress[varidx], &Data[varidx]))
     {
-      /* Next address location */
-      address = address - 4;
+      case 0:
+        break;
+      case NO_VALID_PAGE:
+        return NO_VALID_PAGE;
+      default:
+        readstatus = 1;
+        break;
     }
   }
 
-  /* Return readstatus value: (0: variable exist, 1: variable doesn't exist) */
   return readstatus;
 }
 
@@ -414,313 +384,626 @@ uint16_t EE_ReadVariable(uint16_t VirtAddress, uint16_t* Data)
   * @param  Data: 16 bit data to be written
   * @retval Success or error status:
   *           - FLASH_COMPLETE: on success
-  *           - PAGE_FULL: if valid page is full
+  *           - PAGE_FULL: if no page could be compacted
   *           - NO_VALID_PAGE: if no valid page was found
+  *           - HAL_ERROR: if the virtual address is not in VirtAddVarTab
   *           - Flash error code: on write Flash error
   */
 uint16_t EE_WriteVariable(uint16_t VirtAddress, uint16_t Data)
 {
-  uint16_t Status = 0;
+  /* A batch of one record: a record torn by a power loss is not read back */
+  return EE_WriteVariables(&VirtAddress, &Data, 1);
+}
+
+/**
+  * @brief  Writes/updates a set of variables as one batch: the records are
+  *   enclosed in EE_BATCH_BEGIN/EE_BATCH_COMMIT markers and are only read back
+  *   once the commit marker is written, so a power loss keeps either all the
+  *   old or all the new values. The batch is appended to the head page, or to
+  *   the next erased page; the pages are compacted by EE_Process, here only if
+  *   no erased page is left.
+  * @param  VirtAddress: virtual addresses of the variables, from VirtAddVarTab
+  * @param  Data: 16 bit data to be written, one per virtual address
+  * @param  NbVar: number of variables
+  * @retval Success or error status:
+  *           - FLASH_COMPLETE: on success
+  *           - PAGE_FULL: if the batch does not fit in a page
+  *           - NO_VALID_PAGE: if no valid page was found
+  *           - HAL_ERROR: if a virtual address is not in VirtAddVarTab
+  *           - Flash error code: on write Flash error
+  */
+uint16_t EE_WriteVariables(uint16_t* VirtAddress, uint16_t* Data, uint16_t NbVar)
+{
+  uint16_t varidx = 0, eepromstatus = 0;
+
+  if (NbVar == 0)
+  {
+    return HAL_OK;
+  }
+  /* The batch has to fit in a page next to the markers */
+  if (NbVar + 2 > EE_PAGE_RECORDS)
+  {
+    return PAGE_FULL;
+  }
+  for (varidx = 0; varidx < NbVar; varidx++)
+  {
+    if (EE_IndexFind(VirtAddress[varidx]) < 0)
+    {
+      return HAL_ERROR;
+    }
+  }
+
+  /* Check if there is no valid page */
+  if (EE_Head == NO_VALID_PAGE)
+  {
+    return NO_VALID_PAGE;
+  }
+
+  /* One erased page stays reserved for the compaction */
+  eepromstatus = EE_Append(VirtAddress, Data, NbVar, 1);
+  if (eepromstatus == HAL_OK)
+  {
+    EE_Batches++;
+  }
+  return eepromstatus;
+}
+
+/**
+  * @brief  Check if a batch can be written without a page erase: it fits in
+  *   the head page, or an erased page is left besides the one reserved for
+  *   the compaction. Otherwise EE_WriteVariables compacts a page first.
+  * @param  NbVar: number of variables
+  * @retval 1 if EE_WriteVariables would not erase a page, 0 otherwise
+  */
+uint8_t EE_WriteReady(uint16_t NbVar)
+{
+  if (EE_Head == NO_VALID_PAGE || NbVar + 2 > EE_PAGE_RECORDS)
+  {
+    return 0;
+  }
+  return EE_HeadOffset + (uint32_t)(NbVar + 2) * 4 <= PAGE_SIZE || EE_FreePages() > 1;
+}
 
-  /* Write the variable virtual address and value in the EEPROM */
-  Status = EE_VerifyPageFullWriteVariable(VirtAddress, Data);
+/**
+  * @brief  Background maintenance, called while a page erase may stall the CPU:
+  *   erases a page left dirty, or compacts the oldest page once less than
+  *   EE_FREE_PAGES pages are erased. One page per call.
+  * @param  None
+  * @retval Success or error status:
+  *           - FLASH_COMPLETE: on success or if there is nothing to do
+  *           - NO_VALID_PAGE: if EE_Init was not called
+  *           - Flash error code: on write Flash error
+  */
+uint16_t EE_Process(void)
+{
+  uint16_t page = 0;
+
+  if (EE_Head == NO_VALID_PAGE)
+  {
+    return NO_VALID_PAGE;
+  }
 
-  /* In case the EEPROM active page is full */
-  if (Status == PAGE_FULL)
+  /* A page whose erase failed */
+  for (page = 0; page < EE_PAGES; page++)
   {
-    /* Perform Page transfer */
-    Status = EE_PageTransfer(VirtAddress, Data);
+    if (EE_PageState[page] == EE_PAGE_DIRTY)
+    {
+      return EE_PageErase(page);
+    }
   }
 
-  /* Return last operation status */
-  return Status;
+  /* The head page is only compacted by the writes, when no other page is in use */
+  if (EE_FreePages() < EE_FREE_PAGES && EE_OldestPage() != EE_Head)
+  {
+    return EE_Compact();
+  }
+  return HAL_OK;
 }
 
 /**
-  * @brief  Erases PAGE and PAGE1 and writes VALID_PAGE header to PAGE
+  * @brief  Erase cycles of the most worn page
   * @param  None
-  * @retval Status of the last operation (Flash write or erase) done during
-  *         EEPROM formating
+  * @retval Erase cycles
   */
-static HAL_StatusTypeDef EE_Format(void)
+uint16_t EE_EraseCycles(void)
 {
-  HAL_StatusTypeDef flashstatus = HAL_OK;
-  uint32_t page_error = 0;
-  FLASH_EraseInitTypeDef s_eraseinit;
+  uint16_t page = 0, erases = 0;
 
-  s_eraseinit.TypeErase   = FLASH_TYPEERASE_PAGES;
-  s_eraseinit.PageAddress = PAGE0_ID;
-  s_eraseinit.NbPages     = 1;
-  /* Erase Page0 */
-  if(!EE_VerifyPageFullyErased(PAGE0_BASE_ADDRESS))
+  for (page = 0; page < EE_PAGES && EE_Head != NO_VALID_PAGE; page++)
   {
-    flashstatus = HAL_FLASHEx_Erase(&s_eraseinit, &page_error);
-    /* If erase operation was failed, a Flash error code is returned */
-    if (flashstatus != HAL_OK)
+    if (EE_PageErases[page] > erases)
     {
-      return flashstatus;
+      erases = EE_PageErases[page];
     }
   }
-  /* Set Page0 as valid page: Write VALID_PAGE at Page0 base address */
-  flashstatus = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, PAGE0_BASE_ADDRESS, VALID_PAGE);
-  /* If program operation was failed, a Flash error code is returned */
+  return erases;
+}
+
+/**
+  * @brief  Projected number of saves until the pages reach EE_ENDURANCE: the
+  *   erase cycles left on all pages, one page of records per cycle, divided by
+  *   the records per EE_WriteVariables call since EE_Init including the copies
+  *   of the compaction (the size of a saveConfig batch before the first save)
+  * @param  None
+  * @retval Remaining saves, 0 if EE_Init was not called
+  */
+uint32_t EE_RemainingLife(void)
+{
+  uint32_t cycles = 0, records = NB_OF_VAR + 2;
+  uint16_t page = 0;
+
+  if (EE_Head == NO_VALID_PAGE)
+  {
+    return 0;
+  }
+  for (page = 0; page < EE_PAGES; page++)
+  {
+    if (EE_PageErases[page] < EE_ENDURANCE)
+    {
+      cycles += EE_ENDURANCE - EE_PageErases[page];
+    }
+  }
+  if (EE_Batches != 0)
+  {
+    records = (EE_Records + EE_Batches / 2) / EE_Batches;
+  }
+  return cycles * EE_PAGE_RECORDS / (records ? records : 1);
+}
+
+/**
+  * @brief  Open an erased page as head page: the erase cycles if they were not
+  *   written back, the next sequence number, then the magic marks it in use
+  * @param  Page: page number
+  * @retval Status of the last Flash programming
+  */
+static HAL_StatusTypeDef EE_PageOpen(uint16_t Page)
+{
+  HAL_StatusTypeDef flashstatus = HAL_OK;
+  uint32_t pagestartaddress = EE_PAGE_ADDRESS(Page);
+  uint16_t seq = 0;
+
+  if (Page == NO_VALID_PAGE)
+  {
+    return HAL_ERROR;
+  }
+  if (EE_Head != NO_VALID_PAGE)
+  {
+    seq = (uint16_t)(EE_PageSeq[EE_Head] + 1);
+  }
+
+  if ((*(__IO uint16_t*)(pagestartaddress + EE_HDR_ERASES)) == ERASED)
+  {
+    flashstatus = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, pagestartaddress + EE_HDR_ERASES, EE_PageErases[Page]);
+  }
+  if (flashstatus == HAL_OK)
+  {
+    flashstatus = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, pagestartaddress + EE_HDR_SEQ, seq);
+  }
+  if (flashstatus == HAL_OK)
+  {
+    flashstatus = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, pagestartaddress, EE_PAGE_MAGIC);
+  }
+  /* If program operation was failed, the page is erased again by EE_Process */
   if (flashstatus != HAL_OK)
   {
+    EE_PageState[Page] = EE_PAGE_DIRTY;
     return flashstatus;
   }
 
-  s_eraseinit.PageAddress = PAGE1_ID;
-  /* Erase Page1 */
-  if(!EE_VerifyPageFullyErased(PAGE1_BASE_ADDRESS))
+  EE_PageState[Page] = EE_PAGE_USED;
+  EE_PageSeq[Page]   = seq;
+  EE_Head            = Page;
+  EE_HeadOffset      = EE_HDR_SIZE;
+  return HAL_OK;
+}
+
+/**
+  * @brief  Erase a page and write back its erase cycles. A page in use is
+  *   first marked obsolete, so an interrupted erase never leaves it readable.
+  * @param  Page: page number, not the head page
+  * @retval Status of the last operation (Flash write or erase)
+  */
+static HAL_StatusTypeDef EE_PageErase(uint16_t Page)
+{
+  HAL_StatusTypeDef flashstatus = HAL_OK;
+  uint32_t pagestartaddress = EE_PAGE_ADDRESS(Page);
+  uint32_t page_error = 0;
+  FLASH_EraseInitTypeDef s_eraseinit;
+
+  if (EE_PageState[Page] == EE_PAGE_USED)
   {
-    flashstatus = HAL_FLASHEx_Erase(&s_eraseinit, &page_error);
-    /* If erase operation was failed, a Flash error code is returned */
+    flashstatus = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, pagestartaddress + EE_HDR_OBSOLETE, 0);
     if (flashstatus != HAL_OK)
     {
       return flashstatus;
     }
   }
+  EE_PageState[Page] = EE_PAGE_DIRTY;
 
-  return HAL_OK;
+  s_eraseinit.TypeErase   = FLASH_TYPEERASE_PAGES;
+  s_eraseinit.PageAddress = pagestartaddress;
+  s_eraseinit.NbPages     = 1;
+  flashstatus = HAL_FLASHEx_Erase(&s_eraseinit, &page_error);
+  /* If erase operation was failed, a Flash error code is returned */
+  if (flashstatus != HAL_OK)
+  {
+    return flashstatus;
+  }
+  if (EE_PageErases[Page] < ERASED - 1)
+  {
+    EE_PageErases[Page]++;
+  }
+  EE_PageState[Page] = EE_PAGE_FREE;
+
+  return HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, pagestartaddress + EE_HDR_ERASES, EE_PageErases[Page]);
 }
 
 /**
-  * @brief  Find valid Page for write or read operation
-  * @param  Operation: operation to achieve on the valid page.
-  *   This parameter can be one of the following values:
-  *     @arg READ_FROM_VALID_PAGE: read operation from valid page
-  *     @arg WRITE_IN_VALID_PAGE: write operation from valid page
-  * @retval Valid page number (PAGE or PAGE1) or NO_VALID_PAGE in case
-  *   of no valid page was found
+  * @brief  Find the erased page to open next: the least worn one, the first
+  *   after the head page if several are equally worn
+  * @param  None
+  * @retval Page number or NO_VALID_PAGE if no page is erased
   */
-static uint16_t EE_FindValidPage(uint8_t Operation)
+static uint16_t EE_FreePage(void)
 {
-  uint16_t pagestatus0 = 6, pagestatus1 = 6;
+  uint16_t page = 0, next = 0, found = NO_VALID_PAGE;
 
-  /* Get Page0 actual status */
-  pagestatus0 = (*(__IO uint16_t*)PAGE0_BASE_ADDRESS);
+  for (next = 1; next <= EE_PAGES; next++)
+  {
+    page = (uint16_t)(((EE_Head == NO_VALID_PAGE ? EE_PAGES - 1 : EE_Head) + next) % EE_PAGES);
+    if (EE_PageState[page] == EE_PAGE_FREE &&
+        (found == NO_VALID_PAGE || EE_PageErases[page] < EE_PageErases[found]))
+    {
+      found = page;
+    }
+  }
+  return found;
+}
 
-  /* Get Page1 actual status */
-  pagestatus1 = (*(__IO uint16_t*)PAGE1_BASE_ADDRESS);
+/**
+  * @brief  Count the erased pages
+  * @param  None
+  * @retval Number of erased pages
+  */
+static uint16_t EE_FreePages(void)
+{
+  uint16_t page = 0, count = 0;
 
-  /* Write or read operation */
-  switch (Operation)
+  for (page = 0; page < EE_PAGES; page++)
   {
-    case WRITE_IN_VALID_PAGE:   /* ---- Write operation ---- */
-      if (pagestatus1 == VALID_PAGE)
-      {
-        /* Page0 receiving data */
-        if (pagestatus0 == RECEIVE_DATA)
-        {
-          return PAGE0;         /* Page0 valid */
-        }
-        else
-        {
-          return PAGE1;         /* Page1 valid */
-        }
-      }
-      else if (pagestatus0 == VALID_PAGE)
-      {
-        /* Page1 receiving data */
-        if (pagestatus1 == RECEIVE_DATA)
-        {
-          return PAGE1;         /* Page1 valid */
-        }
-        else
-        {
-          return PAGE0;         /* Page0 valid */
-        }
-      }
-      else
-      {
-        return NO_VALID_PAGE;   /* No valid Page */
-      }
+    if (EE_PageState[page] == EE_PAGE_FREE)
+    {
+      count++;
+    }
+  }
+  return count;
+}
 
-    case READ_FROM_VALID_PAGE:  /* ---- Read operation ---- */
-      if (pagestatus0 == VALID_PAGE)
-      {
-        return PAGE0;           /* Page0 valid */
-      }
-      else if (pagestatus1 == VALID_PAGE)
-      {
-        return PAGE1;           /* Page1 valid */
-      }
-      else
-      {
-        return NO_VALID_PAGE ;  /* No valid Page */
-      }
+/**
+  * @brief  Find the page in use with the lowest sequence number
+  * @param  None
+  * @retval Page number or NO_VALID_PAGE if no page is in use
+  */
+static uint16_t EE_OldestPage(void)
+{
+  uint16_t page = 0, found = NO_VALID_PAGE;
 
-    default:
-      return PAGE0;             /* Page0 valid */
+  for (page = 0; page < EE_PAGES; page++)
+  {
+    if (EE_PageState[page] == EE_PAGE_USED &&
+        (found == NO_VALID_PAGE || (int16_t)(EE_PageSeq[page] - EE_PageSeq[found]) < 0))
+    {
+      found = page;
+    }
   }
+  return found;
 }
 
 /**
-  * @brief  Verify if active page is full and Writes variable in EEPROM.
-  * @param  VirtAddress: 16 bit virtual address of the variable
-  * @param  Data: 16 bit data to be written as variable value
+  * @brief  Append a batch to the head page. A head page without room for it
+  *   is replaced by the next erased page; when only Reserve erased pages are
+  *   left, the oldest page is compacted first.
+  * @param  VirtAddress: virtual addresses of the variables, from VirtAddVarTab
+  * @param  Data: 16 bit data to be written, one per virtual address
+  * @param  NbVar: number of variables
+  * @param  Reserve: erased pages to leave for the compaction
   * @retval Success or error status:
   *           - FLASH_COMPLETE: on success
-  *           - PAGE_FULL: if valid page is full
-  *           - NO_VALID_PAGE: if no valid page was found
+  *           - PAGE_FULL: if no page could be compacted
   *           - Flash error code: on write Flash error
   */
-static uint16_t EE_VerifyPageFullWriteVariable(uint16_t VirtAddress, uint16_t Data)
+static uint16_t EE_Append(uint16_t* VirtAddress, uint16_t* Data, uint16_t NbVar, uint16_t Reserve)
 {
   HAL_StatusTypeDef flashstatus = HAL_OK;
-  uint16_t validpage = PAGE0;
-  uint32_t address = EEPROM_START_ADDRESS, pageendaddress = EEPROM_START_ADDRESS+PAGE_SIZE;
+  uint16_t varidx = 0, sum = 0, tries = 0, eepromstatus = 0;
+  uint32_t address = EEPROM_START_ADDRESS;
+  int16_t  index = 0;
 
-  /* Get valid Page for write operation */
-  validpage = EE_FindValidPage(WRITE_IN_VALID_PAGE);
-
-  /* Check if there is no valid page */
-  if (validpage == NO_VALID_PAGE)
-  {
-    return  NO_VALID_PAGE;
-  }
-
-  /* Get the valid Page start address */
-  address = (uint32_t)(EEPROM_START_ADDRESS + (uint32_t)(validpage * PAGE_SIZE));
-
-  /* Get the valid Page end address */
-  pageendaddress = (uint32_t)((EEPROM_START_ADDRESS - 1) + (uint32_t)((validpage + 1) * PAGE_SIZE));
-
-  /* Check each active page address starting from begining */
-  while (address < pageendaddress)
+  /* Not enough room in the head page for the records and the markers */
+  while (EE_HeadOffset + (uint32_t)(NbVar + 2) * 4 > PAGE_SIZE)
   {
-    /* Verify if address and address+2 contents are 0xFFFFFFFF */
-    if ((*(__IO uint32_t*)address) == 0xFFFFFFFF)
+    if (tries++ > EE_PAGES)
     {
-      /* Set variable data */
-      flashstatus = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, address, Data);
-      /* If program operation was failed, a Flash error code is returned */
+      return PAGE_FULL;
+    }
+    if (EE_FreePages() > Reserve)
+    {
+      flashstatus = EE_PageOpen(EE_FreePage());
       if (flashstatus != HAL_OK)
       {
         return flashstatus;
       }
-      /* Set variable virtual address */
-      flashstatus = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, address + 2, VirtAddress);       
-      /* Return program operation status */
-      return flashstatus;
+    }
+    else if (Reserve != 0)
+    {
+      /* EE_Process did not keep up with the writes */
+      eepromstatus = EE_Compact();
+      if (eepromstatus != HAL_OK)
+      {
+        return eepromstatus;
+      }
     }
     else
     {
-      /* Next address location */
-      address = address + 4;
+      return PAGE_FULL;
     }
   }
 
-  /* Return PAGE_FULL in case the valid page is full */
-  return PAGE_FULL;
+  /* The slots are taken even if the programming fails, they are never programmed twice */
+  address = EE_PAGE_ADDRESS(EE_Head) + EE_HeadOffset;
+  EE_HeadOffset += (uint16_t)((NbVar + 2) * 4);
+
+  flashstatus = EE_ProgramRecord(address, EE_BATCH_BEGIN, NbVar);
+  for (varidx = 0; varidx < NbVar && flashstatus == HAL_OK; varidx++)
+  {
+    flashstatus = EE_ProgramRecord(address + 4 * (varidx + 1), VirtAddress[varidx], Data[varidx]);
+    sum = EE_BatchSum(sum, VirtAddress[varidx], Data[varidx]);
+  }
+  if (flashstatus == HAL_OK)
+  {
+    flashstatus = EE_ProgramRecord(address + 4 * (NbVar + 1), EE_BATCH_COMMIT, sum);
+  }
+  /* If program operation was failed, a Flash error code is returned */
+  if (flashstatus != HAL_OK)
+  {
+    return flashstatus;
+  }
+
+  /* Committed: the index points to the new records */
+  for (varidx = 0; varidx < NbVar; varidx++)
+  {
+    index = EE_IndexFind(VirtAddress[varidx]);
+    EE_IndexPage[index]   = (uint8_t)EE_Head;
+    EE_IndexOffset[index] = (uint16_t)(address + 4 * (varidx + 1) - EE_PAGE_ADDRESS(EE_Head));
+  }
+  EE_Records += NbVar + 2;
+
+  return HAL_OK;
 }
 
 /**
-  * @brief  Transfers last updated variables data from the full Page to
-  *   an empty one.
-  * @param  VirtAddress: 16 bit virtual address of the variable
-  * @param  Data: 16 bit data to be written as variable value
+  * @brief  Compact the oldest page: its variables not written since are copied
+  *   to the head page as one batch, then the page is erased. The head page is
+  *   compacted into the next erased page.
+  * @param  None
   * @retval Success or error status:
   *           - FLASH_COMPLETE: on success
-  *           - PAGE_FULL: if valid page is full
-  *           - NO_VALID_PAGE: if no valid page was found
+  *           - PAGE_FULL: if no page is erased to copy the head page to
   *           - Flash error code: on write Flash error
   */
-static uint16_t EE_PageTransfer(uint16_t VirtAddress, uint16_t Data)
+static uint16_t EE_Compact(void)
 {
   HAL_StatusTypeDef flashstatus = HAL_OK;
-  uint32_t newpageaddress = EEPROM_START_ADDRESS;
-  uint32_t oldpageid = 0;
-  uint16_t validpage = PAGE0, varidx = 0;
-  uint16_t eepromstatus = 0, readstatus = 0;
-  uint32_t page_error = 0;
-  FLASH_EraseInitTypeDef s_eraseinit;
-
-  /* Get active Page for read operation */
-  validpage = EE_FindValidPage(READ_FROM_VALID_PAGE);
+  uint16_t varaddr[NB_OF_VAR], vardata[NB_OF_VAR];
+  uint16_t oldpage = EE_OldestPage(), nbvar = 0, eepromstatus = 0;
+  uint32_t pagestartaddress = EEPROM_START_ADDRESS;
+  int16_t  varidx = 0;
 
-  if (validpage == PAGE1)       /* Page1 valid */
+  if (oldpage == NO_VALID_PAGE)
   {
-    /* New page address where variable will be moved to */
-    newpageaddress = PAGE0_BASE_ADDRESS;
-
-    /* Old page ID where variable will be taken from */
-    oldpageid = PAGE1_ID;
+    return PAGE_FULL;
   }
-  else if (validpage == PAGE0)  /* Page0 valid */
+  if (oldpage == EE_Head)
   {
-    /* New page address  where variable will be moved to */
-    newpageaddress = PAGE1_BASE_ADDRESS;
+    if (EE_FreePages() == 0)
+    {
+      return PAGE_FULL;
+    }
+    flashstatus = EE_PageOpen(EE_FreePage());
+    if (flashstatus != HAL_OK)
+    {
+      return flashstatus;
+    }
+  }
 
-    /* Old page ID where variable will be taken from */
-    oldpageid = PAGE0_ID;
+  /* Until the copies are committed the old page is read after a power loss */
+  pagestartaddress = EE_PAGE_ADDRESS(oldpage);
+  for (varidx = 0; varidx < NB_OF_VAR; varidx++)
+  {
+    if (EE_IndexPage[varidx] == oldpage)
+    {
+      varaddr[nbvar] = VirtAddVarTab[varidx];
+      vardata[nbvar] = (*(__IO uint16_t*)(pagestartaddress + EE_IndexOffset[varidx]));
+      nbvar++;
+    }
   }
-  else
+  if (nbvar != 0)
   {
-    return NO_VALID_PAGE;       /* No valid Page */
+    eepromstatus = EE_Append(varaddr, vardata, nbvar, 0);
+    if (eepromstatus != HAL_OK)
+    {
+      return eepromstatus;
+    }
   }
 
-  /* Set the new Page status to RECEIVE_DATA status */
-  flashstatus = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, newpageaddress, RECEIVE_DATA);
-  /* If program operation was failed, a Flash error code is returned */
-  if (flashstatus != HAL_OK)
+  return EE_PageErase(oldpage);
+}
+
+/**
+  * @brief  Read the variables of a page of the two page format: plain records
+  *   and committed batches, the last record of a variable wins
+  * @param  PageStartAddress: start address of the page
+  * @param  VirtAddress: returns the virtual addresses of the stored variables
+  * @param  Data: returns their data, NB_OF_VAR entries
+  * @retval Number of stored variables
+  */
+static uint16_t EE_LegacyRead(uint32_t PageStartAddress, uint16_t* VirtAddress, uint16_t* Data)
+{
+  uint32_t offset = 0, end = 0;
+  uint16_t addressvalue = 0, nbvar = 0;
+  int16_t  varidx = 0;
+  uint8_t  stored[NB_OF_VAR] = {0};
+
+  for (offset = 4; offset < PAGE_SIZE; offset += 4)
   {
-    return flashstatus;
+    addressvalue = (*(__IO uint16_t*)(PageStartAddress + offset + 2));
+    if (addressvalue == EE_BATCH_BEGIN)
+    {
+      /* The records of an uncommitted batch are skipped */
+      end = offset;
+      if (!EE_BatchEnd(PageStartAddress, &end))
+      {
+        offset = end;
+      }
+      continue;
+    }
+    varidx = EE_IndexFind(addressvalue);
+    if (varidx >= 0)
+    {
+      Data[varidx] = (*(__IO uint16_t*)(PageStartAddress + offset));
+      stored[varidx] = 1;
+    }
   }
 
-  /* Write the variable passed as parameter in the new active page */
-  eepromstatus = EE_VerifyPageFullWriteVariable(VirtAddress, Data);
-  /* If program operation was failed, a Flash error code is returned */
-  if (eepromstatus != HAL_OK)
+  for (varidx = 0; varidx < NB_OF_VAR; varidx++)
   {
-    return eepromstatus;
+    if (stored[varidx])
+    {
+      VirtAddress[nbvar] = VirtAddVarTab[varidx];
+      Data[nbvar]        = Data[varidx];
+      nbvar++;
+    }
   }
+  return nbvar;
+}
+
+/**
+  * @brief  Find the index of a virtual address in VirtAddVarTab
+  * @param  VirtAddress: 16 bit virtual address of the variable
+  * @retval Index in VirtAddVarTab or -1 if the address is not in the table
+  */
+static int16_t EE_IndexFind(uint16_t VirtAddress)
+{
+  int16_t varidx;
 
-  /* Transfer process: transfer variables from old to the new active page */
   for (varidx = 0; varidx < NB_OF_VAR; varidx++)
   {
-    if (VirtAddVarTab[varidx] != VirtAddress)  /* Check each variable except the one passed as parameter */
+    if (VirtAddVarTab[varidx] == VirtAddress)
+    {
+      return varidx;
+    }
+  }
+  return -1;
+}
+
+/**
+  * @brief  Add the records of a page to the RAM index: only the records of
+  *   committed batches are read, the later ones replace the earlier ones
+  * @param  Page: page number
+  * @retval None
+  */
+static void EE_IndexBuild(uint16_t Page)
+{
+  uint32_t pagestartaddress = EE_PAGE_ADDRESS(Page), offset, record, end;
+  int16_t  varidx;
+
+  for (offset = EE_HDR_SIZE; offset < PAGE_SIZE; offset += 4)
+  {
+    if ((*(__IO uint16_t*)(pagestartaddress + offset + 2)) != EE_BATCH_BEGIN)
     {
-      /* Read the other last variable updates */
-      readstatus = EE_ReadVariable(VirtAddVarTab[varidx], &DataVar);
-      /* In case variable corresponding to the virtual address was found */
-      if (readstatus != 0x1)
+      continue;
+    }
+    end = offset;
+    if (EE_BatchEnd(pagestartaddress, &end))
+    {
+      for (record = offset + 4; record < end; record += 4)
       {
-        /* Transfer the variable to the new active page */
-        eepromstatus = EE_VerifyPageFullWriteVariable(VirtAddVarTab[varidx], DataVar);
-        /* If program operation was failed, a Flash error code is returned */
-        if (eepromstatus != HAL_OK)
+        varidx = EE_IndexFind((*(__IO uint16_t*)(pagestartaddress + record + 2)));
+        if (varidx >= 0)
         {
-          return eepromstatus;
+          EE_IndexPage[varidx]   = (uint8_t)Page;
+          EE_IndexOffset[varidx] = (uint16_t)record;
         }
       }
     }
+    offset = end;
   }
+}
 
-  s_eraseinit.TypeErase   = FLASH_TYPEERASE_PAGES;
-  s_eraseinit.PageAddress = oldpageid;
-  s_eraseinit.NbPages     = 1;
-
-  /* Erase the old Page: Set old Page status to ERASED status */
-  flashstatus = HAL_FLASHEx_Erase(&s_eraseinit, &page_error);
-  /* If erase operation was failed, a Flash error code is returned */
-  if (flashstatus != HAL_OK)
-  {
-    return flashstatus;
-  }
+/**
+  * @brief  Program one record: the data first, the virtual address marks it written
+  * @param  Address: record address
+  * @param  VirtAddress: 16 bit virtual address of the variable
+  * @param  Data: 16 bit data to be written as variable value
+  * @retval Status of the Flash programming
+  */
+static HAL_StatusTypeDef EE_ProgramRecord(uint32_t Address, uint16_t VirtAddress, uint16_t Data)
+{
+  HAL_StatusTypeDef flashstatus;
 
-  /* Set new Page status to VALID_PAGE status */
-  flashstatus = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, newpageaddress, VALID_PAGE);
-  /* If program operation was failed, a Flash error code is returned */
+  flashstatus = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, Address, Data);
   if (flashstatus != HAL_OK)
   {
     return flashstatus;
   }
+  return HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, Address + 2, VirtAddress);
+}
 
+/**
+  * @brief  Checksum of the records of a batch, stored in EE_BATCH_COMMIT: a
+  *   record torn by a power loss does not commit the batch
+  * @param  Sum: checksum of the previous records, 0 for the first one
+  * @param  VirtAddress: 16 bit virtual address of the record
+  * @param  Data: 16 bit data of the record
+  * @retval Updated checksum
+  */
+static uint16_t EE_BatchSum(uint16_t Sum, uint16_t VirtAddress, uint16_t Data)
+{
+  Sum = (uint16_t)((Sum << 1) | (Sum >> 15));
+  return (uint16_t)(Sum + (VirtAddress ^ Data) + 1);
+}
 
+/**
+  * @brief  Find the end of a batch
+  * @param  PageStartAddress: start address of the page
+  * @param  Offset: offset of the EE_BATCH_BEGIN record, returns the offset of
+  *   the last record of the batch
+  * @retval 1 if the batch is committed, 0 if it was interrupted or aborted
+  */
+static uint8_t EE_BatchEnd(uint32_t PageStartAddress, uint32_t* Offset)
+{
+  uint32_t offset = *Offset;
+  uint16_t count = (*(__IO uint16_t*)(PageStartAddress + offset)), records = 0, sum = 0;
+  uint16_t addressvalue, datavalue;
 
-  /* Return last operation flash status */
-  return flashstatus;
+  for (offset += 4; offset < PAGE_SIZE; offset += 4)
+  {
+    addressvalue = (*(__IO uint16_t*)(PageStartAddress + offset + 2));
+    datavalue    = (*(__IO uint16_t*)(PageStartAddress + offset));
+    if (addressvalue == EE_BATCH_COMMIT || addressvalue == EE_BATCH_ABORT)
+    {
+      *Offset = offset;
+      return addressvalue == EE_BATCH_COMMIT && records == count && datavalue == sum;
+    }
+    if (addressvalue == EE_BATCH_BEGIN || (addressvalue == ERASED && datavalue == ERASED))
+    {
+      break;                    /* Interrupted by a power loss */
+    }
+    sum = EE_BatchSum(sum, addressvalue, datavalue);
+    records++;
+  }
+  *Offset = offset - 4;
+  return 0;
 }
 
 /**
@@ -0,0 +1,205 @@
+/**
+  * This file is part of the hoverboard-firmware-hack project.
+  *
+  * Copyright (C) 2020-2021 Emanuel FERU <aerdronix@gmail.com>
+  *
+  * This program is free software: you can redistribute it and/or modify
+  * it under the terms of the GNU General Public License as published by
+  * the Free Software Foundation, either version 3 of the License, or
+  * (at your option) any later version.
+  *
+  * This program is distributed in the hope that it will be useful,
+  * but WITHOUT ANY WARRANTY; without even the implied warranty of
+  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  * GNU General Public License for more details.
+  *
+  * You should have received a copy of the GNU General Public License
+  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Includes
+#include <stdint.h>
+#include "filter.h"
+
+#define FILT_MIN(a, b)  ((a) < (b) ? (a) : (b))
+#define FILT_MAX(a, b)  ((a) > (b) ? (a) : (b))
+#define FILT_SORT2(a, b) { int16_t t_ = FILT_MIN(a, b); (b) = FILT_MAX(a, b); (a) = t_; }
+
+
+/* =========================== Filtering Functions =========================== */
+
+  /* Low pass filter fixed-point 32 bits: fixdt(1,32,16)
+  * Max:  32767.99998474121
+  * Min: -32768
+  * Res:  1.52587890625e-05
+  *
+  * Inputs:       u     = int16 or int32
+  * Outputs:      y     = fixdt(1,32,16)
+  * Parameters:   coef  = fixdt(0,16,16) = [0,65535U]
+  *
+  * Example:
+  * If coef = 0.8 (in floating point), then coef = 0.8 * 2^16 = 52429 (in fixed-point)
+  * filtLowPass16(u, 52429, &y);
+  * yint = (int16_t)(y >> 16); // the integer output is the fixed-point ouput shifted by 16 bits
+  */
+void filtLowPass32(int32_t u, uint16_t coef, int32_t *y) {
+  int64_t tmp;
+  tmp = ((int64_t)((u << 4) - (*y >> 12)) * coef) >> 4;
+  tmp = (tmp > 2147483647LL) ? 2147483647LL : ((tmp < -2147483648LL) ? -2147483648LL : tmp);  // Overflow protection
+  *y = (int32_t)tmp + (*y);
+}
+
+
+  /* rateLimiter16(int16_t u, int16_t rate, int16_t *y);
+  * Inputs:       u     = int16
+  * Outputs:      y     = fixdt(1,16,4)
+  * Parameters:   rate  = fixdt(1,16,4) = [0, 32767] Do NOT make rate negative (>32767)
+  */
+void rateLimiter16(int16_t u, int16_t rate, int16_t *y) {
+  int16_t q0;
+  int16_t q1;
+
+  q0 = (u << 4)  - *y;
+
+  if (q0 > rate) {
+    q0 = rate;
+  } else {
+    q1 = -rate;
+    if (q0 < q1) {
+      q0 = q1;
+    }
+  }
+
+  *y = q0 + *y;
+}
+
+
+  /* Biquad filter, direct form I
+  * Inputs:       u     = int16
+  * Outputs:      y     = int16, saturated
+  * Parameters:   f->b0, b1, b2, a1, a2 = fixdt(1,16,14), normalized to a0 = 1
+  *
+  * The products are accumulated in 64 bits (SMLAL), the output truncation remainder is added to the next sample.
+  * Example, 2nd order Butterworth lowpass at fc = 5 Hz sampled at fs = 200 Hz (w = 2*pi*fc/fs, alpha = sin(w)/sqrt(2)):
+  *   b0 = b2 = (1 - cos(w)) / 2 / (1 + alpha), b1 = 2 * b0, a1 = -2 * cos(w) / (1 + alpha), a2 = (1 - alpha) / (1 + alpha)
+  *   b0 = b2 = 0.005543, b1 = 0.011085, a1 = -1.778631, a2 = 0.800802
+  * Rounded to fixdt(1,16,14) the DC gain is (b0 + b1 + b2) / (1 + a1 + a2) = 364 / 363: adjust b1 for an exact unity gain
+  *   Biquad16 f = {91, 181, 91, FILT_Q14(-1.778631), FILT_Q14(0.800802)};   // b1 = 16384 + a1 + a2 - b0 - b2
+  */
+void filtBiquadInit16(Biquad16 *f, int16_t u) {
+  f->x1  = f->x2 = u;                                   // steady state of a filter with unity DC gain
+  f->y1  = f->y2 = u;
+  f->err = 0;
+}
+
+int16_t filtBiquad16(int16_t u, Biquad16 *f) {
+  int64_t acc;
+  int32_t y;
+
+  acc = (int64_t)f->b0 * u + (int64_t)f->b1 * f->x1 + (int64_t)f->b2 * f->x2
+      - (int64_t)f->a1 * f->y1 - (int64_t)f->a2 * f->y2 + f->err;
+  y   = (int32_t)(acc >> 14);
+  if (y > 32767) {
+    y = 32767;
+    f->err = 0;
+  } else if (y < -32768) {
+    y = -32768;
+    f->err = 0;
+  } else {
+    f->err = (int16_t)(acc - ((int64_t)y << 14));
+  }
+  f->x2 = f->x1;
+  f->x1 = u;
+  f->y2 = f->y1;
+  f->y1 = (int16_t)y;
+  return (int16_t)y;
+}
+
+
+  /* Moving average over 2^log2Len samples
+  * Inputs:       u     = int16
+  * Outputs:      y     = int16, rounded
+  * Parameters:   log2Len = [0, FILT_MAVG_LOG2_MAX]
+  */
+void filtMovAvgInit16(MovAvg16 *f, uint8_t log2Len, int16_t u) {
+  f->log2Len = FILT_MIN(log2Len, FILT_MAVG_LOG2_MAX);
+  for (uint8_t i = 0; i < FILT_MAVG_LEN_MAX; i++) {
+    f->buf[i] = u;
+  }
+  f->sum = (int32_t)u << f->log2Len;
+  f->idx = 0;
+}
+
+int16_t filtMovAvg16(int16_t u, MovAvg16 *f) {
+  f->sum += u - f->buf[f->idx];
+  f->buf[f->idx] = u;
+  f->idx = (f->idx + 1) & ((1 << f->log2Len) - 1);
+  return (int16_t)((f->sum + ((1 << f->log2Len) >> 1)) >> f->log2Len);
+}
+
+
+  /* Median of 3 and sliding median of 5 samples: a glitch of 1 (2) samples is removed, a step is delayed by 1 (2) samples
+  * Inputs:       u     = int16
+  * Outputs:      y     = int16
+  * The median of 5 is a sorting network of 7 min/max pairs, no branch on the sample values
+  */
+int16_t filtMedian3(int16_t a, int16_t b, int16_t c) {
+  return FILT_MAX(FILT_MIN(a, b), FILT_MIN(FILT_MAX(a, b), c));
+}
+
+void filtMedianInit5(Median5 *f, int16_t u) {
+  for (uint8_t i = 0; i < 5; i++) {
+    f->buf[i] = u;
+  }
+  f->idx = 0;
+}
+
+int16_t filtMedian5(int16_t u, Median5 *f) {
+  int16_t p0, p1, p2, p3, p4;
+
+  f->buf[f->idx] = u;
+  f->idx = (f->idx == 4) ? 0 : f->idx + 1;
+  p0 = f->buf[0]; p1 = f->buf[1]; p2 = f->buf[2]; p3 = f->buf[3]; p4 = f->buf[4];
+  FILT_SORT2(p0, p1); FILT_SORT2(p3, p4); FILT_SORT2(p0, p3);
+  FILT_SORT2(p1, p4); FILT_SORT2(p1, p2); FILT_SORT2(p2, p3);
+  FILT_SORT2(p1, p2);
+  return p2;
+}
+
+
+  /* Input pipeline: deadband -> expo -> rate limiter -> low pass -> clamp
+  * Inputs:       u     = int16, |u| < 2048 (rateLimiter16)
+  * Outputs:      y     = int16
+  * Parameters:   c     = one row of the stage table, s = state of the channel
+  *
+  * Every stage runs on every sample, a stage is bypassed by its neutral value: dband = 0, expo = 0, rate = 32767,
+  * filt = 65535 (output within 1 count of the input), min/max = input range. Apart from the first two stages this is
+  * the former rateLimiter16 -> filtLowPass32 chain of main.c, bit for bit.
+  * The expo curve spans the input range c->full, not the clamp: a clamp below the input range cuts the curve, it does
+  * not steepen it. Its output is saturated to the range of rateLimiter16. The curve is computed with the reciprocal
+  * of filtPipeRange and skipped at expo = 0, so the default table costs the former chain plus the deadband and clamp.
+  */
+void filtPipeRange(PipeCfg *c, int16_t full) {
+  c->full = FILT_MAX(full, 1);
+  c->inv  = (int32_t)((1UL << 30) / (uint32_t)c->full);
+}
+
+int16_t filtPipe(int16_t u, const PipeCfg *c, PipeState *s) {
+  int32_t e, q;
+
+  u = u - FILT_MIN(FILT_MAX(u, -c->dband), c->dband);     // Deadband
+
+  if (c->expo) {                                           // Expo: u + expo * (u^3/full^2 - u)
+    e = FILT_MIN(FILT_MAX(u, -c->full), c->full);          // beyond the input range the cube saturates
+    q = (e * c->inv) >> 15;                                // e/full, fixdt(1,32,15): |e * inv| <= 2^30
+    q = (q * q) >> 15;                                     // (e/full)^2
+    e = u + ((((e * q) >> 15) - u) * c->expo >> 14);
+    u = (int16_t)FILT_MIN(FILT_MAX(e, -2047), 2047);       // rateLimiter16: |u| < 2048
+  }
+
+  rateLimiter16(u, c->rate, &s->rate);                     // Rate limiter
+  filtLowPass32(s->rate >> 4, c->filt, &s->lpf);           // Low pass
+  u    = (int16_t)(s->lpf >> 16);
+
+  return FILT_MIN(FILT_MAX(u, c->min), c->max);            // Clamp
+}
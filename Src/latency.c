@@ -0,0 +1,143 @@
+/**
+  * This file is part of the hoverboard-firmware-hack project.
+  *
+  * Copyright (C) 2020-2021 Emanuel FERU <aerdronix@gmail.com>
+  *
+  * This program is free software: you can redistribute it and/or modify
+  * it under the terms of the GNU General Public License as published by
+  * the Free Software Foundation, either version 3 of the License, or
+  * (at your option) any later version.
+  *
+  * This program is distributed in the hope that it will be useful,
+  * but WITHOUT ANY WARRANTY; without even the implied warranty of
+  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  * GNU General Public License for more details.
+  *
+  * You should have received a copy of the GNU General Public License
+  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Includes
+#include <string.h>
+#include "stm32f1xx_hal.h"
+#include "defines.h"
+#include "config.h"
+#include "util.h"
+
+#ifdef LATENCY_MEASURE
+
+//------------------------------------------------------------------------
+// Global variables set externally
+//------------------------------------------------------------------------
+extern uint8_t inIdx;                   // input index used for the commands
+
+//------------------------------------------------------------------------
+// Global variables set here in latency.c
+//------------------------------------------------------------------------
+uint16_t latP50, latP90, latP99, latMax;                        // [us] latency percentiles over the last LAT_HIST_WINDOW commands
+uint16_t latStageUs[LAT_STAGES];                                // [us] delay from arrival to each stage, last command
+static volatile uint32_t latArrival;                            // [cycles] arrival time of the latest command of the active input
+static volatile uint8_t  latArrivalNew;                         // a new command arrived since the last readCommand()
+static volatile uint32_t latRec[LAT_STAGES];                    // [cycles] stage timestamps of the command in flight
+static volatile uint8_t  latPending;                            // command written to pwml/pwmr, not yet consumed by the controller
+static volatile uint8_t  latDone;                               // command consumed, ready to be recorded
+static uint8_t  latValid;                                       // command in flight has a fresh arrival time
+static uint16_t latHist[LAT_HIST_BINS];
+static uint16_t latHistCnt;
+static uint16_t latHistMax;
+
+
+/* =========================== Latency Measurement Functions =========================== */
+
+ /*
+ * Input-to-PWM latency measurement
+ * Every command is timestamped with the DWT cycle counter when it arrives (USART frame, PPM frame, ADC sample),
+ * after readCommand, after the rate limiter and filter, after the mixer, when written to pwml/pwmr and
+ * when the first BLDC_controller_step consumes it. Commands that did not arrive since the previous loop are not counted.
+ * Percentiles of the arrival-to-step latency are updated every LAT_HIST_WINDOW commands.
+ */
+#define LAT_CYC2US(cyc)   ((cyc) / (SystemCoreClock / 1000000U))
+
+void latencyInit(void) {
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CYCCNT       = 0;
+  DWT->CTRL        |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+void latencyArrive(void) {
+  latArrival    = DWT->CYCCNT;
+  latArrivalNew = 1;
+}
+
+// Stamps the arrival only when it comes from the input selected by inIdx
+void latencyArriveIn(uint8_t idx) {
+  if (idx == inIdx) {
+    latencyArrive();
+  }
+}
+
+// Called from the DMA interrupt right before the controller step
+void latencyStep(void) {
+  if (latPending) {
+    latRec[LAT_STEP]  = DWT->CYCCNT;
+    latPending        = 0;
+    latDone           = 1;
+  }
+}
+
+static uint16_t latencyPercentile(uint16_t pct) {
+  uint16_t target = (uint16_t)(((uint32_t)latHistCnt * pct + 99) / 100);
+  uint16_t sum    = 0;
+  for (uint8_t i = 0; i < LAT_HIST_BINS; i++) {
+    sum += latHist[i];
+    if (sum >= target) {
+      return (uint16_t)MIN((i + 1) * LAT_HIST_RES, latHistMax);   // upper edge of the bin
+    }
+  }
+  return latHistMax;
+}
+
+static void latencyRecord(void) {
+  uint32_t us;
+
+  for (uint8_t i = LAT_READ; i < LAT_STAGES; i++) {
+    latStageUs[i] = (uint16_t)MIN(LAT_CYC2US(latRec[i] - latRec[LAT_ARRIVE]), UINT16_MAX);
+  }
+  us = latStageUs[LAT_STEP];
+  latHist[MIN(us / LAT_HIST_RES, LAT_HIST_BINS - 1)]++;
+  latHistMax = MAX(latHistMax, us);
+
+  if (++latHistCnt >= LAT_HIST_WINDOW) {
+    latP50  = latencyPercentile(50);
+    latP90  = latencyPercentile(90);
+    latP99  = latencyPercentile(99);
+    latMax  = latHistMax;
+    memset(latHist, 0, sizeof(latHist));
+    latHistCnt = 0;
+    latHistMax = 0;
+  }
+}
+
+void latencyStage(uint8_t stage) {
+  uint32_t now = DWT->CYCCNT;
+
+  if (stage == LAT_READ) {        // a new command enters the pipeline
+    if (latDone) {
+      latDone = 0;
+      latencyRecord();
+    }
+    latPending          = 0;
+    __disable_irq();              // Snapshot, the USART and DMA interrupts stamp new arrivals
+    latValid            = latArrivalNew;
+    latArrivalNew       = 0;
+    latRec[LAT_ARRIVE]  = latArrival;
+    __enable_irq();
+  }
+  latRec[stage] = now;
+  if (stage == LAT_PWM) {
+    latPending  = latValid;
+  }
+}
+
+#endif
+
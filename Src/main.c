@@ -27,6 +27,7 @@
 #include "setup.h"
 #include "config.h"
 #include "util.h"
+#include "filter.h"
 #include "BLDC_controller.h"      /* BLDC's header file */
 #include "rtwtypes.h"
 #include "comms.h"
@@ -81,9 +82,26 @@ extern volatile int pwml;               // global variable for pwm left. -1000 t
 extern volatile int pwmr;               // global variable for pwm right. -1000 to 1000
 
 extern uint8_t enable;                  // global variable for motor enable
+extern PowerState powerState;           // power state machine
+#ifdef IDLE_LOW_POWER
+extern volatile uint8_t idleMode;       // low-power idle active
+#endif
 
 extern int16_t batVoltage;              // global variable for battery voltage
 
+#if (defined(CONTROL_SERIAL_USART2) || defined(CONTROL_SERIAL_USART3)) && !defined(CONTROL_IBUS)
+extern uint8_t serialTgtAcv;            // Per-motor targets received on the active serial input
+extern int16_t serialTgtL;              // Left motor target from the serial command
+extern int16_t serialTgtR;              // Right motor target from the serial command
+#ifdef SERIAL_SYNC
+extern volatile uint8_t syncSched;      // Scheduled targets state
+extern volatile int syncPwmL;           // pwml for the scheduled targets
+extern volatile int syncPwmR;           // pwmr for the scheduled targets
+extern int16_t syncTgtL;                // Scheduled left motor target
+extern int16_t syncTgtR;                // Scheduled right motor target
+#endif
+extern uint8_t serialEnaReq;            // Motors enable allowed by the serial command
+#endif
 #if defined(SIDEBOARD_SERIAL_USART2)
 extern SerialSideboard Sideboard_L;
 #endif
@@ -116,7 +134,7 @@ int16_t cmdR;                    // global variable for Right Command
 //------------------------------------------------------------------------
 // Local variables
 //------------------------------------------------------------------------
-#if defined(FEEDBACK_SERIAL_USART2) || defined(FEEDBACK_SERIAL_USART3)
+#if !defined(FEEDBACK_TELEMETRY) && (defined(FEEDBACK_SERIAL_USART2) || defined(FEEDBACK_SERIAL_USART3))
 typedef struct{
   uint16_t  start;
   int16_t   cmd1;
@@ -152,142 +170,45 @@ static uint8_t sideboard_leds_R;
 static int16_t    speed;                // local variable for speed. -1000 to 1000
 #ifndef VARIANT_TRANSPOTTER
   static int16_t  steer;                // local variable for steering. -1000 to 1000
-  static int16_t  steerRateFixdt;       // local fixed-point variable for steering rate limiter
-  static int16_t  speedRateFixdt;       // local fixed-point variable for speed rate limiter
-  static int32_t  steerFixdt;           // local fixed-point variable for steering low-pass filter
-  static int32_t  speedFixdt;           // local fixed-point variable for speed low-pass filter
+  static PipeState steerPipe;           // steering input pipeline: rate limiter and low-pass filter state
+  static PipeState speedPipe;           // speed input pipeline: rate limiter and low-pass filter state
+  PipeCfg         inPipe[4] = { {INPUT_PIPE1}, {INPUT_PIPE2}, {TARGET_PIPE}, {TARGET_PIPE} };  // input pipeline stage table: input1, input2, left and right motor target
+  #if (defined(CONTROL_SERIAL_USART2) || defined(CONTROL_SERIAL_USART3)) && !defined(CONTROL_IBUS)
+  static PipeState tgtPipeL;            // left motor target pipeline state
+  static PipeState tgtPipeR;            // right motor target pipeline state
+  #ifdef SERIAL_SYNC
+  static PipeState syncPipeL;           // left motor target pipeline state after the step to the scheduled target
+  static PipeState syncPipeR;           // right motor target pipeline state after the step to the scheduled target
+  #endif
+  #endif
 #endif
 
 static uint32_t    buzzerTimer_prev = 0;
 static uint32_t    inactivity_timeout_counter;
 static MultipleTap MultipleTapBrake;    // define multiple tap functionality for the Brake pedal
 
-#ifdef VARIANT_HOVERCAR
-boolean_T isThrottleMax(void)
-{
-  readCommand();
-
-  if ((input2[inIdx].raw > input2[inIdx].max - 250) && (input2[inIdx].raw < input2[inIdx].max + 250)) { 
-    return true;
-  }
-  return false;
-}
-
-boolean_T isThrottleMin(void)
-{
-  readCommand();
-
-  if ((input2[inIdx].raw > input2[inIdx].min - 250) && (input2[inIdx].raw < input2[inIdx].min + 250)) { 
-    return true;
-  }
-  return false;
-}
-#endif
-
-void powerOn(void)
-{
-  poweronMelody();
-  HAL_GPIO_WritePin(LED_PORT, LED_PIN, GPIO_PIN_SET);
-
-// this part is for calibration, if no condition meet, then just regular poweron procedure is run
-// for entering calibration mode:
-// 1. set and hold throttle position to maximum
-// 2. power button toggle (on and off) twice within KEYLOCK_CHECK_TIME (1 sec) interval
-// 3. toggle (on and off) power button with delay CALIBRATE_HOLD_TIME (5 sec)
-// 4. release power button
-// 5. Release throttle
-// 6. one long beep - calibrate current and speed mode entered
-// 7. calibrate current holding throttle to next step
-// 8. short toggle power button (or wait for 10 sec)
-// 9. one long beep - calibrate speed and holding throttle to next step
-// 10. short toggle power button
-// 11. power off
-
-// to calibrate min/max
-// 6. after step 5 above, short toggle of power button within 1 second
-// 7. three long beeps - MIN/MAX calibration mode entered
-// 8. calibrate throttle handle by rotation, calibrate switch handle by switching left-right
-// 9. short toggle of power button
-// 10. power off
-
-#ifdef KEYLOCK_POWER_SWITCH
-
-  if (isThrottleMax())
-  {
-    uint16_t power_btn_hold_time = 0;
-
-    // power on button short press
-    while (HAL_GPIO_ReadPin(BUTTON_PORT, BUTTON_PIN) 
-      && power_btn_hold_time++ < KEYLOCK_CHECK_TIME) 
-    { 
-      HAL_Delay(WAIT_DELAY); 
-    }
-
-    // check for first short press
-    if ((power_btn_hold_time < KEYLOCK_CHECK_TIME) && isThrottleMax()) 
-    {
-      power_btn_hold_time = 0;
-      while (HAL_GPIO_ReadPin(BUTTON_PORT, BUTTON_PIN) 
-        && power_btn_hold_time++ < KEYLOCK_CHECK_TIME) 
-      { 
-        HAL_Delay(WAIT_DELAY); 
-      }
-
-      // second short press
-      if ((power_btn_hold_time < KEYLOCK_CHECK_TIME) && isThrottleMax()) 
-      {
-        uint16_t calibrate_timeout = 0;
-        PRINTF("calibrate mode, press power button for more than 5 sec\r\n");
-        while (true) 
-        {
-          power_btn_hold_time = 0;
-          // check for >=5 sec press, wait until release
-          while (HAL_GPIO_ReadPin(BUTTON_PORT, BUTTON_PIN)) 
-          {
-            HAL_Delay(WAIT_DELAY);
-            if (power_btn_hold_time++ == CALIBRATE_HOLD_TIME) { beepShort(5); }
-          }
-
-          if (power_btn_hold_time >= CALIBRATE_HOLD_TIME) 
-          {
-            // wait untill throttle is released
-            while (!(isThrottleMin())) {HAL_Delay(WAIT_DELAY);}
-
-            calibrate();
-            powerOff(); 
-          }
-          else if (power_btn_hold_time > PWR_BTN_DEBOUNCE) 
-          { 
-            // Short press: power off (80 ms debounce)
-            powerOff();  
-          }
-
-          if (calibrate_timeout++ > CALIBRATE_MOD_IMEOUT_TIME) 
-          {
-            // timout for calibration
-            PRINTF("Calibrate mode timeout\r\n");
-            break;
-          }
-
-          HAL_Delay(WAIT_DELAY);
-        }
-      }
-    }
-  }
-#else
-  // Loop until button is released
-  while(HAL_GPIO_ReadPin(BUTTON_PORT, BUTTON_PIN)) { HAL_Delay(10); }
-#endif
-}
-
 void motorsEnable(void)
 {
   // ####### MOTOR ENABLING: Only if the initial input is very small (for SAFETY) #######
-  if (enable == 0 && (!rtY_Left.z_errCode && !rtY_Right.z_errCode) && (input1[inIdx].cmd > -50 && input1[inIdx].cmd < 50) && (input2[inIdx].cmd > -50 && input2[inIdx].cmd < 50)){
+  #if (defined(CONTROL_SERIAL_USART2) || defined(CONTROL_SERIAL_USART3)) && !defined(CONTROL_IBUS)
+  if (!serialEnaReq) {                // Motors disabled by the serial command
+    enable = 0;
+    return;
+  }
+  if (serialTgtAcv && (ABS(serialTgtL) >= 50 || ABS(serialTgtR) >= 50)) {
+    return;                           // Per-motor targets must be very small as well
+  }
+  #endif
+  if (enable == 0 && powerState == PWR_RUN && (!rtY_Left.z_errCode && !rtY_Right.z_errCode) && (input1[inIdx].cmd > -50 && input1[inIdx].cmd < 50) && (input2[inIdx].cmd > -50 && input2[inIdx].cmd < 50)){
     beepShort(6);                     // make 2 beeps indicating the motor enable
     beepShort(4);
-    HAL_Delay(100);
-    steerFixdt = speedFixdt = 0;      // reset filters
+    #ifndef VARIANT_TRANSPOTTER
+    steerPipe.lpf = speedPipe.lpf = 0;  // reset filters
+    #if (defined(CONTROL_SERIAL_USART2) || defined(CONTROL_SERIAL_USART3)) && !defined(CONTROL_IBUS)
+    tgtPipeL.rate = tgtPipeR.rate = 0;  // the per-motor targets start from standstill
+    tgtPipeL.lpf  = tgtPipeR.lpf  = 0;
+    #endif
+    #endif
     enable = 1;                       // enable motors
     PRINTF("-- Motors enabled --\r\n");
   }
@@ -298,8 +219,7 @@ void motorsDisable(void)
   // ####### MOTOR DISABLING: Only if the initial input is very small (for SAFETY) #######
   if (enable == 1 && (!rtY_Left.z_errCode && !rtY_Right.z_errCode) && (input1[inIdx].cmd > -50 && input1[inIdx].cmd < 50) && (input2[inIdx].cmd > -50 && input2[inIdx].cmd < 50)){
     beepShort(4);
-    beepShort(6);                     // make 2 beeps indicating the motor enable
-    HAL_Delay(100);
+    beepShort(6);                     // make 2 beeps indicating the motor disable
     enable = 0;                       // enable motors
     PRINTF("-- Motors disabled --\r\n");
   }
@@ -344,6 +264,9 @@ int main(void) {
   MX_ADC1_Init();
   MX_ADC2_Init();
   BLDC_Init();        // BLDC Controller Init
+  #ifdef LATENCY_MEASURE
+  latencyInit();      // DWT cycle counter for latency measurement
+  #endif
 
   HAL_GPIO_WritePin(OFF_PORT, OFF_PIN, GPIO_PIN_SET);   // Activate Latch
   Input_Lim_Init();   // Input Limitations Init
@@ -381,6 +304,7 @@ int main(void) {
     if (buzzerTimer - buzzerTimer_prev > 16 * DELAY_IN_MAIN_LOOP) {   // 1 ms = 16 ticks buzzerTimer
 
     readCommand();                        // Read Command: input1[inIdx].cmd, input2[inIdx].cmd
+    LATENCY_STAGE(LAT_READ);
     calcAvgSpeed();                       // Calculate average measured speed: speedAvg, speedAvgAbs
 
     #ifndef VARIANT_TRANSPOTTER
@@ -496,13 +420,10 @@ int main(void) {
         }
       #endif
 
-      // ####### LOW-PASS FILTER #######
-      rateLimiter16(input1[inIdx].cmd , RATE, &steerRateFixdt);
-      rateLimiter16(input2[inIdx].cmd , RATE, &speedRateFixdt);
-      filtLowPass32(steerRateFixdt >> 4, FILTER, &steerFixdt);
-      filtLowPass32(speedRateFixdt >> 4, FILTER, &speedFixdt);
-      steer = (int16_t)(steerFixdt >> 16);  // convert fixed-point to integer
-      speed = (int16_t)(speedFixdt >> 16);  // convert fixed-point to integer
+      // ####### INPUT PIPELINE: deadband, expo, rate limiter, low-pass filter, clamp #######
+      steer = filtPipe(input1[inIdx].cmd, &inPipe[0], &steerPipe);
+      speed = filtPipe(input2[inIdx].cmd, &inPipe[1], &speedPipe);
+      LATENCY_STAGE(LAT_FILTER);
 
       // ####### VARIANT_HOVERCAR #######
       #ifdef VARIANT_HOVERCAR
@@ -523,6 +444,22 @@ int main(void) {
       // cmdR = CLAMP((int)(speed * SPEED_COEFFICIENT -  steer * STEER_COEFFICIENT), INPUT_MIN, INPUT_MAX);
       // cmdL = CLAMP((int)(speed * SPEED_COEFFICIENT +  steer * STEER_COEFFICIENT), INPUT_MIN, INPUT_MAX);
       mixerFcn(speed << 4, steer << 4, &cmdR, &cmdL);   // This function implements the equations above
+      #if (defined(CONTROL_SERIAL_USART2) || defined(CONTROL_SERIAL_USART3)) && !defined(CONTROL_IBUS)
+      #ifdef SERIAL_SYNC
+      if (syncTargets()) {                              // Scheduled targets that were switched in by the motor ISR become the current targets
+        tgtPipeL = syncPipeL;                           // and the pipeline continues from the step the ISR applied
+        tgtPipeR = syncPipeR;
+      }
+      #endif
+      if (serialTgtAcv) {                               // Per-motor targets from the serial command bypass the mixer, not the rate limiter and filter
+        cmdL = (filtPipe(serialTgtL, &inPipe[2], &tgtPipeL) * slow_down_coeff) / 100;
+        cmdR = (filtPipe(serialTgtR, &inPipe[3], &tgtPipeR) * slow_down_coeff) / 100;
+      } else {                                          // Track the mixer outputs, a switch to per-motor targets starts from them
+        tgtPipeL.rate = cmdL << 4;  tgtPipeL.lpf = (int32_t)cmdL << 16;
+        tgtPipeR.rate = cmdR << 4;  tgtPipeR.lpf = (int32_t)cmdR << 16;
+      }
+      #endif
+      LATENCY_STAGE(LAT_MIXER);
 
       // ####### SET OUTPUTS (if the target change is less than +/- 100) #######
       #ifdef INVERT_R_DIRECTION
@@ -535,6 +472,28 @@ int main(void) {
       #else
         pwml = cmdL;
       #endif
+      LATENCY_STAGE(LAT_PWM);
+
+      #if defined(SERIAL_SYNC) && (defined(CONTROL_SERIAL_USART2) || defined(CONTROL_SERIAL_USART3)) && !defined(CONTROL_IBUS)
+      if (syncSched != SYNC_IDLE) {                     // Outputs for the scheduled targets, the motor ISR switches to them at the scheduled time
+        int16_t syncCmdL, syncCmdR;
+        syncPipeL = tgtPipeL;                           // first pipeline step towards the scheduled targets: the ramp starts at
+        syncPipeR = tgtPipeR;                           // the scheduled time, the next steps follow with the main loop
+        syncCmdL  = (filtPipe(syncTgtL, &inPipe[2], &syncPipeL) * slow_down_coeff) / 100;
+        syncCmdR  = (filtPipe(syncTgtR, &inPipe[3], &syncPipeR) * slow_down_coeff) / 100;
+        #ifdef INVERT_R_DIRECTION
+          syncPwmR = syncCmdR;
+        #else
+          syncPwmR = -syncCmdR;
+        #endif
+        #ifdef INVERT_L_DIRECTION
+          syncPwmL = -syncCmdL;
+        #else
+          syncPwmL = syncCmdL;
+        #endif
+        syncSched = SYNC_ARMED;
+      }
+      #endif
     #endif
 
     #ifdef VARIANT_TRANSPOTTER
@@ -545,7 +504,7 @@ int main(void) {
       if (nunchuk_connected == 0) {
         cmdL = cmdL * 0.8f + (CLAMP(distanceErr + (steering*((float)MAX(ABS(distanceErr), 50)) * ROT_P), -850, 850) * -0.2f);
         cmdR = cmdR * 0.8f + (CLAMP(distanceErr - (steering*((float)MAX(ABS(distanceErr), 50)) * ROT_P), -850, 850) * -0.2f);
-        if (distanceErr > 0) {
+        if (distanceErr > 0 && powerState == PWR_RUN) {
           enable = 1;
         }
         if (distanceErr > -300) {
@@ -657,6 +616,11 @@ int main(void) {
     right_dc_curr = -(rtU_Right.i_DCLink * 100) / A2BIT_CONV;  // Right DC Link Current * 100
     dc_curr       = left_dc_curr + right_dc_curr;            // Total DC Link Current * 100
 
+    // ####### ODOMETER #######
+    #ifdef ODOMETER_COUNTERS
+      odomProcess(HAL_GetTick());
+    #endif
+
     // ####### DEBUG SERIAL OUT #######
     #if defined(DEBUG_SERIAL_USART2) || defined(DEBUG_SERIAL_USART3)
       if (main_loop_counter % 25 == 0) {    // Send data periodically every 125 ms      
@@ -677,7 +641,9 @@ int main(void) {
     #endif
 
     // ####### FEEDBACK SERIAL OUT #######
-    #if defined(FEEDBACK_SERIAL_USART2) || defined(FEEDBACK_SERIAL_USART3)
+    #if defined(FEEDBACK_TELEMETRY) && (defined(FEEDBACK_SERIAL_USART2) || defined(FEEDBACK_SERIAL_USART3))
+      telemetryProcess();
+    #elif defined(FEEDBACK_SERIAL_USART2) || defined(FEEDBACK_SERIAL_USART3)
       if (main_loop_counter % 2 == 0) {    // Send data periodically every 10 ms
         Feedback.start	        = (uint16_t)SERIAL_START_FRAME;
         Feedback.cmd1           = (int16_t)input1[inIdx].cmd;
@@ -708,8 +674,21 @@ int main(void) {
       }
     #endif
 
-    // ####### POWEROFF BY POWER-BUTTON #######
-    powerOffPressCheck();
+    // ####### FAULT BLACK BOX #######
+    #ifdef FAULT_BLACKBOX
+      bboxProcess(HAL_GetTick());
+    #endif
+
+    // ####### EEPROM COMPACTION #######
+    if (eepromEraseOk()) {                // page erases stall the CPU: only at standstill
+      eepromProcess();
+    }
+
+    // ####### POWER STATE MACHINE: POWER-BUTTON, CALIBRATION, POWEROFF #######
+    powerStep(HAL_GPIO_ReadPin(BUTTON_PORT, BUTTON_PIN), HAL_GetTick());
+
+    // ####### LOW-POWER IDLE #######
+    idleCheck();
 
     // ####### BEEP AND EMERGENCY POWEROFF #######
     if (TEMP_POWEROFF_ENABLE && board_temp_deg_c >= TEMP_POWEROFF) 
@@ -776,6 +755,11 @@ int main(void) {
     buzzerTimer_prev = buzzerTimer;
     main_loop_counter++;
     }
+    #ifdef IDLE_LOW_POWER
+    else if (idleMode) {
+      __WFI();                            // sleep until the next interrupt
+    }
+    #endif
   }
 }
 
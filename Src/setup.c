@@ -126,7 +126,11 @@ void HAL_UART_MspInit(UART_HandleTypeDef* uartHandle)
     PA3     ------> USART2_RX 
     */
     GPIO_InitStruct.Pin = GPIO_PIN_2;
+    #if defined(SERIAL_MULTIDROP) && defined(CONTROL_SERIAL_USART2)
+    GPIO_InitStruct.Mode = GPIO_MODE_AF_OD;     // Tx shared with the other boards, pull-up on the bus
+    #else
     GPIO_InitStruct.Mode = GPIO_MODE_AF_PP;
+    #endif
     GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_HIGH;
     HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
 
@@ -181,7 +185,11 @@ void HAL_UART_MspInit(UART_HandleTypeDef* uartHandle)
     PB11     ------> USART3_RX 
     */
     GPIO_InitStruct.Pin = GPIO_PIN_10;
+    #if defined(SERIAL_MULTIDROP) && defined(CONTROL_SERIAL_USART3)
+    GPIO_InitStruct.Mode = GPIO_MODE_AF_OD;     // Tx shared with the other boards, pull-up on the bus
+    #else
     GPIO_InitStruct.Mode = GPIO_MODE_AF_PP;
+    #endif
     GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_HIGH;
     HAL_GPIO_Init(GPIOB, &GPIO_InitStruct);
 
@@ -27,6 +27,7 @@
 #include "config.h"
 #include "eeprom.h"
 #include "util.h"
+#include "filter.h"
 #include "BLDC_controller.h"
 #include "rtwtypes.h"
 #include "comms.h"
@@ -41,15 +42,17 @@
 // Global variables set externally
 //------------------------------------------------------------------------
 extern volatile adc_buf_t adc_buffer;
+#if defined(ADC_INPUT_MEDIAN) && defined(CONTROL_ADC)
+extern volatile int16_t adcTx2Filt;
+extern volatile int16_t adcRx2Filt;
+#endif
 extern I2C_HandleTypeDef hi2c2;
 extern UART_HandleTypeDef huart2;
 extern UART_HandleTypeDef huart3;
 
 extern int16_t batVoltage;
 extern uint8_t backwardDrive;
-extern uint8_t buzzerCount;             // global variable for the buzzer counts. can be 1, 2, 3, 4, 5, 6, 7...
 extern uint8_t buzzerFreq;              // global variable for the buzzer pitch. can be 1, 2, 3, 4, 5, 6, 7...
-extern uint8_t buzzerPattern;           // global variable for the buzzer pattern. can be 1, 2, 3, 4, 5, 6, 7...
 
 extern uint8_t enable;                  // global variable for motor enable
 
@@ -57,6 +60,10 @@ extern uint8_t nunchuk_data[6];
 extern volatile uint32_t timeoutCntGen; // global counter for general timeout counter
 extern volatile uint8_t  timeoutFlgGen; // global flag for general timeout counter
 extern volatile uint32_t main_loop_counter;
+extern volatile uint32_t buzzerTimer;   // PWM period counter, local time base of SERIAL_SYNC
+#ifndef VARIANT_TRANSPOTTER
+extern PipeCfg inPipe[4];               // input pipeline stage table: input1, input2, left and right motor target
+#endif
 
 #if defined(CONTROL_PPM_LEFT) || defined(CONTROL_PPM_RIGHT)
 extern volatile uint16_t ppm_captured_value[PPM_NUM_CHANNELS+1];
@@ -124,22 +131,139 @@ static   uint16_t saveValue       = 0;
 static   uint8_t  saveValue_valid = 0;
 #elif !defined(VARIANT_HOVERBOARD) && !defined(VARIANT_TRANSPOTTER)
 uint16_t VirtAddVarTab[NB_OF_VAR] = {1000, 1001, 1002, 1003, 1004, 1005, 1006, 1007, 1008, 1009,
-                                     1010, 1011, 1012, 1013, 1014, 1015, 1016, 1017, 1018};
+                                     1010, 1011, 1012, 1013, 1014, 1015, 1016, 1017, 1018, 1019,
+                                     1020, 1021, 1022, 1023, 1024, 1025, 1026, 1027, 1028, 1029,
+                                     1030, 1031, 1032, 1033, 1034};
 #else
 uint16_t VirtAddVarTab[NB_OF_VAR] = {1000};       // Dummy virtual address to avoid warnings
 #endif
+uint16_t cfgData[CFG_SLOTS];                      // RAM copy of the configuration record, valid if cfgStatus is CFG_OK or CFG_MIGRATED
+uint8_t  cfgStatus = CFG_NONE;                    // [-] outcome of the last configuration load or save
+uint16_t eeErases;                                // [-] erase cycles of the most worn EEPROM page
+uint32_t eeLife;                                  // [-] projected number of saves until the EEPROM pages wear out
 
 
 //------------------------------------------------------------------------
 // Local variables
 //------------------------------------------------------------------------
-static int16_t INPUT_MAX;             // [-] Input target maximum limitation
-static int16_t INPUT_MIN;             // [-] Input target minimum limitation
-
+static int16_t INPUT_MAX =  1000;     // [-] Input target maximum limitation
+static int16_t INPUT_MIN = -1000;     // [-] Input target minimum limitation
+
+static BuzzerNote       beepQueue[BEEP_QUEUE_SIZE];             // one-shot notes, written by the main loop
+static volatile uint8_t beepHead;                               // queue write index, owned by the main loop
+static volatile uint8_t beepTail;                               // queue read index, owned by the sequencer
+static BuzzerNote       beepPatternSeq[2 * BEEP_COUNT_MAX + 1]; // looping error pattern, played when the queue is empty
+static uint8_t          beepPatternLen;
+static uint8_t          beepPatternIdx;
+static volatile uint8_t beepCntReq, beepFreqReq, beepPatReq;    // pattern requested by beepCount()
+static uint8_t          beepCnt, beepFreq, beepPat;             // pattern currently loaded in beepPatternSeq
+static volatile uint16_t beepNoteTimer;                         // [ms] remaining duration of the current note
+static volatile uint8_t beepPlayingPattern;
+
+
+PowerState      powerState = PWR_RUN;                           // power state machine, stepped by powerStep()
+static uint8_t  pwrStateEntry;                                  // state changed, entry time not latched yet
+static uint32_t pwrStateTick;                                   // [ms] entry time of the current state
+static uint32_t pwrBtnTick;                                     // [ms] power button timestamp
+static uint8_t  pwrBtnHeld;                                     // power button press in progress
+static uint8_t  pwrBtnBeep;                                     // long press beep already played
+static uint8_t  cal_minmax;                                     // calibration selected: 1 = MIN/MAX, 0 = current and speed limits
+
+static void powerSetState(PowerState state);
+static void powerOffMelody(void);
+static void calibrateDone(void);
 
 #if !defined(VARIANT_HOVERBOARD) && !defined(VARIANT_TRANSPOTTER)
   static uint8_t  cur_spd_valid  = 0;
   static uint8_t  inp_cal_valid  = 0;
+  static int32_t  cal_input1_fixdt;                             // calibration context, shared by the calibration steps
+  static int32_t  cal_input2_fixdt;
+  static Median5  cal_input1_med;                               // glitch rejection before the calibration low-pass filters
+  static Median5  cal_input2_med;
+  static uint16_t cal_cur_factor;                               // fixdt(0,16,16)
+  static uint8_t  cal_step;
+  #ifdef AUTO_CALIBRATION_ENA
+  static int16_t  cal_input1_min, cal_input1_mid, cal_input1_max;
+  static int16_t  cal_input2_min, cal_input2_mid, cal_input2_max;
+  #endif
+#endif
+
+#ifdef IDLE_LOW_POWER
+volatile uint8_t idleMode;                                      // motors disabled and stationary: controller skipped, core sleeps
+volatile uint8_t idleWake;                                      // set by the DMA interrupt when a hall sensor change ended the idle mode
+#endif
+
+#ifdef FEEDBACK_TELEMETRY
+extern volatile uint16_t isrCycles;
+extern volatile uint16_t isrCyclesMax;
+extern int16_t batVoltageCalib;
+extern int16_t board_temp_deg_c;
+extern int16_t left_dc_curr;
+extern int16_t right_dc_curr;
+extern int16_t cmdL;
+extern int16_t cmdR;
+uint32_t tlmFields = TLM_FIELDS_DEF;                            // selected telemetry fields, TLM_* bits
+uint8_t  tlmDiv    = TLM_DIV_DEF;                               // [main loops] telemetry period, 0 = off
+uint16_t tlmDrop;                                               // frames skipped because the previous transfer was still ongoing
+static uint16_t tlmSeq;
+  #if defined(FEEDBACK_SERIAL_USART2)
+  static uint8_t tlmBufL[14 + 2 * TLM_FIELDS_NUM + 2];          // frame buffer, read by the Tx DMA
+  #endif
+  #if defined(FEEDBACK_SERIAL_USART3)
+  static uint8_t tlmBufR[14 + 2 * TLM_FIELDS_NUM + 2];          // frame buffer, read by the Tx DMA
+  #endif
+#endif
+
+#ifdef ODOMETER_COUNTERS
+extern int16_t batVoltageCalib;
+extern int16_t dc_curr;
+uint32_t odom[ODOM_NUM];                                        // [m], [mAh], [Wh], [s] persistent counters, ODOM_*
+static uint32_t odomBase[ODOM_NUM];                             // stored bases
+static uint16_t odomDelta[ODOM_NUM];                            // stored deltas
+static int32_t  odomAcc[ODOM_NUM];                              // remainders below one counter unit
+static uint32_t odomTick;                                       // [ms] last integration
+static uint32_t odomSaveTick;                                   // [ms] last checkpoint
+static const int32_t odomUnit[ODOM_NUM] = {                     // accumulator value of one counter unit
+  60000 * 1000,                                                 // [rpm * mm * ms]:  1 m
+  360000,                                                       // [A/100 * ms]:     1 mAh
+  360000000,                                                    // [W/100 * ms]:     1 Wh
+  1000                                                          // [ms]:             1 s
+};
+#endif
+
+#ifdef FAULT_BLACKBOX
+extern int16_t batVoltageCalib;
+extern int16_t board_temp_deg_c;
+extern int16_t dc_curr;
+extern int16_t cmdL;
+extern int16_t cmdR;
+uint16_t bboxCount;                                             // stored snapshots
+static int16_t  bboxRing[BBOX_SAMPLES][BBOX_CH_NUM];            // latest samples, bboxHead is the slot of the next one
+static uint16_t bboxHead;
+static uint16_t bboxFill;                                       // valid samples in the ring
+static uint8_t  bboxDivCnt;
+static uint8_t  bboxActive;                                     // active faults, bit n = BBOX_FLT_* n
+static uint8_t  bboxFault;                                      // fault of the snapshot in the ring, BBOX_FLT_NONE while recording
+static uint16_t bboxPost;                                       // samples recorded after the fault
+static uint32_t bboxTime;                                       // [ms] time of the fault
+static uint32_t bboxDrive;                                      // [s] drive time at the fault
+static uint32_t bboxDist;                                       // [m] distance at the fault
+static uint8_t  bboxPage;                                       // page of the newest snapshot
+static uint32_t bboxAddr;                                       // first free address of bboxPage
+static uint16_t bboxSeq;                                        // number of the newest snapshot
+static uint32_t bboxWrAddr;                                     // data programming: next halfword
+static uint8_t  bboxWrLow;                                      // data programming: byte waiting for its pair
+static uint8_t  bboxWrOdd;
+static uint8_t  bboxWrErr;
+static uint16_t bboxWrCrc;
+  #if defined(DEBUG_SERIAL_USART2) || defined(DEBUG_SERIAL_USART3)
+static uint8_t  bboxRdPages;                                    // printing: pages left, 0 = idle
+static uint32_t bboxRdAddr;                                     // printing: snapshot in progress
+static uint32_t bboxRdEnd;                                      // printing: end of its page
+static uint32_t bboxRdData;                                     // printing: next data byte
+static uint16_t bboxRdSample;                                   // printing: next sample, BBOX_RD_HDR before the header
+static int16_t  bboxRdVal[BBOX_CH_NUM];                         // printing: previous sample
+  #endif
 #endif
 
 #if defined(CONTROL_ADC)
@@ -176,22 +300,54 @@ static uint32_t Sideboard_R_len = sizeof(Sideboard_R);
 
 #if defined(CONTROL_SERIAL_USART2)
 static SerialCommand commandL;
-static SerialCommand commandL_raw;
-static uint32_t commandL_len = sizeof(commandL);
   #ifdef CONTROL_IBUS
+  static SerialCommand commandL_raw;
+  static uint32_t commandL_len = sizeof(commandL);
   static uint16_t ibusL_captured_value[IBUS_NUM_CHANNELS];
+  #else
+  SerialParser parserL;                 // Streaming parser state and Rx statistics
   #endif
 #endif
 
 #if defined(CONTROL_SERIAL_USART3)
 static SerialCommand commandR;
-static SerialCommand commandR_raw;
-static uint32_t commandR_len = sizeof(commandR);
   #ifdef CONTROL_IBUS
+  static SerialCommand commandR_raw;
+  static uint32_t commandR_len = sizeof(commandR);
   static uint16_t ibusR_captured_value[IBUS_NUM_CHANNELS];
+  #else
+  SerialParser parserR;                 // Streaming parser state and Rx statistics
   #endif
 #endif
 
+#if (defined(CONTROL_SERIAL_USART2) || defined(CONTROL_SERIAL_USART3)) && !defined(CONTROL_IBUS)
+uint8_t  serialTgtAcv;                  // Per-motor targets received on the active serial input
+int16_t  serialTgtL;                    // Left motor target from the serial command
+int16_t  serialTgtR;                    // Right motor target from the serial command
+uint8_t  serialEnaReq = 1;              // Motors enable allowed by the serial command
+#endif
+#ifdef SERIAL_SYNC
+int32_t  syncErr;                       // [us] host time minus estimated host time at the last sync record
+int16_t  syncDrift;                     // [ppm] local clock drift against the host
+uint16_t syncLate;                      // Scheduled targets that arrived too late and were applied at once
+volatile uint8_t  syncSched;            // SYNC_IDLE/PENDING/ARMED, ARMED lets the motor ISR switch to syncPwmL/R at syncSchedTick
+volatile uint32_t syncSchedTick;        // [PWM periods] local time at which the scheduled targets take effect
+volatile int     syncPwmL;              // pwml for the scheduled targets, written by the main loop
+volatile int     syncPwmR;              // pwmr for the scheduled targets, written by the main loop
+int16_t  syncTgtL;                      // Scheduled left motor target
+int16_t  syncTgtR;                      // Scheduled right motor target
+static uint8_t  syncValid;              // Host time was received
+static uint32_t syncHost0;              // [us] estimated host time at syncLocal0
+static uint32_t syncLocal0;             // [PWM periods] local time of the last sync record
+static int32_t  syncRate;               // [us per PWM period, fixdt(1,32,16)] estimated host time per PWM period
+#define SYNC_RATE_NOM   ((int32_t)((1000000LL << 16) / PWM_FREQ))
+#endif
+#ifdef SERIAL_MULTIDROP
+uint8_t  nodeId = SERIAL_NODE_ID;       // Node ID on the multi-drop bus
+static volatile uint8_t  nodePollReq;   // Telemetry answer pending
+static volatile uint32_t nodePollLoop;  // Main loop in which the answer is sent
+#endif
+
 #if defined(SUPPORT_BUTTONS) || defined(SUPPORT_BUTTONS_LEFT) || defined(SUPPORT_BUTTONS_RIGHT)
 static uint8_t button1;                 // Blue
 static uint8_t button2;                 // Green
@@ -207,26 +363,133 @@ static uint8_t standstillAcv = 0;
 #endif
 
 /* =========================== Retargeting printf =========================== */
-/* retarget the C library printf function to the USART */
+/* retarget the C library printf function to the USART
+ * - the output is copied into a ring buffer drained by the Tx DMA, so printf never waits for the UART
+ * - single producer (main loop) and single consumer (Tx complete interrupt): logHead is only written by the producer,
+ *   logTail and logTxLen only by the consumer, or by the producer while no transfer is in flight
+ */
 #if defined(DEBUG_SERIAL_USART2) || defined(DEBUG_SERIAL_USART3)
+  #if defined(DEBUG_SERIAL_USART2)
+    #define LOG_HUART huart2
+  #else
+    #define LOG_HUART huart3
+  #endif
+  #define LOG_TX_MASK (LOG_TX_BUFFER_SIZE - 1)
+
+  uint8_t  logLevel = LOG_LEVEL;                                  // messages above this level are not printed
+  uint16_t logDrop;                                               // [bytes] output dropped because the Tx ring buffer was full
+  uint16_t logPeak;                                               // [bytes] highest Tx ring buffer fill level
+  uint8_t  logHold;                                               // text output is held back while a binary debug frame is being sent
+  static uint8_t  logBuf[LOG_TX_BUFFER_SIZE];
+  static uint8_t  logHoldBuf[LOG_HOLD_BUFFER_SIZE];               // text held back, in the order it was printed
+  static uint16_t logHoldLen;
+  static volatile uint16_t logHead;                               // free running write index
+  static volatile uint16_t logTail;                               // free running read index
+  static volatile uint16_t logTxLen;                              // length of the DMA transfer in flight, 0 = idle
+
+  /*
+   * Start the DMA transfer of the next contiguous block of the ring buffer, if the DMA is idle
+   */
+  static void logKick(void) {
+    uint16_t tail, len;
+    if (logTxLen) {                                               // checked first: only while idle logTail can not move under us
+      return;
+    }
+    tail = logTail;
+    len  = logHead - tail;
+    if (!len) {
+      return;
+    }
+    if (len > LOG_TX_BUFFER_SIZE - (tail & LOG_TX_MASK)) {      // stop at the end of the buffer, the rest follows in the next transfer
+      len = LOG_TX_BUFFER_SIZE - (tail & LOG_TX_MASK);
+    }
+    logTxLen = len;
+    if (HAL_UART_Transmit_DMA(&LOG_HUART, &logBuf[tail & LOG_TX_MASK], len) != HAL_OK) {
+      logTxLen = 0;                                               // retried on the next write
+    }
+  }
+
+  /*
+   * Free space in the Tx ring buffer
+   */
+  uint16_t logFree(void) {
+    return LOG_TX_BUFFER_SIZE - (uint16_t)(logHead - logTail);
+  }
+
+  /*
+   * Copy data into the Tx ring buffer. What does not fit is dropped
+   */
+  void logWrite(const uint8_t *data, uint16_t len) {
+    uint16_t head = logHead;
+    uint16_t free = LOG_TX_BUFFER_SIZE - (uint16_t)(head - logTail);
+    uint16_t i;
+
+    if (len > free) {
+      logDrop += len - free;
+      len      = free;
+    }
+    for (i = 0; i < len; i++) {
+      logBuf[(head + i) & LOG_TX_MASK] = data[i];
+    }
+    logHead = head + len;                                         // publish the data only after it was copied
+    if ((uint16_t)(logHead - logTail) > logPeak) {
+      logPeak = logHead - logTail;
+    }
+    logKick();
+  }
+
+  /*
+   * Move the held back text into the Tx ring buffer, as much as fits, once the binary frame is sent
+   */
+  void logFlush(void) {
+    uint16_t len = logFree();                                     // read once, the Tx interrupt can free more space meanwhile
+    len = MIN(logHoldLen, len);
+    if (logHold || !len) {
+      return;
+    }
+    logWrite(logHoldBuf, len);
+    logHoldLen -= len;
+    memmove(logHoldBuf, &logHoldBuf[len], logHoldLen);
+  }
+
+  /*
+   * Text output: held back while logHold is set, or while older held text is still waiting. What does not fit is dropped
+   */
+  static void logText(const uint8_t *data, uint16_t len) {
+    uint16_t n;
+    logFlush();
+    if (!logHold && !logHoldLen) {
+      logWrite(data, len);
+      return;
+    }
+    n = MIN(len, LOG_HOLD_BUFFER_SIZE - logHoldLen);
+    memcpy(&logHoldBuf[logHoldLen], data, n);
+    logHoldLen += n;
+    logDrop    += len - n;
+  }
+
+  void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart) {
+    if (huart->Instance == LOG_HUART.Instance && logTxLen) {
+      logTail  = logTail + logTxLen;
+      logTxLen = 0;
+      logKick();
+    }
+  }
+
   #ifdef __GNUC__
     #define PUTCHAR_PROTOTYPE int __io_putchar(int ch)
   #else
     #define PUTCHAR_PROTOTYPE int fputc(int ch, FILE *f)
   #endif
   PUTCHAR_PROTOTYPE {
-    #if defined(DEBUG_SERIAL_USART2)
-      HAL_UART_Transmit(&huart2, (uint8_t *)&ch, 1, 1000);
-    #elif defined(DEBUG_SERIAL_USART3)
-      HAL_UART_Transmit(&huart3, (uint8_t *)&ch, 1, 1000);
-    #endif
+    uint8_t c = (uint8_t)ch;
+    logText(&c, 1);
     return ch;
   }
   
   #ifdef __GNUC__
     int _write(int file, char *data, int len) {
-      int i;
-      for (i = 0; i < len; i++) { __io_putchar( *data++ );}
+      logText((uint8_t *)data, (uint16_t)len);
       return len;
     }
   #endif
@@ -270,13 +533,26 @@ void BLDC_Init(void) {
 }
 
 void Input_Lim_Init(void) {     // Input Limitations - ! Do NOT touch !
+  int16_t fieldWeakHi = MAX(rtP_Left.r_fieldWeakHi, rtP_Right.r_fieldWeakHi) >> 4;   // FI_WEAK_HI, can change at runtime
+  #ifndef VARIANT_TRANSPOTTER
+  int16_t inMax = INPUT_MAX, inMin = INPUT_MIN;
+  #endif
+
   if (rtP_Left.b_fieldWeakEna || rtP_Right.b_fieldWeakEna) {
-    INPUT_MAX = MAX( 1000, FIELD_WEAK_HI);
-    INPUT_MIN = MIN(-1000,-FIELD_WEAK_HI);
+    INPUT_MAX = MAX( 1000, fieldWeakHi);
+    INPUT_MIN = MIN(-1000,-fieldWeakHi);
   } else {
     INPUT_MAX =  1000;
     INPUT_MIN = -1000;
   }
+
+  #ifndef VARIANT_TRANSPOTTER
+  for (uint8_t i = 0; i < 4; i++) {  // pipeline clamps at the input range follow it, other clamps are kept
+    if (inPipe[i].max == inMax) { inPipe[i].max = INPUT_MAX; }
+    if (inPipe[i].min == inMin) { inPipe[i].min = INPUT_MIN; }
+    filtPipeRange(&inPipe[i], INPUT_MAX);  // the expo curve spans the input range
+  }
+  #endif
 }
 
 void Input_Init(void) {
@@ -293,6 +569,10 @@ void Input_Init(void) {
     Nunchuk_Init();
   #endif
 
+  #ifdef DEBUG_SERIAL_PROTOCOL
+    initLookup();
+  #endif
+
   #if defined(DEBUG_SERIAL_USART2) || defined(CONTROL_SERIAL_USART2) || defined(FEEDBACK_SERIAL_USART2) || defined(SIDEBOARD_SERIAL_USART2)
     UART2_Init();
   #endif
@@ -309,23 +589,27 @@ void Input_Init(void) {
   #endif
 
   #if !defined(VARIANT_HOVERBOARD) && !defined(VARIANT_TRANSPOTTER)
-    uint16_t writeCheck, readVal;
     HAL_FLASH_Unlock();
     EE_Init();            /* EEPROM Init */
-    EE_ReadVariable(VirtAddVarTab[0], &writeCheck);
-    if (writeCheck == FLASH_WRITE_KEY) {
-      EE_ReadVariable(VirtAddVarTab[1] , &readVal); rtP_Left.i_max = rtP_Right.i_max = (int16_t)readVal;
-      EE_ReadVariable(VirtAddVarTab[2] , &readVal); rtP_Left.n_max = rtP_Right.n_max = (int16_t)readVal;
+    #ifdef ODOMETER_COUNTERS
+    odomLoad();
+    #endif
+    if (configLoad()) {
+      rtP_Left.i_max = rtP_Right.i_max = (int16_t)cfgData[1];
+      rtP_Left.n_max = rtP_Right.n_max = (int16_t)cfgData[2];
       for (uint8_t i=0; i<INPUTS_NR; i++) {
-        EE_ReadVariable(VirtAddVarTab[ 3+8*i] , &readVal); input1[i].typ = (uint8_t)readVal;
-        EE_ReadVariable(VirtAddVarTab[ 4+8*i] , &readVal); input1[i].min = (int16_t)readVal;
-        EE_ReadVariable(VirtAddVarTab[ 5+8*i] , &readVal); input1[i].mid = (int16_t)readVal;
-        EE_ReadVariable(VirtAddVarTab[ 6+8*i] , &readVal); input1[i].max = (int16_t)readVal;
-        EE_ReadVariable(VirtAddVarTab[ 7+8*i] , &readVal); input2[i].typ = (uint8_t)readVal;
-        EE_ReadVariable(VirtAddVarTab[ 8+8*i] , &readVal); input2[i].min = (int16_t)readVal;
-        EE_ReadVariable(VirtAddVarTab[ 9+8*i] , &readVal); input2[i].mid = (int16_t)readVal;
-        EE_ReadVariable(VirtAddVarTab[10+8*i] , &readVal); input2[i].max = (int16_t)readVal;
+        input1[i].typ = (uint8_t)cfgData[ 3+8*i];
+        input1[i].min = (int16_t)cfgData[ 4+8*i];
+        input1[i].mid = (int16_t)cfgData[ 5+8*i];
+        input1[i].max = (int16_t)cfgData[ 6+8*i];
+        input2[i].typ = (uint8_t)cfgData[ 7+8*i];
+        input2[i].min = (int16_t)cfgData[ 8+8*i];
+        input2[i].mid = (int16_t)cfgData[ 9+8*i];
+        input2[i].max = (int16_t)cfgData[10+8*i];
       }
+      #ifdef SERIAL_MULTIDROP
+      if (cfgData[19] < SERIAL_NODE_BCAST) nodeId = (uint8_t)cfgData[19];
+      #endif
     } else {
       for (uint8_t i=0; i<INPUTS_NR; i++) {
         if (input1[i].typDef == 3) {  // If Input type defined is 3 (auto), identify the input type based on the values from config.h
@@ -343,6 +627,10 @@ void Input_Init(void) {
     HAL_FLASH_Lock();
   #endif
 
+  #ifdef FAULT_BLACKBOX
+    bboxInit();
+  #endif
+
   #ifdef VARIANT_TRANSPOTTER
     enable = 1;
 
@@ -413,42 +701,30 @@ void UART_DisableRxErrors(UART_HandleTypeDef *huart)
 /* =========================== General Functions =========================== */
 
 void poweronMelody(void) {
-    buzzerCount = 0;  // prevent interraction with beep counter
     for (int i = 8; i >= 0; i--) {
-      buzzerFreq = (uint8_t)i;
-      HAL_Delay(100);
+      beepNote((uint8_t)i, 100);
     }
-    buzzerFreq = 0;
 }
 
 void beepCount(uint8_t cnt, uint8_t freq, uint8_t pattern) {
-    buzzerCount   = cnt;
-    buzzerFreq    = freq;
-    buzzerPattern = pattern;
+    beepCntReq  = MIN(cnt, BEEP_COUNT_MAX);
+    beepFreqReq = freq;
+    beepPatReq  = pattern;
 }
 
 void beepLong(uint8_t freq) {
-    buzzerCount = 0;  // prevent interraction with beep counter
-    buzzerFreq = freq;
-    HAL_Delay(500);
-    buzzerFreq = 0;
+    beepNote(freq, 500);
 }
 
 void beepLongMany(uint8_t freq, uint16_t duration, uint8_t count) {
-    buzzerCount = 0;  // prevent interraction with beep counter
     for (uint8_t i = 0; i < count; i++) {
-      buzzerFreq = freq;
-      HAL_Delay(duration);
-      buzzerFreq = 0;
-      HAL_Delay(300);
+      beepNote(freq, duration);
+      beepNote(0, 300);
     }
 }
 
 void beepShort(uint8_t freq) {
-    buzzerCount = 0;  // prevent interraction with beep counter
-    buzzerFreq = freq;
-    HAL_Delay(100);
-    buzzerFreq = 0;
+    beepNote(freq, BEEP_DELAY);
 }
 
 void beepShortMany(uint8_t cnt, int8_t dir) {
@@ -463,6 +739,97 @@ void beepShortMany(uint8_t cnt, int8_t dir) {
     }
 }
 
+ /*
+ * Buzzer Sequencer
+ * The beep functions above do not block: they push notes into beepQueue and return.
+ * beepSequencer() is called every 1 ms from the DMA interrupt, plays the queued notes
+ * and, when the queue is empty, loops the error pattern requested by beepCount().
+ * A pause is a note with freq = 0.
+ *
+ * beepCount(cnt, freq, pattern) is expressed as the sequence:
+ *   cnt x [tone(freq, T), pause(pattern*T)], pause(2*(pattern+1)*T)   with T = BEEP_PATTERN_PERIOD
+ * and cnt = 0 gives a continuous [tone(freq, T), pause(pattern*T)] loop.
+ */
+uint8_t beepNote(uint8_t freq, uint16_t duration) {
+  uint8_t head = beepHead;
+  uint8_t next = (head + 1) & (BEEP_QUEUE_SIZE - 1);
+  if (next == beepTail) {                 // queue full: drop the note
+    return 0;
+  }
+  beepQueue[head].freq     = freq;
+  beepQueue[head].duration = duration;
+  beepHead = next;
+  return 1;
+}
+
+uint8_t beepBusy(void) {
+  return (beepHead != beepTail) || (beepNoteTimer && !beepPlayingPattern);
+}
+
+void beepWait(void) {
+  while (beepBusy()) { }
+}
+
+static void beepPatternBuild(void) {
+  uint8_t  len  = 0;
+  uint16_t rest = beepPat * BEEP_PATTERN_PERIOD;
+
+  if (beepFreq != 0) {
+    for (uint8_t i = 0; i < MAX(beepCnt, 1); i++) {
+      beepPatternSeq[len].freq       = beepFreq;
+      beepPatternSeq[len++].duration = BEEP_PATTERN_PERIOD;
+      if (rest) {
+        beepPatternSeq[len].freq       = 0;
+        beepPatternSeq[len++].duration = rest;
+      }
+    }
+    if (beepCnt) {                        // pause 2 periods after the beep group
+      beepPatternSeq[len].freq       = 0;
+      beepPatternSeq[len++].duration = 2 * (beepPat + 1) * BEEP_PATTERN_PERIOD;
+    }
+  }
+  beepPatternLen = len;
+  beepPatternIdx = 0;
+}
+
+void beepSequencer(void) {
+  BuzzerNote note;
+
+  // Reload the error pattern if beepCount() requested a different one
+  if (beepCntReq != beepCnt || beepFreqReq != beepFreq || beepPatReq != beepPat) {
+    beepCnt  = beepCntReq;
+    beepFreq = beepFreqReq;
+    beepPat  = beepPatReq;
+    beepPatternBuild();
+    if (beepPlayingPattern) {             // interrupt the old pattern immediately
+      beepNoteTimer = 0;
+    }
+  }
+
+  if (beepNoteTimer && --beepNoteTimer) {
+    return;
+  }
+
+  if (beepTail != beepHead) {             // one-shot notes take precedence over the error pattern
+    note     = beepQueue[beepTail];
+    beepTail = (beepTail + 1) & (BEEP_QUEUE_SIZE - 1);
+    beepPlayingPattern = 0;
+  } else if (beepPatternLen) {
+    note = beepPatternSeq[beepPatternIdx];
+    if (++beepPatternIdx >= beepPatternLen) {
+      beepPatternIdx = 0;
+    }
+    beepPlayingPattern = 1;
+  } else {
+    note.freq     = 0;
+    note.duration = 0;
+    beepPlayingPattern = 0;
+  }
+
+  buzzerFreq    = note.freq;
+  beepNoteTimer = note.duration;
+}
+
 void calcAvgSpeed(void) {
     // Calculate measured average speed. The minus sign (-) is because motors spin in opposite directions
     #if   !defined(INVERT_L_DIRECTION) && !defined(INVERT_R_DIRECTION)
@@ -482,6 +849,51 @@ void calcAvgSpeed(void) {
     speedAvgAbs   = abs(speedAvg);
 }
 
+ /*
+ * Low-Power Idle
+ * Enters the idle mode when the motors are disabled and stationary, with no input activity, for IDLE_ENTRY_TIME.
+ * In idle the DMA interrupt skips the controller steps and lowers the ADC trigger rate by IDLE_ADC_DIV, the main loop
+ * sleeps with WFI between the interrupts. The flash interface clock is stopped during sleep; the SRAM clock stays on for
+ * the ADC DMA.
+ */
+void idleCheck(void) {
+#ifdef IDLE_LOW_POWER
+  static uint32_t idle_tick;
+  uint32_t now = HAL_GetTick();
+
+  if (enable || idleWake || speedAvgAbs || rtY_Left.n_mot || rtY_Right.n_mot || rtY_Left.z_errCode || rtY_Right.z_errCode
+      || ABS(input1[inIdx].cmd) > IDLE_WAKE_THRESHOLD || ABS(input2[inIdx].cmd) > IDLE_WAKE_THRESHOLD) {
+    idle_tick = now;
+    idleWake  = 0;
+    if (idleMode) {
+      idleMode = 0;
+      __HAL_RCC_FLITF_CLK_ENABLE();
+    }
+  } else if (!idleMode && now - idle_tick >= IDLE_ENTRY_TIME) {
+    __HAL_RCC_FLITF_CLK_DISABLE();              // flash interface clock off during sleep
+    idleMode = 1;
+  }
+#endif
+}
+
+#if !defined(VARIANT_HOVERBOARD) && !defined(VARIANT_TRANSPOTTER)
+ /*
+ * Calibration input filters: sliding median of 5 against ADC glitches, then low-pass
+ * A single wrong sample no longer widens the MIN/MAX limits found by adcCalibStep()
+ */
+static void calFilterInit(void) {
+  cal_input1_fixdt = input1[inIdx].raw << 16;
+  cal_input2_fixdt = input2[inIdx].raw << 16;
+  filtMedianInit5(&cal_input1_med, input1[inIdx].raw);
+  filtMedianInit5(&cal_input2_med, input2[inIdx].raw);
+}
+
+static void calFilterStep(void) {
+  filtLowPass32(filtMedian5(input1[inIdx].raw, &cal_input1_med), FILTER, &cal_input1_fixdt);
+  filtLowPass32(filtMedian5(input2[inIdx].raw, &cal_input2_med), FILTER, &cal_input2_fixdt);
+}
+#endif
+
  /*
  * Auto-calibration of the ADC Limits
  * This function finds the Minimum, Maximum, and Middle for the ADC input
@@ -489,60 +901,64 @@ void calcAvgSpeed(void) {
  * - press the power button for more than 5 sec and release after the beep sound
  * - move the potentiometers freely to the min and max limits repeatedly
  * - release potentiometers to the resting postion
- * - press the power button to confirm or wait for the 20 sec timeout
+ * - press the power button to confirm or wait for the 30 sec timeout
  * The Values will be saved to flash. Values are persistent if you flash with platformio. To erase them, make a full chip erase.
+ *
+ * adcCalibLim() only starts the procedure, the sampling is done by adcCalibStep() from the power state machine.
  */
 void adcCalibLim(void) {
-#ifdef AUTO_CALIBRATION_ENA
+#if defined(AUTO_CALIBRATION_ENA) && !defined(VARIANT_HOVERBOARD) && !defined(VARIANT_TRANSPOTTER)
   calcAvgSpeed();
   if (speedAvgAbs > 5) {    // do not enter this mode if motors are spinning
+    calibrateDone();
     return;
   }
 
-#if !defined(VARIANT_HOVERBOARD) && !defined(VARIANT_TRANSPOTTER)
-
   PRINTF("Input calibration started...\r\n");
 
-  readInputRaw();
   // Inititalization: MIN = a high value, MAX = a low value
-  int32_t  input1_fixdt = input1[inIdx].raw << 16;
-  int32_t  input2_fixdt = input2[inIdx].raw << 16;
-  int16_t  INPUT1_MIN_temp = MAX_int16_T;
-  int16_t  INPUT1_MID_temp = 0;
-  int16_t  INPUT1_MAX_temp = MIN_int16_T;
-  int16_t  INPUT2_MIN_temp = MAX_int16_T;
-  int16_t  INPUT2_MID_temp = 0;
-  int16_t  INPUT2_MAX_temp = MIN_int16_T;
-  int16_t  input_margin    = 0;
-  uint16_t input_cal_timeout = 0;
-  
+  calFilterInit();
+  cal_input1_min    = MAX_int16_T;
+  cal_input1_mid    = 0;
+  cal_input1_max    = MIN_int16_T;
+  cal_input2_min    = MAX_int16_T;
+  cal_input2_mid    = 0;
+  cal_input2_max    = MIN_int16_T;
+  powerSetState(PWR_CAL_ADC);
+#else
+  calibrateDone();
+#endif
+}
+
+#if defined(AUTO_CALIBRATION_ENA) && !defined(VARIANT_HOVERBOARD) && !defined(VARIANT_TRANSPOTTER)
+static void adcCalibStep(uint8_t btn, uint32_t elapsed) {
+  int16_t input_margin = 0;
+
+  // Extract MIN, MAX and MID from ADC while the power button is not pressed
+  if (!btn && elapsed < 30000) {    // 30 sec timeout
+    calFilterStep();
+
+    cal_input1_mid = (int16_t)(cal_input1_fixdt >> 16);   // convert fixed-point to integer
+    cal_input2_mid = (int16_t)(cal_input2_fixdt >> 16);
+    cal_input1_min = MIN(cal_input1_min, cal_input1_mid);
+    cal_input1_max = MAX(cal_input1_max, cal_input1_mid);
+    cal_input2_min = MIN(cal_input2_min, cal_input2_mid);
+    cal_input2_max = MAX(cal_input2_max, cal_input2_mid);
+    return;
+  }
+
   #ifdef CONTROL_ADC
   if (inIdx == CONTROL_ADC) {
     input_margin = ADC_MARGIN;
   }
   #endif
 
-  // Extract MIN, MAX and MID from ADC while the power button is not pressed
-  while (!HAL_GPIO_ReadPin(BUTTON_PORT, BUTTON_PIN) && input_cal_timeout++ < 6000) {   // 30 sec timeout
-    readInputRaw();
-    filtLowPass32(input1[inIdx].raw, FILTER, &input1_fixdt);
-    filtLowPass32(input2[inIdx].raw, FILTER, &input2_fixdt);
-    
-    INPUT1_MID_temp = (int16_t)(input1_fixdt >> 16);// CLAMP(input1_fixdt >> 16, INPUT1_MIN, INPUT1_MAX);   // convert fixed-point to integer
-    INPUT2_MID_temp = (int16_t)(input2_fixdt >> 16);// CLAMP(input2_fixdt >> 16, INPUT2_MIN, INPUT2_MAX);
-    INPUT1_MIN_temp = MIN(INPUT1_MIN_temp, INPUT1_MID_temp);
-    INPUT1_MAX_temp = MAX(INPUT1_MAX_temp, INPUT1_MID_temp);
-    INPUT2_MIN_temp = MIN(INPUT2_MIN_temp, INPUT2_MID_temp);
-    INPUT2_MAX_temp = MAX(INPUT2_MAX_temp, INPUT2_MID_temp);
-    HAL_Delay(5);
-  }
-
   PRINTF("Input1 is ");
 
-  input1[inIdx].typ = checkInputType(INPUT1_MIN_temp, INPUT1_MID_temp, INPUT1_MAX_temp);
+  input1[inIdx].typ = checkInputType(cal_input1_min, cal_input1_mid, cal_input1_max);
   if (input1[inIdx].typ == input1[inIdx].typDef || input1[inIdx].typDef == 3) {  // Accept calibration only if the type is correct OR type was set to 3 (auto)
-    input1[inIdx].min = INPUT1_MIN_temp + input_margin;
-    input1[inIdx].max = INPUT1_MAX_temp - input_margin;
+    input1[inIdx].min = cal_input1_min + input_margin;
+    input1[inIdx].max = cal_input1_max - input_margin;
     input1[inIdx].mid = (input1[inIdx].min + input1[inIdx].max) >> 1;
     PRINTF("..OK\r\nmin:%i mid:%i max:%i\r\n",input1[inIdx].min, input1[inIdx].mid, input1[inIdx].max);
   } else {
@@ -552,12 +968,12 @@ void adcCalibLim(void) {
 
   PRINTF("Input2 is ");
 
-  input2[inIdx].typ = checkInputType(INPUT2_MIN_temp, INPUT2_MID_temp, INPUT2_MAX_temp);
+  input2[inIdx].typ = checkInputType(cal_input2_min, cal_input2_mid, cal_input2_max);
   if (input2[inIdx].typ == input2[inIdx].typDef || input2[inIdx].typDef == 3) {  // Accept calibration only if the type is correct OR type was set to 3 (auto)
-    input2[inIdx].min = INPUT2_MIN_temp + input_margin;
-    input2[inIdx].max = INPUT2_MAX_temp - input_margin;
+    input2[inIdx].min = cal_input2_min + input_margin;
+    input2[inIdx].max = cal_input2_max - input_margin;
     input2[inIdx].mid = (input2[inIdx].min + input2[inIdx].max) >> 1;
-    PRINTF("..OK\r\nmin:%i mid:%i max:%i\r\n",input1[inIdx].min, input1[inIdx].mid, input1[inIdx].max);
+    PRINTF("..OK\r\nmin:%i mid:%i max:%i\r\n",input2[inIdx].min, input2[inIdx].mid, input2[inIdx].max);
   } else {
     input2[inIdx].typ = 0; // Disable input
     PRINTF("..NOK\r\n");
@@ -567,29 +983,34 @@ void adcCalibLim(void) {
           input1[inIdx].typ, input1[inIdx].min, input1[inIdx].mid, input1[inIdx].max,
           input2[inIdx].typ, input2[inIdx].min, input2[inIdx].mid, input2[inIdx].max);
 
-#endif
-#endif  // AUTO_CALIBRATION_ENA
+  calibrateDone();
 }
+#endif
+
  /*
  * Update Maximum Motor Current Limit (via ADC1) and Maximum Speed Limit (via ADC2)
  * Procedure:
  * - press the power button for more than 5 sec and immediatelly after the beep sound press one more time shortly
  * - move and hold the pots to a desired limit position for Current and Speed
  * - press the power button to confirm or wait for the 10 sec timeout
+ * With a single active input, current and speed are set in two steps, each confirmed by the power button.
+ *
+ * updateCurSpdLim() only starts the procedure, the sampling is done by updateCurSpdLimStep() from the power state machine.
  */
 void updateCurSpdLim(void) {
+#if !defined(VARIANT_HOVERBOARD) && !defined(VARIANT_TRANSPOTTER)
   calcAvgSpeed();
   if (speedAvgAbs > 5) {    // do not enter this mode if motors are spinning
+    calibrateDone();
     return;
   }
 
-#if !defined(VARIANT_HOVERBOARD) && !defined(VARIANT_TRANSPOTTER)
-
   PRINTF("Torque and Speed limits update started...\r\n");
   
   if (input1[inIdx].typ == 0 || input2[inIdx].typ == 0) {
     if (input1[inIdx].typ == 0 && input2[inIdx].typ == 0) {
-      PRINTF("No active inputs for calibrate...\r\n");
+      LOG(LOG_WARN, "No active inputs for calibrate...\r\n");
+      calibrateDone();
       return;
     }
     else {
@@ -597,82 +1018,59 @@ void updateCurSpdLim(void) {
     }
   }
 
-  int32_t  input1_fixdt = input1[inIdx].raw << 16;
-  int32_t  input2_fixdt = input2[inIdx].raw << 16;
-  uint16_t cur_factor;    // fixdt(0,16,16)
-  uint16_t spd_factor;    // fixdt(0,16,16)
-  uint16_t cur_spd_timeout = 0;
-  cur_spd_valid = 0;
+  calFilterInit();
+  cal_step          = 0;
+  cur_spd_valid     = 0;
 
   PRINTF("Press the power button when ready or wait for 10sec...\r\n");
-  // Wait for the power button press
-  while (!HAL_GPIO_ReadPin(BUTTON_PORT, BUTTON_PIN) && cur_spd_timeout++ < 2000) 
-  {  // 10 sec timeout
-    readInputRaw();
-    filtLowPass32(input1[inIdx].raw, FILTER, &input1_fixdt);
-    filtLowPass32(input2[inIdx].raw, FILTER, &input2_fixdt);
-    HAL_Delay(5);
-  }
+  powerSetState(PWR_CAL_CURSPD);
+#else
+  calibrateDone();
+#endif
+}
+
+#if !defined(VARIANT_HOVERBOARD) && !defined(VARIANT_TRANSPOTTER)
+static void updateCurSpdLimStep(void) {
+  uint16_t spd_factor;    // fixdt(0,16,16)
 
-  while (HAL_GPIO_ReadPin(BUTTON_PORT, BUTTON_PIN)) { HAL_Delay(WAIT_DELAY); }
   beepLong(10);
 
   // Calculate scaling factors
   if (input1[inIdx].typ != 0 && input2[inIdx].typ != 0) 
   {
-    cur_factor = CLAMP((input1_fixdt - (input1[inIdx].min << 16)) / (input1[inIdx].max - input1[inIdx].min), 6553, 65535);    // ADC1, MIN_cur(10%) = 1.5 A
-    spd_factor = CLAMP((input2_fixdt - (input2[inIdx].min << 16)) / (input2[inIdx].max - input2[inIdx].min), 3276, 65535);    // ADC2, MIN_spd(5%)  = 50 rpm
-  } 
-  else if (input1[inIdx].typ != 0) 
-  {
-    cur_factor = CLAMP((input1_fixdt - (input1[inIdx].min << 16)) / (input1[inIdx].max - input1[inIdx].min), 6553, 65535);    // ADC1, MIN_cur(10%) = 1.5 A
-    
-    // Wait for the power button press
-    cur_spd_timeout = 0;
-    PRINTF("Press the power button when ready or wait for 10sec...\r\n");
-
-    while (!HAL_GPIO_ReadPin(BUTTON_PORT, BUTTON_PIN) && cur_spd_timeout++ < 2000) 
-    {  // 10 sec timeout
-      readInputRaw();
-      filtLowPass32(input1[inIdx].raw, FILTER, &input1_fixdt);
-      HAL_Delay(5);
-    }
-
-    while (HAL_GPIO_ReadPin(BUTTON_PORT, BUTTON_PIN)) { HAL_Delay(WAIT_DELAY); }
-    beepLong(10);
-    spd_factor = CLAMP((input1_fixdt - (input1[inIdx].min << 16)) / (input1[inIdx].max - input1[inIdx].min), 3276, 65535);    // ADC2, MIN_spd(5%)  = 50 rpm
+    cal_cur_factor = CLAMP((cal_input1_fixdt - (input1[inIdx].min << 16)) / (input1[inIdx].max - input1[inIdx].min), 6553, 65535);    // ADC1, MIN_cur(10%) = 1.5 A
+    spd_factor     = CLAMP((cal_input2_fixdt - (input2[inIdx].min << 16)) / (input2[inIdx].max - input2[inIdx].min), 3276, 65535);    // ADC2, MIN_spd(5%)  = 50 rpm
   } 
   else 
   {
-    cur_factor = CLAMP((input2_fixdt - (input2[inIdx].min << 16)) / (input2[inIdx].max - input2[inIdx].min), 6553, 65535);    // ADC1, MIN_cur(10%) = 1.5 A
-
-    // Wait for the power button press
-    cur_spd_timeout = 0;
-    PRINTF("Press the power button when ready or wait for 10sec...\r\n");
-    while (!HAL_GPIO_ReadPin(BUTTON_PORT, BUTTON_PIN) && cur_spd_timeout++ < 2000) 
-    {  // 10 sec timeout
-      readInputRaw();
-      filtLowPass32(input2[inIdx].raw, FILTER, &input2_fixdt);
-      HAL_Delay(5);
+    InputStruct *in     = (input1[inIdx].typ != 0) ? &input1[inIdx] : &input2[inIdx];
+    int32_t  in_fixdt   = (input1[inIdx].typ != 0) ? cal_input1_fixdt : cal_input2_fixdt;
+
+    if (cal_step == 0) {
+      // First step: current limit, then wait for the next power button press
+      cal_cur_factor = CLAMP((in_fixdt - (in->min << 16)) / (in->max - in->min), 6553, 65535);    // MIN_cur(10%) = 1.5 A
+      cal_step = 1;
+      PRINTF("Press the power button when ready or wait for 10sec...\r\n");
+      powerSetState(PWR_CAL_CURSPD);
+      return;
     }
-    while (HAL_GPIO_ReadPin(BUTTON_PORT, BUTTON_PIN)) { HAL_Delay(WAIT_DELAY); }
-    beepLong(10);
-    spd_factor = CLAMP((input2_fixdt - (input2[inIdx].min << 16)) / (input2[inIdx].max - input2[inIdx].min), 3276, 65535);    // ADC2, MIN_spd(5%)  = 50 rpm
+    spd_factor = CLAMP((in_fixdt - (in->min << 16)) / (in->max - in->min), 3276, 65535);          // MIN_spd(5%)  = 50 rpm
   }
      
   // Update current limit
-  rtP_Left.i_max = rtP_Right.i_max  = (int16_t)((I_MOT_MAX * A2BIT_CONV * cur_factor) >> 12);    // fixdt(0,16,16) to fixdt(1,16,4)
+  rtP_Left.i_max = rtP_Right.i_max  = (int16_t)((I_MOT_MAX * A2BIT_CONV * cal_cur_factor) >> 12);    // fixdt(0,16,16) to fixdt(1,16,4)
   // Update speed limit
-  rtP_Left.n_max = rtP_Right.n_max  = (int16_t)((N_MOT_MAX * spd_factor) >> 12);                 // fixdt(0,16,16) to fixdt(1,16,4)
+  rtP_Left.n_max = rtP_Right.n_max  = (int16_t)((N_MOT_MAX * spd_factor) >> 12);                     // fixdt(0,16,16) to fixdt(1,16,4)
 
   cur_spd_valid  = 3;  // Mark update to be saved in Flash at shutdown
 
   // cur_spd_valid: 0 = No limit changed, 1 = Current limit changed, 2 = Speed limit changed, 3 = Both limits changed
   PRINTF("Limits (%i)\r\nCurrent: fixdt:%li factor%i i_max:%i \r\nSpeed: fixdt:%li factor:%i n_max:%i\r\n",
-          cur_spd_valid, input1_fixdt, cur_factor, rtP_Left.i_max, input2_fixdt, spd_factor, rtP_Left.n_max);
-  HAL_Delay(250);
-#endif
+          cur_spd_valid, cal_input1_fixdt, cal_cur_factor, rtP_Left.i_max, cal_input2_fixdt, spd_factor, rtP_Left.n_max);
+
+  calibrateDone();
 }
+#endif
 
  /*
  * Standstill Hold Function
@@ -756,7 +1154,7 @@ void cruiseControl(uint8_t button) {
       rtP_Left.b_cruiseCtrlEna  = 1;
       rtP_Right.b_cruiseCtrlEna = 1;
       cruiseCtrlAcv = 1;
-      beepShortMany(2, 1);                                              // 200 ms beep delay. Acts as a debounce also.
+      beepShortMany(2, 1);
     } else if (button && rtP_Left.b_cruiseCtrlEna && !standstillAcv) {  // Cruise control deactivated if no Standstill Hold is active
       rtP_Left.b_cruiseCtrlEna  = 0;
       rtP_Right.b_cruiseCtrlEna = 0;
@@ -836,12 +1234,17 @@ void calcInputCmd(InputStruct *in, int16_t out_min, int16_t out_max) {
 void readInputRaw(void) {
     #ifdef CONTROL_ADC
     if (inIdx == CONTROL_ADC) {
+      #ifdef ADC_INPUT_MEDIAN
+        int16_t l_tx2 = adcTx2Filt, l_rx2 = adcRx2Filt;   // glitch filtered in the ADC interrupt
+      #else
+        int16_t l_tx2 = adc_buffer.l_tx2, l_rx2 = adc_buffer.l_rx2;
+      #endif
       #ifdef ADC_ALTERNATE_CONNECT
-        input1[inIdx].raw = adc_buffer.l_rx2;
-        input2[inIdx].raw = adc_buffer.l_tx2;
+        input1[inIdx].raw = l_rx2;
+        input2[inIdx].raw = l_tx2;
       #else
-        input1[inIdx].raw = adc_buffer.l_tx2;
-        input2[inIdx].raw = adc_buffer.l_rx2;
+        input1[inIdx].raw = l_tx2;
+        input2[inIdx].raw = l_rx2;
       #endif
     }
     #endif
@@ -860,6 +1263,10 @@ void readInputRaw(void) {
     }
     #endif
 
+    #if (defined(CONTROL_SERIAL_USART2) || defined(CONTROL_SERIAL_USART3)) && !defined(CONTROL_IBUS)
+    serialTgtAcv = 0;                                                   // Set again below if the active input is serial
+    serialEnaReq = 1;
+    #endif
     #if defined(CONTROL_SERIAL_USART2)
     if (inIdx == CONTROL_SERIAL_USART2) {
       #ifdef CONTROL_IBUS
@@ -869,8 +1276,7 @@ void readInputRaw(void) {
         input1[inIdx].raw = (ibusL_captured_value[0] - 500) * 2;
         input2[inIdx].raw = (ibusL_captured_value[1] - 500) * 2; 
       #else
-        input1[inIdx].raw = commandL.steer;
-        input2[inIdx].raw = commandL.speed;
+        usart_apply_command(&commandL);
       #endif
     }
     #endif
@@ -883,8 +1289,7 @@ void readInputRaw(void) {
         input1[inIdx].raw = (ibusR_captured_value[0] - 500) * 2;
         input2[inIdx].raw = (ibusR_captured_value[1] - 500) * 2; 
       #else
-        input1[inIdx].raw = commandR.steer;
-        input2[inIdx].raw = commandR.speed;
+        usart_apply_command(&commandR);
       #endif
     }
     #endif
@@ -1038,6 +1443,12 @@ void handleTimeout(void) {
       ctrlModReq  = OPEN_MODE;                                          // Request OPEN_MODE. This will bring the motor power to 0 in a controlled way
       input1[inIdx].cmd  = 0;
       input2[inIdx].cmd  = 0;
+      #if (defined(CONTROL_SERIAL_USART2) || defined(CONTROL_SERIAL_USART3)) && !defined(CONTROL_IBUS)
+      serialTgtL = serialTgtR = 0;
+      #endif
+      #ifdef SERIAL_SYNC
+      syncSched  = SYNC_IDLE;
+      #endif
     } else {
       ctrlModReq  = ctrlModReqRaw;                                      // Follow the Mode request
     }
@@ -1084,7 +1495,13 @@ void readCommand(void) {
     #endif
 
     #if defined(CRUISE_CONTROL_SUPPORT) && (defined(SUPPORT_BUTTONS) || defined(SUPPORT_BUTTONS_LEFT) || defined(SUPPORT_BUTTONS_RIGHT))
-      cruiseControl(button1);                                           // Cruise control activation/deactivation
+      static uint8_t  button1_prev = 0;                                 // button1 state of the previous loop
+      static uint32_t button1_tick = 0;                                 // [ms] time of the last accepted press
+      if (button1 && !button1_prev && HAL_GetTick() - button1_tick >= CRUISE_DEBOUNCE_TIME) {  // Rising edge, debounced
+        button1_tick = HAL_GetTick();
+        cruiseControl(1);                                               // Cruise control activation/deactivation
+      }
+      button1_prev = button1;
     #endif
 }
 
@@ -1117,6 +1534,7 @@ void usart2_rx_check(void)
   #endif // DEBUG_SERIAL_USART2
 
   #ifdef CONTROL_SERIAL_USART2
+  #ifdef CONTROL_IBUS
   uint8_t *ptr;	
   if (pos != old_pos) {                                                 // Check change in received data
     ptr = (uint8_t *)&commandL_raw;                                     // Initialize the pointer with command_raw address
@@ -1132,6 +1550,16 @@ void usart2_rx_check(void)
       usart_process_command(&commandL_raw, &commandL, 2);               // Process data
     }
   }
+  #else
+  if (pos != old_pos) {                                                 // Check change in received data
+    if (pos > old_pos) {                                                // "Linear" buffer mode: feed data directly from the DMA buffer
+      usart_parse_command(&parserL, &rx_buffer_L[old_pos], pos - old_pos, &commandL, 2);
+    } else {                                                            // "Overflow" buffer mode: feed the end of buffer, then the beginning
+      usart_parse_command(&parserL, &rx_buffer_L[old_pos], rx_buffer_L_len - old_pos, &commandL, 2);
+      usart_parse_command(&parserL, &rx_buffer_L[0], pos, &commandL, 2);
+    }
+  }
+  #endif
   #endif // CONTROL_SERIAL_USART2
 
   #ifdef SIDEBOARD_SERIAL_USART2
@@ -1190,6 +1618,7 @@ void usart3_rx_check(void)
   #endif // DEBUG_SERIAL_USART3
 
   #ifdef CONTROL_SERIAL_USART3
+  #ifdef CONTROL_IBUS
   uint8_t *ptr;
   if (pos != old_pos) {                                                 // Check change in received data
     ptr = (uint8_t *)&commandR_raw;                                     // Initialize the pointer with command_raw address
@@ -1205,6 +1634,16 @@ void usart3_rx_check(void)
       usart_process_command(&commandR_raw, &commandR, 3);               // Process data
     }
   }
+  #else
+  if (pos != old_pos) {                                                 // Check change in received data
+    if (pos > old_pos) {                                                // "Linear" buffer mode: feed data directly from the DMA buffer
+      usart_parse_command(&parserR, &rx_buffer_R[old_pos], pos - old_pos, &commandR, 3);
+    } else {                                                            // "Overflow" buffer mode: feed the end of buffer, then the beginning
+      usart_parse_command(&parserR, &rx_buffer_R[old_pos], rx_buffer_R_len - old_pos, &commandR, 3);
+      usart_parse_command(&parserR, &rx_buffer_R[0], pos, &commandR, 3);
+    }
+  }
+  #endif
   #endif // CONTROL_SERIAL_USART3
 
   #ifdef SIDEBOARD_SERIAL_USART3
@@ -1233,14 +1672,40 @@ void usart3_rx_check(void)
   #endif
 }
 
+/*
+ * DMA Rx half/full transfer callbacks
+ * - drain the circular buffer also while the line is continuously busy (no IDLE detected), so back-to-back frames are not overwritten
+ */
+#if ((defined(CONTROL_SERIAL_USART2) || defined(CONTROL_SERIAL_USART3)) && !defined(CONTROL_IBUS)) || defined(DEBUG_SERIAL_PROTOCOL)
+void HAL_UART_RxHalfCpltCallback(UART_HandleTypeDef *huart)
+{
+  #if (defined(CONTROL_SERIAL_USART2) && !defined(CONTROL_IBUS)) || (defined(DEBUG_SERIAL_USART2) && defined(DEBUG_SERIAL_PROTOCOL))
+  if (huart->Instance == USART2) {
+    usart2_rx_check();
+  }
+  #endif
+  #if (defined(CONTROL_SERIAL_USART3) && !defined(CONTROL_IBUS)) || (defined(DEBUG_SERIAL_USART3) && defined(DEBUG_SERIAL_PROTOCOL))
+  if (huart->Instance == USART3) {
+    usart3_rx_check();
+  }
+  #endif
+}
+
+void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart)
+{
+  HAL_UART_RxHalfCpltCallback(huart);
+}
+#endif
+
 /*
  * Process Rx debug user command input
+ * - the data can be any part of the stream, text lines and binary frames are assembled in debug_rx()
  */
 #if defined(DEBUG_SERIAL_USART2) || defined(DEBUG_SERIAL_USART3)
 void usart_process_debug(uint8_t *userCommand, uint32_t len)
 {
   #ifdef DEBUG_SERIAL_PROTOCOL
-    handle_input(userCommand, len);
+    debug_rx(userCommand, len);
   #endif
 }
 
@@ -1249,106 +1714,403 @@ void usart_process_debug(uint8_t *userCommand, uint32_t len)
 /*
  * Process command Rx data
  * - if the command_in data is valid (correct START_FRAME and checksum) copy the command_in to command_out
+ * - returns 1 if the command was accepted, 0 otherwise
  */
-#if defined(CONTROL_SERIAL_USART2) || defined(CONTROL_SERIAL_USART3)
-void usart_process_command(SerialCommand *command_in, SerialCommand *command_out, uint8_t usart_idx)
+#if (defined(CONTROL_SERIAL_USART2) || defined(CONTROL_SERIAL_USART3)) && defined(CONTROL_IBUS)
+uint8_t usart_process_command(SerialCommand *command_in, SerialCommand *command_out, uint8_t usart_idx)
 {
-  #ifdef CONTROL_IBUS
-    uint16_t ibus_chksum;
-    if (command_in->start == IBUS_LENGTH && command_in->type == IBUS_COMMAND) {
-      ibus_chksum = 0xFFFF - IBUS_LENGTH - IBUS_COMMAND;
-      for (uint8_t i = 0; i < (IBUS_NUM_CHANNELS * 2); i++) {
-        ibus_chksum -= command_in->channels[i];
-      }
-      if (ibus_chksum == (uint16_t)((command_in->checksumh << 8) + command_in->checksuml)) {
-        *command_out = *command_in;
-        if (usart_idx == 2) {             // Sideboard USART2
-          #ifdef CONTROL_SERIAL_USART2
-          timeoutFlgSerial_L = 0;         // Clear timeout flag
-          timeoutCntSerial_L = 0;         // Reset timeout counter
-          #endif
-        } else if (usart_idx == 3) {      // Sideboard USART3
-          #ifdef CONTROL_SERIAL_USART3
-          timeoutFlgSerial_R = 0;         // Clear timeout flag
-          timeoutCntSerial_R = 0;         // Reset timeout counter
-          #endif
-        }
-      }
+  uint16_t ibus_chksum;
+  if (command_in->start == IBUS_LENGTH && command_in->type == IBUS_COMMAND) {
+    ibus_chksum = 0xFFFF - IBUS_LENGTH - IBUS_COMMAND;
+    for (uint8_t i = 0; i < (IBUS_NUM_CHANNELS * 2); i++) {
+      ibus_chksum -= command_in->channels[i];
     }
-  #else
-  uint16_t checksum;
-  if (command_in->start == SERIAL_START_FRAME) {
-    checksum = (uint16_t)(command_in->start ^ command_in->steer ^ command_in->speed);
-    if (command_in->checksum == checksum) {
+    if (ibus_chksum == (uint16_t)((command_in->checksumh << 8) + command_in->checksuml)) {
       *command_out = *command_in;
       if (usart_idx == 2) {             // Sideboard USART2
         #ifdef CONTROL_SERIAL_USART2
+        LATENCY_ARRIVE_IN(CONTROL_SERIAL_USART2);
         timeoutFlgSerial_L = 0;         // Clear timeout flag
         timeoutCntSerial_L = 0;         // Reset timeout counter
         #endif
       } else if (usart_idx == 3) {      // Sideboard USART3
         #ifdef CONTROL_SERIAL_USART3
+        LATENCY_ARRIVE_IN(CONTROL_SERIAL_USART3);
         timeoutFlgSerial_R = 0;         // Clear timeout flag
         timeoutCntSerial_R = 0;         // Reset timeout counter
         #endif
       }
+      return 1;
     }
   }
-  #endif
+  return 0;
 }
 #endif
 
+#if (defined(CONTROL_SERIAL_USART2) || defined(CONTROL_SERIAL_USART3)) && !defined(CONTROL_IBUS)
+static const uint8_t cmdTlvLen[] = {0, 4, 4, 1, 1, 5, 5, 1, 4, 4};  // Minimum value length of each known record type
+
 /*
- * Process Sideboard Rx data
- * - if the Sideboard_in data is valid (correct START_FRAME and checksum) copy the Sideboard_in to Sideboard_out
+ * Process command Rx data
+ * - frame_in has a correct START_FRAME, version and checksum (checked by the parser)
+ * - the TLV records are decoded directly from the frame into command_out. Unknown record types are skipped
+ * - returns 1 if the records are well formed, 0 otherwise (command_out is not modified)
+ * - SERIAL_MULTIDROP: returns 2 for frames addressed to another node, and schedules the telemetry answer for accepted frames
  */
-#if defined(SIDEBOARD_SERIAL_USART2) || defined(SIDEBOARD_SERIAL_USART3)
-void usart_process_sideboard(SerialSideboard *Sideboard_in, SerialSideboard *Sideboard_out, uint8_t usart_idx)
+uint8_t usart_process_command(SerialFrame *frame_in, SerialCommand *command_out, uint8_t usart_idx)
 {
-  uint16_t checksum;
-  if (Sideboard_in->start == SERIAL_START_FRAME) {
-    checksum = (uint16_t)(Sideboard_in->start ^ Sideboard_in->pitch ^ Sideboard_in->dPitch ^ Sideboard_in->cmd1 ^ Sideboard_in->cmd2 ^ Sideboard_in->sensors);
-    if (Sideboard_in->checksum == checksum) {
-      *Sideboard_out = *Sideboard_in;
-      if (usart_idx == 2) {             // Sideboard USART2
-        #ifdef SIDEBOARD_SERIAL_USART2
-        timeoutCntSerial_L  = 0;        // Reset timeout counter
-        timeoutFlgSerial_L = 0;         // Clear timeout flag
-        #endif
-      } else if (usart_idx == 3) {      // Sideboard USART3
-        #ifdef SIDEBOARD_SERIAL_USART3
-        timeoutCntSerial_R = 0;         // Reset timeout counter
-        timeoutFlgSerial_R = 0;         // Clear timeout flag
-        #endif
-      }
+  const uint8_t *rec;
+  uint8_t  i;
+  uint16_t valid = 0;
+  #ifdef SERIAL_MULTIDROP
+  uint8_t  node  = SERIAL_NODE_BCAST;
+  #endif
+
+  for (i = 0; i < frame_in->len; i += 2 + rec[1]) {                     // Check the records layout first
+    rec = &frame_in->data[i];
+    if (i + 2 > frame_in->len || i + 2 + rec[1] > frame_in->len) {
+      return 0;
+    }
+    if (rec[0] < ARRAY_LEN(cmdTlvLen) && rec[1] < cmdTlvLen[rec[0]]) {
+      return 0;
     }
+    #ifdef SERIAL_MULTIDROP
+    if (rec[0] == CMD_TLV_NODE) {
+      node = rec[2];
+    }
+    #endif
   }
-}
-#endif
 
+  #ifdef SERIAL_MULTIDROP
+  if (node != SERIAL_NODE_BCAST && node != nodeId) {
+    return 2;
+  }
+  if (node != SERIAL_NODE_BCAST) {                                      // addressed: answer in the next main loop
+    nodePollLoop = main_loop_counter;
+    nodePollReq  = 1;
+  } else if (!nodePollReq) {                                            // broadcast: only a new poll cycle sets the slot, so that
+    nodePollLoop = main_loop_counter + (uint32_t)nodeId * SERIAL_SLOT_LOOPS;  // frames faster than the slots do not starve the high IDs
+    nodePollReq  = 1;
+  }
+  #endif
 
-/* =========================== Sideboard Functions =========================== */
+  for (i = 0; i < frame_in->len; i += 2 + rec[1]) {
+    rec = &frame_in->data[i];
+    switch (rec[0]) {
+      case CMD_TLV_STEER_SPEED:
+        command_out->steer    = (int16_t)(rec[2] | (rec[3] << 8));
+        command_out->speed    = (int16_t)(rec[4] | (rec[5] << 8));
+        break;
+      case CMD_TLV_MOTOR_TGT:
+        command_out->tgtL     = (int16_t)(rec[2] | (rec[3] << 8));
+        command_out->tgtR     = (int16_t)(rec[4] | (rec[5] << 8));
+        break;
+      case CMD_TLV_CTRL_MOD:
+        command_out->ctrlMod  = rec[2];
+        break;
+      case CMD_TLV_FLAGS:
+        command_out->flags    = rec[2];
+        break;
+      case CMD_TLV_PARAM_SET:
+        if (command_out->paramCnt < SERIAL_PARAM_QUEUE) {                // Queued, records of several frames received in one main loop are all applied
+          command_out->paramIdx[command_out->paramCnt] = rec[2];
+          command_out->paramVal[command_out->paramCnt] = (int32_t)(rec[3] | (rec[4] << 8) | (rec[5] << 16) | ((uint32_t)rec[6] << 24));
+          command_out->paramCnt++;
+        }
+        break;
+      case CMD_TLV_TELEMETRY:
+        command_out->tlmFields = (uint32_t)(rec[2] | (rec[3] << 8) | (rec[4] << 16) | ((uint32_t)rec[5] << 24));
+        command_out->tlmDiv    = rec[6];
+        break;
+      case CMD_TLV_NODE:
+        break;
+      #ifdef SERIAL_SYNC
+      case CMD_TLV_SYNC:
+        command_out->syncHost  = (uint32_t)(rec[2] | (rec[3] << 8) | (rec[4] << 16) | ((uint32_t)rec[5] << 24));
+        command_out->syncLocal = buzzerTimer;                           // Frame end, the same moment on all boards of the bus
+        command_out->syncReq   = 1;
+        break;
+      case CMD_TLV_APPLY_AT:
+        command_out->applyAt   = (uint32_t)(rec[2] | (rec[3] << 8) | (rec[4] << 16) | ((uint32_t)rec[5] << 24));
+        command_out->applyReq  = 1;
+        break;
+      #endif
+      default:
+        continue;
+    }
+    valid |= CMD_VLD(rec[0]);
+  }
+  #ifdef SERIAL_SYNC
+  if (!(valid & ~(CMD_VLD(CMD_TLV_SYNC) | CMD_VLD(CMD_TLV_NODE)))) {  // A sync only frame keeps the commands of the previous frame
+    valid |= command_out->valid;
+  }
+  #endif
+  command_out->valid = valid;
+
+  if (usart_idx == 2) {             // Sideboard USART2
+    #ifdef CONTROL_SERIAL_USART2
+    LATENCY_ARRIVE_IN(CONTROL_SERIAL_USART2);
+    timeoutFlgSerial_L = 0;         // Clear timeout flag
+    timeoutCntSerial_L = 0;         // Reset timeout counter
+    #endif
+  } else if (usart_idx == 3) {      // Sideboard USART3
+    #ifdef CONTROL_SERIAL_USART3
+    LATENCY_ARRIVE_IN(CONTROL_SERIAL_USART3);
+    timeoutFlgSerial_R = 0;         // Clear timeout flag
+    timeoutCntSerial_R = 0;         // Reset timeout counter
+    #endif
+  }
+  return 1;
+}
 
 /*
- * Sideboard LEDs Handling
- * This function manages the leds behavior connected to the sideboard
+ * Streaming command parser
+ * - consumes the Rx bytes one by one, so frames split over several IDLE events or received back-to-back are handled
+ * - synchronizes on SERIAL_START_FRAME. If the header or checksum is wrong, the first byte is dropped and the other
+ *   collected bytes are parsed again from the start, so a frame starting inside the rejected one is found and every
+ *   header field is checked again at its new position
  */
-void sideboardLeds(uint8_t *leds) {
-  #if defined(SIDEBOARD_SERIAL_USART2) || defined(SIDEBOARD_SERIAL_USART3)
-    // Enable flag: use LED4 (bottom Blue)
-    // enable == 1, turn on led
-    // enable == 0, blink led
-    if (enable) {
-      *leds |= LED4_SET;
-    } else if (!enable && (main_loop_counter % 20 == 0)) {
-      *leds ^= LED4_SET;
+void usart_parse_command(SerialParser *parser, const uint8_t *data, uint32_t len, SerialCommand *command_out, uint8_t usart_idx)
+{
+  uint8_t *frame = (uint8_t *)&parser->frame;
+  uint8_t  replay[sizeof(SerialFrame)];                                 // Bytes to parse again after a resync. Never more than one frame
+  uint8_t  replayLen = 0, replayIdx = 0, n;
+  uint16_t crc;
+  uint8_t  ok;
+
+  while (replayIdx < replayLen || len) {
+    if (replayIdx < replayLen) {
+      frame[parser->idx++] = replay[replayIdx++];
+    } else {
+      frame[parser->idx++] = *data++;
+      len--;
     }
 
-    // Backward Drive: use LED5 (upper Blue)
-    // backwardDrive == 1, blink led
-    // backwardDrive == 0, turn off led
-    if (backwardDrive && (main_loop_counter % 50 == 0)) {
-      *leds ^= LED5_SET;
+    ok = 1;
+    if (parser->idx == 1) {                                             // Start frame low byte
+      if (frame[0] != (uint8_t)SERIAL_START_FRAME) {
+        parser->idx = 0;
+        parser->errSync++;
+      }
+      continue;
+    } else if (parser->idx == 2) {                                      // Start frame high byte
+      if (frame[1] != (uint8_t)(SERIAL_START_FRAME >> 8)) {
+        parser->errSync++;
+        ok = 0;
+      }
+    } else if (parser->idx == 3) {                                      // Version
+      if (parser->frame.ver != SERIAL_CMD_VERSION) {
+        parser->errFmt++;
+        ok = 0;
+      }
+    } else if (parser->idx == 4) {                                      // Length
+      if (parser->frame.len > SERIAL_CMD_DATA_MAX) {
+        parser->errFmt++;
+        ok = 0;
+      }
+    } else if (parser->idx == 4 + parser->frame.len + 2) {              // Complete frame
+      crc = parser->frame.data[parser->frame.len] | (parser->frame.data[parser->frame.len + 1] << 8);
+      if (crc != calcCRC16(frame, 4 + parser->frame.len)) {
+        parser->errCrc++;
+        ok = 0;
+      } else {
+        switch (usart_process_command(&parser->frame, command_out, usart_idx)) {
+          case 0:  parser->errFmt++;  break;
+          case 1:  parser->cntOk++;   break;
+          default:                    break;                            // Frame for another node
+        }
+        parser->idx = 0;
+      }
+    }
+
+    if (!ok) {                                                          // Resync: drop the first byte, parse the rest again. Counted once, by the check that failed
+      n = parser->idx - 1;
+      memmove(&replay[n], &replay[replayIdx], replayLen - replayIdx);   // The collected bytes come before the unread ones
+      memcpy(replay, &frame[1], n);
+      replayLen   = n + replayLen - replayIdx;
+      replayIdx   = 0;
+      parser->idx = 0;
+    }
+  }
+}
+
+/*
+ * Apply the serial command to the inputs
+ * - called from the main loop for the active serial input, after the command was received in the USART interrupt
+ */
+void usart_apply_command(SerialCommand *command)
+{
+  uint16_t valid = command->valid;
+
+  input1[inIdx].raw = command->steer;
+  input2[inIdx].raw = command->speed;
+
+  #ifdef SERIAL_SYNC
+  if (command->syncReq) {
+    command->syncReq = 0;
+    syncUpdate(command->syncHost, command->syncLocal);
+  }
+  if (command->applyReq) {
+    command->applyReq = 0;
+    if (valid & CMD_VLD(CMD_TLV_MOTOR_TGT)) {
+      syncSchedule(command->tgtL, command->tgtR, command->applyAt);
+    }
+  }
+  #endif
+
+  if (valid & CMD_VLD(CMD_TLV_MOTOR_TGT)) {
+    serialTgtAcv = 1;
+    if (!(valid & CMD_VLD(CMD_TLV_APPLY_AT))) {                         // Scheduled targets are taken over by syncTargets()
+      serialTgtL = CLAMP(command->tgtL, INPUT_MIN, INPUT_MAX);
+      serialTgtR = CLAMP(command->tgtR, INPUT_MIN, INPUT_MAX);
+      #ifdef SERIAL_SYNC
+      syncSched  = SYNC_IDLE;                                           // Newer targets replace the scheduled ones
+      #endif
+    }
+  }
+  if ((valid & CMD_VLD(CMD_TLV_CTRL_MOD)) && command->ctrlMod <= TRQ_MODE) {
+    ctrlModReqRaw = command->ctrlMod;
+  }
+  if (valid & CMD_VLD(CMD_TLV_FLAGS)) {
+    serialEnaReq = (command->flags & CMD_FLG_ENABLE) ? 1 : 0;
+    if (command->flags & CMD_FLG_BRAKE) {
+      input1[inIdx].raw = input2[inIdx].raw = 0;
+      serialTgtL = serialTgtR = 0;
+      #ifdef SERIAL_SYNC
+      syncSched  = SYNC_IDLE;
+      #endif
+    }
+  }
+
+  #ifdef FEEDBACK_TELEMETRY
+  if (valid & CMD_VLD(CMD_TLV_TELEMETRY)) {
+    tlmFields = command->tlmFields;
+    tlmDiv    = command->tlmDiv;
+  }
+  #endif
+
+  if (command->paramCnt) {
+    #ifdef DEBUG_SERIAL_PROTOCOL
+    uint8_t paramIdx[SERIAL_PARAM_QUEUE], paramCnt;
+    int32_t paramVal[SERIAL_PARAM_QUEUE];
+    __disable_irq();                                                    // Snapshot, the USART interrupt appends to the queue
+    paramCnt = command->paramCnt;
+    memcpy(paramIdx, command->paramIdx, paramCnt * sizeof(paramIdx[0]));
+    memcpy(paramVal, command->paramVal, paramCnt * sizeof(paramVal[0]));
+    command->paramCnt = 0;
+    __enable_irq();
+    for (uint8_t i = 0; i < paramCnt; i++) {
+      writeParamVal(paramIdx[i], paramVal[i]);
+    }
+    #else
+    command->paramCnt = 0;
+    #endif
+  }
+}
+#endif
+
+
+/*
+ * Calculate CRC16 (CCITT-FALSE: polynomial 0x1021, initial value 0xFFFF)
+ */
+uint16_t calcCRC16(const uint8_t *data, uint32_t len)
+{
+  return updateCRC16(0xFFFF, data, len);
+}
+
+/*
+ * Continue a CRC16 calculation over the next block of data, for frames that are sent in pieces
+ */
+static const uint16_t crc16Nibble[16] = {                               // CRC16 CCITT of each 4-bit value, polynomial 0x1021
+  0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+  0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF
+};
+
+uint16_t updateCRC16(uint16_t crc, const uint8_t *data, uint32_t len)
+{
+  uint8_t  b;
+
+  while (len--) {                                                       // Two table steps per byte instead of eight shifts
+    b   = *data++;
+    crc = (uint16_t)(crc << 4) ^ crc16Nibble[(crc >> 12) ^ (b >> 4)];
+    crc = (uint16_t)(crc << 4) ^ crc16Nibble[(crc >> 12) ^ (b & 0x0F)];
+  }
+  return crc;
+}
+
+/*
+ * Calculate CRC32 (IEEE 802.3: reflected polynomial 0xEDB88320, initial value and final xor 0xFFFFFFFF)
+ */
+static const uint32_t crc32Nibble[16] = {                               // CRC32 of each 4-bit value, reflected polynomial 0xEDB88320
+  0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+  0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
+uint32_t calcCRC32(const uint8_t *data, uint32_t len)
+{
+  uint32_t crc = 0xFFFFFFFF;
+
+  while (len--) {
+    crc ^= *data++;
+    crc  = (crc >> 4) ^ crc32Nibble[crc & 0x0F];
+    crc  = (crc >> 4) ^ crc32Nibble[crc & 0x0F];
+  }
+  return ~crc;
+}
+
+/*
+ * Process Sideboard Rx data
+ * - if the Sideboard_in data is valid (correct START_FRAME and checksum) copy the Sideboard_in to Sideboard_out
+ */
+#if defined(SIDEBOARD_SERIAL_USART2) || defined(SIDEBOARD_SERIAL_USART3)
+void usart_process_sideboard(SerialSideboard *Sideboard_in, SerialSideboard *Sideboard_out, uint8_t usart_idx)
+{
+  uint16_t checksum;
+  if (Sideboard_in->start == SERIAL_START_FRAME) {
+    checksum = (uint16_t)(Sideboard_in->start ^ Sideboard_in->pitch ^ Sideboard_in->dPitch ^ Sideboard_in->cmd1 ^ Sideboard_in->cmd2 ^ Sideboard_in->sensors);
+    if (Sideboard_in->checksum == checksum) {
+      *Sideboard_out = *Sideboard_in;
+      if (usart_idx == 2) {             // Sideboard USART2
+        #ifdef SIDEBOARD_SERIAL_USART2
+        LATENCY_ARRIVE_IN(SIDEBOARD_SERIAL_USART2);
+        timeoutCntSerial_L  = 0;        // Reset timeout counter
+        timeoutFlgSerial_L = 0;         // Clear timeout flag
+        #endif
+      } else if (usart_idx == 3) {      // Sideboard USART3
+        #ifdef SIDEBOARD_SERIAL_USART3
+        LATENCY_ARRIVE_IN(SIDEBOARD_SERIAL_USART3);
+        timeoutCntSerial_R = 0;         // Reset timeout counter
+        timeoutFlgSerial_R = 0;         // Clear timeout flag
+        #endif
+      }
+    }
+  }
+}
+#endif
+
+
+/* =========================== Sideboard Functions =========================== */
+
+/*
+ * Sideboard LEDs Handling
+ * This function manages the leds behavior connected to the sideboard
+ */
+void sideboardLeds(uint8_t *leds) {
+  #if defined(SIDEBOARD_SERIAL_USART2) || defined(SIDEBOARD_SERIAL_USART3)
+    // Enable flag: use LED4 (bottom Blue)
+    // enable == 1, turn on led
+    // enable == 0, blink led
+    if (enable) {
+      *leds |= LED4_SET;
+    } else if (!enable && (main_loop_counter % 20 == 0)) {
+      *leds ^= LED4_SET;
+    }
+
+    // Backward Drive: use LED5 (upper Blue)
+    // backwardDrive == 1, blink led
+    // backwardDrive == 0, turn off led
+    if (backwardDrive && (main_loop_counter % 50 == 0)) {
+      *leds ^= LED5_SET;
     }
 
     // Brake: use LED5 (upper Blue)
@@ -1501,6 +2263,528 @@ void sideboardSensors(uint8_t sensors) {
 
 
 
+/* =========================== Configuration Functions =========================== */
+
+ /*
+ * Load the configuration record into cfgData in one pass over the EEPROM index
+ * The record is used if the key matches FLASH_WRITE_KEY and its CRC32 is correct. Records of an older schema are
+ * migrated and saved again, records of a newer firmware are ignored. Returns 1 if cfgData holds a configuration
+ */
+uint8_t configLoad(void) {
+  uint16_t data[CFG_SLOTS];
+
+  memset(data, 0xFF, sizeof(data));                   // CFG_UNSET
+  if (EE_ReadVariables(VirtAddVarTab, data, CFG_SLOTS) == NO_VALID_PAGE) {
+    cfgStatus = CFG_NONE;
+  } else if (data[CFG_VERSION] != CFG_UNSET && data[CFG_VERSION] > CFG_SCHEMA) {
+    cfgStatus = CFG_NEWER;
+  } else if (data[CFG_VERSION] != CFG_UNSET &&
+             calcCRC32((const uint8_t *)data, 2 * CFG_CRC_LO) != (data[CFG_CRC_LO] | ((uint32_t)data[CFG_CRC_HI] << 16))) {
+    cfgStatus = CFG_CORRUPT;
+  } else if (data[CFG_KEY] != FLASH_WRITE_KEY) {
+    cfgStatus = CFG_NONE;
+  } else {
+    cfgStatus = data[CFG_VERSION] == CFG_SCHEMA ? CFG_OK : CFG_MIGRATED;
+  }
+
+  if (cfgStatus != CFG_OK && cfgStatus != CFG_MIGRATED) {
+    memset(cfgData, 0xFF, sizeof(cfgData));
+    if (cfgStatus == CFG_CORRUPT) LOG(LOG_ERR, "Config CRC error, using config.h\r\n");
+    if (cfgStatus == CFG_NEWER)   LOG(LOG_WARN, "Config schema %u is newer, using config.h\r\n", data[CFG_VERSION]);
+    return 0;
+  }
+
+  memcpy(cfgData, data, sizeof(cfgData));
+  if (cfgStatus == CFG_MIGRATED) {
+    // The former per-variable format has the same value slots, the save adds the version and the CRC.
+    // Later schema changes convert the slots here, one version step after the other
+    LOG(LOG_INFO, "Config migrated to schema %u\r\n", CFG_SCHEMA);
+    configSave();
+    cfgStatus = CFG_MIGRATED;                         // until the next save
+  }
+  return 1;
+}
+
+ /*
+ * Save cfgData as one EEPROM batch with the key, schema version and CRC32: a power loss keeps the previous record
+ */
+uint16_t configSave(void) {
+  uint32_t crc;
+  uint16_t status;
+
+  cfgData[CFG_KEY]     = (uint16_t)FLASH_WRITE_KEY;
+  cfgData[CFG_VERSION] = CFG_SCHEMA;
+  crc = calcCRC32((const uint8_t *)cfgData, 2 * CFG_CRC_LO);
+  cfgData[CFG_CRC_LO]  = (uint16_t)crc;
+  cfgData[CFG_CRC_HI]  = (uint16_t)(crc >> 16);
+
+  HAL_FLASH_Unlock();
+  status = EE_WriteVariables(VirtAddVarTab, cfgData, CFG_SLOTS);
+  HAL_FLASH_Lock();
+  if (status == HAL_OK) {
+    cfgStatus = CFG_OK;
+  }
+  return status;
+}
+
+
+
+/* =========================== Odometer Functions =========================== */
+#ifdef ODOMETER_COUNTERS
+ /*
+ * Load the odometer counters: base plus delta, 0 if never saved
+ */
+void odomLoad(void) {
+  uint16_t data[ODOM_SLOTS];
+
+  memset(data, 0, sizeof(data));
+  EE_ReadVariables(&VirtAddVarTab[ODOM_BASE], data, ODOM_SLOTS);
+  for (uint8_t i = 0; i < ODOM_NUM; i++) {
+    odomBase[i]  = data[2*i] | ((uint32_t)data[2*i + 1] << 16);
+    odomDelta[i] = data[2*ODOM_NUM + i];
+    odom[i]      = odomBase[i] + odomDelta[i];
+  }
+  odomTick = odomSaveTick = HAL_GetTick();
+}
+
+ /*
+ * Checkpoint the odometer counters as one EEPROM batch
+ * Only the changed deltas are written. Once a delta exceeds ODOM_DELTA_MAX, all bases are rewritten with zero deltas
+ */
+void odomSave(void) {
+  uint16_t addr[ODOM_SLOTS], data[ODOM_SLOTS], n = 0;
+  uint8_t  consolidate = 0;
+  uint8_t  i;
+
+  for (i = 0; i < ODOM_NUM; i++) {
+    if (odom[i] - odomBase[i] > ODOM_DELTA_MAX) {
+      consolidate = 1;
+    }
+  }
+  for (i = 0; i < ODOM_NUM; i++) {
+    if (consolidate) {
+      addr[n] = VirtAddVarTab[ODOM_BASE + 2*i];     data[n++] = (uint16_t)odom[i];
+      addr[n] = VirtAddVarTab[ODOM_BASE + 2*i + 1]; data[n++] = (uint16_t)(odom[i] >> 16);
+      addr[n] = VirtAddVarTab[ODOM_DELTA + i];      data[n++] = 0;
+    } else if (odom[i] - odomBase[i] != odomDelta[i]) {
+      addr[n] = VirtAddVarTab[ODOM_DELTA + i];      data[n++] = (uint16_t)(odom[i] - odomBase[i]);
+    }
+  }
+  if (n == 0) {
+    return;
+  }
+
+  HAL_FLASH_Unlock();
+  uint16_t status = EE_WriteVariables(addr, data, n);
+  HAL_FLASH_Lock();
+  if (status != HAL_OK) {
+    return;                                         // retried at the next checkpoint, e.g. after the compaction
+  }
+  for (i = 0; i < ODOM_NUM; i++) {
+    if (consolidate) {
+      odomBase[i] = odom[i];
+    }
+    odomDelta[i] = (uint16_t)(odom[i] - odomBase[i]);
+  }
+}
+
+ /*
+ * Integrate the odometer counters, called every main loop
+ * The checkpoint is written at standstill only, the motors may be enabled: the flash programming stalls the CPU, the
+ * motor interrupt included, for about 50 us per halfword. It waits while the write would first compact a page (an erase
+ * stalls for up to 40 ms), until eepromProcess() has erased one
+ */
+void odomProcess(uint32_t now) {
+  int32_t  dt  = (int32_t)(now - odomTick);
+  int32_t  inc[ODOM_NUM];
+
+  odomTick = now;
+  if (dt > 1000) {
+    dt = 1000;                                      // main loop held up, e.g. by a page erase: keep the products in range
+  }
+  inc[ODOM_DIST]   = speedAvgAbs * ODOM_WHEEL_CIRC * dt;
+  inc[ODOM_CHARGE] = dc_curr > 0 ? dc_curr * dt : 0;
+  inc[ODOM_ENERGY] = dc_curr > 0 ? batVoltageCalib * dc_curr / 100 * dt : 0;
+  inc[ODOM_TIME]   = enable ? dt : 0;
+  for (uint8_t i = 0; i < ODOM_NUM; i++) {
+    odomAcc[i] += inc[i];
+    while (odomAcc[i] >= odomUnit[i]) {
+      odomAcc[i] -= odomUnit[i];
+      odom[i]++;
+    }
+  }
+
+  if (speedAvgAbs < 5 && now - odomSaveTick >= ODOM_SAVE_PERIOD * 1000 && EE_WriteReady(ODOM_SLOTS)) {
+    odomSaveTick = now;
+    odomSave();
+  }
+}
+#endif
+
+
+
+/* =========================== Black Box Functions =========================== */
+#ifdef FAULT_BLACKBOX
+#define BBOX_PAGE_ADDRESS(page)   (BBOX_START_ADDRESS + (uint32_t)(page) * FLASH_PAGE_SIZE)
+#define BBOX_DATA_MAX             (FLASH_PAGE_SIZE - sizeof(BBoxHeader))
+#define BBOX_RD_HDR               0xFFFF
+
+ /*
+ * Snapshot or the remains of one cut by a power loss at addr, below end
+ */
+static uint8_t bboxUsed(uint32_t addr, uint32_t end) {
+  const BBoxHeader *h = (const BBoxHeader *)addr;
+  return addr + sizeof(BBoxHeader) <= end && h->len != 0xFFFF && addr + sizeof(BBoxHeader) + h->len <= end;
+}
+
+ /*
+ * Address after the snapshot at addr, halfword aligned
+ */
+static uint32_t bboxSkip(uint32_t addr) {
+  return addr + sizeof(BBoxHeader) + ((((const BBoxHeader *)addr)->len + 1) & ~1u);
+}
+
+ /*
+ * Count the snapshots and find the newest one: the next snapshot follows it in its page
+ */
+static void bboxScan(void) {
+  const BBoxHeader *h;
+  uint32_t addr, end;
+  uint8_t  page, found = 0;
+
+  bboxCount = 0;
+  bboxPage  = 0;
+  for (page = 0; page < BBOX_PAGES; page++) {
+    addr = BBOX_PAGE_ADDRESS(page);
+    end  = addr + FLASH_PAGE_SIZE;
+    while (bboxUsed(addr, end)) {
+      h = (const BBoxHeader *)addr;
+      if (h->magic == BBOX_MAGIC) {
+        bboxCount++;
+        if (!found || (int16_t)(h->seq - bboxSeq) > 0) {
+          bboxSeq  = h->seq;
+          bboxPage = page;
+          found    = 1;
+        }
+      }
+      addr = bboxSkip(addr);
+    }
+  }
+  addr = BBOX_PAGE_ADDRESS(bboxPage);
+  end  = addr + FLASH_PAGE_SIZE;
+  while (bboxUsed(addr, end)) {
+    addr = bboxSkip(addr);
+  }
+  bboxAddr = addr;
+}
+
+ /*
+ * Size of the zigzag varint of a sample difference, 3 bytes at most for int16_t samples
+ */
+static uint8_t bboxVarLen(int32_t d) {
+  uint32_t z = ((uint32_t)d << 1) ^ (uint32_t)(d >> 31);
+  return z < 0x80 ? 1 : (z < 0x4000 ? 2 : 3);
+}
+
+ /*
+ * Program the data bytes in pairs, the CRC16 is calculated on the way
+ */
+static void bboxPutByte(uint8_t b) {
+  bboxWrCrc = updateCRC16(bboxWrCrc, &b, 1);
+  if (!bboxWrOdd) {
+    bboxWrLow = b;
+    bboxWrOdd = 1;
+    return;
+  }
+  if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, bboxWrAddr, bboxWrLow | ((uint16_t)b << 8)) != HAL_OK) {
+    bboxWrErr = 1;
+  }
+  bboxWrAddr += 2;
+  bboxWrOdd   = 0;
+}
+
+static void bboxPutVar(int32_t d) {
+  uint32_t z = ((uint32_t)d << 1) ^ (uint32_t)(d >> 31);
+  while (z >= 0x80) {
+    bboxPutByte((uint8_t)z | 0x80);
+    z >>= 7;
+  }
+  bboxPutByte((uint8_t)z);
+}
+
+ /*
+ * Sample k of the ring, 0 = oldest
+ */
+static const int16_t *bboxSample(uint16_t k) {
+  return bboxRing[(bboxHead + BBOX_SAMPLES - bboxFill + k) % BBOX_SAMPLES];
+}
+
+ /*
+ * Write the snapshot in the ring, the flash has to be unlocked
+ * Programming order: length, data, header, magic. A power loss leaves a snapshot without magic, skipped by its length
+ */
+static void bboxWrite(void) {
+  BBoxHeader h;
+  FLASH_EraseInitTypeDef erase;
+  const int16_t *s;
+  const uint16_t *w = (const uint16_t *)&h;
+  int16_t  prev[BBOX_CH_NUM];
+  uint32_t size = 0, raw, delta, end, need, i, page_error = 0;
+  uint16_t first = bboxFill, len = 0, k;
+  uint8_t  c;
+
+  // Oldest sample from which the data still fits in a page: the newest samples around the fault are kept
+  for (k = bboxFill; k-- > 0; ) {
+    s   = bboxSample(k);
+    raw = delta = 0;
+    for (c = 0; c < BBOX_CH_NUM; c++) {
+      raw   += bboxVarLen(s[c]);
+      delta += k ? bboxVarLen(s[c] - bboxSample(k - 1)[c]) : 0;
+    }
+    if (size + raw > BBOX_DATA_MAX) {
+      break;
+    }
+    first = k;
+    len   = (uint16_t)(size + raw);
+    size += delta;
+  }
+  if (first == bboxFill) {
+    return;
+  }
+
+  // Next page when the snapshot does not fit or the space was not erased: the oldest snapshots are erased
+  need = sizeof(BBoxHeader) + ((len + 1u) & ~1u);
+  end  = BBOX_PAGE_ADDRESS(bboxPage) + FLASH_PAGE_SIZE;
+  for (i = bboxAddr; i < bboxAddr + need && i < end; i += 2) {
+    if (*(__IO uint16_t *)i != 0xFFFF) {
+      break;
+    }
+  }
+  if (bboxAddr + need > end || i < bboxAddr + need) {
+    bboxPage           = (bboxPage + 1) % BBOX_PAGES;
+    bboxAddr           = BBOX_PAGE_ADDRESS(bboxPage);
+    erase.TypeErase    = FLASH_TYPEERASE_PAGES;
+    erase.PageAddress  = bboxAddr;
+    erase.NbPages      = 1;
+    if (HAL_FLASHEx_Erase(&erase, &page_error) != HAL_OK) {
+      return;
+    }
+  }
+
+  h.magic     = BBOX_MAGIC;
+  h.len       = len;
+  h.seq       = bboxSeq + 1;
+  h.fault     = bboxFault;
+  h.channels  = BBOX_CH_NUM;
+  h.samples   = bboxFill - first;
+  h.post      = bboxPost;
+  h.period    = BBOX_DIV * DELAY_IN_MAIN_LOOP;
+  h.time      = bboxTime;
+  h.driveTime = bboxDrive;
+  h.distance  = bboxDist;
+
+  if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, bboxAddr + 2, len) != HAL_OK) {
+    return;
+  }
+  bboxWrAddr = bboxAddr + sizeof(BBoxHeader);
+  bboxWrOdd  = 0;
+  bboxWrErr  = 0;
+  bboxWrCrc  = 0xFFFF;
+  memset(prev, 0, sizeof(prev));
+  for (k = first; k < bboxFill; k++) {
+    s = bboxSample(k);
+    for (c = 0; c < BBOX_CH_NUM; c++) {
+      bboxPutVar(s[c] - prev[c]);
+      prev[c] = s[c];
+    }
+  }
+  h.crc = bboxWrCrc;
+  if (bboxWrOdd && HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, bboxWrAddr, 0xFF00 | bboxWrLow) != HAL_OK) {
+    bboxWrErr = 1;
+  }
+  for (i = 2; i < sizeof(BBoxHeader) / 2 && !bboxWrErr; i++) {
+    if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, bboxAddr + 2 * i, w[i]) != HAL_OK) {
+      bboxWrErr = 1;
+    }
+  }
+  if (!bboxWrErr) {
+    HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, bboxAddr, w[0]);
+  }
+}
+
+ /*
+ * Find the stored snapshots, called at power on
+ */
+void bboxInit(void) {
+  bboxScan();
+}
+
+ /*
+ * Sample the key signals and detect the faults, called every main loop
+ * The snapshot is written at standstill with the motors off: the flash programming stalls the CPU, the motor interrupt included
+ */
+void bboxProcess(uint32_t now) {
+  int16_t *s;
+  uint8_t  active = 0, fault;
+
+  if (rtY_Left.z_errCode || rtY_Right.z_errCode)                     active |= 1 << BBOX_FLT_MOTOR;
+  if (timeoutFlgADC && enable)                                       active |= 1 << BBOX_FLT_ADC;     // no fault with the motors off, e.g. no remote at power on
+  if (timeoutFlgSerial && enable)                                    active |= 1 << BBOX_FLT_SERIAL;
+  if (TEMP_POWEROFF_ENABLE && board_temp_deg_c >= TEMP_POWEROFF)     active |= 1 << BBOX_FLT_TEMP;
+  if (batVoltage < BAT_DEAD)                                         active |= 1 << BBOX_FLT_BATTERY;
+  if (bboxFault == BBOX_FLT_NONE && (active & ~bboxActive)) {       // the first new fault wins, the next ones are in the state channel
+    for (fault = BBOX_FLT_MOTOR; !(active & ~bboxActive & (1 << fault)); fault++);
+    bboxFault = fault;
+    bboxPost  = 0;
+    bboxTime  = now;
+    #ifdef ODOMETER_COUNTERS
+    bboxDrive = odom[ODOM_TIME];
+    bboxDist  = odom[ODOM_DIST];
+    #endif
+  }
+  bboxActive = active;
+
+  if (bboxFault == BBOX_FLT_NONE || bboxPost < BBOX_POST_SAMPLES) {
+    if (++bboxDivCnt < BBOX_DIV) {
+      return;
+    }
+    bboxDivCnt = 0;
+    s = bboxRing[bboxHead];
+    s[BBOX_CH_CMD_L]   = cmdL;
+    s[BBOX_CH_CMD_R]   = cmdR;
+    s[BBOX_CH_SPEED_L] = rtY_Left.n_mot;
+    s[BBOX_CH_SPEED_R] = rtY_Right.n_mot;
+    s[BBOX_CH_DC_CURR] = dc_curr;
+    s[BBOX_CH_BATV]    = batVoltageCalib;
+    s[BBOX_CH_TEMP]    = board_temp_deg_c;
+    s[BBOX_CH_IN1]     = input1[inIdx].cmd;
+    s[BBOX_CH_IN2]     = input2[inIdx].cmd;
+    s[BBOX_CH_STATE]   = (rtY_Left.z_errCode & 7) | ((rtY_Right.z_errCode & 7) << 3) |
+                         (timeoutFlgADC ? BBOX_STATE_ADC : 0) | (timeoutFlgSerial ? BBOX_STATE_SERIAL : 0) |
+                         (timeoutFlgGen ? BBOX_STATE_GEN : 0) | (enable ? BBOX_STATE_ENABLE : 0);
+    bboxHead = (bboxHead + 1) % BBOX_SAMPLES;
+    if (bboxFill < BBOX_SAMPLES) {
+      bboxFill++;
+    }
+    if (bboxFault != BBOX_FLT_NONE) {
+      bboxPost++;
+    }
+  } else if (enable == 0 && speedAvgAbs < 5) {
+    bboxSave();
+  }
+}
+
+ /*
+ * Write the pending snapshot and restart the recording, also called at power off
+ */
+void bboxSave(void) {
+  if (bboxFault == BBOX_FLT_NONE) {
+    return;
+  }
+  HAL_FLASH_Unlock();
+  bboxWrite();
+  HAL_FLASH_Lock();
+  bboxScan();
+  bboxFault = BBOX_FLT_NONE;
+  bboxFill  = 0;
+}
+
+ /*
+ * Erase the stored snapshots, with the motors off only. Returns 1 if erased
+ */
+uint8_t bboxClear(void) {
+  FLASH_EraseInitTypeDef erase;
+  uint32_t page_error = 0;
+  HAL_StatusTypeDef status;
+
+  if (enable || speedAvgAbs >= 5) {
+    return 0;
+  }
+  erase.TypeErase   = FLASH_TYPEERASE_PAGES;
+  erase.PageAddress = BBOX_START_ADDRESS;
+  erase.NbPages     = BBOX_PAGES;
+  HAL_FLASH_Unlock();
+  status = HAL_FLASHEx_Erase(&erase, &page_error);
+  HAL_FLASH_Lock();
+  bboxScan();
+  return status == HAL_OK;
+}
+
+  #if defined(DEBUG_SERIAL_USART2) || defined(DEBUG_SERIAL_USART3)
+ /*
+ * Start printing the stored snapshots, oldest first
+ */
+void bboxPrintStart(void) {
+  bboxRdPages  = BBOX_PAGES;
+  bboxRdAddr   = BBOX_PAGE_ADDRESS((bboxPage + 1) % BBOX_PAGES);
+  bboxRdEnd    = bboxRdAddr + FLASH_PAGE_SIZE;
+  bboxRdSample = BBOX_RD_HDR;
+}
+
+ /*
+ * Print the snapshots as CSV, as much as fits in the Tx buffer: called by process_debug() until it returns 0
+ * Time in ms relative to the fault, state as BBOX_STATE_* bits
+ */
+uint8_t bboxPrint(void) {
+  const BBoxHeader *h;
+  uint32_t z;
+  uint8_t  c, b, shift;
+
+  while (bboxRdPages) {
+    if (logFree() < 100) {
+      return 1;
+    }
+    h = (const BBoxHeader *)bboxRdAddr;
+    if (bboxRdSample == BBOX_RD_HDR) {
+      if (!bboxUsed(bboxRdAddr, bboxRdEnd)) {
+        if (--bboxRdPages) {                                      // end of the page, next one
+          bboxRdAddr = BBOX_PAGE_ADDRESS((bboxPage + 1 + BBOX_PAGES - bboxRdPages) % BBOX_PAGES);
+          bboxRdEnd  = bboxRdAddr + FLASH_PAGE_SIZE;
+        } else {
+          printf("# bbox end, %u snapshots\r\n", bboxCount);
+        }
+        continue;
+      }
+      if (h->magic != BBOX_MAGIC || h->channels != BBOX_CH_NUM) { // cut by a power loss, or of another firmware
+        bboxRdAddr = bboxSkip(bboxRdAddr);
+        continue;
+      }
+      printf("# bbox seq:%u fault:%u time:%lu drive:%lu dist:%lu samples:%u post:%u period:%u crc:%s\r\n",
+             h->seq, h->fault, (unsigned long)h->time, (unsigned long)h->driveTime, (unsigned long)h->distance, h->samples, h->post, h->period,
+             calcCRC16((const uint8_t *)(bboxRdAddr + sizeof(BBoxHeader)), h->len) == h->crc ? "ok" : "error");
+      printf("t_ms,cmdL,cmdR,speedL,speedR,dcCurr,batV,temp,in1,in2,state\r\n");
+      memset(bboxRdVal, 0, sizeof(bboxRdVal));
+      bboxRdData   = bboxRdAddr + sizeof(BBoxHeader);
+      bboxRdSample = 0;
+      continue;
+    }
+    if (bboxRdSample >= h->samples) {
+      bboxRdAddr   = bboxSkip(bboxRdAddr);
+      bboxRdSample = BBOX_RD_HDR;
+      continue;
+    }
+    printf("%li", (long)((int32_t)bboxRdSample - (h->samples - 1 - h->post)) * h->period);
+    for (c = 0; c < BBOX_CH_NUM; c++) {
+      z = 0;
+      shift = 0;
+      do {
+        b  = *(__IO uint8_t *)bboxRdData++;
+        z |= (uint32_t)(b & 0x7F) << shift;
+        shift += 7;
+      } while ((b & 0x80) && shift < 21);
+      bboxRdVal[c] += (int16_t)((z >> 1) ^ (0 - (z & 1)));
+      printf(",%i", bboxRdVal[c]);
+    }
+    printf("\r\n");
+    bboxRdSample++;
+  }
+  return 0;
+}
+  #endif
+#endif
+
+
+
 /* =========================== Poweroff Functions =========================== */
 
  /*
@@ -1517,202 +2801,597 @@ void saveConfig() {
   #endif
   #if !defined(VARIANT_HOVERBOARD) && !defined(VARIANT_TRANSPOTTER)
     if (inp_cal_valid || cur_spd_valid) {
-      HAL_FLASH_Unlock();
-      EE_WriteVariable(VirtAddVarTab[0] , (uint16_t)FLASH_WRITE_KEY);
-      EE_WriteVariable(VirtAddVarTab[1] , (uint16_t)rtP_Left.i_max);
-      EE_WriteVariable(VirtAddVarTab[2] , (uint16_t)rtP_Left.n_max);
+      cfgData[1] = (uint16_t)rtP_Left.i_max;
+      cfgData[2] = (uint16_t)rtP_Left.n_max;
       for (uint8_t i=0; i<INPUTS_NR; i++) {
-        EE_WriteVariable(VirtAddVarTab[ 3+8*i] , (uint16_t)input1[i].typ);
-        EE_WriteVariable(VirtAddVarTab[ 4+8*i] , (uint16_t)input1[i].min);
-        EE_WriteVariable(VirtAddVarTab[ 5+8*i] , (uint16_t)input1[i].mid);
-        EE_WriteVariable(VirtAddVarTab[ 6+8*i] , (uint16_t)input1[i].max);
-        EE_WriteVariable(VirtAddVarTab[ 7+8*i] , (uint16_t)input2[i].typ);
-        EE_WriteVariable(VirtAddVarTab[ 8+8*i] , (uint16_t)input2[i].min);
-        EE_WriteVariable(VirtAddVarTab[ 9+8*i] , (uint16_t)input2[i].mid);
-        EE_WriteVariable(VirtAddVarTab[10+8*i] , (uint16_t)input2[i].max);
+        cfgData[ 3+8*i] = (uint16_t)input1[i].typ;
+        cfgData[ 4+8*i] = (uint16_t)input1[i].min;
+        cfgData[ 5+8*i] = (uint16_t)input1[i].mid;
+        cfgData[ 6+8*i] = (uint16_t)input1[i].max;
+        cfgData[ 7+8*i] = (uint16_t)input2[i].typ;
+        cfgData[ 8+8*i] = (uint16_t)input2[i].min;
+        cfgData[ 9+8*i] = (uint16_t)input2[i].mid;
+        cfgData[10+8*i] = (uint16_t)input2[i].max;
       }
-      HAL_FLASH_Lock();
+      #ifdef SERIAL_MULTIDROP
+      cfgData[19] = (uint16_t)nodeId;
+      #endif
+      configSave();
     }
   #endif 
+  #ifdef ODOMETER_COUNTERS
+    odomSave();
+  #endif
+  #ifdef FAULT_BLACKBOX
+    bboxSave();
+  #endif
 }
 
+ /*
+ * A page erase stalls the CPU for up to 40 ms, the motor interrupt included: erases are done at standstill only,
+ * with the motors off or without a command
+ */
+uint8_t eepromEraseOk(void) {
+  return speedAvgAbs < 5 && (enable == 0 || (ABS(input1[inIdx].cmd) < 50 && ABS(input2[inIdx].cmd) < 50));
+}
 
-void powerOff(void) {
-  enable = 0;
-  PRINTF("-- Motors disabled --\r\n");
+ /*
+ * EEPROM background compaction, called by the main loop while eepromEraseOk()
+ */
+void eepromProcess(void) {
+  HAL_FLASH_Unlock();
+  EE_Process();
+  HAL_FLASH_Lock();
+  eeErases = EE_EraseCycles();
+  eeLife   = EE_RemainingLife();
+}
 
-  #ifdef KEYLOCK_POWER_SWITCH
-    uint16_t delay_cycle = 0;
-    while (HAL_GPIO_ReadPin(BUTTON_PORT, BUTTON_PIN)) {
-      if (!(delay_cycle %= 10)) {
-        beepShortMany(2, -1);
-      }
 
-      HAL_Delay(150);
-      delay_cycle++;
-    }
-  #endif
+uint8_t isThrottleMax(void)
+{
+  return (input2[inIdx].raw > input2[inIdx].max - 250) && (input2[inIdx].raw < input2[inIdx].max + 250);
+}
 
-  buzzerCount = 0;  // prevent interraction with beep counter
-  buzzerPattern = 0;
-  for (int i = 0; i < 8; i++) {
-    buzzerFreq = (uint8_t)i;
-    HAL_Delay(100);
-  }
+uint8_t isThrottleMin(void)
+{
+  return (input2[inIdx].raw > input2[inIdx].min - 250) && (input2[inIdx].raw < input2[inIdx].min + 250);
+}
 
-  saveConfig();
+static void powerSetState(PowerState state) {
+  powerState    = state;
+  pwrStateEntry = 1;              // entry time is latched on the next powerStep()
+}
 
-  HAL_GPIO_WritePin(OFF_PORT, OFF_PIN, GPIO_PIN_RESET);
-  while(1) {}
+ /*
+ * Power On
+ * Plays the power-on melody and selects the initial state of the power state machine.
+ * The rest of the power-on sequence is handled by powerStep() from the main loop.
+ *
+ * for entering calibration mode:
+ * 1. set and hold throttle position to maximum
+ * 2. power button toggle (on and off) twice within KEYLOCK_CHECK_TIME (1 sec) interval
+ * 3. toggle (on and off) power button with delay CALIBRATE_HOLD_TIME (5 sec)
+ * 4. release power button
+ * 5. Release throttle
+ * 6. one long beep - calibrate current and speed mode entered
+ * 7. calibrate current holding throttle to next step
+ * 8. short toggle power button (or wait for 10 sec)
+ * 9. one long beep - calibrate speed and holding throttle to next step
+ * 10. short toggle power button
+ * 11. power off
+ *
+ * to calibrate min/max
+ * 6. after step 5 above, short toggle of power button within 1 second
+ * 7. three long beeps - MIN/MAX calibration mode entered
+ * 8. calibrate throttle handle by rotation, calibrate switch handle by switching left-right
+ * 9. short toggle of power button
+ * 10. power off
+ */
+void powerOn(void)
+{
+  poweronMelody();
+  HAL_GPIO_WritePin(LED_PORT, LED_PIN, GPIO_PIN_SET);
+
+#ifdef KEYLOCK_POWER_SWITCH
+  readCommand();
+  powerSetState(isThrottleMax() ? PWR_ON_KEYLOCK1 : PWR_RUN);
+#else
+  powerSetState(PWR_ON_RELEASE);  // wait until button is released
+#endif
 }
 
+ /*
+ * Calibration
+ * A short press within 1 second selects the MIN/MAX input calibration, otherwise the current and speed limits are updated.
+ * Calibration always ends with a power off, which stores the new values in flash.
+ */
 void calibrate(void) 
 {
-  uint16_t wait_for_press = 0;
-  
   // disable motors
   enable = 0;
+  cal_minmax = 0;
+  powerSetState(PWR_CAL_SELECT);
+}
 
-  // if short press within 1 second from entering calibrate mode, min-max values
-  while (!HAL_GPIO_ReadPin(BUTTON_PORT, BUTTON_PIN) 
-    && wait_for_press++ < CALIBRARE_MINMAX_CHECK_TIME) 
-  {
-     HAL_Delay(WAIT_DELAY);
+static void calibrateDone(void)
+{
+  beepShort(5);
+  powerOff();
+}
+
+ /*
+ * Power Off
+ * Disables the motors and starts the power-off sequence: melody, saving the configuration and releasing the power latch.
+ * Calling it again while the sequence is running has no effect.
+ */
+void powerOff(void) {
+  enable = 0;
+  if (powerState >= PWR_OFF_KEYLOCK) {
+    return;
   }
-  
-  // wait untill release
-  while (HAL_GPIO_ReadPin(BUTTON_PORT, BUTTON_PIN)) { HAL_Delay(WAIT_DELAY); }
+  PRINTF("-- Motors disabled --\r\n");
 
-  if (wait_for_press < CALIBRARE_MINMAX_CHECK_TIME) 
-  {
-    // calibrate min-max values
-    #ifdef AUTO_CALIBRATION_ENA
-    beepLongMany(8, 500, 3);
+  #ifdef KEYLOCK_POWER_SWITCH
+    powerSetState(PWR_OFF_KEYLOCK);
+  #else
+    powerOffMelody();
+  #endif
+}
 
-    adcCalibLim();
-    beepShort(5);
-    #endif
-  } 
-  else 
-  {
-    beepLong(8);
-    updateCurSpdLim();
-    beepShort(5); 
+static void powerOffMelody(void) {
+  beepCount(0, 0, 0);
+  for (int i = 0; i < 8; i++) {
+    beepNote((uint8_t)i, 100);
   }
-}  
+  powerSetState(PWR_OFF_MELODY);
+}
 
-void powerOffPressCheck(void) {
-  #ifdef KEYLOCK_POWER_SWITCH
-  uint16_t cnt_press = 0;
-  while(!HAL_GPIO_ReadPin(BUTTON_PORT, BUTTON_PIN)) {
-    HAL_Delay(10);
-    if (cnt_press++ >= PWR_BTN_DEBOUNCE) {
-      powerOff();
-    }
+ /*
+ * Power State Machine
+ * Called every main loop with the power button level and the time in ms. Handles the power-on calibration entry,
+ * the power button, the calibration procedures and the power-off sequence without blocking the main loop.
+ * Input values are taken from input1[inIdx]/input2[inIdx], refreshed by readCommand() in the same loop.
+ */
+void powerStep(uint8_t btn, uint32_t now) {
+  uint8_t  entry = pwrStateEntry;
+  uint32_t elapsed;
+
+  if (entry) {
+    pwrStateTick  = now;
+    pwrStateEntry = 0;
   }
-  #else
-  if (HAL_GPIO_ReadPin(BUTTON_PORT, BUTTON_PIN)) {
-    enable = 0;
-  #if defined(VARIANT_TRANSPOTTER)
-      while (HAL_GPIO_ReadPin(BUTTON_PORT, BUTTON_PIN)) { HAL_Delay(10); }
-      beepShort(5);
-      HAL_Delay(300);
-      if (HAL_GPIO_ReadPin(BUTTON_PORT, BUTTON_PIN)) {
-        while (HAL_GPIO_ReadPin(BUTTON_PORT, BUTTON_PIN)) { HAL_Delay(10); }
+  elapsed = now - pwrStateTick;
+
+  switch (powerState) {
+    case PWR_RUN:
+      #ifdef KEYLOCK_POWER_SWITCH
+        if (btn || entry) {
+          pwrBtnTick = now;
+        } else if (now - pwrBtnTick > PWR_BTN_DEBOUNCE * WAIT_DELAY) {
+          powerOff();
+        }
+      #else
+        if (btn) {
+          enable = 0;
+          #if defined(VARIANT_TRANSPOTTER)
+            powerSetState(PWR_TP_RELEASE1);
+          #else
+            pwrBtnBeep = 0;
+            powerSetState(PWR_BTN_HOLD);
+          #endif
+        }
+      #endif
+      break;
+
+  #ifndef KEYLOCK_POWER_SWITCH
+    case PWR_ON_RELEASE:
+      if (!btn) { powerSetState(PWR_RUN); }
+      break;
+
+    #if defined(VARIANT_TRANSPOTTER)
+    case PWR_TP_RELEASE1:
+      if (!btn) {
+        beepShort(5);
+        powerSetState(PWR_TP_WAIT);
+      }
+      break;
+
+    case PWR_TP_WAIT:
+      if (elapsed >= BEEP_DELAY + 300) {
+        if (btn) {
+          powerSetState(PWR_TP_RELEASE2);
+        } else {
+          setDistance += 0.25;
+          if (setDistance > 2.6) {
+            setDistance = 0.5;
+          }
+          beepShort(setDistance / 0.25);
+          saveValue = setDistance * 1000;
+          saveValue_valid = 1;
+          powerSetState(PWR_RUN);
+        }
+      }
+      break;
+
+    case PWR_TP_RELEASE2:
+      if (!btn) {
         beepLong(5);
-        HAL_Delay(350);
         powerOff();
-      } else {
-        setDistance += 0.25;
-        if (setDistance > 2.6) {
-          setDistance = 0.5;
-        }
-        beepShort(setDistance / 0.25);
-        saveValue = setDistance * 1000;
-        saveValue_valid = 1;
       }
-  #else
-      uint16_t power_btn_hold_time = 0;
-       
+      break;
+    #else
+    case PWR_BTN_HOLD:
       // check for long press
-      while (HAL_GPIO_ReadPin(BUTTON_PORT, BUTTON_PIN)) {
-        HAL_Delay(WAIT_DELAY);
-        if (power_btn_hold_time++ == CALIBRATE_HOLD_TIME) { beepShort(5); }
+      if (btn) {
+        if (elapsed >= CALIBRATE_HOLD_TIME * WAIT_DELAY && !pwrBtnBeep) {
+          beepShort(5);
+          pwrBtnBeep = 1;
+        }
+        break;
       }
       #if !defined(VARIANT_HOVERBOARD)
-      if (power_btn_hold_time >= CALIBRATE_HOLD_TIME) {        
+      if (elapsed >= CALIBRATE_HOLD_TIME * WAIT_DELAY) {
         calibrate();
-        powerOff(); 
-      } else 
+      } else
       #endif
-      if (power_btn_hold_time > PWR_BTN_DEBOUNCE) { // Short press: power off (80 ms debounce)
-        powerOff();  
+      if (elapsed > PWR_BTN_DEBOUNCE * WAIT_DELAY) { // Short press: power off (80 ms debounce)
+        powerOff();
+      } else {
+        powerSetState(PWR_RUN);
       }
+      break;
+    #endif
+  #endif // KEYLOCK_POWER_SWITCH
+
+  #ifdef KEYLOCK_POWER_SWITCH
+    case PWR_ON_KEYLOCK1:
+    case PWR_ON_KEYLOCK2:
+      // power on button short press
+      if (btn && elapsed < KEYLOCK_CHECK_TIME * WAIT_DELAY) {
+        break;
+      }
+      if (elapsed < KEYLOCK_CHECK_TIME * WAIT_DELAY && isThrottleMax()) {
+        if (powerState == PWR_ON_KEYLOCK1) {
+          powerSetState(PWR_ON_KEYLOCK2);
+        } else {
+          PRINTF("calibrate mode, press power button for more than 5 sec\r\n");
+          pwrBtnHeld = 0;
+          pwrBtnBeep = 0;
+          powerSetState(PWR_ON_CAL_HOLD);
+        }
+      } else {
+        powerSetState(PWR_RUN);
+      }
+      break;
+
+    case PWR_ON_CAL_HOLD:
+      // check for >=5 sec press, wait until release
+      if (btn) {
+        if (!pwrBtnHeld) {
+          pwrBtnHeld = 1;
+          pwrBtnTick = now;
+        }
+        if (now - pwrBtnTick >= CALIBRATE_HOLD_TIME * WAIT_DELAY && !pwrBtnBeep) {
+          beepShort(5);
+          pwrBtnBeep = 1;
+        }
+        break;
+      }
+      if (pwrBtnHeld) {
+        pwrBtnHeld = 0;
+        pwrBtnBeep = 0;
+        if (now - pwrBtnTick >= CALIBRATE_HOLD_TIME * WAIT_DELAY) {
+          powerSetState(PWR_ON_CAL_THROTTLE);     // wait untill throttle is released
+          break;
+        } else if (now - pwrBtnTick > PWR_BTN_DEBOUNCE * WAIT_DELAY) {
+          powerOff();                             // Short press: power off (80 ms debounce)
+          break;
+        }
+      }
+      if (elapsed > CALIBRATE_MOD_IMEOUT_TIME * WAIT_DELAY) {
+        LOG(LOG_WARN, "Calibrate mode timeout\r\n");   // timout for calibration
+        powerSetState(PWR_RUN);
+      }
+      break;
+
+    case PWR_ON_CAL_THROTTLE:
+      if (isThrottleMin()) {
+        calibrate();
+      }
+      break;
+  #endif // KEYLOCK_POWER_SWITCH
+
+    case PWR_CAL_SELECT:
+      // if short press within 1 second from entering calibrate mode, min-max values
+      if (btn || elapsed >= CALIBRARE_MINMAX_CHECK_TIME * WAIT_DELAY) {
+        cal_minmax = btn;
+        powerSetState(PWR_CAL_RELEASE);
+      }
+      break;
+
+    case PWR_CAL_RELEASE:
+      // wait untill release
+      if (!btn) {
+        if (cal_minmax) {
+          // calibrate min-max values
+          #ifdef AUTO_CALIBRATION_ENA
+          beepLongMany(8, 500, 3);
+          #endif
+          adcCalibLim();
+        } else {
+          beepLong(8);
+          updateCurSpdLim();
+        }
+      }
+      break;
+
+  #if !defined(VARIANT_HOVERBOARD) && !defined(VARIANT_TRANSPOTTER)
+    #ifdef AUTO_CALIBRATION_ENA
+    case PWR_CAL_ADC:
+      adcCalibStep(btn, elapsed);
+      break;
+    #endif
+
+    case PWR_CAL_CURSPD:
+      // Wait for the power button press, 10 sec timeout
+      calFilterStep();
+      if (btn || elapsed >= 10000) {
+        powerSetState(PWR_CAL_CURSPD_RELEASE);
+      }
+      break;
+
+    case PWR_CAL_CURSPD_RELEASE:
+      if (!btn) {
+        updateCurSpdLimStep();
+      }
+      break;
+  #endif
+
+  #ifdef KEYLOCK_POWER_SWITCH
+    case PWR_OFF_KEYLOCK:
+      if (!btn) {
+        powerOffMelody();
+      } else if (entry || now - pwrBtnTick >= 1500) {
+        beepShortMany(2, -1);
+        pwrBtnTick = now;
+      }
+      break;
   #endif
+
+    case PWR_OFF_MELODY:
+      if (!beepBusy()) {          // let the melody finish before the flash write stalls the CPU
+        saveConfig();
+        HAL_GPIO_WritePin(OFF_PORT, OFF_PIN, GPIO_PIN_RESET);
+        powerSetState(PWR_OFF);
+      }
+      break;
+
+    default:
+      break;
   }
-  #endif // KEYLOCK_POWER_SWITCH
 }
 
 
 
-/* =========================== Filtering Functions =========================== */
+/* =========================== Telemetry Functions =========================== */
 
-  /* Low pass filter fixed-point 32 bits: fixdt(1,32,16)
-  * Max:  32767.99998474121
-  * Min: -32768
-  * Res:  1.52587890625e-05
-  * 
-  * Inputs:       u     = int16 or int32
-  * Outputs:      y     = fixdt(1,32,16)
-  * Parameters:   coef  = fixdt(0,16,16) = [0,65535U]
-  * 
-  * Example: 
-  * If coef = 0.8 (in floating point), then coef = 0.8 * 2^16 = 52429 (in fixed-point)
-  * filtLowPass16(u, 52429, &y);
-  * yint = (int16_t)(y >> 16); // the integer output is the fixed-point ouput shifted by 16 bits
-  */
-void filtLowPass32(int32_t u, uint16_t coef, int32_t *y) {
-  int64_t tmp;  
-  tmp = ((int64_t)((u << 4) - (*y >> 12)) * coef) >> 4;
-  tmp = CLAMP(tmp, -2147483648LL, 2147483647LL);  // Overflow protection: 2147483647LL = 2^31 - 1
-  *y = (int32_t)tmp + (*y);
-}
-  // Old filter
-  // Inputs:       u     = int16
-  // Outputs:      y     = fixdt(1,32,20)
-  // Parameters:   coef  = fixdt(0,16,16) = [0,65535U]
-  // yint = (int16_t)(y >> 20); // the integer output is the fixed-point ouput shifted by 20 bits
-  // void filtLowPass32(int16_t u, uint16_t coef, int32_t *y) {
-  //   int32_t tmp;  
-  //   tmp = (int16_t)(u << 4) - (*y >> 16);  
-  //   tmp = CLAMP(tmp, -32768, 32767);  // Overflow protection  
-  //   *y  = coef * tmp + (*y);
-  // }
-
-
-  /* rateLimiter16(int16_t u, int16_t rate, int16_t *y);
-  * Inputs:       u     = int16
-  * Outputs:      y     = fixdt(1,16,4)
-  * Parameters:   rate  = fixdt(1,16,4) = [0, 32767] Do NOT make rate negative (>32767)
-  */
-void rateLimiter16(int16_t u, int16_t rate, int16_t *y) {
-  int16_t q0;
-  int16_t q1;
+#ifdef FEEDBACK_TELEMETRY
+/*
+ * Build a telemetry frame with the selected fields into buf
+ * - returns the frame length
+ */
+static uint16_t telemetryBuild(uint8_t *buf)
+{
+  uint32_t fields = tlmFields & ((1UL << TLM_FIELDS_NUM) - 1);
+  #ifdef SERIAL_MULTIDROP
+  fields |= 1UL << TLM_NODE;                                        // the host needs to know who answered
+  #endif
+  uint32_t now    = HAL_GetTick();
+  uint16_t len    = 14;                                             // header, sequence, timestamp and field mask
+  uint16_t crc;
+  int16_t  val;
+  uint8_t  i;
+
+  for (i = 0; i < TLM_FIELDS_NUM; i++) {
+    if (!(fields & (1UL << i))) {
+      continue;
+    }
+    switch (i) {
+      case TLM_CMD1:        val = input1[inIdx].cmd;          break;
+      case TLM_CMD2:        val = input2[inIdx].cmd;          break;
+      case TLM_SPEED_R:     val = rtY_Right.n_mot;            break;
+      case TLM_SPEED_L:     val = rtY_Left.n_mot;             break;
+      case TLM_BATV:        val = batVoltageCalib;            break;
+      case TLM_TEMP:        val = board_temp_deg_c;           break;
+      case TLM_CMD_L:       val = cmdL;                       break;
+      case TLM_CMD_R:       val = cmdR;                       break;
+      case TLM_IQ_L:        val = rtY_Left.iq;                break;
+      case TLM_IQ_R:        val = rtY_Right.iq;               break;
+      case TLM_ID_L:        val = rtY_Left.id;                break;
+      case TLM_ID_R:        val = rtY_Right.id;               break;
+      case TLM_ANGLE_L:     val = rtY_Left.a_elecAngle;       break;
+      case TLM_ANGLE_R:     val = rtY_Right.a_elecAngle;      break;
+      case TLM_ERR_L:       val = rtY_Left.z_errCode;         break;
+      case TLM_ERR_R:       val = rtY_Right.z_errCode;        break;
+      case TLM_DC_CURR_L:   val = left_dc_curr;               break;
+      case TLM_DC_CURR_R:   val = right_dc_curr;              break;
+      case TLM_ISR_CYC:     val = (int16_t)isrCycles;         break;
+      case TLM_ISR_CYC_MAX: val = (int16_t)isrCyclesMax;      break;
+      #ifdef SERIAL_MULTIDROP
+      case TLM_NODE:        val = nodeId;                     break;
+      #endif
+      case TLM_CTRL_IN:     val = (int16_t)(rtU_Left.b_hallA | (rtU_Left.b_hallB << 1) | (rtU_Left.b_hallC << 2) |
+                                            (rtU_Right.b_hallA << 3) | (rtU_Right.b_hallB << 4) | (rtU_Right.b_hallC << 5) |
+                                            (rtU_Left.b_motEna << 6) | (rtU_Left.z_ctrlModReq << 8));   break;
+      case TLM_TGT_L:       val = rtU_Left.r_inpTgt;          break;
+      case TLM_TGT_R:       val = rtU_Right.r_inpTgt;         break;
+      case TLM_PHA_AB_L:    val = rtU_Left.i_phaAB;           break;
+      case TLM_PHA_BC_L:    val = rtU_Left.i_phaBC;           break;
+      case TLM_PHA_AB_R:    val = rtU_Right.i_phaAB;          break;
+      case TLM_PHA_BC_R:    val = rtU_Right.i_phaBC;          break;
+      case TLM_DC_LINK_L:   val = rtU_Left.i_DCLink;          break;
+      case TLM_DC_LINK_R:   val = rtU_Right.i_DCLink;         break;
+      #ifdef ODOMETER_COUNTERS
+      case TLM_ODOM:        val = (int16_t)(odom[(tlmSeq >> 1) & 3] >> (16 * (tlmSeq & 1)));   break;
+      #endif
+      default:              val = 0;                          break;
+    }
+    buf[len++] = (uint8_t)val;
+    buf[len++] = (uint8_t)(val >> 8);
+  }
+
+  buf[0]  = (uint8_t)SERIAL_START_FRAME;
+  buf[1]  = (uint8_t)(SERIAL_START_FRAME >> 8);
+  buf[2]  = TLM_VERSION;
+  buf[3]  = (uint8_t)(len - 4);
+  buf[4]  = (uint8_t)tlmSeq;
+  buf[5]  = (uint8_t)(tlmSeq >> 8);
+  buf[6]  = (uint8_t)now;
+  buf[7]  = (uint8_t)(now >> 8);
+  buf[8]  = (uint8_t)(now >> 16);
+  buf[9]  = (uint8_t)(now >> 24);
+  buf[10] = (uint8_t)fields;
+  buf[11] = (uint8_t)(fields >> 8);
+  buf[12] = (uint8_t)(fields >> 16);
+  buf[13] = (uint8_t)(fields >> 24);
+  crc     = calcCRC16(buf, len);
+  buf[len++] = (uint8_t)crc;
+  buf[len++] = (uint8_t)(crc >> 8);
+  return len;
+}
 
-  q0 = (u << 4)  - *y;
+/*
+ * Send the telemetry frame every tlmDiv main loops
+ * - the frame is only built when the Tx DMA of the USART is idle, otherwise the frame is dropped and counted in tlmDrop
+ * - SERIAL_MULTIDROP: only one frame is sent as answer to each accepted command frame, in the slot set by usart_process_command()
+ */
+void telemetryProcess(void)
+{
+  uint16_t len;
+
+  #ifdef SERIAL_MULTIDROP
+  if (!nodePollReq || (int32_t)(main_loop_counter - nodePollLoop) < 0) {
+    return;
+  }
+  nodePollReq = 0;
+  #else
+  if (tlmDiv == 0 || main_loop_counter % tlmDiv != 0) {
+    return;
+  }
+  #endif
 
-  if (q0 > rate) {
-    q0 = rate;
+  #if defined(FEEDBACK_SERIAL_USART2)
+  if (__HAL_DMA_GET_COUNTER(huart2.hdmatx) == 0) {
+    len = telemetryBuild(tlmBufL);
+    HAL_UART_Transmit_DMA(&huart2, tlmBufL, len);
   } else {
-    q1 = -rate;
-    if (q0 < q1) {
-      q0 = q1;
-    }
+    tlmDrop++;
+  }
+  #endif
+  #if defined(FEEDBACK_SERIAL_USART3)
+  if (__HAL_DMA_GET_COUNTER(huart3.hdmatx) == 0) {
+    len = telemetryBuild(tlmBufR);
+    HAL_UART_Transmit_DMA(&huart3, tlmBufR, len);
+  } else {
+    tlmDrop++;
+  }
+  #endif
+
+  tlmSeq++;
+  isrCyclesMax = 0;
+}
+#endif
+
+
+/* =========================== Time Sync Functions =========================== */
+
+#ifdef SERIAL_SYNC
+/*
+ * Estimated host time at a local time
+ */
+static uint32_t syncHostAt(uint32_t localTick)
+{
+  return syncHost0 + (uint32_t)(((int64_t)(int32_t)(localTick - syncLocal0) * syncRate) >> 16);
+}
+
+/*
+ * Local time at an estimated host time
+ */
+static uint32_t syncLocalAt(uint32_t hostUs)
+{
+  return syncLocal0 + (uint32_t)(int32_t)(((int64_t)(int32_t)(hostUs - syncHost0) << 16) / syncRate);
+}
+
+/*
+ * Update the host time estimation with a sync record
+ * - a second order loop: half of the error corrects the offset, a quarter of the error over the interval corrects the rate
+ * - the error includes the Rx interrupt jitter, which the loop averages out over several records
+ */
+void syncUpdate(uint32_t hostUs, uint32_t localTick)
+{
+  int32_t dt  = (int32_t)(localTick - syncLocal0);
+  int32_t err = (int32_t)(hostUs - syncHostAt(localTick));
+
+  if (!syncValid || dt <= 0 || err > SYNC_RESET_US || err < -SYNC_RESET_US) {
+    syncHost0  = hostUs;
+    syncLocal0 = localTick;
+    syncRate   = SYNC_RATE_NOM;
+    syncValid  = 1;
+    syncErr    = 0;
+    syncDrift  = 0;
+    return;
+  }
+
+  syncRate  += (int32_t)(((int64_t)err << 16) / dt) / 4;
+  syncRate   = CLAMP(syncRate, SYNC_RATE_NOM - (int32_t)((int64_t)SYNC_RATE_NOM * SYNC_DRIFT_MAX / 1000000),
+                               SYNC_RATE_NOM + (int32_t)((int64_t)SYNC_RATE_NOM * SYNC_DRIFT_MAX / 1000000));
+  syncHost0  = hostUs - err / 2;
+  syncLocal0 = localTick;
+  syncErr    = err;
+  syncDrift  = (int16_t)(((int64_t)(syncRate - SYNC_RATE_NOM) * 1000000) / SYNC_RATE_NOM);
+}
+
+/*
+ * Schedule motor targets for a host time
+ * - targets without a host time estimation, in the past or too far ahead are applied at once
+ */
+void syncSchedule(int16_t tgtL, int16_t tgtR, uint32_t hostUs)
+{
+  int32_t ahead = (int32_t)(hostUs - syncHostAt(buzzerTimer));
+
+  syncTgtL = CLAMP(tgtL, INPUT_MIN, INPUT_MAX);
+  syncTgtR = CLAMP(tgtR, INPUT_MIN, INPUT_MAX);
+  if (!syncValid || ahead <= 0 || ahead > SYNC_AHEAD_MAX) {
+    syncSched  = SYNC_IDLE;
+    serialTgtL = syncTgtL;
+    serialTgtR = syncTgtR;
+    syncLate++;
+    return;
   }
+  syncSchedTick = syncLocalAt(hostUs);
+  syncSched     = SYNC_PENDING;                                     // Armed by the main loop once syncPwmL/R are calculated
+}
 
-  *y = q0 + *y;
+/*
+ * Take over the scheduled targets after the motor ISR switched to them, called in the main loop before the targets are used
+ * - returns 1 when the targets were taken over
+ */
+uint8_t syncTargets(void)
+{
+  if (!serialTgtAcv) {
+    syncSched = SYNC_IDLE;
+  } else if (syncSched == SYNC_ARMED && (int32_t)(buzzerTimer - syncSchedTick) >= 0) {
+    serialTgtL = syncTgtL;
+    serialTgtR = syncTgtR;
+    syncSched  = SYNC_IDLE;
+    return 1;
+  }
+  return 0;
 }
+#endif
+
 
+/* =========================== Filtering Functions =========================== */
 
   /* mixerFcn(rtu_speed, rtu_steer, &rty_speedR, &rty_speedL); 
   * Inputs:       rtu_speed, rtu_steer                  = fixdt(1,16,4)